@@ -28,6 +28,9 @@
 #include "report.h"
 #include "suffix.h"
 
+#include <stdlib.h>
+#include <string.h>
+
 static double timeval_to_secs(struct timeval *t)
 {
     return  t->tv_sec + t->tv_usec / 1e6;
@@ -85,11 +88,30 @@ void report_transfer_bin_rate(FILE *outf, struct timeval *start_time,
     report_transfer_bin_rate_elapsed(outf, elapsed_time, bytes);
 }
 
-void report_latency(FILE *outf, FILE *log, struct timeval *start_time,
-		    struct timeval *latencies, size_t count)
+static void report_min_max_avg(FILE *outf, double min_time, size_t min_pos,
+                               double max_time, size_t max_pos,
+                               double avg_time, size_t count)
 {
     const char *min_suffix = " ", *max_suffix = " ",
         *avg_suffix = " ";
+
+    if (min_time < 1)
+        min_suffix = suffix_si_get(&min_time);
+    fprintf(outf, "min (%zd) = %-6.1f%ss : ",
+            min_pos, min_time, min_suffix);
+    if (max_time < 1)
+        max_suffix = suffix_si_get(&max_time);
+    fprintf(outf, "max (%zd) = %-6.1f%ss : ",
+            max_pos, max_time, max_suffix);
+    if (avg_time < 1)
+        avg_suffix = suffix_si_get(&avg_time);
+    fprintf(outf, "avg (%zd) = %-6.1f%ss",
+            count, avg_time, avg_suffix);
+}
+
+void report_latency(FILE *outf, FILE *log, struct timeval *start_time,
+		    struct timeval *latencies, size_t count)
+{
     double elapsed_time, min_time, max_time, avg_time;
     size_t min_pos = 0, max_pos = 0;
 
@@ -119,17 +141,164 @@ void report_latency(FILE *outf, FILE *log, struct timeval *start_time,
 
     }
 
-    if (min_time < 1)
-        min_suffix = suffix_si_get(&min_time);
-    fprintf(outf, "min (%zd) = %-6.1f%ss : ",
-            min_pos, min_time, min_suffix);
-    if (max_time < 1)
-        max_suffix = suffix_si_get(&max_time);
-    fprintf(outf, "max (%zd) = %-6.1f%ss : ",
-            max_pos, max_time, max_suffix);
-    avg_time /= count;
-    if (avg_time < 1)
-        avg_suffix = suffix_si_get(&avg_time);
-    fprintf(outf, "avg (%zd) = %-6.1f%ss",
-            count, avg_time, avg_suffix);
+    report_min_max_avg(outf, min_time, min_pos, max_time, max_pos,
+                       avg_time / count, count);
+}
+
+void report_latency_elapsed(FILE *outf, FILE *log, double *elapsed,
+                            size_t count)
+{
+    double min_time, max_time, avg_time = 0;
+    size_t min_pos = 0, max_pos = 0;
+
+    if (!count)
+        return;
+
+    min_time = max_time = elapsed[0];
+
+    for (size_t i=0 ; i<count ; i++) {
+        if (log)
+            fprintf(log,"%4zd\t%f\n", i, elapsed[i]);
+
+        if (elapsed[i] < min_time) {
+            min_time = elapsed[i];
+            min_pos  = i;
+        }
+        if (elapsed[i] > max_time) {
+            max_time = elapsed[i];
+            max_pos  = i;
+        }
+
+        avg_time += elapsed[i];
+    }
+
+    report_min_max_avg(outf, min_time, min_pos, max_time, max_pos,
+                       avg_time / count, count);
+}
+
+static double *pairs_to_elapsed(struct timeval *start_times,
+                                struct timeval *end_times, size_t count)
+{
+    double *elapsed = malloc(count * sizeof(*elapsed));
+    if (!elapsed)
+        return NULL;
+
+    for (size_t i=0 ; i<count ; i++)
+        elapsed[i] = timeval_to_secs(&end_times[i]) -
+            timeval_to_secs(&start_times[i]);
+
+    return elapsed;
+}
+
+void report_latency_pairs(FILE *outf, FILE *log, struct timeval *start_times,
+                          struct timeval *end_times, size_t count)
+{
+    double *elapsed = pairs_to_elapsed(start_times, end_times, count);
+    if (!elapsed)
+        return;
+
+    report_latency_elapsed(outf, log, elapsed, count);
+    free(elapsed);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double *sorted_copy(double *elapsed, size_t count)
+{
+    double *sorted = malloc(count * sizeof(*sorted));
+    if (!sorted)
+        return NULL;
+
+    memcpy(sorted, elapsed, count * sizeof(*sorted));
+    qsort(sorted, count, sizeof(*sorted), cmp_double);
+    return sorted;
+}
+
+/* Nearest-rank percentile of an already sorted array */
+static double sorted_percentile(double *sorted, size_t count, double pct)
+{
+    double exact = pct / 100 * count;
+    size_t rank = (size_t) exact;
+
+    if (rank < exact)
+        rank++;
+    return sorted[rank ? rank - 1 : 0];
+}
+
+void report_percentiles_elapsed(FILE *outf, double *elapsed, size_t count)
+{
+    static const double pcts[] = {50, 90, 99, 99.9};
+    double *sorted;
+
+    if (!count)
+        return;
+
+    sorted = sorted_copy(elapsed, count);
+    if (!sorted)
+        return;
+
+    for (unsigned i=0 ; i<sizeof(pcts)/sizeof(pcts[0]) ; i++) {
+        double value = sorted_percentile(sorted, count, pcts[i]);
+        const char *suffix = " ";
+
+        if (value < 1)
+            suffix = suffix_si_get(&value);
+        fprintf(outf, "%sp%g = %-6.1f%ss", i ? " : " : "",
+                pcts[i], value, suffix);
+    }
+
+    free(sorted);
+}
+
+void report_percentiles(FILE *outf, struct timeval *start_times,
+                        struct timeval *end_times, size_t count)
+{
+    double *elapsed = pairs_to_elapsed(start_times, end_times, count);
+    if (!elapsed)
+        return;
+
+    report_percentiles_elapsed(outf, elapsed, count);
+    free(elapsed);
+}
+
+void report_first_touch_elapsed(FILE *outf, double *elapsed, size_t count)
+{
+    const char *first_suffix = " ", *steady_suffix = " ";
+    double first, steady, *sorted;
+
+    if (count < 2)
+        return;
+
+    sorted = sorted_copy(&elapsed[1], count - 1);
+    if (!sorted)
+        return;
+
+    first  = elapsed[0];
+    steady = sorted_percentile(sorted, count - 1, 50);
+    free(sorted);
+
+    double ratio = steady > 0 ? first / steady : 0;
+
+    if (first < 1)
+        first_suffix = suffix_si_get(&first);
+    fprintf(outf, "first = %-6.1f%ss : ", first, first_suffix);
+    if (steady < 1)
+        steady_suffix = suffix_si_get(&steady);
+    fprintf(outf, "steady (p50 of %zd) = %-6.1f%ss : ratio = %.1fx",
+            count - 1, steady, steady_suffix, ratio);
+}
+
+void report_first_touch(FILE *outf, struct timeval *start_times,
+                        struct timeval *end_times, size_t count)
+{
+    double *elapsed = pairs_to_elapsed(start_times, end_times, count);
+    if (!elapsed)
+        return;
+
+    report_first_touch_elapsed(outf, elapsed, count);
+    free(elapsed);
 }
@@ -45,4 +45,17 @@ void report_transfer_bin_rate(FILE *outf, struct timeval *start_time,
 void report_latency(FILE *outf, FILE *log, struct timeval *start_time,
 		    struct timeval *latencies, size_t count);
 
+void report_latency_elapsed(FILE *outf, FILE *log, double *elapsed,
+                            size_t count);
+void report_latency_pairs(FILE *outf, FILE *log, struct timeval *start_times,
+                          struct timeval *end_times, size_t count);
+
+void report_percentiles_elapsed(FILE *outf, double *elapsed, size_t count);
+void report_percentiles(FILE *outf, struct timeval *start_times,
+                        struct timeval *end_times, size_t count);
+
+void report_first_touch_elapsed(FILE *outf, double *elapsed, size_t count);
+void report_first_touch(FILE *outf, struct timeval *start_times,
+                        struct timeval *end_times, size_t count);
+
 #endif
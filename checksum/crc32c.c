@@ -0,0 +1,236 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     CRC32C, see crc32c.h.
+//
+//     The implementation is picked once at load time. The SSE4.2 path
+//     is compiled with a target attribute so the rest of the program
+//     does not need -msse4.2 and still runs on older CPUs.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "crc32c.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42
+#endif
+
+#define POLY 0x82f63b78     // reflected Castagnoli polynomial
+
+static uint32_t table[8][256];
+
+static uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    uint64_t word;
+
+    crc = ~crc;
+
+    while (len && ((uintptr_t) p & 7)) {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+    while (len >= 8) {
+        memcpy(&word, p, 8);
+        word ^= crc;
+        crc = table[7][word & 0xff] ^
+              table[6][(word >> 8) & 0xff] ^
+              table[5][(word >> 16) & 0xff] ^
+              table[4][(word >> 24) & 0xff] ^
+              table[3][(word >> 32) & 0xff] ^
+              table[2][(word >> 40) & 0xff] ^
+              table[1][(word >> 48) & 0xff] ^
+              table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    uint64_t c = ~crc;
+    uint64_t word;
+
+    while (len && ((uintptr_t) p & 7)) {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+
+#ifdef __x86_64__
+    while (len >= 8) {
+        memcpy(&word, p, 8);
+        c = _mm_crc32_u64(c, word);
+        p += 8;
+        len -= 8;
+    }
+#else
+    while (len >= 4) {
+        uint32_t w;
+        memcpy(&w, p, 4);
+        c = _mm_crc32_u32(c, w);
+        p += 4;
+        len -= 4;
+    }
+    (void) word;
+#endif
+
+    while (len--)
+        c = _mm_crc32_u8(c, *p++);
+
+    return ~(uint32_t) c;
+}
+#endif
+
+static uint32_t (*crc32c_fn)(uint32_t, const void *, size_t) = crc32c_sw;
+static const char *crc32c_name = "software";
+
+__attribute__((constructor))
+static void crc32c_init(void)
+{
+    uint32_t crc;
+    int i, j;
+
+    // Slicing-by-8: table[k][b] is the CRC of byte b followed by k zeros
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (crc & 1 ? POLY : 0);
+        table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+        for (j = 1; j < 8; j++)
+            table[j][i] = table[0][table[j - 1][i] & 0xff] ^
+                          (table[j - 1][i] >> 8);
+
+#ifdef CRC32C_HAVE_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_fn = crc32c_sse42;
+        crc32c_name = "sse4.2";
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    return crc32c_fn(crc, buf, len);
+}
+
+const char *crc32c_impl(void)
+{
+    return crc32c_name;
+}
+
+size_t crc32c_nblocks(size_t len, size_t block)
+{
+    if (!block || len <= block)
+        return 1;
+    return (len + block - 1) / block;
+}
+
+static uint32_t block_crc(const unsigned char *p, size_t len, size_t block,
+                          size_t i)
+{
+    size_t off, n;
+
+    if (!block)
+        return crc32c(0, p, len);
+
+    off = i * block;
+    if (off >= len)
+        return crc32c(0, p, 0);
+    n = len - off < block ? len - off : block;
+    return crc32c(0, p + off, n);
+}
+
+uint32_t crc32c_blocks(const void *buf, size_t len, size_t block,
+                       uint32_t *out)
+{
+    size_t i, nblocks = crc32c_nblocks(len, block);
+    uint32_t crc, be, digest = 0;
+
+    if (nblocks == 1) {
+        crc = crc32c(0, buf, len);
+        if (out)
+            out[0] = crc;
+        return crc;
+    }
+
+    for (i = 0; i < nblocks; i++) {
+        crc = block_crc(buf, len, block, i);
+        if (out)
+            out[i] = crc;
+        be = htonl(crc);
+        digest = crc32c(digest, &be, sizeof(be));
+    }
+
+    return digest;
+}
+
+static size_t trailer_blocks(size_t len, size_t block)
+{
+    if (!block)
+        return 1;
+    return (len + block + 3) / (block + 4);
+}
+
+size_t crc32c_trailer_len(size_t len, size_t block)
+{
+    return trailer_blocks(len, block) * sizeof(uint32_t);
+}
+
+void crc32c_seal(void *buf, size_t len, size_t block)
+{
+    size_t i, nblocks = trailer_blocks(len, block);
+    size_t payload = len - nblocks * sizeof(uint32_t);
+    unsigned char *trailer = (unsigned char *) buf + payload;
+    uint32_t be;
+
+    for (i = 0; i < nblocks; i++) {
+        be = htonl(block_crc(buf, payload, block, i));
+        memcpy(trailer + i * sizeof(be), &be, sizeof(be));
+    }
+}
+
+long crc32c_check(const void *buf, size_t len, size_t block)
+{
+    size_t i, nblocks = trailer_blocks(len, block);
+    size_t payload = len - nblocks * sizeof(uint32_t);
+    const unsigned char *trailer = (const unsigned char *) buf + payload;
+    uint32_t be;
+
+    for (i = 0; i < nblocks; i++) {
+        memcpy(&be, trailer + i * sizeof(be), sizeof(be));
+        if (ntohl(be) != block_crc(buf, payload, block, i))
+            return i;
+    }
+
+    return -1;
+}
@@ -0,0 +1,61 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     CRC32C (Castagnoli) for end-to-end data integrity checks. Uses
+//     the SSE4.2 crc32 instruction when the CPU has it and a
+//     slicing-by-8 table otherwise.
+//
+//     A buffer can be checksummed as a whole or per fixed size
+//     block. Block checksums are folded into one digest small enough
+//     for immediate data, or stored as a trailer at the end of the
+//     buffer so the receiver can tell which block went bad.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Standard CRC32C of buf, continuing from crc (0 to start a new one).
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* "sse4.2" or "software" */
+const char *crc32c_impl(void);
+
+/*
+ * Checksum len bytes in block sized pieces (the whole buffer if block
+ * is 0) and return the CRC32C of the block checksums. Each block's
+ * checksum is also stored in out when it is not NULL.
+ */
+size_t crc32c_nblocks(size_t len, size_t block);
+uint32_t crc32c_blocks(const void *buf, size_t len, size_t block,
+                       uint32_t *out);
+
+/*
+ * Trailer layout: the last crc32c_trailer_len() bytes of a len byte
+ * buffer hold the big endian checksums of the blocks of the payload
+ * in front of them. crc32c_check() returns the first bad block or -1.
+ */
+size_t crc32c_trailer_len(size_t len, size_t block);
+void crc32c_seal(void *buf, size_t len, size_t block);
+long crc32c_check(const void *buf, size_t len, size_t block);
+
+#endif
@@ -0,0 +1,870 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Key-value store whose GETs bypass the server CPU. The server
+//     (no address given) publishes an open addressed hash table of
+//     cache line aligned buckets in one registered region and hands
+//     every client its address and rkey. A key lives in one of the
+//     --probe buckets starting at its hash, so a client GET is a
+//     single RDMA READ of that window. PUTs, and GETs for comparison,
+//     are two-sided RPCs served by a thread per connection.
+//
+//     Each bucket carries a version, odd while the server is writing
+//     it, and a CRC32C over the version, key and value. A READ that
+//     raced a PUT fails the check and is retried.
+//
+//     The client PUTs --keys keys, then times --iters random GETs
+//     done with one-sided READs and the same GETs done as RPCs.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <endian.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+#include <rdma/rdma_cma.h>
+#include <rdma/rdma_verbs.h>
+#include <infiniband/verbs.h>
+
+#include "../argconfig/argconfig.h"
+#include "../argconfig/report.h"
+#include "../checksum/crc32c.h"
+#include "../pattern/pattern.h"
+
+#define KV_CACHELINE 64
+
+enum errors {
+  BAD_ARGS       = 1,
+  NO_BUFFER,
+  SETUP_PROBLEM,
+  RUN_PROBLEM,
+};
+
+/*
+ * Table layout. The value follows the header and the bucket is padded
+ * to whole cache lines. An empty bucket is all zeroes.
+ */
+
+struct kv_bucket {
+  uint64_t                version;
+  uint64_t                key;
+  uint32_t                vlen;
+  uint32_t                crc;
+  uint8_t                 value[];
+};
+
+enum kv_op {
+  KV_HELLO,
+  KV_PUT,
+  KV_GET,
+  KV_OK,
+  KV_MISS,
+  KV_FULL,
+  KV_ERROR,
+};
+
+/* RPCs, big endian. KV_HELLO describes the table. */
+struct kv_msg {
+  uint32_t                op;
+  uint32_t                vlen;
+  uint64_t                key;
+  uint64_t                addr;
+  uint64_t                buckets;
+  uint32_t                rkey;
+  uint32_t                bucket_size;
+  uint32_t                probe;
+  uint32_t                reserved;
+  uint8_t                 value[];
+};
+
+enum kv_result {
+  KV_FOUND,
+  KV_ABSENT,
+  KV_TORN,
+};
+
+const char program_desc[] =
+    "Key-value store with one-sided RDMA READ GETs and RPC PUTs";
+
+struct kvstore {
+  char                    *addr;
+  char                    *port;
+  long                    buckets;
+  unsigned                value_size;
+  unsigned                probe;
+  long                    keys;
+  long                    iters;
+  unsigned                verbose;
+
+  /* server */
+  char                    *table;
+  size_t                  table_size;
+  size_t                  bucket_size;
+  struct ibv_pd           *pd;
+  struct ibv_mr           *table_mr;
+
+  /* client, from KV_HELLO */
+  uint64_t                remote_addr;
+  uint32_t                rkey;
+
+  size_t                  msg_size;
+};
+
+static const struct kvstore defaults = {
+  .addr       = NULL,
+  .port       = "12346",
+  .buckets    = 1 << 20,
+  .value_size = 40,
+  .probe      = 4,
+  .keys       = 100000,
+  .iters      = 100000,
+  .verbose    = 0,
+};
+
+static const struct argconfig_commandline_options command_line_options[] = {
+    {"port",          "PORT", CFG_STRING, &defaults.port, required_argument,
+            "port to use"},
+    {"b",             "NUM", CFG_LONG_SUFFIX, &defaults.buckets, required_argument, NULL},
+    {"buckets",       "NUM", CFG_LONG_SUFFIX, &defaults.buckets, required_argument,
+            "server: buckets in the hash table"},
+    {"value",         "NUM", CFG_POSITIVE, &defaults.value_size, required_argument,
+            "value bytes per bucket, the client needs at least the server's"},
+    {"probe",         "NUM", CFG_POSITIVE, &defaults.probe, required_argument,
+            "server: buckets a key may probe, one client READ covers them all"},
+    {"k",             "NUM", CFG_LONG_SUFFIX, &defaults.keys, required_argument, NULL},
+    {"keys",          "NUM", CFG_LONG_SUFFIX, &defaults.keys, required_argument,
+            "client: keys to PUT before the GETs"},
+    {"i",             "NUM", CFG_LONG_SUFFIX, &defaults.iters, required_argument, NULL},
+    {"iters",         "NUM", CFG_LONG_SUFFIX, &defaults.iters, required_argument,
+            "client: GETs to time each way"},
+    {"v",             "", CFG_NONE, &defaults.verbose, no_argument, NULL},
+    {"verbose",       "", CFG_NONE, &defaults.verbose, no_argument,
+            "be verbose"},
+    {0}
+};
+
+static int report(const char *func, int val)
+{
+  fprintf(stderr, "%s: %d = %s.\n", func, errno, strerror(errno));
+  return val;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t kv_hash(uint64_t key)
+{
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return key;
+}
+
+static uint32_t kv_crc(uint64_t version, uint64_t key, uint32_t vlen,
+                       const void *value)
+{
+  struct kv_bucket hdr = {
+    .version = version,
+    .key     = key,
+    .vlen    = vlen,
+  };
+
+  return crc32c(crc32c(0, &hdr, offsetof(struct kv_bucket, crc)),
+                value, vlen);
+}
+
+/*
+ * Look for key in a snapshot of its probe window, taken either by an
+ * RDMA READ or by a memcpy on the server. An empty bucket ends the
+ * probe. A bucket that could hold the key but is being written or
+ * fails its CRC makes the whole lookup KV_TORN.
+ */
+
+static enum kv_result kv_scan(const char *window, unsigned probe,
+                              size_t bucket_size, uint64_t key,
+                              const struct kv_bucket **found)
+{
+  for (unsigned i=0; i<probe; i++) {
+    const struct kv_bucket *b = (const void *) (window + i * bucket_size);
+
+    if (!b->version)
+      return KV_ABSENT;
+    if (b->version & 1) {
+      if (!b->key || b->key == key)
+        return KV_TORN;
+      continue;
+    }
+    if (b->key != key)
+      continue;
+
+    if (b->vlen > bucket_size - sizeof(*b) ||
+        b->crc != kv_crc(b->version, b->key, b->vlen, b->value))
+      return KV_TORN;
+
+    *found = b;
+    return KV_FOUND;
+  }
+
+  return KV_ABSENT;
+}
+
+static char *kv_bucket_at(struct kvstore *cfg, size_t i)
+{
+  return cfg->table + i * cfg->bucket_size;
+}
+
+/*
+ * Claim the key's bucket, or the first empty one in its window, by
+ * making its version odd. Concurrent PUTs from other connections spin
+ * on an odd version until the writer is done.
+ */
+
+static int kv_put(struct kvstore *cfg, uint64_t key, const void *value,
+                  uint32_t vlen)
+{
+  size_t h = kv_hash(key) % cfg->buckets;
+
+  if (vlen > cfg->value_size)
+    return KV_ERROR;
+
+  for (unsigned i=0; i<cfg->probe; i++) {
+    struct kv_bucket *b = (void *) kv_bucket_at(cfg, h + i);
+    uint64_t v;
+
+    do {
+      v = __atomic_load_n(&b->version, __ATOMIC_ACQUIRE);
+      if (v & 1)
+        continue;
+      if (v && b->key != key)
+        break;
+      if (__atomic_compare_exchange_n(&b->version, &v, v + 1, 0,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        break;
+    } while (1);
+
+    if (v & 1 || (v && b->key != key))
+      continue;
+
+    b->key = key;
+    b->vlen = vlen;
+    memcpy(b->value, value, vlen);
+    b->crc = kv_crc(v + 2, key, vlen, value);
+    __atomic_store_n(&b->version, v + 2, __ATOMIC_RELEASE);
+    return KV_OK;
+  }
+
+  return KV_FULL;
+}
+
+static int kv_get(struct kvstore *cfg, char *window, uint64_t key,
+                  struct kv_msg *rep)
+{
+  size_t h = kv_hash(key) % cfg->buckets;
+  const struct kv_bucket *b;
+  enum kv_result res;
+
+  do {
+    memcpy(window, kv_bucket_at(cfg, h), cfg->probe * cfg->bucket_size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    res = kv_scan(window, cfg->probe, cfg->bucket_size, key, &b);
+  } while (res == KV_TORN);
+
+  if (res == KV_ABSENT)
+    return KV_MISS;
+
+  rep->vlen = htobe32(b->vlen);
+  memcpy(rep->value, b->value, b->vlen);
+  return KV_OK;
+}
+
+struct kv_conn {
+  struct kvstore          *cfg;
+  struct rdma_cm_id       *id;
+  struct kv_msg           *req;
+  struct kv_msg           *rep;
+  struct ibv_mr           *req_mr;
+  struct ibv_mr           *rep_mr;
+  char                    *window;
+  unsigned long           puts;
+  unsigned long           gets;
+};
+
+static void free_conn(struct kv_conn *c)
+{
+  if (c->req_mr)
+    rdma_dereg_mr(c->req_mr);
+  if (c->rep_mr)
+    rdma_dereg_mr(c->rep_mr);
+  free(c->req);
+  free(c->rep);
+  free(c->window);
+  rdma_destroy_ep(c->id);
+  free(c);
+}
+
+/*
+ * A remote disconnect does not move the QP to error, so the receive is
+ * never flushed when a client leaves. Nothing else reads the sync
+ * endpoint's CM events; poll them now and then to notice it.
+ */
+static int disconnected(struct rdma_cm_id *id)
+{
+  struct rdma_cm_event *event;
+  int gone;
+
+  if (rdma_get_cm_event(id->channel, &event))
+    return 0;
+  gone = event->event == RDMA_CM_EVENT_DISCONNECTED;
+  rdma_ack_cm_event(event);
+  return gone;
+}
+
+/* Returns 0 with the next request received, -1 once the client is gone */
+static int wait_request(struct kv_conn *c)
+{
+  struct ibv_wc wc;
+  unsigned idle = 0;
+  int n;
+
+  while (!(n = ibv_poll_cq(c->id->recv_cq, 1, &wc)))
+    if (++idle % 4096 == 0 && disconnected(c->id))
+      return -1;
+
+  return n < 0 || wc.status ? -1 : 0;
+}
+
+static void *serve_conn(void *arg)
+{
+  struct kv_conn *c = arg;
+  struct kvstore *cfg = c->cfg;
+  struct ibv_wc wc;
+  uint32_t op;
+
+  fcntl(c->id->channel->fd, F_SETFL,
+        fcntl(c->id->channel->fd, F_GETFL) | O_NONBLOCK);
+
+  while (1) {
+    if (wait_request(c))
+      break;
+
+    memset(c->rep, 0, sizeof(*c->rep));
+    switch (be32toh(c->req->op)) {
+    case KV_PUT:
+      op = kv_put(cfg, be64toh(c->req->key), c->req->value,
+                  be32toh(c->req->vlen));
+      c->puts++;
+      break;
+    case KV_GET:
+      op = kv_get(cfg, c->window, be64toh(c->req->key), c->rep);
+      c->gets++;
+      break;
+    default:
+      op = KV_ERROR;
+    }
+    c->rep->op = htobe32(op);
+
+    /* Repost before replying so the next request never finds no recv */
+    if (rdma_post_recv(c->id, NULL, c->req, cfg->msg_size, c->req_mr) ||
+        rdma_post_send(c->id, NULL, c->rep, cfg->msg_size, c->rep_mr, 0) ||
+        rdma_get_send_comp(c->id, &wc) <= 0 || wc.status)
+      break;
+  }
+
+  if (cfg->verbose)
+    fprintf(stdout, "Connection closed after %lu PUTs and %lu RPC GETs.\n",
+            c->puts, c->gets);
+
+  rdma_disconnect(c->id);
+  free_conn(c);
+  return NULL;
+}
+
+/*
+ * The table is registered against the PD of the first connection.
+ * Later connections come in on the same device and get the same
+ * default PD from librdmacm.
+ */
+
+static int reg_table(struct kvstore *cfg, struct rdma_cm_id *id)
+{
+  if (cfg->table_mr) {
+    if (id->pd != cfg->pd) {
+      errno = EXDEV;
+      return report("connection on another device", -1);
+    }
+    return 0;
+  }
+
+  cfg->pd = id->pd;
+  cfg->table_mr = ibv_reg_mr(cfg->pd, cfg->table, cfg->table_size,
+                             IBV_ACCESS_LOCAL_WRITE |
+                             IBV_ACCESS_REMOTE_READ);
+  if (!cfg->table_mr)
+    return report("ibv_reg_mr", -1);
+
+  if (cfg->verbose)
+    fprintf(stdout, "Registered %zu byte table, rkey %x.\n",
+            cfg->table_size, cfg->table_mr->rkey);
+  return 0;
+}
+
+static int accept_conn(struct kvstore *cfg, struct rdma_cm_id *id)
+{
+  struct kv_conn *c;
+  struct ibv_wc wc;
+  pthread_t thread;
+
+  c = calloc(1, sizeof(*c));
+  if (!c) {
+    rdma_destroy_ep(id);
+    return report("calloc", NO_BUFFER);
+  }
+  c->cfg = cfg;
+  c->id = id;
+  c->req = calloc(1, cfg->msg_size);
+  c->rep = calloc(1, cfg->msg_size);
+  c->window = malloc(cfg->probe * cfg->bucket_size);
+  if (!c->req || !c->rep || !c->window)
+    goto err;
+
+  if (reg_table(cfg, id))
+    goto err;
+
+  c->req_mr = rdma_reg_msgs(id, c->req, cfg->msg_size);
+  c->rep_mr = rdma_reg_msgs(id, c->rep, cfg->msg_size);
+  if (!c->req_mr || !c->rep_mr) {
+    report("rdma_reg_msgs", 0);
+    goto err;
+  }
+
+  if (rdma_post_recv(id, NULL, c->req, cfg->msg_size, c->req_mr)) {
+    report("rdma_post_recv", 0);
+    goto err;
+  }
+
+  if (rdma_accept(id, NULL)) {
+    report("rdma_accept", 0);
+    goto err;
+  }
+
+  c->rep->op = htobe32(KV_HELLO);
+  c->rep->addr = htobe64((uintptr_t) cfg->table);
+  c->rep->rkey = htobe32(cfg->table_mr->rkey);
+  c->rep->buckets = htobe64(cfg->buckets);
+  c->rep->bucket_size = htobe32(cfg->bucket_size);
+  c->rep->probe = htobe32(cfg->probe);
+  c->rep->vlen = htobe32(cfg->value_size);
+  if (rdma_post_send(id, NULL, c->rep, cfg->msg_size, c->rep_mr, 0) ||
+      rdma_get_send_comp(id, &wc) <= 0 || wc.status) {
+    report("send hello", 0);
+    rdma_disconnect(id);
+    goto err;
+  }
+
+  if (pthread_create(&thread, NULL, serve_conn, c)) {
+    rdma_disconnect(id);
+    goto err;
+  }
+  pthread_detach(thread);
+
+  if (cfg->verbose)
+    fprintf(stdout, "Accepted a connection on %s.\n",
+            id->verbs->device->name);
+  return 0;
+
+err:
+  free_conn(c);
+  return SETUP_PROBLEM;
+}
+
+static int run_server(struct kvstore *cfg)
+{
+  struct rdma_addrinfo hints, *res;
+  struct ibv_qp_init_attr attr;
+  struct rdma_cm_id *lid, *id;
+  int ret;
+
+  cfg->table_size = (cfg->buckets + cfg->probe - 1) * cfg->bucket_size;
+  cfg->table = mmap(NULL, cfg->table_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (cfg->table == MAP_FAILED)
+    return report("mmap", NO_BUFFER);
+  madvise(cfg->table, cfg->table_size, MADV_HUGEPAGE);
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_flags = RAI_PASSIVE;
+  hints.ai_port_space = RDMA_PS_TCP;
+  ret = rdma_getaddrinfo(NULL, cfg->port, &hints, &res);
+  if (ret)
+    return report("rdma_getaddrinfo", SETUP_PROBLEM);
+
+  memset(&attr, 0, sizeof(attr));
+  attr.cap.max_send_wr = attr.cap.max_recv_wr = 1;
+  attr.cap.max_send_sge = attr.cap.max_recv_sge = 1;
+  attr.sq_sig_all = 1;
+  ret = rdma_create_ep(&lid, res, NULL, &attr);
+  rdma_freeaddrinfo(res);
+  if (ret)
+    return report("rdma_create_ep", SETUP_PROBLEM);
+
+  if (rdma_listen(lid, 0)) {
+    rdma_destroy_ep(lid);
+    return report("rdma_listen", SETUP_PROBLEM);
+  }
+
+  fprintf(stdout, "Serving %ld buckets of %zu bytes, probe %u, on port %s.\n",
+          cfg->buckets, cfg->bucket_size, cfg->probe, cfg->port);
+
+  while (!rdma_get_request(lid, &id))
+    accept_conn(cfg, id);
+
+  report("rdma_get_request", 0);
+  rdma_destroy_ep(lid);
+  return RUN_PROBLEM;
+}
+
+struct kv_client {
+  struct kvstore          *cfg;
+  struct rdma_cm_id       *id;
+  struct kv_msg           *req;
+  struct kv_msg           *rep;
+  struct ibv_mr           *req_mr;
+  struct ibv_mr           *rep_mr;
+  char                    *window;
+  struct ibv_mr           *window_mr;
+  uint8_t                 *value;
+  uint64_t                buckets;
+  size_t                  bucket_size;
+  unsigned                probe;
+  unsigned                value_size;
+  size_t                  msg_size;     /* what the server receives */
+  unsigned long           retries;
+  unsigned long           misses;
+  unsigned long           bad;
+};
+
+static int rpc(struct kv_client *cl)
+{
+  struct ibv_wc wc;
+
+  if (rdma_post_send(cl->id, NULL, cl->req, cl->msg_size, cl->req_mr, 0))
+    return report("rdma_post_send", -1);
+  if (rdma_get_send_comp(cl->id, &wc) <= 0 || wc.status)
+    return report("rdma_get_send_comp", -1);
+  if (rdma_get_recv_comp(cl->id, &wc) <= 0 || wc.status)
+    return report("rdma_get_recv_comp", -1);
+  if (rdma_post_recv(cl->id, NULL, cl->rep, cl->cfg->msg_size, cl->rep_mr))
+    return report("rdma_post_recv", -1);
+
+  return be32toh(cl->rep->op);
+}
+
+static int check_value(struct kv_client *cl, uint64_t key, const void *value,
+                       uint32_t vlen)
+{
+  if (vlen == cl->value_size &&
+      pattern_verify(value, vlen, PATTERN_PRBS, key) < 0)
+    return 0;
+
+  if (cl->cfg->verbose)
+    fprintf(stderr, "Bad value for key %" PRIu64 "\n", key);
+  cl->bad++;
+  return -1;
+}
+
+static int get_onesided(struct kv_client *cl, uint64_t key)
+{
+  size_t h = kv_hash(key) % cl->buckets;
+  const struct kv_bucket *b;
+  struct ibv_wc wc;
+  enum kv_result res;
+
+  do {
+    if (rdma_post_read(cl->id, NULL, cl->window, cl->probe * cl->bucket_size,
+                       cl->window_mr, 0,
+                       cl->cfg->remote_addr + h * cl->bucket_size,
+                       cl->cfg->rkey))
+      return report("rdma_post_read", -1);
+    if (rdma_get_send_comp(cl->id, &wc) <= 0 || wc.status)
+      return report("rdma_get_send_comp", -1);
+
+    res = kv_scan(cl->window, cl->probe, cl->bucket_size, key, &b);
+    if (res == KV_TORN)
+      cl->retries++;
+  } while (res == KV_TORN);
+
+  if (res == KV_ABSENT) {
+    cl->misses++;
+    return 0;
+  }
+  check_value(cl, key, b->value, b->vlen);
+  return 0;
+}
+
+static int get_rpc(struct kv_client *cl, uint64_t key)
+{
+  int op;
+
+  memset(cl->req, 0, sizeof(*cl->req));
+  cl->req->op = htobe32(KV_GET);
+  cl->req->key = htobe64(key);
+  op = rpc(cl);
+  if (op < 0)
+    return op;
+
+  if (op == KV_MISS) {
+    cl->misses++;
+    return 0;
+  }
+  if (op != KV_OK) {
+    fprintf(stderr, "GET of key %" PRIu64 " failed: %d\n", key, op);
+    return -1;
+  }
+  check_value(cl, key, cl->rep->value, be32toh(cl->rep->vlen));
+  return 0;
+}
+
+static int put_rpc(struct kv_client *cl, uint64_t key)
+{
+  int op;
+
+  memset(cl->req, 0, sizeof(*cl->req));
+  cl->req->op = htobe32(KV_PUT);
+  cl->req->key = htobe64(key);
+  cl->req->vlen = htobe32(cl->value_size);
+  pattern_fill(cl->req->value, cl->value_size, PATTERN_PRBS, key);
+  op = rpc(cl);
+  if (op < 0)
+    return op;
+
+  if (op != KV_OK) {
+    fprintf(stderr, "PUT of key %" PRIu64 " failed: %s\n", key,
+            op == KV_FULL ? "probe window full, try more --buckets" :
+            "server error");
+    return -1;
+  }
+  return 0;
+}
+
+static void report_phase(const char *label, double *lat, size_t count,
+                         double elapsed)
+{
+  fprintf(stdout, "%s: %zu in %.3f s = %.0f ops/s\n", label, count,
+          elapsed, count / elapsed);
+  fprintf(stdout, "%s latency: ", label);
+  report_latency_elapsed(stdout, NULL, lat, count);
+  fprintf(stdout, "\n%s percentiles: ", label);
+  report_percentiles_elapsed(stdout, lat, count);
+  fprintf(stdout, "\n");
+}
+
+/*
+ * Time count operations. keys holds the key for each one, so both GET
+ * flavours look up exactly the same sequence.
+ */
+
+static int run_phase(struct kv_client *cl, const char *label,
+                     int (*op)(struct kv_client *, uint64_t),
+                     uint64_t *keys, size_t count, double *lat)
+{
+  double start, t;
+
+  cl->retries = cl->misses = cl->bad = 0;
+  start = now();
+  for (size_t i=0; i<count; i++) {
+    t = now();
+    if (op(cl, keys[i]))
+      return RUN_PROBLEM;
+    lat[i] = now() - t;
+  }
+
+  report_phase(label, lat, count, now() - start);
+  if (cl->retries || cl->misses || cl->bad)
+    fprintf(stdout, "%s: %lu torn reads retried, %lu misses, %lu bad "
+            "values\n", label, cl->retries, cl->misses, cl->bad);
+
+  return cl->bad ? RUN_PROBLEM : 0;
+}
+
+static int client_connect(struct kvstore *cfg, struct kv_client *cl)
+{
+  struct rdma_addrinfo hints, *res;
+  struct ibv_qp_init_attr attr;
+  struct ibv_wc wc;
+  int ret;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_port_space = RDMA_PS_TCP;
+  ret = rdma_getaddrinfo(cfg->addr, cfg->port, &hints, &res);
+  if (ret)
+    return report("rdma_getaddrinfo", SETUP_PROBLEM);
+
+  memset(&attr, 0, sizeof(attr));
+  attr.cap.max_send_wr = attr.cap.max_recv_wr = 1;
+  attr.cap.max_send_sge = attr.cap.max_recv_sge = 1;
+  attr.sq_sig_all = 1;
+  ret = rdma_create_ep(&cl->id, res, NULL, &attr);
+  rdma_freeaddrinfo(res);
+  if (ret)
+    return report("rdma_create_ep", SETUP_PROBLEM);
+
+  cl->req = calloc(1, cfg->msg_size);
+  cl->rep = calloc(1, cfg->msg_size);
+  if (!cl->req || !cl->rep)
+    return report("calloc", NO_BUFFER);
+  cl->req_mr = rdma_reg_msgs(cl->id, cl->req, cfg->msg_size);
+  cl->rep_mr = rdma_reg_msgs(cl->id, cl->rep, cfg->msg_size);
+  if (!cl->req_mr || !cl->rep_mr)
+    return report("rdma_reg_msgs", SETUP_PROBLEM);
+
+  if (rdma_post_recv(cl->id, NULL, cl->rep, cfg->msg_size, cl->rep_mr))
+    return report("rdma_post_recv", SETUP_PROBLEM);
+
+  if (rdma_connect(cl->id, NULL))
+    return report("rdma_connect", SETUP_PROBLEM);
+
+  if (rdma_get_recv_comp(cl->id, &wc) <= 0 || wc.status ||
+      be32toh(cl->rep->op) != KV_HELLO)
+    return report("hello", SETUP_PROBLEM);
+
+  cfg->remote_addr = be64toh(cl->rep->addr);
+  cfg->rkey = be32toh(cl->rep->rkey);
+  cl->buckets = be64toh(cl->rep->buckets);
+  cl->bucket_size = be32toh(cl->rep->bucket_size);
+  cl->probe = be32toh(cl->rep->probe);
+  cl->value_size = be32toh(cl->rep->vlen);
+  if (!cl->buckets || cl->value_size > cfg->value_size ||
+      cl->bucket_size < sizeof(struct kv_bucket) + cl->value_size) {
+    errno = EPROTO;
+    return report("server table does not fit --value", SETUP_PROBLEM);
+  }
+  /* The server sized its receives from its own --value */
+  cl->msg_size = sizeof(struct kv_msg) + cl->value_size;
+
+  if (rdma_post_recv(cl->id, NULL, cl->rep, cfg->msg_size, cl->rep_mr))
+    return report("rdma_post_recv", SETUP_PROBLEM);
+
+  cl->window = aligned_alloc(KV_CACHELINE, cl->probe * cl->bucket_size);
+  if (!cl->window)
+    return report("aligned_alloc", NO_BUFFER);
+  cl->window_mr = rdma_reg_msgs(cl->id, cl->window,
+                                cl->probe * cl->bucket_size);
+  if (!cl->window_mr)
+    return report("rdma_reg_msgs", SETUP_PROBLEM);
+
+  if (cfg->verbose)
+    fprintf(stdout, "Connected to %s: %" PRIu64 " buckets of %zu bytes, "
+            "probe %u, rkey %x.\n", cfg->addr, cl->buckets, cl->bucket_size,
+            cl->probe, cfg->rkey);
+  return 0;
+}
+
+static int run_client(struct kvstore *cfg)
+{
+  struct kv_client cl = { .cfg = cfg };
+  uint64_t *keys = NULL;
+  double *lat = NULL;
+  size_t n = cfg->keys > cfg->iters ? cfg->keys : cfg->iters;
+  int ret;
+
+  ret = client_connect(cfg, &cl);
+  if (ret)
+    goto out;
+
+  keys = malloc(n * sizeof(*keys));
+  lat = malloc(n * sizeof(*lat));
+  if (!keys || !lat) {
+    ret = report("malloc", NO_BUFFER);
+    goto out;
+  }
+
+  for (long i=0; i<cfg->keys; i++)
+    keys[i] = i + 1;
+  ret = run_phase(&cl, "rpc put", put_rpc, keys, cfg->keys, lat);
+  if (ret)
+    goto out;
+
+  srand(1);
+  for (long i=0; i<cfg->iters; i++)
+    keys[i] = 1 + (uint64_t) rand() % cfg->keys;
+
+  ret = run_phase(&cl, "one-sided get", get_onesided, keys, cfg->iters, lat);
+  if (!ret)
+    ret = run_phase(&cl, "rpc get", get_rpc, keys, cfg->iters, lat);
+
+out:
+  if (cl.id)
+    rdma_disconnect(cl.id);
+  if (cl.window_mr)
+    rdma_dereg_mr(cl.window_mr);
+  if (cl.req_mr)
+    rdma_dereg_mr(cl.req_mr);
+  if (cl.rep_mr)
+    rdma_dereg_mr(cl.rep_mr);
+  if (cl.id)
+    rdma_destroy_ep(cl.id);
+  free(cl.window);
+  free(cl.req);
+  free(cl.rep);
+  free(keys);
+  free(lat);
+  return ret;
+}
+
+int main(int argc, char *argv[])
+{
+  struct kvstore cfg;
+
+  argconfig_append_usage("[SERVER_NAME]");
+  int args = argconfig_parse(argc, argv, program_desc, command_line_options,
+                             &defaults, &cfg, sizeof(cfg));
+  if (args > 1) {
+    argconfig_print_help(argv[0], program_desc, command_line_options);
+    return BAD_ARGS;
+  }
+  if (args == 1)
+    cfg.addr = argv[1];
+
+  if (cfg.buckets <= 0 || cfg.keys <= 0 || cfg.iters <= 0)
+    return BAD_ARGS;
+
+  cfg.bucket_size = (sizeof(struct kv_bucket) + cfg.value_size +
+                     KV_CACHELINE - 1) & ~(size_t) (KV_CACHELINE - 1);
+  cfg.msg_size = sizeof(struct kv_msg) + cfg.value_size;
+  cfg.table_mr = NULL;
+
+  if (cfg.addr)
+    return run_client(&cfg);
+  return run_server(&cfg);
+}
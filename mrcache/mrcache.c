@@ -0,0 +1,539 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Memory registration cache, see mrcache.h.
+//
+//     The interval tree is an AVL tree ordered on range start where
+//     every node also records the largest range end in its subtree,
+//     which lets overlap queries skip whole subtrees.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "mrcache.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+struct mrcache_entry {
+    uintptr_t             start;
+    uintptr_t             end;
+    struct ibv_mr         *mr;
+    unsigned              refcnt;
+    int                   dead;
+
+    /* Interval tree */
+    struct mrcache_entry  *left, *right;
+    uintptr_t             max_end;
+    int                   height;
+
+    /*
+     * LRU list of unreferenced entries, most recent first, or for dead
+     * entries the list of those still referenced
+     */
+    struct mrcache_entry  *lru_prev, *lru_next;
+};
+
+struct mrcache {
+    struct ibv_pd         *pd;
+    int                   access;
+    size_t                budget;
+    uintptr_t             page_mask;
+
+    struct mrcache_entry  *root;
+    struct mrcache_entry  *lru_head, *lru_tail;
+    struct mrcache_entry  *dead;
+
+    struct mrcache_stats  stats;
+    pthread_mutex_t       lock;
+};
+
+struct entry_list {
+    struct mrcache_entry  **entries;
+    size_t                count;
+    size_t                alloced;
+};
+
+////////////////////////////////////////////////////////////////////////
+// Interval tree
+////////////////////////////////////////////////////////////////////////
+
+static int node_height(struct mrcache_entry *n)
+{
+    return n ? n->height : 0;
+}
+
+static void node_update(struct mrcache_entry *n)
+{
+    int lh = node_height(n->left), rh = node_height(n->right);
+
+    n->height  = 1 + (lh > rh ? lh : rh);
+    n->max_end = n->end;
+    if (n->left && n->left->max_end > n->max_end)
+        n->max_end = n->left->max_end;
+    if (n->right && n->right->max_end > n->max_end)
+        n->max_end = n->right->max_end;
+}
+
+static struct mrcache_entry *rotate_right(struct mrcache_entry *n)
+{
+    struct mrcache_entry *l = n->left;
+
+    n->left = l->right;
+    l->right = n;
+    node_update(n);
+    node_update(l);
+    return l;
+}
+
+static struct mrcache_entry *rotate_left(struct mrcache_entry *n)
+{
+    struct mrcache_entry *r = n->right;
+
+    n->right = r->left;
+    r->left = n;
+    node_update(n);
+    node_update(r);
+    return r;
+}
+
+static struct mrcache_entry *rebalance(struct mrcache_entry *n)
+{
+    int balance;
+
+    node_update(n);
+    balance = node_height(n->left) - node_height(n->right);
+
+    if (balance > 1) {
+        if (node_height(n->left->left) < node_height(n->left->right))
+            n->left = rotate_left(n->left);
+        return rotate_right(n);
+    }
+
+    if (balance < -1) {
+        if (node_height(n->right->right) < node_height(n->right->left))
+            n->right = rotate_right(n->right);
+        return rotate_left(n);
+    }
+
+    return n;
+}
+
+/* Entries may share a start address, so break ties on the pointer. */
+static int entry_cmp(struct mrcache_entry *a, struct mrcache_entry *b)
+{
+    if (a->start != b->start)
+        return a->start < b->start ? -1 : 1;
+    if (a != b)
+        return a < b ? -1 : 1;
+    return 0;
+}
+
+static struct mrcache_entry *tree_insert(struct mrcache_entry *n,
+                                         struct mrcache_entry *e)
+{
+    if (!n) {
+        e->left = e->right = NULL;
+        node_update(e);
+        return e;
+    }
+
+    if (entry_cmp(e, n) < 0)
+        n->left = tree_insert(n->left, e);
+    else
+        n->right = tree_insert(n->right, e);
+
+    return rebalance(n);
+}
+
+static struct mrcache_entry *tree_remove_min(struct mrcache_entry *n,
+                                             struct mrcache_entry **min)
+{
+    if (!n->left) {
+        *min = n;
+        return n->right;
+    }
+
+    n->left = tree_remove_min(n->left, min);
+    return rebalance(n);
+}
+
+static struct mrcache_entry *tree_remove(struct mrcache_entry *n,
+                                         struct mrcache_entry *e)
+{
+    struct mrcache_entry *min;
+    int cmp;
+
+    if (!n)
+        return NULL;
+
+    cmp = entry_cmp(e, n);
+    if (cmp < 0) {
+        n->left = tree_remove(n->left, e);
+    } else if (cmp > 0) {
+        n->right = tree_remove(n->right, e);
+    } else {
+        if (!n->left || !n->right)
+            return n->left ? n->left : n->right;
+
+        n->right = tree_remove_min(n->right, &min);
+        min->left = n->left;
+        min->right = n->right;
+        n = min;
+    }
+
+    return rebalance(n);
+}
+
+/*
+ * Collect every entry whose range touches the closed interval
+ * [start, end]. Half open ranges that merely abut the query are
+ * included, which is what merging wants.
+ */
+static int tree_collect(struct mrcache_entry *n, uintptr_t start,
+                        uintptr_t end, struct entry_list *list)
+{
+    if (!n || n->max_end < start)
+        return 0;
+
+    if (tree_collect(n->left, start, end, list))
+        return -1;
+
+    if (n->start > end)
+        return 0;
+
+    if (n->end >= start) {
+        if (list->count == list->alloced) {
+            size_t alloced = list->alloced ? list->alloced * 2 : 8;
+            void *tmp = realloc(list->entries,
+                                alloced * sizeof(*list->entries));
+            if (!tmp)
+                return -1;
+            list->entries = tmp;
+            list->alloced = alloced;
+        }
+        list->entries[list->count++] = n;
+    }
+
+    return tree_collect(n->right, start, end, list);
+}
+
+static struct mrcache_entry *tree_find_covering(struct mrcache_entry *n,
+                                                uintptr_t start,
+                                                uintptr_t end)
+{
+    struct mrcache_entry *found;
+
+    if (!n || n->max_end < end)
+        return NULL;
+
+    if (n->start <= start && n->end >= end)
+        return n;
+
+    found = tree_find_covering(n->left, start, end);
+    if (found)
+        return found;
+
+    if (n->start > start)
+        return NULL;
+
+    return tree_find_covering(n->right, start, end);
+}
+
+////////////////////////////////////////////////////////////////////////
+// LRU
+////////////////////////////////////////////////////////////////////////
+
+static void lru_push(struct mrcache *cache, struct mrcache_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = cache->lru_head;
+    if (cache->lru_head)
+        cache->lru_head->lru_prev = e;
+    else
+        cache->lru_tail = e;
+    cache->lru_head = e;
+}
+
+static void lru_unlink(struct mrcache *cache, struct mrcache_entry *e)
+{
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        cache->lru_head = e->lru_next;
+
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        cache->lru_tail = e->lru_prev;
+
+    e->lru_prev = e->lru_next = NULL;
+}
+
+/* Dead entries still referenced, so that destroy can find them */
+static void dead_push(struct mrcache *cache, struct mrcache_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = cache->dead;
+    if (cache->dead)
+        cache->dead->lru_prev = e;
+    cache->dead = e;
+}
+
+static void dead_unlink(struct mrcache *cache, struct mrcache_entry *e)
+{
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        cache->dead = e->lru_next;
+
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+
+    e->lru_prev = e->lru_next = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Cache
+////////////////////////////////////////////////////////////////////////
+
+static void entry_free(struct mrcache *cache, struct mrcache_entry *e)
+{
+    ibv_dereg_mr(e->mr);
+    cache->stats.pinned -= e->end - e->start;
+    cache->stats.entries--;
+    free(e);
+}
+
+/*
+ * Take an entry out of the tree. Idle entries are released straight
+ * away; referenced ones are marked dead and released on their last
+ * put.
+ */
+static void entry_retire(struct mrcache *cache, struct mrcache_entry *e)
+{
+    cache->root = tree_remove(cache->root, e);
+
+    if (e->refcnt) {
+        e->dead = 1;
+        dead_push(cache, e);
+        return;
+    }
+
+    lru_unlink(cache, e);
+    entry_free(cache, e);
+}
+
+static int evict(struct mrcache *cache, size_t needed)
+{
+    while (cache->stats.pinned + needed > cache->budget) {
+        if (!cache->lru_tail)
+            return -ENOMEM;
+
+        entry_retire(cache, cache->lru_tail);
+        cache->stats.evictions++;
+    }
+
+    return 0;
+}
+
+struct mrcache *mrcache_create(struct ibv_pd *pd, int access, size_t budget)
+{
+    struct mrcache *cache = calloc(1, sizeof(*cache));
+    if (!cache)
+        return NULL;
+
+    cache->pd        = pd;
+    cache->access    = access;
+    cache->budget    = budget;
+    cache->page_mask = sysconf(_SC_PAGESIZE) - 1;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return cache;
+}
+
+/* Entries still referenced are freed too, their owners must not put them */
+void mrcache_destroy(struct mrcache *cache)
+{
+    struct mrcache_entry *e;
+
+    while (cache->root) {
+        e = cache->root;
+        cache->root = tree_remove(cache->root, e);
+        entry_free(cache, e);
+    }
+
+    while ((e = cache->dead)) {
+        dead_unlink(cache, e);
+        entry_free(cache, e);
+    }
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+struct mrcache_entry *mrcache_get(struct mrcache *cache, void *addr,
+                                  size_t len)
+{
+    struct entry_list merge = {0};
+    struct mrcache_entry *e;
+    uintptr_t start, end, mstart, mend;
+    int ret;
+
+    start = (uintptr_t) addr & ~cache->page_mask;
+    end   = ((uintptr_t) addr + len + cache->page_mask) & ~cache->page_mask;
+
+    pthread_mutex_lock(&cache->lock);
+
+    e = tree_find_covering(cache->root, start, end);
+    if (e) {
+        if (!e->refcnt++)
+            lru_unlink(cache, e);
+        cache->stats.hits++;
+        pthread_mutex_unlock(&cache->lock);
+        return e;
+    }
+
+    cache->stats.misses++;
+
+    /*
+     * Grow the new registration to swallow every neighbour it
+     * overlaps or touches, unless that would blow the budget on its
+     * own.
+     */
+    mstart = start;
+    mend = end;
+    if (tree_collect(cache->root, start, end, &merge)) {
+        ret = -ENOMEM;
+        goto out_unlock;
+    }
+
+    for (size_t i = 0; i < merge.count; i++) {
+        if (merge.entries[i]->start < mstart)
+            mstart = merge.entries[i]->start;
+        if (merge.entries[i]->end > mend)
+            mend = merge.entries[i]->end;
+    }
+
+    if (mend - mstart > cache->budget) {
+        mstart = start;
+        mend = end;
+        merge.count = 0;
+    }
+
+    for (size_t i = 0; i < merge.count; i++)
+        entry_retire(cache, merge.entries[i]);
+    if (merge.count)
+        cache->stats.merges++;
+
+    ret = evict(cache, mend - mstart);
+    if (ret)
+        goto out_unlock;
+
+    e = calloc(1, sizeof(*e));
+    if (!e) {
+        ret = -ENOMEM;
+        goto out_unlock;
+    }
+
+    e->start  = mstart;
+    e->end    = mend;
+    e->refcnt = 1;
+    e->mr = ibv_reg_mr(cache->pd, (void *) mstart, mend - mstart,
+                       cache->access);
+    if (!e->mr) {
+        ret = -errno;
+        free(e);
+        goto out_unlock;
+    }
+
+    cache->root = tree_insert(cache->root, e);
+    cache->stats.entries++;
+    cache->stats.pinned += mend - mstart;
+    if (cache->stats.pinned > cache->stats.peak_pinned)
+        cache->stats.peak_pinned = cache->stats.pinned;
+
+    free(merge.entries);
+    pthread_mutex_unlock(&cache->lock);
+    return e;
+
+out_unlock:
+    free(merge.entries);
+    pthread_mutex_unlock(&cache->lock);
+    errno = -ret;
+    return NULL;
+}
+
+void mrcache_put(struct mrcache *cache, struct mrcache_entry *e)
+{
+    pthread_mutex_lock(&cache->lock);
+
+    if (!--e->refcnt) {
+        if (e->dead) {
+            dead_unlink(cache, e);
+            entry_free(cache, e);
+        }
+        else
+            lru_push(cache, e);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+struct ibv_mr *mrcache_entry_mr(struct mrcache_entry *e)
+{
+    return e->mr;
+}
+
+void mrcache_invalidate(struct mrcache *cache, void *addr, size_t len)
+{
+    struct entry_list hits = {0};
+    uintptr_t start = (uintptr_t) addr;
+
+    if (!len)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+
+    /* Strict overlap only: ranges ending at addr are unaffected. */
+    tree_collect(cache->root, start + 1, start + len - 1, &hits);
+    for (size_t i = 0; i < hits.count; i++) {
+        entry_retire(cache, hits.entries[i]);
+        cache->stats.invalidations++;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    free(hits.entries);
+}
+
+int mrcache_munmap(struct mrcache *cache, void *addr, size_t len)
+{
+    mrcache_invalidate(cache, addr, len);
+    return munmap(addr, len);
+}
+
+void mrcache_get_stats(struct mrcache *cache, struct mrcache_stats *stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
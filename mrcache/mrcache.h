@@ -0,0 +1,81 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Memory registration cache. Lets a program post out of arbitrary
+//     buffers without paying for ibv_reg_mr on every send.
+//
+//     Registrations are page aligned and kept in an interval tree
+//     keyed by address range. A miss that overlaps or touches
+//     existing registrations replaces them with one merged MR, so a
+//     working set of neighbouring buffers converges on a few large
+//     MRs. Unused registrations sit on an LRU list and are evicted
+//     to stay under a pinned memory budget.
+//
+//     The cache cannot see the application unmapping memory, so
+//     anything that frees a cached range must call
+//     mrcache_invalidate() first (or use mrcache_munmap()).
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef __MRCACHE_H__
+#define __MRCACHE_H__
+
+#include <stddef.h>
+#include <infiniband/verbs.h>
+
+struct mrcache;
+struct mrcache_entry;
+
+struct mrcache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long merges;
+    unsigned long evictions;
+    unsigned long invalidations;
+    unsigned      entries;
+    size_t        pinned;
+    size_t        peak_pinned;
+};
+
+struct mrcache *mrcache_create(struct ibv_pd *pd, int access, size_t budget);
+
+/*
+ * Deregister and free every entry, including ones that are still
+ * referenced. Their MRs are gone afterwards and they must not be put.
+ */
+void mrcache_destroy(struct mrcache *cache);
+
+/*
+ * Return a registration covering [addr, addr + len) and take a
+ * reference on it. Returns NULL with errno set if the range cannot
+ * be registered within the budget.
+ */
+struct mrcache_entry *mrcache_get(struct mrcache *cache, void *addr,
+                                  size_t len);
+void mrcache_put(struct mrcache *cache, struct mrcache_entry *entry);
+struct ibv_mr *mrcache_entry_mr(struct mrcache_entry *entry);
+
+/*
+ * Drop every registration overlapping [addr, addr + len). Entries
+ * that are still referenced are deregistered on their last put.
+ */
+void mrcache_invalidate(struct mrcache *cache, void *addr, size_t len);
+int mrcache_munmap(struct mrcache *cache, void *addr, size_t len);
+
+void mrcache_get_stats(struct mrcache *cache, struct mrcache_stats *stats);
+
+#endif
@@ -45,6 +45,9 @@
 
 #include "../argconfig/argconfig.h"
 #include "../argconfig/report.h"
+#include "../argconfig/suffix.h"
+#include "../mrcache/mrcache.h"
+#include "../pattern/pattern.h"
 
 enum errors {
   BAD_ARGS       = 1,
@@ -82,9 +85,24 @@ struct myfirstrdma {
   unsigned                iters;
   unsigned                wait;
   unsigned                memset;
+  unsigned                check;
+  char                    *pattern_name;
+  int                     pattern;
 
   unsigned                copymmio;
   unsigned                peerdirect;
+  unsigned                odp;
+  unsigned                implicit;
+  unsigned                prefetch;
+
+  unsigned                bufs;
+  unsigned                use_mrcache;
+  long                    budget;
+  char                    **pool;
+  struct mrcache          *cache;
+  struct mrcache_entry    *send_entry;
+  struct ibv_mr           *send_mr;
+  double                  reg_time;
   int                     mmiofd;
   void                    *mmio;
   char                    *mmap;
@@ -110,9 +128,18 @@ static const struct myfirstrdma defaults = {
   .iters      = 512,
   .wait       = 0,
   .memset     = 0,
+  .check      = 0,
+  .pattern_name = "constant",
 
   .copymmio   = 0,
   .peerdirect = 0,
+  .odp        = 0,
+  .implicit   = 0,
+  .prefetch   = 0,
+
+  .bufs       = 0,
+  .use_mrcache = 0,
+  .budget     = 64 << 20,
   .mmap       = "/sys/devices/pci0000:00/0000:00:01.0/0000:01:00.0/resource4",
 
   .log        = NULL,
@@ -137,6 +164,10 @@ static const struct argconfig_commandline_options command_line_options[] = {
     {"m",        "", CFG_NONE, &defaults.memset, no_argument, NULL},
     {"memset",   "", CFG_NONE, &defaults.memset, no_argument,
             "update the MR with data (should be used with --wait)"},
+    {"pattern",  "NAME", CFG_STRING, &defaults.pattern_name, required_argument,
+            "data for --memset: constant, increment, prbs or sequence"},
+    {"check",    "", CFG_NONE, &defaults.check, no_argument,
+            "check received data against --pattern (peer needs --memset)"},
     {"c",          "", CFG_NONE, &defaults.copymmio, no_argument, NULL},
     {"copymmio",   "", CFG_NONE, &defaults.copymmio, no_argument,
             "on server also copy data to a mmap region"},
@@ -145,6 +176,18 @@ static const struct argconfig_commandline_options command_line_options[] = {
             "use PeerDirect (cannot use -c and must -m must lie within IOMEM)"},
     {"mmap",          "MMAP", CFG_STRING, &defaults.mmap, required_argument,
             "file to mmap, for -p should lie within IOMEM"},
+    {"odp",           "", CFG_NONE, &defaults.odp, no_argument,
+            "register the MR with On-Demand Paging instead of pinning it"},
+    {"implicit",      "", CFG_NONE, &defaults.implicit, no_argument,
+            "use an implicit ODP MR covering the whole address space"},
+    {"prefetch",      "", CFG_NONE, &defaults.prefetch, no_argument,
+            "prefetch the ODP MR with ibv_advise_mr before the run"},
+    {"bufs",          "NUM", CFG_POSITIVE, &defaults.bufs, required_argument,
+            "send from NUM randomly chosen buffers, registering each send"},
+    {"mrcache",       "", CFG_NONE, &defaults.use_mrcache, no_argument,
+            "with --bufs, look registrations up in an MR cache"},
+    {"budget",        "NUM", CFG_LONG_SUFFIX, &defaults.budget, required_argument,
+            "pinned memory budget for --mrcache"},
     {"v",             "", CFG_NONE, &defaults.verbose, no_argument, NULL},
     {"verbose",       "", CFG_NONE, &defaults.verbose, no_argument,
             "be verbose"},
@@ -160,20 +203,94 @@ static int report(struct myfirstrdma *cfg, const char *func, int val)
   return val;
 }
 
-int compare(char *buf, char val, size_t size)
+void wait(struct myfirstrdma *cfg, char *buf, int val)
+{
+  while (pattern_verify(buf, cfg->size, cfg->pattern, val) >= 0)
+    __sync_synchronize();
+}
+
+static int check(struct myfirstrdma *cfg, char *buf, int val)
 {
+  ssize_t bad;
 
-  for (unsigned i=0; i<size; i++)
-    if (buf[i]!=val)
-      return 0;
+  if (!cfg->check)
+    return 0;
 
-  return 1;
+  bad = pattern_verify(buf, cfg->size, cfg->pattern, val);
+  if (bad < 0)
+    return 0;
+
+  fprintf(stderr, "Data mismatch at byte %zd: got 0x%02x expected 0x%02x\n",
+	  bad, (unsigned char) buf[bad], pattern_byte(cfg->pattern, val, bad));
+  errno = EIO;
+  return -1;
 }
 
-void wait(char *buf, char val, size_t size)
+/*
+ * Register the buffer against the PD rdma_create_ep() gave us. By
+ * default this pins the whole buffer up front, just like
+ * rdma_reg_msgs(). With --odp the pages are instead faulted in by the
+ * device the first time it touches them, optionally via an implicit
+ * MR that covers the whole address space.
+ */
+
+static int reg_buf(struct myfirstrdma *cfg)
 {
-  while (compare(buf, val, size)==0)
-    __sync_synchronize();
+  uint32_t needed = IBV_ODP_SUPPORT_SEND | IBV_ODP_SUPPORT_RECV;
+  struct ibv_device_attr_ex attr;
+  struct timeval start, end;
+
+  if (cfg->odp) {
+    if (ibv_query_device_ex(cfg->cid->verbs, NULL, &attr))
+      return report(cfg, "ibv_query_device_ex", -1);
+    /* The endpoint is RC and moves the buffer with SEND and RECV */
+    if (!(attr.odp_caps.general_caps & IBV_ODP_SUPPORT) ||
+	(cfg->implicit &&
+	 !(attr.odp_caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT)) ||
+	(attr.odp_caps.per_transport_caps.rc_odp_caps & needed) != needed) {
+      errno = EOPNOTSUPP;
+      return report(cfg, "odp_caps", -1);
+    }
+    cfg->mr_flags |= IBV_ACCESS_ON_DEMAND;
+  }
+
+  gettimeofday(&start, NULL);
+  if (cfg->implicit)
+    cfg->mr = ibv_reg_mr(cfg->cid->pd, NULL, SIZE_MAX, cfg->mr_flags);
+  else
+    cfg->mr = ibv_reg_mr(cfg->cid->pd, cfg->buf, cfg->size, cfg->mr_flags);
+  gettimeofday(&end, NULL);
+  if (!cfg->mr)
+    return report(cfg, "ibv_reg_mr", -1);
+
+  if (cfg->verbose) {
+    fprintf(stderr, "Registered (%s): ", cfg->implicit ? "implicit ODP" :
+	    cfg->odp ? "ODP" : "pinned");
+    report_transfer_rate(stderr, &start, &end, cfg->size);
+    fprintf(stderr, "\n");
+  }
+
+  if (cfg->prefetch) {
+    struct ibv_sge sge = {
+      .addr   = (uintptr_t) cfg->buf,
+      .length = cfg->size,
+      .lkey   = cfg->mr->lkey,
+    };
+
+    gettimeofday(&start, NULL);
+    if (ibv_advise_mr(cfg->cid->pd, IBV_ADVISE_MR_ADVICE_PREFETCH_WRITE,
+		      IBV_ADVISE_MR_FLAG_FLUSH, &sge, 1))
+      return report(cfg, "ibv_advise_mr", -1);
+    gettimeofday(&end, NULL);
+
+    if (cfg->verbose) {
+      fprintf(stderr, "Prefetched: ");
+      report_transfer_rate(stderr, &start, &end, cfg->size);
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return 0;
 }
 
 static int setup(struct myfirstrdma *cfg)
@@ -232,9 +349,9 @@ static int setup(struct myfirstrdma *cfg)
    */
 
   if (cfg->server){
-    cfg->mr = rdma_reg_msgs(cfg->cid, cfg->buf, cfg->size);
+    ret = reg_buf(cfg);
     if (ret)
-      return report(cfg, "rdma_reg_msgs", ret);
+      return ret;
     ret = rdma_connect(cfg->cid, NULL);
     if (ret)
       return report(cfg, "rdma_connect", ret);
@@ -248,9 +365,9 @@ static int setup(struct myfirstrdma *cfg)
     ret = rdma_get_request(cfg->lid, &cfg->cid);
     if (ret)
       return report(cfg, "rdma_get_request", ret);
-    cfg->mr = rdma_reg_msgs(cfg->cid, cfg->buf, cfg->size);
+    ret = reg_buf(cfg);
     if (ret)
-      return report(cfg, "rdma_reg_msgs", ret);
+      return ret;
     ret = rdma_post_recv(cfg->cid, NULL, cfg->buf, cfg->size, cfg->mr);
     if (ret)
       return report(cfg, "rdma_post_recv", ret);
@@ -264,12 +381,124 @@ static int setup(struct myfirstrdma *cfg)
     return ret;
 }
 
+static double timeval_to_secs(struct timeval *t)
+{
+  return t->tv_sec + t->tv_usec / 1e6;
+}
+
+/*
+ * With --bufs every send comes out of a randomly chosen application
+ * buffer that first has to be registered, either from scratch or
+ * through the MR cache. Registration time is accumulated so the two
+ * approaches can be compared.
+ */
+
+static char *pick_send_buf(struct myfirstrdma *cfg)
+{
+  if (!cfg->bufs)
+    return cfg->buf;
+  return cfg->pool[rand() % cfg->bufs];
+}
+
+static int post_send_buf(struct myfirstrdma *cfg, char *buf)
+{
+  struct timeval start, end;
+  struct ibv_mr *mr = cfg->mr;
+
+  if (cfg->bufs) {
+    gettimeofday(&start, NULL);
+    if (cfg->cache) {
+      cfg->send_entry = mrcache_get(cfg->cache, buf, cfg->size);
+      mr = cfg->send_entry ? mrcache_entry_mr(cfg->send_entry) : NULL;
+    } else {
+      mr = ibv_reg_mr(cfg->cid->pd, buf, cfg->size, IBV_ACCESS_LOCAL_WRITE);
+    }
+    gettimeofday(&end, NULL);
+    cfg->reg_time += timeval_to_secs(&end) - timeval_to_secs(&start);
+    if (!mr)
+      return -1;
+    cfg->send_mr = mr;
+  }
+
+  return rdma_post_send(cfg->cid, NULL, buf, cfg->size, mr, 0);
+}
+
+static void release_send_buf(struct myfirstrdma *cfg)
+{
+  struct timeval start, end;
+
+  if (!cfg->bufs)
+    return;
+
+  gettimeofday(&start, NULL);
+  if (cfg->cache)
+    mrcache_put(cfg->cache, cfg->send_entry);
+  else
+    ibv_dereg_mr(cfg->send_mr);
+  gettimeofday(&end, NULL);
+  cfg->reg_time += timeval_to_secs(&end) - timeval_to_secs(&start);
+}
+
+static void report_registration(struct myfirstrdma *cfg)
+{
+  struct mrcache_stats stats;
+  double total = cfg->reg_time, per_send = cfg->reg_time / cfg->iters;
+  const char *t_suffix = " ", *p_suffix = " ";
+
+  if (total < 1)
+    t_suffix = suffix_si_get(&total);
+  if (per_send < 1)
+    p_suffix = suffix_si_get(&per_send);
+
+  fprintf(stderr, "Registration (%s, %u bufs): %-6.1f%ss total : "
+	  "%-6.1f%ss per send",	cfg->cache ? "mrcache" : "per send",
+	  cfg->bufs, total, t_suffix, per_send, p_suffix);
+
+  if (cfg->cache) {
+    mrcache_get_stats(cfg->cache, &stats);
+    double peak = stats.peak_pinned;
+    const char *peak_suffix = suffix_dbinary_get(&peak);
+    fprintf(stderr, "\nMR cache: hits %lu : misses %lu : merges %lu : "
+	    "evictions %lu : entries %u : peak pinned %.1f%sB",
+	    stats.hits, stats.misses, stats.merges, stats.evictions,
+	    stats.entries, peak, peak_suffix);
+  }
+  fprintf(stderr, "\n");
+}
+
+/*
+ * Compare the very first round trip, which takes any ODP page faults,
+ * with the steady state of the rest of the run.
+ */
+
+static void report_first_touch_iters(struct myfirstrdma *cfg)
+{
+  double *iter;
+  struct timeval *prev = &cfg->start_time;
+
+  iter = malloc(cfg->iters * sizeof(*iter));
+  if (!iter)
+    return;
+
+  for (unsigned i=0; i<cfg->iters; i++) {
+    iter[i] = timeval_to_secs(&cfg->latency[2*i+1]) - timeval_to_secs(prev);
+    prev = &cfg->latency[2*i+1];
+  }
+
+  fprintf(stderr, "First touch: ");
+  report_first_touch_elapsed(stderr, iter, cfg->iters);
+  fprintf(stderr, "\n");
+
+  free(iter);
+}
+
 int run(struct myfirstrdma *cfg)
 {
 
   int ret;
   struct ibv_wc wc;
   int sval = 0, cval = 1;
+  char *sbuf;
 
   memset((void*)cfg->buf, 0x0, cfg->size);
 
@@ -282,26 +511,30 @@ int run(struct myfirstrdma *cfg)
   for (unsigned i=0; i<cfg->iters ; i++) {
 
     if (cfg->server){
+      sbuf = pick_send_buf(cfg);
       if (cfg->memset)
-	memset((void*)cfg->buf, cval, cfg->size);
+	pattern_fill(sbuf, cfg->size, cfg->pattern, cval);
       __sync_synchronize();
-      ret = rdma_post_send(cfg->cid, NULL, cfg->buf, cfg->size, cfg->mr, 0);
+      ret = post_send_buf(cfg, sbuf);
       if (ret)
 	return report(cfg, "rdma_post_send", ret);
       ret = rdma_get_send_comp(cfg->cid, &wc);
       gettimeofday(&cfg->latency[2*i], NULL);
       if (ret != 1)
 	return report(cfg, "rdma_get_send_comp", ret);
+      release_send_buf(cfg);
       ret = rdma_post_recv(cfg->cid, NULL, cfg->buf, cfg->size, cfg->mr);
       if (ret)
 	return report(cfg, "rdma_post_recv", ret);
     } else {
       if (cfg->wait)
-	wait(cfg->buf, cval, cfg->size);
+	wait(cfg, cfg->buf, cval);
       ret = rdma_get_recv_comp(cfg->cid, &wc);
       gettimeofday(&cfg->latency[2*i], NULL);
       if (ret != 1)
 	return report(cfg, "rdma_get_recv_comp", ret);
+      if (check(cfg, cfg->buf, cval))
+	return report(cfg, "check", -EIO);
       if (cfg->copymmio)
 	if ( !memcpy(cfg->mmio, cfg->buf, cfg->size) )
 	  return report(cfg, "memcpy", -ENOMEM);
@@ -311,26 +544,30 @@ int run(struct myfirstrdma *cfg)
 
     if (cfg->server) {
       if (cfg->wait)
-	wait(cfg->buf, sval, cfg->size);
+	wait(cfg, cfg->buf, sval);
       ret = rdma_get_recv_comp(cfg->cid, &wc);
       gettimeofday(&cfg->latency[2*i+1], NULL);
       if (ret != 1)
 	return report(cfg, "rdma_get_recv_comp", ret);
+      if (check(cfg, cfg->buf, sval))
+	return report(cfg, "check", -EIO);
 
     } else {
       if (cfg->copymmio)
 	if ( !memcpy(cfg->buf, cfg->mmio, cfg->size) )
 	  return report(cfg, "memcpy", -ENOMEM);
+      sbuf = pick_send_buf(cfg);
       if (cfg->memset)
-	memset(cfg->buf, sval, cfg->size);
+	pattern_fill(sbuf, cfg->size, cfg->pattern, sval);
       __sync_synchronize();
-      ret = rdma_post_send(cfg->cid, NULL, cfg->buf, cfg->size, cfg->mr, 0);
+      ret = post_send_buf(cfg, sbuf);
       if (ret)
 	return report(cfg, "rdma_post_send", ret);
       ret = rdma_get_send_comp(cfg->cid, &wc);
       gettimeofday(&cfg->latency[2*i+1], NULL);
       if (ret != 1)
 	return report(cfg, "rdma_get_send_comp", ret);
+      release_send_buf(cfg);
       ret = rdma_post_recv(cfg->cid, NULL, cfg->buf, cfg->size, cfg->mr);
       if (ret)
 	return report(cfg, "rdma_post_recv", ret);
@@ -352,6 +589,11 @@ int run(struct myfirstrdma *cfg)
 		 cfg->latency, cfg->iters*2);
   fprintf(stderr, "\n");
 
+  report_first_touch_iters(cfg);
+
+  if (cfg->bufs)
+    report_registration(cfg);
+
   return 0;
 }
 
@@ -378,6 +620,16 @@ int main(int argc, char *argv[])
   if (cfg.peerdirect && !cfg.mmap)
     return report(&cfg, "bad defaults", BAD_ARGS);
 
+  if (cfg.implicit)
+    cfg.odp = 1;
+
+  if (cfg.prefetch && !cfg.odp)
+    return report(&cfg, "--prefetch requires --odp", BAD_ARGS);
+
+  cfg.pattern = pattern_parse(cfg.pattern_name);
+  if (cfg.pattern < 0)
+    return report(&cfg, "unknown --pattern", BAD_ARGS);
+
   if (cfg.log){
       cfg.flog = fopen(cfg.log,"w");
       if (!cfg.flog)
@@ -405,9 +657,32 @@ int main(int argc, char *argv[])
   if (!cfg.latency)
     return report(&cfg, "malloc", NO_BUFFER);
 
+  cfg.pool = NULL;
+  cfg.cache = NULL;
+  cfg.reg_time = 0;
+  if (cfg.bufs) {
+    srand(getpid());
+    cfg.pool = calloc(cfg.bufs, sizeof(*cfg.pool));
+    if (!cfg.pool)
+      return report(&cfg, "calloc", NO_BUFFER);
+    for (unsigned i=0; i<cfg.bufs; i++) {
+      cfg.pool[i] = malloc(cfg.size);
+      if (!cfg.pool[i])
+	return report(&cfg, "malloc", NO_BUFFER);
+      memset(cfg.pool[i], 0, cfg.size);
+    }
+  }
+
   if ( setup(&cfg) )
     return report(&cfg, "setup", SETUP_PROBLEM);
 
+  if (cfg.bufs && cfg.use_mrcache) {
+    cfg.cache = mrcache_create(cfg.cid->pd, IBV_ACCESS_LOCAL_WRITE,
+			       cfg.budget);
+    if (!cfg.cache)
+      return report(&cfg, "mrcache_create", SETUP_PROBLEM);
+  }
+
   if ( run(&cfg) )
     return report(&cfg, "run", RUN_PROBLEM);
 
@@ -418,6 +693,14 @@ int main(int argc, char *argv[])
   if (!cfg.peerdirect || cfg.server)
     free(cfg.buf);
   free(cfg.latency);
+  for (unsigned i=0; i<cfg.bufs; i++) {
+    if (cfg.cache)
+      mrcache_invalidate(cfg.cache, cfg.pool[i], cfg.size);
+    free(cfg.pool[i]);
+  }
+  free(cfg.pool);
+  if (cfg.cache)
+    mrcache_destroy(cfg.cache);
   ibv_dereg_mr(cfg.mr);
   if (cfg.flog)
       fclose(cfg.flog);
@@ -0,0 +1,425 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Test patterns, see pattern.h.
+//
+//     Every pattern is built from little endian 32 bit lanes. Lane k
+//     is a counter that advances by a fixed step per vector, passed
+//     through a hash for prbs. The vector kernels only do whole
+//     vectors and stop at the first vector that does not match; the
+//     scalar code finishes the tail and finds the exact bad byte.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "pattern.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PATTERN_HAVE_X86
+#endif
+
+static const char *names[] = {
+    [PATTERN_CONSTANT]  = "constant",
+    [PATTERN_INCREMENT] = "increment",
+    [PATTERN_PRBS]      = "prbs",
+    [PATTERN_SEQUENCE]  = "sequence",
+};
+
+#define NPATTERNS (sizeof(names) / sizeof(names[0]))
+
+static uint32_t mix32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint32_t pattern_key(enum pattern_type type, uint64_t seed)
+{
+    switch (type) {
+    case PATTERN_PRBS:
+        return mix32((uint32_t) seed ^ mix32(seed >> 32));
+    case PATTERN_SEQUENCE:
+        return seed;
+    default:
+        return seed & 0xff;
+    }
+}
+
+static uint32_t counter(enum pattern_type type, uint32_t key, size_t k)
+{
+    uint32_t b;
+
+    switch (type) {
+    case PATTERN_CONSTANT:
+        return key * 0x01010101;
+    case PATTERN_INCREMENT:
+        b = key + 4 * k;
+        return (b & 0xff) | ((b + 1) & 0xff) << 8 |
+            ((b + 2) & 0xff) << 16 | ((b + 3) & 0xff) << 24;
+    case PATTERN_PRBS:
+        return key + k;
+    default:
+        return k & 1 ? key : k / 2;
+    }
+}
+
+static uint32_t lane(enum pattern_type type, uint32_t key, size_t k)
+{
+    uint32_t c = counter(type, key, k);
+
+    return type == PATTERN_PRBS ? mix32(c) : c;
+}
+
+static void put_lane(uint8_t *p, uint32_t v, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        p[i] = v >> (8 * i);
+}
+
+static void fill_scalar(uint8_t *buf, size_t start, size_t len,
+                        enum pattern_type type, uint32_t key)
+{
+    for (size_t i = start; i < len; i += 4)
+        put_lane(buf + i, lane(type, key, i / 4),
+                 len - i < 4 ? len - i : 4);
+}
+
+static ssize_t verify_scalar(const uint8_t *buf, size_t start, size_t len,
+                             enum pattern_type type, uint32_t key)
+{
+    uint8_t want[4];
+
+    for (size_t i = start; i < len; i += 4) {
+        size_t n = len - i < 4 ? len - i : 4;
+
+        put_lane(want, lane(type, key, i / 4), n);
+        if (!memcmp(buf + i, want, n))
+            continue;
+        for (size_t j = 0; j < n; j++)
+            if (buf[i + j] != want[j])
+                return i + j;
+    }
+
+    return -1;
+}
+
+#ifdef PATTERN_HAVE_X86
+
+// The per-type loops are forced inline into a switch so each pattern
+// gets its own loop with no branching on the type inside it.
+
+#define AVX2 __attribute__((target("avx2")))
+#define AVX512 __attribute__((target("avx512f,avx512bw")))
+#define INLINE inline __attribute__((always_inline))
+
+static AVX2 INLINE __m256i avx2_mix(__m256i x)
+{
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x7feb352d));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x846ca68b));
+    return _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+}
+
+static AVX2 INLINE void avx2_init(enum pattern_type type, uint32_t key,
+                                  __m256i *v, __m256i *step)
+{
+    uint32_t c[8];
+
+    for (int i = 0; i < 8; i++)
+        c[i] = counter(type, key, i);
+    *v = _mm256_loadu_si256((const __m256i *) c);
+
+    switch (type) {
+    case PATTERN_CONSTANT:
+        *step = _mm256_setzero_si256();
+        break;
+    case PATTERN_INCREMENT:
+        *step = _mm256_set1_epi8(32);
+        break;
+    case PATTERN_PRBS:
+        *step = _mm256_set1_epi32(8);
+        break;
+    default:
+        *step = _mm256_setr_epi32(4, 0, 4, 0, 4, 0, 4, 0);
+        break;
+    }
+}
+
+static AVX2 INLINE __m256i avx2_out(enum pattern_type type, __m256i v)
+{
+    return type == PATTERN_PRBS ? avx2_mix(v) : v;
+}
+
+static AVX2 INLINE __m256i avx2_next(enum pattern_type type, __m256i v,
+                                     __m256i step)
+{
+    if (type == PATTERN_INCREMENT)
+        return _mm256_add_epi8(v, step);
+    return _mm256_add_epi32(v, step);
+}
+
+static AVX2 INLINE size_t avx2_fill_type(uint8_t *buf, size_t len,
+                                         enum pattern_type type, uint32_t key)
+{
+    __m256i v, step;
+    size_t i;
+
+    avx2_init(type, key, &v, &step);
+    for (i = 0; i + 32 <= len; i += 32) {
+        _mm256_storeu_si256((__m256i *) (buf + i), avx2_out(type, v));
+        v = avx2_next(type, v, step);
+    }
+
+    return i;
+}
+
+static AVX2 INLINE size_t avx2_verify_type(const uint8_t *buf, size_t len,
+                                           enum pattern_type type,
+                                           uint32_t key)
+{
+    __m256i v, step, x;
+    size_t i;
+
+    avx2_init(type, key, &v, &step);
+    for (i = 0; i + 32 <= len; i += 32) {
+        x = _mm256_loadu_si256((const __m256i *) (buf + i));
+        x = _mm256_cmpeq_epi8(x, avx2_out(type, v));
+        if (_mm256_movemask_epi8(x) != -1)
+            break;
+        v = avx2_next(type, v, step);
+    }
+
+    return i;
+}
+
+static AVX2 size_t fill_avx2(uint8_t *buf, size_t len,
+                             enum pattern_type type, uint32_t key)
+{
+    switch (type) {
+    case PATTERN_CONSTANT:
+        return avx2_fill_type(buf, len, PATTERN_CONSTANT, key);
+    case PATTERN_INCREMENT:
+        return avx2_fill_type(buf, len, PATTERN_INCREMENT, key);
+    case PATTERN_PRBS:
+        return avx2_fill_type(buf, len, PATTERN_PRBS, key);
+    default:
+        return avx2_fill_type(buf, len, PATTERN_SEQUENCE, key);
+    }
+}
+
+static AVX2 size_t verify_avx2(const uint8_t *buf, size_t len,
+                               enum pattern_type type, uint32_t key)
+{
+    switch (type) {
+    case PATTERN_CONSTANT:
+        return avx2_verify_type(buf, len, PATTERN_CONSTANT, key);
+    case PATTERN_INCREMENT:
+        return avx2_verify_type(buf, len, PATTERN_INCREMENT, key);
+    case PATTERN_PRBS:
+        return avx2_verify_type(buf, len, PATTERN_PRBS, key);
+    default:
+        return avx2_verify_type(buf, len, PATTERN_SEQUENCE, key);
+    }
+}
+
+static AVX512 INLINE __m512i avx512_mix(__m512i x)
+{
+    x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 16));
+    x = _mm512_mullo_epi32(x, _mm512_set1_epi32(0x7feb352d));
+    x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 15));
+    x = _mm512_mullo_epi32(x, _mm512_set1_epi32(0x846ca68b));
+    return _mm512_xor_si512(x, _mm512_srli_epi32(x, 16));
+}
+
+static AVX512 INLINE void avx512_init(enum pattern_type type, uint32_t key,
+                                      __m512i *v, __m512i *step)
+{
+    uint32_t c[16];
+
+    for (int i = 0; i < 16; i++)
+        c[i] = counter(type, key, i);
+    *v = _mm512_loadu_si512(c);
+
+    switch (type) {
+    case PATTERN_CONSTANT:
+        *step = _mm512_setzero_si512();
+        break;
+    case PATTERN_INCREMENT:
+        *step = _mm512_set1_epi8(64);
+        break;
+    case PATTERN_PRBS:
+        *step = _mm512_set1_epi32(16);
+        break;
+    default:
+        *step = _mm512_set1_epi64(8);
+        break;
+    }
+}
+
+static AVX512 INLINE __m512i avx512_out(enum pattern_type type, __m512i v)
+{
+    return type == PATTERN_PRBS ? avx512_mix(v) : v;
+}
+
+static AVX512 INLINE __m512i avx512_next(enum pattern_type type, __m512i v,
+                                         __m512i step)
+{
+    if (type == PATTERN_INCREMENT)
+        return _mm512_add_epi8(v, step);
+    return _mm512_add_epi32(v, step);
+}
+
+static AVX512 INLINE size_t avx512_fill_type(uint8_t *buf, size_t len,
+                                             enum pattern_type type,
+                                             uint32_t key)
+{
+    __m512i v, step;
+    size_t i;
+
+    avx512_init(type, key, &v, &step);
+    for (i = 0; i + 64 <= len; i += 64) {
+        _mm512_storeu_si512(buf + i, avx512_out(type, v));
+        v = avx512_next(type, v, step);
+    }
+
+    return i;
+}
+
+static AVX512 INLINE size_t avx512_verify_type(const uint8_t *buf,
+                                               size_t len,
+                                               enum pattern_type type,
+                                               uint32_t key)
+{
+    __m512i v, step, x;
+    size_t i;
+
+    avx512_init(type, key, &v, &step);
+    for (i = 0; i + 64 <= len; i += 64) {
+        x = _mm512_loadu_si512(buf + i);
+        if (_mm512_cmpneq_epi32_mask(x, avx512_out(type, v)))
+            break;
+        v = avx512_next(type, v, step);
+    }
+
+    return i;
+}
+
+static AVX512 size_t fill_avx512(uint8_t *buf, size_t len,
+                                 enum pattern_type type, uint32_t key)
+{
+    switch (type) {
+    case PATTERN_CONSTANT:
+        return avx512_fill_type(buf, len, PATTERN_CONSTANT, key);
+    case PATTERN_INCREMENT:
+        return avx512_fill_type(buf, len, PATTERN_INCREMENT, key);
+    case PATTERN_PRBS:
+        return avx512_fill_type(buf, len, PATTERN_PRBS, key);
+    default:
+        return avx512_fill_type(buf, len, PATTERN_SEQUENCE, key);
+    }
+}
+
+static AVX512 size_t verify_avx512(const uint8_t *buf, size_t len,
+                                   enum pattern_type type, uint32_t key)
+{
+    switch (type) {
+    case PATTERN_CONSTANT:
+        return avx512_verify_type(buf, len, PATTERN_CONSTANT, key);
+    case PATTERN_INCREMENT:
+        return avx512_verify_type(buf, len, PATTERN_INCREMENT, key);
+    case PATTERN_PRBS:
+        return avx512_verify_type(buf, len, PATTERN_PRBS, key);
+    default:
+        return avx512_verify_type(buf, len, PATTERN_SEQUENCE, key);
+    }
+}
+
+#endif
+
+// Vector bulk routines, NULL when only the scalar code is usable.
+static size_t (*fill_fn)(uint8_t *, size_t, enum pattern_type, uint32_t);
+static size_t (*verify_fn)(const uint8_t *, size_t, enum pattern_type,
+                           uint32_t);
+static const char *pattern_impl_name = "scalar";
+
+__attribute__((constructor))
+static void pattern_init(void)
+{
+#ifdef PATTERN_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512bw")) {
+        fill_fn = fill_avx512;
+        verify_fn = verify_avx512;
+        pattern_impl_name = "avx512";
+    } else if (__builtin_cpu_supports("avx2")) {
+        fill_fn = fill_avx2;
+        verify_fn = verify_avx2;
+        pattern_impl_name = "avx2";
+    }
+#endif
+}
+
+int pattern_parse(const char *name)
+{
+    for (unsigned i = 0; i < NPATTERNS; i++)
+        if (!strcmp(name, names[i]))
+            return i;
+
+    return -1;
+}
+
+const char *pattern_name(enum pattern_type type)
+{
+    return type < NPATTERNS ? names[type] : "unknown";
+}
+
+const char *pattern_impl(void)
+{
+    return pattern_impl_name;
+}
+
+void pattern_fill(void *buf, size_t len, enum pattern_type type,
+                  uint64_t seed)
+{
+    uint32_t key = pattern_key(type, seed);
+    size_t done = fill_fn ? fill_fn(buf, len, type, key) : 0;
+
+    fill_scalar(buf, done, len, type, key);
+}
+
+ssize_t pattern_verify(const void *buf, size_t len, enum pattern_type type,
+                       uint64_t seed)
+{
+    uint32_t key = pattern_key(type, seed);
+    size_t done = verify_fn ? verify_fn(buf, len, type, key) : 0;
+
+    return verify_scalar(buf, done, len, type, key);
+}
+
+uint8_t pattern_byte(enum pattern_type type, uint64_t seed, size_t offset)
+{
+    return lane(type, pattern_key(type, seed), offset / 4) >>
+        (8 * (offset & 3));
+}
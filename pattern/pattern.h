@@ -0,0 +1,67 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Test pattern fill and verify. Every pattern is a pure function
+//     of the byte offset and a 64 bit seed, so a verify can say
+//     exactly which byte went wrong without keeping a reference copy.
+//     AVX-512 and AVX2 kernels are used when the CPU has them, with a
+//     scalar fallback.
+//
+//     constant:  every byte is seed & 0xff, like memset()
+//     increment: byte i is (seed + i) & 0xff
+//     prbs:      pseudo random 32 bit words from a counter based hash
+//     sequence:  each 8 byte word holds its word index in the low
+//                half and the low 32 bits of seed in the high half,
+//                so a stale buffer from an earlier message shows up
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef __PATTERN_H__
+#define __PATTERN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+enum pattern_type {
+    PATTERN_CONSTANT,
+    PATTERN_INCREMENT,
+    PATTERN_PRBS,
+    PATTERN_SEQUENCE,
+};
+
+/* Returns -1 if name is not a known pattern */
+int pattern_parse(const char *name);
+const char *pattern_name(enum pattern_type type);
+
+/* "avx512", "avx2" or "scalar" */
+const char *pattern_impl(void);
+
+void pattern_fill(void *buf, size_t len, enum pattern_type type,
+                  uint64_t seed);
+
+/*
+ * Returns the offset of the first byte that does not match the
+ * pattern or -1 if the whole buffer is good.
+ */
+ssize_t pattern_verify(const void *buf, size_t len, enum pattern_type type,
+                       uint64_t seed);
+
+/* The byte pattern_fill() would put at offset */
+uint8_t pattern_byte(enum pattern_type type, uint64_t seed, size_t offset);
+
+#endif
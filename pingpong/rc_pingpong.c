@@ -51,12 +51,28 @@
 #include <errno.h>
 
 #include "pingpong.h"
+#include "../argconfig/report.h"
+#include "../checksum/crc32c.h"
+#include "../pattern/pattern.h"
 
 enum {
 	PINGPONG_RECV_WRID = 1,
 	PINGPONG_SEND_WRID = 2,
 };
 
+/*
+ * UD receives are prefixed by the 40 byte GRH whether or not the
+ * sender attached one, so the receive buffer has to leave room for it.
+ */
+#define PINGPONG_GRH_SIZE 40
+#define PINGPONG_UD_QKEY  0x11111111
+
+enum {
+	PINGPONG_ODP          = 1 << 0,
+	PINGPONG_ODP_IMPLICIT = 1 << 1,
+	PINGPONG_ODP_PREFETCH = 1 << 2,
+};
+
 static int page_size;
 
 struct pingpong_context {
@@ -66,11 +82,25 @@ struct pingpong_context {
 	struct ibv_mr		*mr;
 	struct ibv_cq		*cq;
 	struct ibv_qp		*qp;
+	struct ibv_ah		*ah;
+	enum ibv_qp_type	 qp_type;
+	int			 rem_qpn;
 	void			*buf;
 	int			 size;
+	int			 grh;
 	int			 rx_depth;
 	int			 pending;
 	struct ibv_port_attr     portinfo;
+	int			 integrity;
+	int			 block;
+	double			 csum_time;
+	long long		 csum_bytes;
+	int			 pattern;
+	int			 is_server;
+	unsigned		 sent;
+	unsigned		 received;
+	double			 pattern_time;
+	long long		 pattern_bytes;
 };
 
 struct pingpong_dest {
@@ -80,6 +110,38 @@ struct pingpong_dest {
 	union ibv_gid gid;
 };
 
+static int pp_connect_ud_ctx(struct pingpong_context *ctx, int my_psn,
+			     struct ibv_ah_attr *ah_attr,
+			     struct pingpong_dest *dest)
+{
+	struct ibv_qp_attr attr = {
+		.qp_state		= IBV_QPS_RTR
+	};
+
+	if (ibv_modify_qp(ctx->qp, &attr, IBV_QP_STATE)) {
+		fprintf(stderr, "Failed to modify QP to RTR\n");
+		return 1;
+	}
+
+	attr.qp_state	    = IBV_QPS_RTS;
+	attr.sq_psn	    = my_psn;
+	if (ibv_modify_qp(ctx->qp, &attr,
+			  IBV_QP_STATE              |
+			  IBV_QP_SQ_PSN)) {
+		fprintf(stderr, "Failed to modify QP to RTS\n");
+		return 1;
+	}
+
+	ctx->ah = ibv_create_ah(ctx->pd, ah_attr);
+	if (!ctx->ah) {
+		fprintf(stderr, "Failed to create AH\n");
+		return 1;
+	}
+	ctx->rem_qpn = dest->qpn;
+
+	return 0;
+}
+
 static int pp_connect_ctx(struct pingpong_context *ctx, int port, int my_psn,
 			  enum ibv_mtu mtu, int sl,
 			  struct pingpong_dest *dest, int sgid_idx)
@@ -106,6 +168,10 @@ static int pp_connect_ctx(struct pingpong_context *ctx, int port, int my_psn,
 		attr.ah_attr.grh.dgid = dest->gid;
 		attr.ah_attr.grh.sgid_index = sgid_idx;
 	}
+
+	if (ctx->qp_type == IBV_QPT_UD)
+		return pp_connect_ud_ctx(ctx, my_psn, &attr.ah_attr, dest);
+
 	if (ibv_modify_qp(ctx->qp, &attr,
 			  IBV_QP_STATE              |
 			  IBV_QP_AV                 |
@@ -334,14 +400,106 @@ static int __init_mmap(struct pingpong_context *ctx, size_t size,
 
 static int __free_mmap(struct pingpong_context *ctx)
 {
-	munmap(ctx->buf, ctx->size);
+	munmap(ctx->buf, ctx->size + ctx->grh);
 	return 0;
 }
 
 
+static int pp_check_odp(struct ibv_context *context, enum ibv_qp_type qp_type,
+			int odp)
+{
+	struct ibv_device_attr_ex attr;
+	uint32_t caps, needed = IBV_ODP_SUPPORT_SEND | IBV_ODP_SUPPORT_RECV;
+
+	if (ibv_query_device_ex(context, NULL, &attr)) {
+		fprintf(stderr, "Couldn't query device for ODP support\n");
+		return 1;
+	}
+
+	if (!(attr.odp_caps.general_caps & IBV_ODP_SUPPORT)) {
+		fprintf(stderr, "Device does not support On-Demand Paging\n");
+		return 1;
+	}
+
+	if ((odp & PINGPONG_ODP_IMPLICIT) &&
+	    !(attr.odp_caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT)) {
+		fprintf(stderr, "Device does not support implicit ODP\n");
+		return 1;
+	}
+
+	caps = qp_type == IBV_QPT_UD ?
+		attr.odp_caps.per_transport_caps.ud_odp_caps :
+		attr.odp_caps.per_transport_caps.rc_odp_caps;
+	if ((caps & needed) != needed) {
+		fprintf(stderr, "Device does not support ODP SEND/RECV on this "
+			"transport\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int pp_reg_mr(struct pingpong_context *ctx, int odp)
+{
+	struct timeval start, end;
+	size_t length = ctx->size + ctx->grh;
+	int access = IBV_ACCESS_LOCAL_WRITE;
+
+	if (odp && pp_check_odp(ctx->context, ctx->qp_type, odp))
+		return 1;
+
+	if (odp)
+		access |= IBV_ACCESS_ON_DEMAND;
+
+	gettimeofday(&start, NULL);
+	if (odp & PINGPONG_ODP_IMPLICIT)
+		ctx->mr = ibv_reg_mr(ctx->pd, NULL, SIZE_MAX, access);
+	else
+		ctx->mr = ibv_reg_mr(ctx->pd, ctx->buf, length, access);
+	gettimeofday(&end, NULL);
+
+	if (!ctx->mr) {
+		fprintf(stderr, "Couldn't register MR\n");
+		return 1;
+	}
+
+	printf("  %s MR registration: ",
+	       !odp ? "pinned" :
+	       (odp & PINGPONG_ODP_IMPLICIT) ? "implicit ODP" : "ODP");
+	report_transfer_rate(stdout, &start, &end, length);
+	printf("\n");
+
+	if (odp & PINGPONG_ODP_PREFETCH) {
+		struct ibv_sge sge = {
+			.addr	= (uintptr_t) ctx->buf,
+			.length = length,
+			.lkey	= ctx->mr->lkey
+		};
+
+		/*
+		 * FLUSH makes the prefetch synchronous so the run starts
+		 * with the device page tables already populated.
+		 */
+		gettimeofday(&start, NULL);
+		if (ibv_advise_mr(ctx->pd, IBV_ADVISE_MR_ADVICE_PREFETCH_WRITE,
+				  IBV_ADVISE_MR_FLAG_FLUSH, &sge, 1)) {
+			fprintf(stderr, "Couldn't prefetch MR\n");
+			return 1;
+		}
+		gettimeofday(&end, NULL);
+
+		printf("  ODP prefetch: ");
+		report_transfer_rate(stdout, &start, &end, length);
+		printf("\n");
+	}
+
+	return 0;
+}
+
 static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 					    int rx_depth, int port,
-                        int use_event, int is_server, const char *fname)
+                        int use_event, int is_server, const char *fname,
+					    enum ibv_qp_type qp_type, int odp)
 {
 	struct pingpong_context *ctx;
 
@@ -351,9 +509,11 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 
 	ctx->size     = size;
 	ctx->rx_depth = rx_depth;
+	ctx->qp_type  = qp_type;
+	ctx->grh      = qp_type == IBV_QPT_UD ? PINGPONG_GRH_SIZE : 0;
 
 	if (fname==NULL){
-        ctx->buf = malloc(roundup(size, page_size));
+        ctx->buf = malloc(roundup(size + ctx->grh, page_size));
         if (!ctx->buf) {
             fprintf(stderr, "Couldn't allocate work buf.\n");
             return NULL;
@@ -361,13 +521,13 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
     }
     else
     {
-        if (__init_mmap(ctx, size, fname, 0))
+        if (__init_mmap(ctx, size + ctx->grh, fname, 0))
         {
             fprintf(stderr, "Couldn't allocate work buf.\n");
             return NULL;
         }
     }
-	memset(ctx->buf, 0x7b + is_server, size);
+	memset(ctx->buf, 0x7b + is_server, size + ctx->grh);
 
 	ctx->context = ibv_open_device(ib_dev);
 	if (!ctx->context) {
@@ -391,11 +551,8 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 		return NULL;
 	}
 
-	ctx->mr = ibv_reg_mr(ctx->pd, ctx->buf, size, IBV_ACCESS_LOCAL_WRITE);
-	if (!ctx->mr) {
-		fprintf(stderr, "Couldn't register MR\n");
+	if (pp_reg_mr(ctx, odp))
 		return NULL;
-	}
 
 	ctx->cq = ibv_create_cq(ctx->context, rx_depth + 1, NULL,
 				ctx->channel, 0);
@@ -414,7 +571,7 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 				.max_send_sge = 1,
 				.max_recv_sge = 1
 			},
-			.qp_type = IBV_QPT_RC
+			.qp_type = qp_type
 		};
 
 		ctx->qp = ibv_create_qp(ctx->pd, &attr);
@@ -431,12 +588,15 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 			.port_num        = port,
 			.qp_access_flags = 0
 		};
+		int mask = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT;
 
-		if (ibv_modify_qp(ctx->qp, &attr,
-				  IBV_QP_STATE              |
-				  IBV_QP_PKEY_INDEX         |
-				  IBV_QP_PORT               |
-				  IBV_QP_ACCESS_FLAGS)) {
+		if (qp_type == IBV_QPT_UD) {
+			attr.qkey = PINGPONG_UD_QKEY;
+			mask |= IBV_QP_QKEY;
+		} else
+			mask |= IBV_QP_ACCESS_FLAGS;
+
+		if (ibv_modify_qp(ctx->qp, &attr, mask)) {
 			fprintf(stderr, "Failed to modify QP to INIT\n");
 			return NULL;
 		}
@@ -447,6 +607,11 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 
 int pp_close_ctx(struct pingpong_context *ctx, const char *fname)
 {
+	if (ctx->ah && ibv_destroy_ah(ctx->ah)) {
+		fprintf(stderr, "Couldn't destroy AH\n");
+		return 1;
+	}
+
 	if (ibv_destroy_qp(ctx->qp)) {
 		fprintf(stderr, "Couldn't destroy QP\n");
 		return 1;
@@ -493,7 +658,7 @@ static int pp_post_recv(struct pingpong_context *ctx, int n)
 {
 	struct ibv_sge list = {
 		.addr	= (uintptr_t) ctx->buf,
-		.length = ctx->size,
+		.length = ctx->size + ctx->grh,
 		.lkey	= ctx->mr->lkey
 	};
 	struct ibv_recv_wr wr = {
@@ -511,10 +676,88 @@ static int pp_post_recv(struct pingpong_context *ctx, int n)
 	return i;
 }
 
+static double pp_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * CRC32C digest of the message, per --block sized piece, carried in
+ * the immediate data of every send when --integrity is set.
+ */
+static uint32_t pp_digest(struct pingpong_context *ctx)
+{
+	double start = pp_now();
+	uint32_t crc;
+
+	crc = crc32c_blocks((char *) ctx->buf + ctx->grh, ctx->size,
+			    ctx->block, NULL);
+	ctx->csum_time += pp_now() - start;
+	ctx->csum_bytes += ctx->size;
+	return crc;
+}
+
+static int pp_check_digest(struct pingpong_context *ctx, struct ibv_wc *wc)
+{
+	uint32_t crc;
+
+	if (!(wc->wc_flags & IBV_WC_WITH_IMM)) {
+		fprintf(stderr, "Message without checksum, is --integrity "
+			"set on both sides?\n");
+		return 1;
+	}
+
+	crc = pp_digest(ctx);
+	if (crc != ntohl(wc->imm_data)) {
+		fprintf(stderr, "Checksum mismatch: got 0x%08x expected 0x%08x\n",
+			crc, ntohl(wc->imm_data));
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * With --pattern every message is refilled before it is sent and
+ * checked when it arrives. The seed is the message number and the
+ * sending side, so a message that was dropped, repeated or overwritten
+ * by the wrong peer shows up as a mismatch.
+ */
+static void pp_fill_pattern(struct pingpong_context *ctx)
+{
+	double start = pp_now();
+
+	pattern_fill((char *) ctx->buf + ctx->grh, ctx->size, ctx->pattern,
+		     (uint64_t) ctx->sent++ << 1 | ctx->is_server);
+	ctx->pattern_time += pp_now() - start;
+	ctx->pattern_bytes += ctx->size;
+}
+
+static int pp_check_pattern(struct pingpong_context *ctx)
+{
+	double start = pp_now();
+	unsigned char *buf = (unsigned char *) ctx->buf + ctx->grh;
+	uint64_t seed = (uint64_t) ctx->received++ << 1 | !ctx->is_server;
+	ssize_t bad;
+
+	bad = pattern_verify(buf, ctx->size, ctx->pattern, seed);
+	ctx->pattern_time += pp_now() - start;
+	ctx->pattern_bytes += ctx->size;
+	if (bad < 0)
+		return 0;
+
+	fprintf(stderr, "Data mismatch in message %u at byte %zd: got 0x%02x "
+		"expected 0x%02x\n", ctx->received - 1, bad, buf[bad],
+		pattern_byte(ctx->pattern, seed, bad));
+	return 1;
+}
+
 static int pp_post_send(struct pingpong_context *ctx)
 {
 	struct ibv_sge list = {
-		.addr	= (uintptr_t) ctx->buf,
+		.addr	= (uintptr_t) ctx->buf + ctx->grh,
 		.length = ctx->size,
 		.lkey	= ctx->mr->lkey
 	};
@@ -527,6 +770,20 @@ static int pp_post_send(struct pingpong_context *ctx)
 	};
 	struct ibv_send_wr *bad_wr;
 
+	if (ctx->qp_type == IBV_QPT_UD) {
+		wr.wr.ud.ah          = ctx->ah;
+		wr.wr.ud.remote_qpn  = ctx->rem_qpn;
+		wr.wr.ud.remote_qkey = PINGPONG_UD_QKEY;
+	}
+
+	if (ctx->pattern >= 0)
+		pp_fill_pattern(ctx);
+
+	if (ctx->integrity) {
+		wr.opcode   = IBV_WR_SEND_WITH_IMM;
+		wr.imm_data = htonl(pp_digest(ctx));
+	}
+
 	return ibv_post_send(ctx->qp, &wr, &bad_wr);
 }
 
@@ -548,6 +805,15 @@ static void usage(const char *argv0)
 	printf("  -e, --events           sleep on CQ events (default poll)\n");
 	printf("  -g, --gid-idx=<gid index> local port gid index\n");
 	printf("  -f, --fname=<filename> use a mmapable file for the RDMA MR\n");
+	printf("  -q, --qp-type=<type>   QP transport, rc or ud (default rc)\n");
+	printf("  -L, --log=<filename>   log every round trip latency sample\n");
+	printf("  -o, --odp              register the MR with On-Demand Paging\n");
+	printf("  -O, --odp-implicit     use an implicit ODP MR covering the whole address space\n");
+	printf("  -P, --prefetch         prefetch the ODP MR with ibv_advise_mr before the run\n");
+	printf("  -I, --integrity        send a CRC32C of every message as immediate data and check it\n");
+	printf("  -b, --block=<size>     checksum per <size> bytes with --integrity, 0 for whole message (default 4096)\n");
+	printf("  -t, --pattern=<name>   fill and check every message with a constant, increment,\n"
+	       "                         prbs or sequence pattern (%s)\n", pattern_impl());
 }
 
 int main(int argc, char *argv[])
@@ -558,6 +824,7 @@ int main(int argc, char *argv[])
 	struct pingpong_dest     my_dest;
 	struct pingpong_dest    *rem_dest;
 	struct timeval           start, end;
+	struct timeval          *send_ts, *recv_ts;
 	char                    *ib_devname = NULL;
 	char                    *servername = NULL;
 	int                      port = 18515;
@@ -568,12 +835,19 @@ int main(int argc, char *argv[])
 	int                      iters = 1000;
 	int                      use_event = 0;
 	int                      routs;
-	int                      rcnt, scnt;
+	int                      rcnt, scnt, sposted;
 	int                      num_cq_events = 0;
 	int                      sl = 0;
 	int			 gidx = -1;
 	char			 gid[33];
     char                     *fname = NULL;
+	enum ibv_qp_type	 qp_type = IBV_QPT_RC;
+	char			*log = NULL;
+	FILE			*flog = NULL;
+	int			 odp = 0;
+	int			 integrity = 0;
+	int			 block = 4096;
+	int			 pattern = -1;
 
 	srand48(getpid() * time(NULL));
 
@@ -592,10 +866,18 @@ int main(int argc, char *argv[])
 			{ .name = "events",   .has_arg = 0, .val = 'e' },
 			{ .name = "gid-idx",  .has_arg = 1, .val = 'g' },
 			{ .name = "fname",    .has_arg = 1, .val = 'f' },
+			{ .name = "qp-type",  .has_arg = 1, .val = 'q' },
+			{ .name = "log",      .has_arg = 1, .val = 'L' },
+			{ .name = "odp",          .has_arg = 0, .val = 'o' },
+			{ .name = "odp-implicit", .has_arg = 0, .val = 'O' },
+			{ .name = "prefetch",     .has_arg = 0, .val = 'P' },
+			{ .name = "integrity",    .has_arg = 0, .val = 'I' },
+			{ .name = "block",        .has_arg = 1, .val = 'b' },
+			{ .name = "pattern",      .has_arg = 1, .val = 't' },
 			{ 0 }
 		};
 
-		c = getopt_long(argc, argv, "p:d:i:s:m:r:n:l:eg:f:", long_options, NULL);
+		c = getopt_long(argc, argv, "p:d:i:s:m:r:n:l:eg:f:q:L:oOPIb:t:", long_options, NULL);
 		if (c == -1)
 			break;
 
@@ -656,6 +938,53 @@ int main(int argc, char *argv[])
 			fname = strdup(optarg);
 			break;
 
+		case 'q':
+			if (!strcasecmp(optarg, "rc"))
+				qp_type = IBV_QPT_RC;
+			else if (!strcasecmp(optarg, "ud"))
+				qp_type = IBV_QPT_UD;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'L':
+			log = strdup(optarg);
+			break;
+
+		case 'o':
+			odp |= PINGPONG_ODP;
+			break;
+
+		case 'O':
+			odp |= PINGPONG_ODP | PINGPONG_ODP_IMPLICIT;
+			break;
+
+		case 'P':
+			odp |= PINGPONG_ODP_PREFETCH;
+			break;
+
+		case 'I':
+			integrity = 1;
+			break;
+
+		case 'b':
+			block = strtol(optarg, NULL, 0);
+			if (block < 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 't':
+			pattern = pattern_parse(optarg);
+			if (pattern < 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
 		default:
 			usage(argv[0]);
 			return 1;
@@ -669,8 +998,33 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (odp == PINGPONG_ODP_PREFETCH) {
+		fprintf(stderr, "--prefetch requires --odp or --odp-implicit\n");
+		return 1;
+	}
+
 	page_size = sysconf(_SC_PAGESIZE);
 
+	if (log) {
+		flog = fopen(log, "w");
+		if (!flog) {
+			fprintf(stderr, "Couldn't open log file %s\n", log);
+			return 1;
+		}
+	}
+
+	/*
+	 * Every send post and every receive completion is timestamped so
+	 * we can report the distribution of round trips, not just the
+	 * average.
+	 */
+	send_ts = calloc(iters, sizeof *send_ts);
+	recv_ts = calloc(iters, sizeof *recv_ts);
+	if (!send_ts || !recv_ts) {
+		fprintf(stderr, "Couldn't allocate latency samples\n");
+		return 1;
+	}
+
 	dev_list = ibv_get_device_list(NULL);
 	if (!dev_list) {
 		perror("Failed to get IB devices list");
@@ -696,9 +1050,13 @@ int main(int argc, char *argv[])
 	}
 
 	ctx = pp_init_ctx(ib_dev, size, rx_depth, ib_port, use_event,
-                      !servername, fname);
+                      !servername, fname, qp_type, odp);
 	if (!ctx)
 		return 1;
+	ctx->integrity = integrity;
+	ctx->block = block;
+	ctx->pattern = pattern;
+	ctx->is_server = !servername;
 
 	routs = pp_post_recv(ctx, ctx->rx_depth);
 	if (routs < ctx->rx_depth) {
@@ -718,6 +1076,20 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	/*
+	 * A UD message has to fit in a single packet so cap it at the
+	 * smaller of the requested path MTU and the port's active MTU.
+	 */
+	if (qp_type == IBV_QPT_UD) {
+		int max_size = 1 << (MIN(mtu, ctx->portinfo.active_mtu) + 7);
+
+		if (size > max_size) {
+			fprintf(stderr, "Requested size %d larger than path MTU (%d)\n",
+				size, max_size);
+			return 1;
+		}
+	}
+
 	my_dest.lid = ctx->portinfo.lid;
 	if (ctx->portinfo.link_layer == IBV_LINK_LAYER_INFINIBAND && !my_dest.lid) {
 		fprintf(stderr, "Couldn't get local LID\n");
@@ -756,8 +1128,10 @@ int main(int argc, char *argv[])
 			return 1;
 
 	ctx->pending = PINGPONG_RECV_WRID;
+	sposted = 0;
 
 	if (servername) {
+		gettimeofday(&send_ts[sposted++], NULL);
 		if (pp_post_send(ctx)) {
 			fprintf(stderr, "Couldn't post send\n");
 			return 1;
@@ -831,7 +1205,16 @@ int main(int argc, char *argv[])
 						}
 					}
 
+					if (rcnt < iters)
+						gettimeofday(&recv_ts[rcnt], NULL);
 					++rcnt;
+
+					if (ctx->integrity &&
+					    pp_check_digest(ctx, &wc[i]))
+						return 1;
+					if (ctx->pattern >= 0 &&
+					    pp_check_pattern(ctx))
+						return 1;
 					break;
 
 				default:
@@ -842,6 +1225,7 @@ int main(int argc, char *argv[])
 
 				ctx->pending &= ~(int) wc[i].wr_id;
 				if (scnt < iters && !ctx->pending) {
+					gettimeofday(&send_ts[sposted++], NULL);
 					if (pp_post_send(ctx)) {
 						fprintf(stderr, "Couldn't post send\n");
 						return 1;
@@ -867,6 +1251,47 @@ int main(int argc, char *argv[])
 		       bytes, usec / 1000000., bytes * 8. / usec);
 		printf("%d iters in %.2f seconds = %.2f usec/iter\n",
 		       iters, usec / 1000000., usec / iters);
+		printf("%d msgs in %.2f seconds = %.2f Kmsg/sec\n",
+		       iters * 2, usec / 1000000., iters * 2 * 1000. / usec);
+
+		if (ctx->integrity)
+			printf("%lld bytes checksummed in %.3f seconds = %.2f MB/sec, "
+			       "%.1f%% of run (crc32c %s)\n", ctx->csum_bytes,
+			       ctx->csum_time, ctx->csum_bytes / ctx->csum_time / 1e6,
+			       ctx->csum_time * 1e8 / usec, crc32c_impl());
+
+		if (ctx->pattern >= 0)
+			printf("%lld bytes of %s pattern in %.3f seconds = %.2f MB/sec, "
+			       "%.1f%% of run (%s)\n", ctx->pattern_bytes,
+			       pattern_name(ctx->pattern), ctx->pattern_time,
+			       ctx->pattern_bytes / ctx->pattern_time / 1e6,
+			       ctx->pattern_time * 1e8 / usec, pattern_impl());
+	}
+
+	/*
+	 * The client's n'th receive answers its n'th send. The server
+	 * only sends after a receive so its round trip runs from send n
+	 * to receive n + 1.
+	 */
+	{
+		struct timeval *rtt_end = servername ? recv_ts : recv_ts + 1;
+		int samples = servername ? iters : iters - 1;
+
+		if (samples > 0) {
+			printf("Latency: ");
+			report_latency_pairs(stdout, flog, send_ts, rtt_end,
+					     samples);
+			printf("\n");
+			printf("Percentiles: ");
+			report_percentiles(stdout, send_ts, rtt_end, samples);
+			printf("\n");
+			if (samples > 1) {
+				printf("First touch: ");
+				report_first_touch(stdout, send_ts, rtt_end,
+						   samples);
+				printf("\n");
+			}
+		}
 	}
 
 	ibv_ack_cq_events(ctx->cq, num_cq_events);
@@ -876,6 +1301,10 @@ int main(int argc, char *argv[])
 
 	ibv_free_device_list(dev_list);
 	free(rem_dest);
+	free(send_ts);
+	free(recv_ts);
+	if (flog)
+		fclose(flog);
 
 	return 0;
 }
@@ -0,0 +1,963 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Copy a file to a remote host over RDMA. The client reads FILE in
+//     --chunk sized pieces into one of --buffers registered buffers
+//     and the server writes each piece at the same offset of its
+//     --output file. Chunk k always lives in buffer k % buffers on
+//     both sides, so with three buffers one can be read from disk,
+//     one be on the wire and one be written out at the same time.
+//
+//     By default the client RDMA WRITEs the chunk into the server's
+//     buffer with its number as immediate data. With --read the client
+//     only SENDs the number and the server pulls the chunk with RDMA
+//     READ. Either way the server SENDs the number back once the chunk
+//     is on disk, which frees the buffer on both sides.
+//
+//     Disk I/O on both ends goes through io_uring with O_DIRECT into
+//     the same registered buffers. With --baseline the client first
+//     measures the raw disk read rate, the raw network rate (the copy
+//     without any disk I/O) and the server's raw disk write rate and
+//     rates the copy against the slowest of them.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <rdma/rdma_cma.h>
+#include <rdma/rdma_verbs.h>
+#include <infiniband/verbs.h>
+#include <liburing.h>
+
+#include "../argconfig/argconfig.h"
+#include "../argconfig/report.h"
+
+enum errors {
+  BAD_ARGS       = 1,
+  NO_BUFFER,
+  SETUP_PROBLEM,
+  RUN_PROBLEM,
+};
+
+#define DIO_ALIGN       4096
+#define MAX_BUFFERS     64
+#define NRECV           (MAX_BUFFERS + 2)
+#define CTRL_SLOT       MAX_BUFFERS
+
+enum rc_op {
+  RC_HELLO       = 1,
+  RC_JOB,
+  RC_READY,
+  RC_FREE,
+  RC_DONE,
+};
+
+enum rc_job_flags {
+  JOB_READ       = 1 << 0,    /* server pulls with RDMA READ */
+  JOB_NO_DISK    = 1 << 1,    /* network only */
+  JOB_DISK_ONLY  = 1 << 2,    /* server writes its buffers out only */
+};
+
+enum rc_state {
+  SLOT_IDLE,
+  SLOT_BUSY,
+  SLOT_FULL,
+};
+
+/*
+ * Every message, big endian. HELLO carries addr, rkey, chunk and
+ * buffers. value is the chunk number in READY and FREE, the file size
+ * in JOB and the server's nanoseconds in DONE.
+ */
+struct rc_msg {
+  uint32_t                op;
+  uint32_t                flags;
+  uint32_t                rkey;
+  uint32_t                buffers;
+  uint64_t                addr;
+  uint64_t                chunk;
+  uint64_t                value;
+};
+
+const char program_desc[] =
+    "Pipelined RDMA file copy with io_uring and O_DIRECT on both ends";
+
+struct rcopy {
+  char                    *addr;
+  char                    *port;
+  char                    *output;
+  long                    chunk;
+  unsigned                buffers;
+  unsigned                read;
+  unsigned                baseline;
+  unsigned                verbose;
+
+  char                    *file;
+  int                     fd;
+  size_t                  size;
+  struct rdma_cm_id       *id;
+  char                    *bufs;
+  struct ibv_mr           *mr;
+  struct rc_msg           *msgs;            /* NRECV receives then sends */
+  struct ibv_mr           *msgs_mr;
+  struct io_uring         ring;
+  int                     ring_ready;
+  int                     fixed;
+  uint64_t                peer_addr;
+  uint32_t                peer_rkey;
+  unsigned                idle;             /* empty receive polls */
+  unsigned char           state[MAX_BUFFERS];
+};
+
+static const struct rcopy defaults = {
+  .addr       = NULL,
+  .port       = "12349",
+  .output     = NULL,
+  .chunk      = 1 << 20,
+  .buffers    = 3,
+  .read       = 0,
+  .baseline   = 0,
+  .verbose    = 0,
+};
+
+static const struct argconfig_commandline_options command_line_options[] = {
+    {"port",          "PORT", CFG_STRING, &defaults.port, required_argument,
+            "port to use"},
+    {"o",             "FILE", CFG_STRING, &defaults.output, required_argument, NULL},
+    {"output",        "FILE", CFG_STRING, &defaults.output, required_argument,
+            "server: file to write copies to"},
+    {"c",             "NUM", CFG_LONG_SUFFIX, &defaults.chunk, required_argument, NULL},
+    {"chunk",         "NUM", CFG_LONG_SUFFIX, &defaults.chunk, required_argument,
+            "client: bytes per chunk, a multiple of 4096"},
+    {"b",             "NUM", CFG_POSITIVE, &defaults.buffers, required_argument, NULL},
+    {"buffers",       "NUM", CFG_POSITIVE, &defaults.buffers, required_argument,
+            "client: chunk buffers on each side, 2 double and 3 triple buffers"},
+    {"r",             "", CFG_NONE, &defaults.read, no_argument, NULL},
+    {"read",          "", CFG_NONE, &defaults.read, no_argument,
+            "client: have the server pull chunks with RDMA READ"},
+    {"B",             "", CFG_NONE, &defaults.baseline, no_argument, NULL},
+    {"baseline",      "", CFG_NONE, &defaults.baseline, no_argument,
+            "client: measure raw disk and network rates first"},
+    {"v",             "", CFG_NONE, &defaults.verbose, no_argument, NULL},
+    {"verbose",       "", CFG_NONE, &defaults.verbose, no_argument,
+            "be verbose"},
+    {0}
+};
+
+static int report(const char *func, int val)
+{
+  fprintf(stderr, "%s: %d = %s.\n", func, errno, strerror(errno));
+  return val;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t nchunks(struct rcopy *cfg)
+{
+  return (cfg->size + cfg->chunk - 1) / cfg->chunk;
+}
+
+static size_t chunk_len(struct rcopy *cfg, uint64_t k)
+{
+  size_t left = cfg->size - k * cfg->chunk;
+
+  return left < (size_t) cfg->chunk ? left : (size_t) cfg->chunk;
+}
+
+static char *slot_buf(struct rcopy *cfg, uint64_t k)
+{
+  return cfg->bufs + (k % cfg->buffers) * cfg->chunk;
+}
+
+/* Falls back to the page cache on file systems without O_DIRECT */
+static int open_direct(const char *path, int flags)
+{
+  int fd = open(path, flags | O_DIRECT, 0644);
+
+  if (fd < 0 && errno == EINVAL) {
+    fd = open(path, flags, 0644);
+    if (fd >= 0)
+      fprintf(stderr, "%s: no O_DIRECT, using the page cache.\n", path);
+  }
+  if (fd < 0)
+    report(path, 0);
+  return fd;
+}
+
+/*
+ * Buffers, both registered with the device and, when the kernel allows
+ * it, with the ring as one fixed buffer.
+ */
+
+static int setup_buffers(struct rcopy *cfg)
+{
+  size_t len = (size_t) cfg->buffers * cfg->chunk;
+  struct iovec iov;
+  int ret;
+
+  cfg->bufs = aligned_alloc(DIO_ALIGN, len);
+  if (!cfg->bufs)
+    return report("aligned_alloc", NO_BUFFER);
+
+  cfg->mr = ibv_reg_mr(cfg->id->pd, cfg->bufs, len, IBV_ACCESS_LOCAL_WRITE |
+                       IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ);
+  if (!cfg->mr)
+    return report("ibv_reg_mr", SETUP_PROBLEM);
+
+  ret = io_uring_queue_init(cfg->buffers, &cfg->ring, 0);
+  if (ret) {
+    errno = -ret;
+    return report("io_uring_queue_init", SETUP_PROBLEM);
+  }
+  cfg->ring_ready = 1;
+
+  iov.iov_base = cfg->bufs;
+  iov.iov_len = len;
+  cfg->fixed = !io_uring_register_buffers(&cfg->ring, &iov, 1);
+  if (!cfg->fixed && cfg->verbose)
+    fprintf(stderr, "io_uring_register_buffers failed, not using fixed "
+            "buffers.\n");
+
+  return 0;
+}
+
+static int setup_msgs(struct rcopy *cfg)
+{
+  cfg->msgs = calloc(2 * NRECV, sizeof(*cfg->msgs));
+  if (!cfg->msgs)
+    return report("calloc", NO_BUFFER);
+
+  cfg->msgs_mr = rdma_reg_msgs(cfg->id, cfg->msgs,
+                               2 * NRECV * sizeof(*cfg->msgs));
+  if (!cfg->msgs_mr)
+    return report("rdma_reg_msgs", SETUP_PROBLEM);
+
+  return 0;
+}
+
+static void free_conn(struct rcopy *cfg)
+{
+  if (cfg->ring_ready)
+    io_uring_queue_exit(&cfg->ring);
+  cfg->ring_ready = 0;
+  if (cfg->mr)
+    ibv_dereg_mr(cfg->mr);
+  if (cfg->msgs_mr)
+    rdma_dereg_mr(cfg->msgs_mr);
+  cfg->mr = cfg->msgs_mr = NULL;
+  free(cfg->bufs);
+  free(cfg->msgs);
+  cfg->bufs = NULL;
+  cfg->msgs = NULL;
+  if (cfg->id) {
+    rdma_disconnect(cfg->id);
+    rdma_destroy_ep(cfg->id);
+  }
+  cfg->id = NULL;
+}
+
+/*
+ * Messages
+ */
+
+static int post_msg_recv(struct rcopy *cfg, unsigned i)
+{
+  return rdma_post_recv(cfg->id, (void *) (uintptr_t) i, &cfg->msgs[i],
+                        sizeof(*cfg->msgs), cfg->msgs_mr);
+}
+
+static int send_msg(struct rcopy *cfg, unsigned slot, struct rc_msg *msg)
+{
+  struct rc_msg *m = &cfg->msgs[NRECV + slot];
+
+  m->op = htobe32(msg->op);
+  m->flags = htobe32(msg->flags);
+  m->rkey = htobe32(msg->rkey);
+  m->buffers = htobe32(msg->buffers);
+  m->addr = htobe64(msg->addr);
+  m->chunk = htobe64(msg->chunk);
+  m->value = htobe64(msg->value);
+
+  if (rdma_post_send(cfg->id, NULL, m, sizeof(*m), cfg->msgs_mr, 0))
+    return report("rdma_post_send", -1);
+  return 0;
+}
+
+static int send_op(struct rcopy *cfg, unsigned slot, uint32_t op,
+                   uint32_t flags, uint64_t value)
+{
+  struct rc_msg msg = {.op = op, .flags = flags, .value = value};
+
+  return send_msg(cfg, slot, &msg);
+}
+
+static int send_hello(struct rcopy *cfg)
+{
+  struct rc_msg msg = {
+    .op       = RC_HELLO,
+    .rkey     = cfg->mr->rkey,
+    .buffers  = cfg->buffers,
+    .addr     = (uintptr_t) cfg->bufs,
+    .chunk    = cfg->chunk,
+  };
+
+  return send_msg(cfg, CTRL_SLOT, &msg);
+}
+
+/*
+ * A remote disconnect does not move the local QP to error, so no
+ * receive is flushed when the peer goes away. The endpoint is
+ * synchronous and nothing else reads its CM events, so once connected
+ * its channel is made non-blocking and polled for DISCONNECTED.
+ */
+static void watch_disconnect(struct rcopy *cfg)
+{
+  int fd = cfg->id->channel->fd;
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  cfg->idle = 0;
+}
+
+static int disconnected(struct rcopy *cfg)
+{
+  struct rdma_cm_event *event;
+  int gone;
+
+  if (rdma_get_cm_event(cfg->id->channel, &event))
+    return 0;
+  gone = event->event == RDMA_CM_EVENT_DISCONNECTED;
+  rdma_ack_cm_event(event);
+  return gone;
+}
+
+/*
+ * Returns 1 with the next message in msg, 0 if there is none yet and
+ * -1 on errors or once the peer has disconnected. A WRITE WITH IMM
+ * comes back as READY for its chunk.
+ */
+static int poll_msg(struct rcopy *cfg, struct rc_msg *msg)
+{
+  struct ibv_wc wc;
+  struct rc_msg *m;
+  int n = ibv_poll_cq(cfg->id->recv_cq, 1, &wc);
+
+  if (!n && ++cfg->idle % 4096 == 0 && disconnected(cfg)) {
+    if (cfg->verbose)
+      fprintf(stdout, "Peer disconnected.\n");
+    return -1;
+  }
+  if (n <= 0)
+    return n;
+  cfg->idle = 0;
+  if (wc.status) {
+    if (wc.status != IBV_WC_WR_FLUSH_ERR)
+      fprintf(stderr, "receive failed status %d\n", wc.status);
+    return -1;
+  }
+
+  m = &cfg->msgs[wc.wr_id];
+  if (wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+    memset(msg, 0, sizeof(*msg));
+    msg->op = RC_READY;
+    msg->value = be32toh(wc.imm_data);
+  } else {
+    msg->op = be32toh(m->op);
+    msg->flags = be32toh(m->flags);
+    msg->rkey = be32toh(m->rkey);
+    msg->buffers = be32toh(m->buffers);
+    msg->addr = be64toh(m->addr);
+    msg->chunk = be64toh(m->chunk);
+    msg->value = be64toh(m->value);
+  }
+
+  if (post_msg_recv(cfg, wc.wr_id))
+    return report("rdma_post_recv", -1);
+  return 1;
+}
+
+/*
+ * Returns the chunk an RDMA READ finished, -2 for anything else or
+ * nothing and -1 on errors.
+ */
+static int64_t poll_send(struct rcopy *cfg)
+{
+  struct ibv_wc wc;
+  int n = ibv_poll_cq(cfg->id->send_cq, 1, &wc);
+
+  if (n < 0)
+    return -1;
+  if (!n)
+    return -2;
+  if (wc.status) {
+    fprintf(stderr, "send failed status %d\n", wc.status);
+    return -1;
+  }
+  return wc.wr_id ? (int64_t) wc.wr_id - 1 : -2;
+}
+
+static int wait_msg(struct rcopy *cfg, struct rc_msg *msg, uint32_t op)
+{
+  int ret;
+
+  while (!(ret = poll_msg(cfg, msg)))
+    if (poll_send(cfg) == -1)
+      return -1;
+  if (ret < 0)
+    return -1;
+
+  if (op && msg->op != op) {
+    fprintf(stderr, "expected message %u, got %u\n", op, msg->op);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Disk I/O, a chunk at a time at the chunk's offset. O_DIRECT wants
+ * whole blocks so the tail chunk is read and written rounded up and the
+ * output is truncated to size at the end.
+ */
+
+static int submit_io(struct rcopy *cfg, int write, uint64_t k)
+{
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&cfg->ring);
+  size_t len = (chunk_len(cfg, k) + DIO_ALIGN - 1) & ~(size_t) (DIO_ALIGN - 1);
+  char *buf = slot_buf(cfg, k);
+  off_t off = k * cfg->chunk;
+  int ret;
+
+  if (!sqe) {
+    errno = EBUSY;
+    return report("io_uring_get_sqe", -1);
+  }
+
+  if (write && cfg->fixed)
+    io_uring_prep_write_fixed(sqe, cfg->fd, buf, len, off, 0);
+  else if (write)
+    io_uring_prep_write(sqe, cfg->fd, buf, len, off);
+  else if (cfg->fixed)
+    io_uring_prep_read_fixed(sqe, cfg->fd, buf, len, off, 0);
+  else
+    io_uring_prep_read(sqe, cfg->fd, buf, len, off);
+  io_uring_sqe_set_data64(sqe, k);
+
+  ret = io_uring_submit(&cfg->ring);
+  if (ret < 0) {
+    errno = -ret;
+    return report("io_uring_submit", -1);
+  }
+  return 0;
+}
+
+/* Returns the chunk of a finished read or write, -2 if none, -1 on errors */
+static int64_t reap_io(struct rcopy *cfg)
+{
+  struct io_uring_cqe *cqe;
+  uint64_t k;
+  int res;
+
+  if (io_uring_peek_cqe(&cfg->ring, &cqe))
+    return -2;
+  k = io_uring_cqe_get_data64(cqe);
+  res = cqe->res;
+  io_uring_cqe_seen(&cfg->ring, cqe);
+
+  if (res < 0) {
+    errno = -res;
+    return report("disk i/o", -1);
+  }
+  if ((size_t) res < chunk_len(cfg, k)) {
+    fprintf(stderr, "short disk i/o at chunk %llu: %d bytes\n",
+            (unsigned long long) k, res);
+    return -1;
+  }
+  return k;
+}
+
+/* Streams size bytes between the file and the buffers, no network */
+static int disk_pass(struct rcopy *cfg, int write)
+{
+  uint64_t n = nchunks(cfg), next = 0, done = 0;
+  int64_t k;
+
+  memset(cfg->state, SLOT_IDLE, sizeof(cfg->state));
+  while (done < n) {
+    while (next < n && cfg->state[next % cfg->buffers] == SLOT_IDLE) {
+      if (submit_io(cfg, write, next))
+        return -1;
+      cfg->state[next++ % cfg->buffers] = SLOT_BUSY;
+    }
+
+    k = reap_io(cfg);
+    if (k == -1)
+      return -1;
+    if (k >= 0) {
+      cfg->state[k % cfg->buffers] = SLOT_IDLE;
+      done++;
+    }
+  }
+  return 0;
+}
+
+static int sync_output(struct rcopy *cfg)
+{
+  struct stat st;
+
+  if (fstat(cfg->fd, &st))
+    return report("fstat", -1);
+  if (!S_ISREG(st.st_mode))
+    return 0;
+  if (ftruncate(cfg->fd, cfg->size))
+    return report("ftruncate", -1);
+  if (fdatasync(cfg->fd))
+    return report("fdatasync", -1);
+  return 0;
+}
+
+/*
+ * Server
+ */
+
+static int got_chunk(struct rcopy *cfg, uint32_t flags, uint64_t k,
+                     uint64_t *done)
+{
+  if (!(flags & JOB_NO_DISK))
+    return submit_io(cfg, 1, k);
+
+  (*done)++;
+  return send_op(cfg, k % cfg->buffers, RC_FREE, 0, k);
+}
+
+static int server_job(struct rcopy *cfg, struct rc_msg *job)
+{
+  uint32_t flags = job->flags;
+  uint64_t n, done = 0;
+  struct rc_msg msg;
+  double start = now();
+  int64_t k;
+  int ret;
+
+  cfg->size = job->value;
+  n = nchunks(cfg);
+
+  if (flags & JOB_DISK_ONLY) {
+    if (disk_pass(cfg, 1))
+      return -1;
+    n = 0;
+  }
+
+  while (done < n) {
+    ret = poll_msg(cfg, &msg);
+    if (ret < 0)
+      return -1;
+    if (ret && msg.op != RC_READY) {
+      fprintf(stderr, "unexpected message %u in a copy\n", msg.op);
+      return -1;
+    }
+    if (ret && flags & JOB_READ) {
+      k = msg.value;
+      if (rdma_post_read(cfg->id, (void *) (uintptr_t) (k + 1),
+                         slot_buf(cfg, k), chunk_len(cfg, k), cfg->mr, 0,
+                         cfg->peer_addr + (k % cfg->buffers) * cfg->chunk,
+                         cfg->peer_rkey))
+        return report("rdma_post_read", -1);
+    } else if (ret && got_chunk(cfg, flags, msg.value, &done)) {
+      return -1;
+    }
+
+    k = poll_send(cfg);
+    if (k == -1)
+      return -1;
+    if (k >= 0 && got_chunk(cfg, flags, k, &done))
+      return -1;
+
+    if (flags & JOB_NO_DISK)
+      continue;
+    k = reap_io(cfg);
+    if (k == -1)
+      return -1;
+    if (k >= 0) {
+      done++;
+      if (send_op(cfg, k % cfg->buffers, RC_FREE, 0, k))
+        return -1;
+    }
+  }
+
+  if (!(flags & JOB_NO_DISK) && sync_output(cfg))
+    return -1;
+
+  if (cfg->verbose) {
+    fprintf(stdout, "job %x: ", flags);
+    report_transfer_rate_elapsed(stdout, now() - start, cfg->size);
+    fprintf(stdout, "\n");
+  }
+
+  return send_op(cfg, CTRL_SLOT, RC_DONE, 0, (now() - start) * 1e9);
+}
+
+static int serve_conn(struct rcopy *cfg, struct rdma_cm_id *id)
+{
+  struct rc_msg msg;
+  int ret;
+
+  cfg->id = id;
+  ret = setup_msgs(cfg);
+  if (ret)
+    return ret;
+  if (post_msg_recv(cfg, 0))
+    return report("rdma_post_recv", SETUP_PROBLEM);
+  if (rdma_accept(id, NULL))
+    return report("rdma_accept", SETUP_PROBLEM);
+  watch_disconnect(cfg);
+
+  if (wait_msg(cfg, &msg, RC_HELLO))
+    return SETUP_PROBLEM;
+  if (!msg.buffers || msg.buffers > MAX_BUFFERS || !msg.chunk ||
+      msg.chunk % DIO_ALIGN) {
+    fprintf(stderr, "bad hello: %u buffers of %llu bytes\n", msg.buffers,
+            (unsigned long long) msg.chunk);
+    return SETUP_PROBLEM;
+  }
+  cfg->buffers = msg.buffers;
+  cfg->chunk = msg.chunk;
+  cfg->peer_addr = msg.addr;
+  cfg->peer_rkey = msg.rkey;
+
+  ret = setup_buffers(cfg);
+  if (ret)
+    return ret;
+  for (unsigned i=1; i<cfg->buffers+2; i++)
+    if (post_msg_recv(cfg, i))
+      return report("rdma_post_recv", SETUP_PROBLEM);
+  if (send_hello(cfg))
+    return SETUP_PROBLEM;
+
+  if (cfg->verbose)
+    fprintf(stdout, "Client connected: %u buffers of %ld bytes.\n",
+            cfg->buffers, cfg->chunk);
+
+  while (!wait_msg(cfg, &msg, RC_JOB))
+    if (server_job(cfg, &msg))
+      return RUN_PROBLEM;
+
+  return 0;
+}
+
+static int run_server(struct rcopy *cfg)
+{
+  struct rdma_addrinfo hints, *res;
+  struct ibv_qp_init_attr attr;
+  struct rdma_cm_id *lid, *id;
+
+  if (!cfg->output) {
+    fprintf(stderr, "the server needs an --output file\n");
+    return BAD_ARGS;
+  }
+  cfg->fd = open_direct(cfg->output, O_WRONLY | O_CREAT);
+  if (cfg->fd < 0)
+    return SETUP_PROBLEM;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_flags = RAI_PASSIVE;
+  hints.ai_port_space = RDMA_PS_TCP;
+  if (rdma_getaddrinfo(NULL, cfg->port, &hints, &res))
+    return report("rdma_getaddrinfo", SETUP_PROBLEM);
+
+  memset(&attr, 0, sizeof(attr));
+  attr.cap.max_send_wr = 2 * MAX_BUFFERS + 4;
+  attr.cap.max_recv_wr = NRECV;
+  attr.cap.max_send_sge = attr.cap.max_recv_sge = 1;
+  attr.sq_sig_all = 1;
+  if (rdma_create_ep(&lid, res, NULL, &attr))
+    return report("rdma_create_ep", SETUP_PROBLEM);
+  rdma_freeaddrinfo(res);
+
+  if (rdma_listen(lid, 0))
+    return report("rdma_listen", SETUP_PROBLEM);
+
+  fprintf(stdout, "Writing copies to %s, listening on port %s.\n",
+          cfg->output, cfg->port);
+
+  while (!rdma_get_request(lid, &id)) {
+    int ret = serve_conn(cfg, id);
+
+    if (ret && ret != RUN_PROBLEM)
+      fprintf(stderr, "dropping client after setup error\n");
+    free_conn(cfg);
+  }
+
+  return report("rdma_get_request", RUN_PROBLEM);
+}
+
+/*
+ * Client
+ */
+
+static int ship(struct rcopy *cfg, uint32_t flags, uint64_t k)
+{
+  struct ibv_send_wr wr, *bad_wr;
+  struct ibv_sge sge;
+
+  if (flags & JOB_READ)
+    return send_op(cfg, k % cfg->buffers, RC_READY, 0, k);
+
+  sge.addr = (uintptr_t) slot_buf(cfg, k);
+  sge.length = chunk_len(cfg, k);
+  sge.lkey = cfg->mr->lkey;
+
+  memset(&wr, 0, sizeof(wr));
+  wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+  wr.imm_data = htobe32(k);
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  wr.wr.rdma.remote_addr = cfg->peer_addr + (k % cfg->buffers) * cfg->chunk;
+  wr.wr.rdma.rkey = cfg->peer_rkey;
+  if (ibv_post_send(cfg->id->qp, &wr, &bad_wr))
+    return report("ibv_post_send", -1);
+  return 0;
+}
+
+/*
+ * Runs one job on the server. Chunks are read into a buffer once the
+ * server has freed it and shipped in order once read. Returns the
+ * client's elapsed time and the server's in server_time.
+ */
+static double client_job(struct rcopy *cfg, uint32_t flags,
+                         double *server_time)
+{
+  uint64_t n = flags & JOB_DISK_ONLY ? 0 : nchunks(cfg);
+  uint64_t next_read = 0, next_send = 0, freed = 0;
+  struct rc_msg msg;
+  double start = now();
+  int64_t k;
+  int ret;
+
+  if (send_op(cfg, CTRL_SLOT, RC_JOB, flags, cfg->size))
+    return -1;
+
+  memset(cfg->state, SLOT_IDLE, sizeof(cfg->state));
+  while (freed < n) {
+    while (next_read < n && cfg->state[next_read % cfg->buffers] == SLOT_IDLE) {
+      if (flags & JOB_NO_DISK) {
+        cfg->state[next_read % cfg->buffers] = SLOT_FULL;
+      } else {
+        if (submit_io(cfg, 0, next_read))
+          return -1;
+        cfg->state[next_read % cfg->buffers] = SLOT_BUSY;
+      }
+      next_read++;
+    }
+
+    while (next_send < next_read &&
+           cfg->state[next_send % cfg->buffers] == SLOT_FULL) {
+      if (ship(cfg, flags, next_send))
+        return -1;
+      cfg->state[next_send++ % cfg->buffers] = SLOT_BUSY;
+    }
+
+    if (!(flags & JOB_NO_DISK)) {
+      k = reap_io(cfg);
+      if (k == -1)
+        return -1;
+      if (k >= 0)
+        cfg->state[k % cfg->buffers] = SLOT_FULL;
+    }
+
+    ret = poll_msg(cfg, &msg);
+    if (ret < 0)
+      return -1;
+    if (ret && msg.op != RC_FREE) {
+      fprintf(stderr, "unexpected message %u in a copy\n", msg.op);
+      return -1;
+    }
+    if (ret) {
+      cfg->state[msg.value % cfg->buffers] = SLOT_IDLE;
+      freed++;
+    }
+
+    if (poll_send(cfg) == -1)
+      return -1;
+  }
+
+  if (wait_msg(cfg, &msg, RC_DONE))
+    return -1;
+  *server_time = msg.value / 1e9;
+  return now() - start;
+}
+
+static int connect_client(struct rcopy *cfg)
+{
+  struct rdma_addrinfo hints, *res;
+  struct ibv_qp_init_attr attr;
+  struct rc_msg msg;
+  int ret;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_port_space = RDMA_PS_TCP;
+  if (rdma_getaddrinfo(cfg->addr, cfg->port, &hints, &res))
+    return report("rdma_getaddrinfo", SETUP_PROBLEM);
+
+  memset(&attr, 0, sizeof(attr));
+  attr.cap.max_send_wr = 2 * MAX_BUFFERS + 4;
+  attr.cap.max_recv_wr = NRECV;
+  attr.cap.max_send_sge = attr.cap.max_recv_sge = 1;
+  attr.sq_sig_all = 1;
+  ret = rdma_create_ep(&cfg->id, res, NULL, &attr);
+  rdma_freeaddrinfo(res);
+  if (ret)
+    return report("rdma_create_ep", SETUP_PROBLEM);
+
+  ret = setup_msgs(cfg);
+  if (!ret)
+    ret = setup_buffers(cfg);
+  if (ret)
+    return ret;
+
+  for (unsigned i=0; i<cfg->buffers+2; i++)
+    if (post_msg_recv(cfg, i))
+      return report("rdma_post_recv", SETUP_PROBLEM);
+
+  if (rdma_connect(cfg->id, NULL))
+    return report("rdma_connect", SETUP_PROBLEM);
+  watch_disconnect(cfg);
+
+  if (send_hello(cfg) || wait_msg(cfg, &msg, RC_HELLO))
+    return SETUP_PROBLEM;
+  cfg->peer_addr = msg.addr;
+  cfg->peer_rkey = msg.rkey;
+
+  return 0;
+}
+
+static void print_rate(const char *label, double elapsed, size_t bytes)
+{
+  fprintf(stdout, "%-12s ", label);
+  report_transfer_rate_elapsed(stdout, elapsed, bytes);
+  fprintf(stdout, "\n");
+}
+
+static int run_client(struct rcopy *cfg)
+{
+  uint32_t flags = cfg->read ? JOB_READ : 0;
+  double disk_read = 0, network = 0, disk_write = 0, copy, server;
+  const char *limit = NULL;
+  double slowest = 0;
+  struct stat st;
+  int ret;
+
+  cfg->fd = open_direct(cfg->file, O_RDONLY);
+  if (cfg->fd < 0)
+    return SETUP_PROBLEM;
+  if (fstat(cfg->fd, &st))
+    return report("fstat", SETUP_PROBLEM);
+  cfg->size = st.st_size;
+
+  ret = connect_client(cfg);
+  if (ret)
+    goto out;
+
+  if (cfg->verbose)
+    fprintf(stdout, "Copying %zu bytes in %llu chunks through %u buffers "
+            "with RDMA %s.\n", cfg->size, (unsigned long long) nchunks(cfg),
+            cfg->buffers, cfg->read ? "READ" : "WRITE");
+
+  ret = RUN_PROBLEM;
+  if (cfg->baseline) {
+    disk_read = now();
+    if (disk_pass(cfg, 0))
+      goto out;
+    disk_read = now() - disk_read;
+    print_rate("disk read:", disk_read, cfg->size);
+
+    network = client_job(cfg, flags | JOB_NO_DISK, &server);
+    if (network < 0)
+      goto out;
+    print_rate("network:", network, cfg->size);
+
+    if (client_job(cfg, JOB_DISK_ONLY, &disk_write) < 0)
+      goto out;
+    print_rate("disk write:", disk_write, cfg->size);
+
+    slowest = disk_read;
+    limit = "disk read";
+    if (network > slowest) {
+      slowest = network;
+      limit = "network";
+    }
+    if (disk_write > slowest) {
+      slowest = disk_write;
+      limit = "disk write";
+    }
+  }
+
+  copy = client_job(cfg, flags, &server);
+  if (copy < 0)
+    goto out;
+  print_rate("copy:", copy, cfg->size);
+  if (limit && copy > 0)
+    fprintf(stdout, "copy runs at %.0f%% of the %s limit\n",
+            100 * slowest / copy, limit);
+  ret = 0;
+
+out:
+  free_conn(cfg);
+  close(cfg->fd);
+  return ret;
+}
+
+int main(int argc, char *argv[])
+{
+  struct rcopy cfg;
+
+  argconfig_append_usage("[SERVER_NAME FILE]");
+  int args = argconfig_parse(argc, argv, program_desc, command_line_options,
+                             &defaults, &cfg, sizeof(cfg));
+  if (args != 0 && args != 2) {
+    argconfig_print_help(argv[0], program_desc, command_line_options);
+    return BAD_ARGS;
+  }
+
+  if (args == 0)
+    return run_server(&cfg);
+
+  cfg.addr = argv[1];
+  cfg.file = argv[2];
+  if (cfg.chunk <= 0 || cfg.chunk > 1L << 30 || cfg.chunk % DIO_ALIGN ||
+      cfg.buffers > MAX_BUFFERS) {
+    fprintf(stderr, "--chunk must be a multiple of %d up to 1G and --buffers "
+            "at most %d\n", DIO_ALIGN, MAX_BUFFERS);
+    return BAD_ARGS;
+  }
+
+  return run_client(&cfg);
+}
@@ -0,0 +1,548 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Memory registration cost benchmark. Sweeps region size, page
+//     size (4K, transparent huge pages, hugetlbfs), access flags and
+//     pinned vs. On-Demand Paging registration and measures how long
+//     ibv_reg_mr() and ibv_dereg_mr() take, optionally from several
+//     threads sharing one PD. The numbers are what you need to size
+//     a registration cache.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/time.h>
+#include <sys/mman.h>
+
+#include <infiniband/verbs.h>
+
+#include "../argconfig/argconfig.h"
+#include "../argconfig/report.h"
+#include "../argconfig/suffix.h"
+
+#define HUGE_2M (2UL << 20)
+
+enum errors {
+  BAD_ARGS       = 1,
+  NO_DEVICE,
+  NO_BUFFER,
+  SETUP_PROBLEM,
+  RUN_PROBLEM,
+};
+
+enum page_type {
+  PAGE_4K,
+  PAGE_THP,
+  PAGE_HUGETLB,
+};
+
+static const char *page_names[] = {
+  [PAGE_4K]      = "4k",
+  [PAGE_THP]     = "thp",
+  [PAGE_HUGETLB] = "hugetlb",
+};
+
+static const struct {
+  const char *name;
+  int        flags;
+} access_modes[] = {
+  {"local",  IBV_ACCESS_LOCAL_WRITE},
+  {"remote", IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+             IBV_ACCESS_REMOTE_WRITE},
+  {"atomic", IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+             IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC},
+};
+
+#define NUM_ACCESS_MODES (sizeof(access_modes) / sizeof(access_modes[0]))
+
+const char program_desc[] =
+    "Measure ibv_reg_mr/ibv_dereg_mr cost across region size, page size, "
+    "access flags and ODP";
+
+struct regbench {
+  char                    *device;
+  long                    min_size;
+  long                    max_size;
+  unsigned                iters;
+  unsigned                threads;
+  char                    *pages;
+  char                    *access;
+  unsigned                odp;
+  unsigned                cold;
+  unsigned                verbose;
+
+  char                    *log;
+  FILE                    *flog;
+
+  struct ibv_context      *ctx;
+  struct ibv_pd           *pd;
+  int                     odp_supported;
+};
+
+static const struct regbench defaults = {
+  .device     = NULL,
+  .min_size   = 4096,
+  .max_size   = 256 << 20,
+  .iters      = 16,
+  .threads    = 1,
+  .pages      = "4k,thp",
+  .access     = "local,remote",
+  .odp        = 0,
+  .cold       = 0,
+  .verbose    = 0,
+  .log        = NULL,
+};
+
+static const struct argconfig_commandline_options command_line_options[] = {
+    {"d",             "DEV", CFG_STRING, &defaults.device, required_argument, NULL},
+    {"device",        "DEV", CFG_STRING, &defaults.device, required_argument,
+            "RDMA device to use (default first device found)"},
+    {"min-size",      "NUM", CFG_LONG_SUFFIX, &defaults.min_size, required_argument,
+            "smallest region to register"},
+    {"max-size",      "NUM", CFG_LONG_SUFFIX, &defaults.max_size, required_argument,
+            "largest region to register (sizes double from min-size)"},
+    {"i",             "NUM", CFG_POSITIVE, &defaults.iters, required_argument, NULL},
+    {"iters",         "NUM", CFG_POSITIVE, &defaults.iters, required_argument,
+            "registrations per size, per thread"},
+    {"t",             "NUM", CFG_POSITIVE, &defaults.threads, required_argument, NULL},
+    {"threads",       "NUM", CFG_POSITIVE, &defaults.threads, required_argument,
+            "number of threads registering concurrently against one PD"},
+    {"pages",         "LIST", CFG_STRING, &defaults.pages, required_argument,
+            "comma separated page types to sweep: 4k, thp, hugetlb"},
+    {"access",        "LIST", CFG_STRING, &defaults.access, required_argument,
+            "comma separated access flags to sweep: local, remote, atomic"},
+    {"odp",           "", CFG_NONE, &defaults.odp, no_argument,
+            "also sweep On-Demand Paging registrations"},
+    {"cold",          "", CFG_NONE, &defaults.cold, no_argument,
+            "do not pre-fault the buffer, so registration pays for it"},
+    {"log",           "FILE", CFG_STRING, &defaults.log, required_argument,
+            "log every registration latency sample to FILE"},
+    {"v",             "", CFG_NONE, &defaults.verbose, no_argument, NULL},
+    {"verbose",       "", CFG_NONE, &defaults.verbose, no_argument,
+            "be verbose"},
+    {0}
+};
+
+/*
+ * Holds the workers until every one of them has been created, then
+ * starts them together, or sends them home if a create failed.
+ */
+struct start_gate {
+  pthread_mutex_t         lock;
+  pthread_cond_t          cond;
+  int                     state;      /* 0 wait, 1 go, -1 abort */
+};
+
+struct worker {
+  pthread_t               thread;
+  struct regbench         *cfg;
+  struct start_gate       *gate;
+
+  char                    *buf;
+  char                    *base;
+  size_t                  mapped;
+  size_t                  size;
+  int                     access;
+
+  double                  *reg;
+  double                  *dereg;
+  int                     err;
+};
+
+static int report(const char *func, int val)
+{
+  fprintf(stderr,"%s: %d = %s.\n", func, errno, strerror(errno));
+  return val;
+}
+
+static double elapsed(struct timeval *start, struct timeval *end)
+{
+  return (end->tv_sec - start->tv_sec) +
+    (end->tv_usec - start->tv_usec) / 1e6;
+}
+
+/*
+ * Allocate a region backed by the requested page type. THP regions
+ * are 2MB aligned so the kernel can actually back them with huge
+ * pages; hugetlb needs pages reserved in /proc/sys/vm/nr_hugepages.
+ */
+
+static char *alloc_region(enum page_type type, size_t size, char **base,
+                          size_t *mapped)
+{
+  char *buf;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+  *mapped = size;
+
+  if (type == PAGE_HUGETLB) {
+    *mapped = (size + HUGE_2M - 1) & ~(HUGE_2M - 1);
+    flags |= MAP_HUGETLB;
+  } else if (type == PAGE_THP) {
+    *mapped = size + HUGE_2M;
+  }
+
+  buf = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (buf == MAP_FAILED)
+    return NULL;
+  *base = buf;
+
+  if (type == PAGE_THP) {
+    char *aligned = (char *)(((uintptr_t) buf + HUGE_2M - 1) &
+                             ~(HUGE_2M - 1));
+    if (madvise(aligned, size, MADV_HUGEPAGE))
+      perror("madvise(MADV_HUGEPAGE)");
+    return aligned;
+  }
+
+  if (type == PAGE_4K)
+    madvise(buf, size, MADV_NOHUGEPAGE);
+
+  return buf;
+}
+
+static void *worker_thread(void *arg)
+{
+  struct worker *w = arg;
+  struct timeval t0, t1, t2;
+  struct ibv_mr *mr;
+  int state;
+
+  pthread_mutex_lock(&w->gate->lock);
+  while (!w->gate->state)
+    pthread_cond_wait(&w->gate->cond, &w->gate->lock);
+  state = w->gate->state;
+  pthread_mutex_unlock(&w->gate->lock);
+  if (state < 0)
+    return NULL;
+
+  for (unsigned i=0; i<w->cfg->iters; i++) {
+    gettimeofday(&t0, NULL);
+    mr = ibv_reg_mr(w->cfg->pd, w->buf, w->size, w->access);
+    gettimeofday(&t1, NULL);
+    if (!mr) {
+      w->err = errno;
+      break;
+    }
+    if (ibv_dereg_mr(mr)) {
+      w->err = errno;
+      break;
+    }
+    gettimeofday(&t2, NULL);
+
+    w->reg[i]   = elapsed(&t0, &t1);
+    w->dereg[i] = elapsed(&t1, &t2);
+  }
+
+  return NULL;
+}
+
+static void report_point(struct regbench *cfg, struct worker *workers,
+                         const char *label, size_t size)
+{
+  unsigned n = cfg->iters * cfg->threads;
+  double *reg, *dereg, reg_wall = 0;
+
+  reg   = malloc(n * sizeof(*reg));
+  dereg = malloc(n * sizeof(*dereg));
+  if (!reg || !dereg)
+    goto out;
+
+  /*
+   * Registration throughput is the bytes registered by all threads
+   * divided by the longest time any one thread spent in ibv_reg_mr.
+   */
+  for (unsigned t=0; t<cfg->threads; t++) {
+    double sum = 0;
+    for (unsigned i=0; i<cfg->iters; i++) {
+      reg[t*cfg->iters+i]   = workers[t].reg[i];
+      dereg[t*cfg->iters+i] = workers[t].dereg[i];
+      sum += workers[t].reg[i];
+    }
+    if (sum > reg_wall)
+      reg_wall = sum;
+  }
+
+  if (cfg->flog)
+    fprintf(cfg->flog, "# %s size=%zd\n", label, size);
+
+  fprintf(stdout, "%s reg   : ", label);
+  report_transfer_bin_rate_elapsed(stdout, reg_wall, size * n);
+  fprintf(stdout, "\n    ");
+  report_latency_elapsed(stdout, cfg->flog, reg, n);
+  fprintf(stdout, "\n    ");
+  report_percentiles_elapsed(stdout, reg, n);
+  fprintf(stdout, "\n%s dereg : ", label);
+  report_latency_elapsed(stdout, NULL, dereg, n);
+  fprintf(stdout, "\n    ");
+  report_percentiles_elapsed(stdout, dereg, n);
+  fprintf(stdout, "\n");
+
+out:
+  free(reg);
+  free(dereg);
+}
+
+static int run_point(struct regbench *cfg, enum page_type type,
+                     size_t size, int access, const char *label)
+{
+  struct worker *workers;
+  struct start_gate gate = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+  };
+  unsigned started = 0;
+  int ret = 0;
+
+  workers = calloc(cfg->threads, sizeof(*workers));
+  if (!workers)
+    return report("calloc", NO_BUFFER);
+
+  for (unsigned t=0; t<cfg->threads; t++) {
+    struct worker *w = &workers[t];
+
+    w->cfg     = cfg;
+    w->gate    = &gate;
+    w->size    = size;
+    w->access  = access;
+    w->reg     = calloc(cfg->iters, sizeof(*w->reg));
+    w->dereg   = calloc(cfg->iters, sizeof(*w->dereg));
+    w->buf     = alloc_region(type, size, &w->base, &w->mapped);
+    if (!w->reg || !w->dereg || !w->buf) {
+      if (type == PAGE_HUGETLB && !w->buf)
+        fprintf(stderr, "%s: no hugetlb pages available, skipping "
+                "(see /proc/sys/vm/nr_hugepages)\n", label);
+      else
+        report("alloc", NO_BUFFER);
+      ret = NO_BUFFER;
+      goto out;
+    }
+
+    if (!cfg->cold)
+      memset(w->buf, 0xa5, size);
+  }
+
+  for (; started<cfg->threads; started++) {
+    errno = pthread_create(&workers[started].thread, NULL, worker_thread,
+                           &workers[started]);
+    if (errno) {
+      ret = report("pthread_create", SETUP_PROBLEM);
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&gate.lock);
+  gate.state = ret ? -1 : 1;
+  pthread_cond_broadcast(&gate.cond);
+  pthread_mutex_unlock(&gate.lock);
+  for (unsigned t=0; t<started; t++)
+    pthread_join(workers[t].thread, NULL);
+  if (ret)
+    goto out;
+
+  for (unsigned t=0; t<cfg->threads; t++)
+    if (workers[t].err) {
+      errno = workers[t].err;
+      ret = report(label, RUN_PROBLEM);
+      goto out;
+    }
+
+  report_point(cfg, workers, label, size);
+
+out:
+  for (unsigned t=0; t<cfg->threads; t++) {
+    if (workers[t].buf)
+      munmap(workers[t].base, workers[t].mapped);
+    free(workers[t].reg);
+    free(workers[t].dereg);
+  }
+  free(workers);
+  return ret;
+}
+
+static int parse_pages(const char *list, int *pages, int max)
+{
+  char *tmp = strdup(list), *tok, *save;
+  int n = 0;
+
+  for (tok = strtok_r(tmp, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    unsigned p;
+    for (p=0; p<sizeof(page_names)/sizeof(page_names[0]); p++)
+      if (!strcmp(tok, page_names[p]))
+        break;
+    if (p == sizeof(page_names)/sizeof(page_names[0])) {
+      fprintf(stderr, "unknown page type '%s'\n", tok);
+      n = -1;
+      break;
+    }
+    if (n == max) {
+      fprintf(stderr, "at most %d page types\n", max);
+      n = -1;
+      break;
+    }
+    pages[n++] = p;
+  }
+
+  free(tmp);
+  return n;
+}
+
+static int parse_access(const char *list, int *modes, int max)
+{
+  char *tmp = strdup(list), *tok, *save;
+  int n = 0;
+
+  for (tok = strtok_r(tmp, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    unsigned a;
+    for (a=0; a<NUM_ACCESS_MODES; a++)
+      if (!strcmp(tok, access_modes[a].name))
+        break;
+    if (a == NUM_ACCESS_MODES) {
+      fprintf(stderr, "unknown access mode '%s'\n", tok);
+      n = -1;
+      break;
+    }
+    if (n == max) {
+      fprintf(stderr, "at most %d access modes\n", max);
+      n = -1;
+      break;
+    }
+    modes[n++] = a;
+  }
+
+  free(tmp);
+  return n;
+}
+
+static int open_device(struct regbench *cfg)
+{
+  struct ibv_device **list;
+  struct ibv_device_attr_ex attr;
+  int i;
+
+  list = ibv_get_device_list(NULL);
+  if (!list)
+    return report("ibv_get_device_list", NO_DEVICE);
+
+  for (i=0; list[i]; i++)
+    if (!cfg->device || !strcmp(ibv_get_device_name(list[i]), cfg->device))
+      break;
+  if (!list[i]) {
+    fprintf(stderr, "no RDMA device %s found\n",
+            cfg->device ? cfg->device : "");
+    ibv_free_device_list(list);
+    return NO_DEVICE;
+  }
+
+  cfg->ctx = ibv_open_device(list[i]);
+  ibv_free_device_list(list);
+  if (!cfg->ctx)
+    return report("ibv_open_device", NO_DEVICE);
+
+  cfg->pd = ibv_alloc_pd(cfg->ctx);
+  if (!cfg->pd)
+    return report("ibv_alloc_pd", SETUP_PROBLEM);
+
+  if (!ibv_query_device_ex(cfg->ctx, NULL, &attr))
+    cfg->odp_supported = attr.odp_caps.general_caps & IBV_ODP_SUPPORT;
+
+  if (cfg->verbose)
+    fprintf(stdout, "Using device %s (ODP %ssupported)\n",
+            ibv_get_device_name(cfg->ctx->device),
+            cfg->odp_supported ? "" : "not ");
+
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  struct regbench cfg;
+  int pages[PAGE_HUGETLB + 1], modes[NUM_ACCESS_MODES];
+  int npages, nmodes, ret = 0;
+
+  int args = argconfig_parse(argc, argv, program_desc, command_line_options,
+                             &defaults, &cfg, sizeof(cfg));
+  if (args) {
+    argconfig_print_help(argv[0], program_desc, command_line_options);
+    return BAD_ARGS;
+  }
+
+  npages = parse_pages(cfg.pages, pages, sizeof(pages)/sizeof(pages[0]));
+  nmodes = parse_access(cfg.access, modes, NUM_ACCESS_MODES);
+  if (npages <= 0 || nmodes <= 0 || cfg.min_size <= 0 ||
+      cfg.max_size < cfg.min_size)
+    return BAD_ARGS;
+
+  cfg.flog = NULL;
+  if (cfg.log) {
+    cfg.flog = fopen(cfg.log, "w");
+    if (!cfg.flog)
+      return report("cannot open log file", BAD_ARGS);
+  }
+
+  cfg.ctx = NULL;
+  cfg.pd = NULL;
+  cfg.odp_supported = 0;
+  ret = open_device(&cfg);
+  if (ret)
+    goto out;
+
+  if (cfg.odp && !cfg.odp_supported)
+    fprintf(stderr, "Device does not support ODP, skipping ODP sweep\n");
+
+  for (int p=0; p<npages; p++)
+    for (int a=0; a<nmodes; a++)
+      for (int odp=0; odp<=(cfg.odp && cfg.odp_supported); odp++)
+        for (long size=cfg.min_size; size<=cfg.max_size; size*=2) {
+          char label[64];
+          double sz = size;
+          int rc;
+          const char *sz_suffix = suffix_dbinary_get(&sz);
+          int access = access_modes[modes[a]].flags;
+
+          if (odp)
+            access |= IBV_ACCESS_ON_DEMAND;
+
+          snprintf(label, sizeof(label), "%4.0f%sB %-7s %-6s %-6s x%u",
+                   sz, sz_suffix, page_names[pages[p]],
+                   access_modes[modes[a]].name, odp ? "odp" : "pinned",
+                   cfg.threads);
+
+          /* A missing hugetlb pool skips the rest of that sweep. */
+          rc = run_point(&cfg, pages[p], size, access, label);
+          if (rc == NO_BUFFER && pages[p] == PAGE_HUGETLB)
+            break;
+          if (rc && !ret)
+            ret = rc;
+        }
+
+out:
+  if (cfg.pd)
+    ibv_dealloc_pd(cfg.pd);
+  if (cfg.ctx)
+    ibv_close_device(cfg.ctx);
+  if (cfg.flog)
+    fclose(cfg.flog);
+
+  return ret;
+}
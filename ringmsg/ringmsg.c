@@ -0,0 +1,756 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Messaging over a remote ring buffer, compared with SEND/RECV.
+//     Each side owns a --ring byte receive ring that its peer RDMA
+//     WRITEs framed messages into. The receiver finds them by polling
+//     the ring, so there is no receive to post per message.
+//
+//     A frame is an 8 byte header holding the length and the low 32
+//     bits of the message sequence number, the payload padded to 8
+//     bytes and an 8 byte trailer holding the full sequence number.
+//     A frame is complete once both the header and the trailer show
+//     the expected sequence number. Like FaRM this relies on the NIC
+//     placing the bytes of one WRITE in address order. A frame that
+//     would run past the end of the ring is preceded by a wrap header
+//     and starts again at offset 0.
+//
+//     The sender builds frames in a local mirror of the remote ring
+//     and writes them from there. It may only reuse ring space the
+//     receiver has handed back. The receiver returns that space
+//     lazily: it RDMA WRITEs its consumed byte count into the
+//     sender's credit word every --credit bytes.
+//
+//     The client times ping-pong latency and one-way message rate
+//     over the rings, then the same over SEND/RECV. The server takes
+//     the message size and count from the client.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <endian.h>
+#include <time.h>
+
+#include <rdma/rdma_cma.h>
+#include <rdma/rdma_verbs.h>
+#include <infiniband/verbs.h>
+
+#include "../argconfig/argconfig.h"
+#include "../argconfig/report.h"
+#include "../pattern/pattern.h"
+
+#define RING_WRAP   0xffffffff
+#define RING_ALIGN  8
+
+enum errors {
+  BAD_ARGS       = 1,
+  NO_BUFFER,
+  SETUP_PROBLEM,
+  RUN_PROBLEM,
+};
+
+struct ring_hdr {
+  uint32_t                len;
+  uint32_t                seq;
+};
+
+/* Exchanged once after connecting, big endian */
+struct ring_hello {
+  uint64_t                ring_addr;
+  uint64_t                credit_addr;
+  uint32_t                ring_rkey;
+  uint32_t                credit_rkey;
+  uint32_t                ring_size;
+  uint32_t                size;
+  uint64_t                iters;
+  uint32_t                check;
+  uint32_t                reserved;
+};
+
+const char program_desc[] =
+    "Credit based RDMA WRITE ring messaging compared with SEND/RECV";
+
+struct ringmsg {
+  char                    *addr;
+  char                    *port;
+  long                    size;
+  long                    iters;
+  long                    ring_size;
+  long                    credit;
+  unsigned                depth;
+  unsigned                signal;
+  unsigned                inline_size;
+  unsigned                check;
+  unsigned                verbose;
+
+  struct rdma_cm_id       *lid;
+  struct rdma_cm_id       *id;
+
+  /* receive side: our ring and what we have consumed of it */
+  char                    *ring;
+  struct ibv_mr           *ring_mr;
+  uint64_t                consumed;
+  uint64_t                credited;
+  uint64_t                rx_seq;
+  uint64_t                *credit_out;
+  struct ibv_mr           *credit_out_mr;
+
+  /* send side: a mirror of the peer's ring and its credit word */
+  char                    *mirror;
+  struct ibv_mr           *mirror_mr;
+  uint64_t                peer_ring_addr;
+  uint32_t                peer_ring_rkey;
+  uint64_t                peer_ring_size;
+  uint64_t                peer_credit_addr;
+  uint32_t                peer_credit_rkey;
+  volatile uint64_t       *credit_in;
+  struct ibv_mr           *credit_in_mr;
+  uint64_t                produced;
+  uint64_t                tx_seq;
+
+  /* SEND/RECV */
+  char                    *rx_bufs;
+  struct ibv_mr           *rx_mr;
+  char                    *tx_buf;
+  struct ibv_mr           *tx_mr;
+  struct ring_hello       hello;
+  struct ibv_mr           *hello_mr;
+
+  unsigned                unsignaled;
+  unsigned                inflight;
+
+  char                    *payload;
+  double                  *lat;
+  unsigned long           bad;
+};
+
+static const struct ringmsg defaults = {
+  .addr        = NULL,
+  .port        = "12347",
+  .size        = 32,
+  .iters       = 100000,
+  .ring_size   = 64 << 10,
+  .credit      = 0,
+  .depth       = 256,
+  .signal      = 16,
+  .inline_size = 64,
+  .check       = 0,
+  .verbose     = 0,
+};
+
+static const struct argconfig_commandline_options command_line_options[] = {
+    {"port",          "PORT", CFG_STRING, &defaults.port, required_argument,
+            "port to use"},
+    {"s",             "NUM", CFG_LONG_SUFFIX, &defaults.size, required_argument, NULL},
+    {"size",          "NUM", CFG_LONG_SUFFIX, &defaults.size, required_argument,
+            "client: message payload bytes"},
+    {"i",             "NUM", CFG_LONG_SUFFIX, &defaults.iters, required_argument, NULL},
+    {"iters",         "NUM", CFG_LONG_SUFFIX, &defaults.iters, required_argument,
+            "client: messages per test"},
+    {"r",             "NUM", CFG_LONG_SUFFIX, &defaults.ring_size, required_argument, NULL},
+    {"ring",          "NUM", CFG_LONG_SUFFIX, &defaults.ring_size, required_argument,
+            "receive ring bytes, a power of two"},
+    {"credit",        "NUM", CFG_LONG_SUFFIX, &defaults.credit, required_argument,
+            "bytes consumed before handing ring space back (default ring/4)"},
+    {"depth",         "NUM", CFG_POSITIVE, &defaults.depth, required_argument,
+            "send queue depth and receives posted for SEND/RECV"},
+    {"signal",        "NUM", CFG_POSITIVE, &defaults.signal, required_argument,
+            "signal one work request in NUM"},
+    {"inline",        "NUM", CFG_POSITIVE, &defaults.inline_size, required_argument,
+            "send writes and sends up to NUM bytes inline"},
+    {"check",         "", CFG_NONE, &defaults.check, no_argument,
+            "client: verify every payload on both sides"},
+    {"v",             "", CFG_NONE, &defaults.verbose, no_argument, NULL},
+    {"verbose",       "", CFG_NONE, &defaults.verbose, no_argument,
+            "be verbose"},
+    {0}
+};
+
+static int report(const char *func, int val)
+{
+  fprintf(stderr, "%s: %d = %s.\n", func, errno, strerror(errno));
+  return val;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t frame_size(size_t len)
+{
+  return sizeof(struct ring_hdr) + ((len + RING_ALIGN - 1) & ~(RING_ALIGN - 1)) +
+    sizeof(uint64_t);
+}
+
+/*
+ * Every work request goes through here. Only one in --signal is
+ * signaled, and its completion retires the ones before it, so the
+ * send queue is only drained when it is about to overflow.
+ */
+
+static int post_wr(struct ringmsg *cfg, enum ibv_wr_opcode opcode, void *buf,
+                   size_t len, struct ibv_mr *mr, uint64_t raddr, uint32_t rkey)
+{
+  struct ibv_sge sge = {
+    .addr   = (uintptr_t) buf,
+    .length = len,
+    .lkey   = mr->lkey,
+  };
+  struct ibv_send_wr wr = {
+    .sg_list = &sge,
+    .num_sge = 1,
+    .opcode  = opcode,
+  };
+  struct ibv_send_wr *bad_wr;
+  struct ibv_wc wc;
+  int n;
+
+  while (cfg->inflight + cfg->signal > cfg->depth) {
+    n = ibv_poll_cq(cfg->id->send_cq, 1, &wc);
+    if (n < 0 || (n && wc.status)) {
+      fprintf(stderr, "send completion failed status %d\n", n ? wc.status : n);
+      return -1;
+    }
+    if (n)
+      cfg->inflight -= cfg->signal;
+  }
+
+  if (len <= cfg->inline_size)
+    wr.send_flags |= IBV_SEND_INLINE;
+  if (++cfg->unsignaled == cfg->signal) {
+    wr.send_flags |= IBV_SEND_SIGNALED;
+    cfg->unsignaled = 0;
+  }
+  wr.wr.rdma.remote_addr = raddr;
+  wr.wr.rdma.rkey = rkey;
+
+  if (ibv_post_send(cfg->id->qp, &wr, &bad_wr))
+    return report("ibv_post_send", -1);
+  cfg->inflight++;
+  return 0;
+}
+
+/*
+ * Called from every spin on the peer. A remote disconnect does not
+ * move the QP to error and a ring never completes anything, so every
+ * 4096 spins the endpoint's non-blocking CM channel is checked for
+ * DISCONNECTED instead.
+ */
+
+static int peer_gone(struct ringmsg *cfg, unsigned *spins)
+{
+  struct rdma_cm_event *event;
+  int gone;
+
+  if (++*spins % 4096 || rdma_get_cm_event(cfg->id->channel, &event))
+    return 0;
+  gone = event->event == RDMA_CM_EVENT_DISCONNECTED;
+  rdma_ack_cm_event(event);
+  if (gone)
+    fprintf(stderr, "peer disconnected\n");
+  return gone;
+}
+
+static int ring_write(struct ringmsg *cfg, uint64_t off, size_t len)
+{
+  return post_wr(cfg, IBV_WR_RDMA_WRITE, cfg->mirror + off, len,
+                 cfg->mirror_mr, cfg->peer_ring_addr + off,
+                 cfg->peer_ring_rkey);
+}
+
+/*
+ * Frame len bytes of buf into the peer's ring, waiting for the
+ * receiver to hand back enough space first.
+ */
+
+static int ring_send(struct ringmsg *cfg, const void *buf, uint32_t len)
+{
+  uint64_t mask = cfg->peer_ring_size - 1;
+  uint64_t off = cfg->produced & mask;
+  size_t fsize = frame_size(len);
+  size_t need = fsize;
+  struct ring_hdr *hdr;
+  unsigned spins = 0;
+  uint64_t seq;
+
+  if (off + fsize > cfg->peer_ring_size)
+    need += cfg->peer_ring_size - off;
+
+  while (cfg->peer_ring_size - (cfg->produced - *cfg->credit_in) < need)
+    if (peer_gone(cfg, &spins))
+      return -1;
+
+  if (need != fsize) {
+    hdr = (void *) (cfg->mirror + off);
+    hdr->len = RING_WRAP;
+    hdr->seq = ++cfg->tx_seq;
+    if (ring_write(cfg, off, sizeof(*hdr)))
+      return -1;
+    cfg->produced += cfg->peer_ring_size - off;
+    off = 0;
+  }
+
+  seq = ++cfg->tx_seq;
+  hdr = (void *) (cfg->mirror + off);
+  hdr->len = len;
+  hdr->seq = seq;
+  memcpy(hdr + 1, buf, len);
+  *(uint64_t *) (cfg->mirror + off + fsize - sizeof(uint64_t)) = seq;
+
+  cfg->produced += fsize;
+  return ring_write(cfg, off, fsize);
+}
+
+/*
+ * Wait for the next frame in our ring and return its payload, or NULL
+ * if the peer goes away. It stays valid until ring_consume().
+ */
+
+static char *ring_recv(struct ringmsg *cfg, uint32_t *len)
+{
+  uint64_t mask = cfg->ring_size - 1;
+  volatile struct ring_hdr *hdr;
+  volatile uint64_t *trailer;
+  unsigned spins = 0;
+  uint64_t off;
+
+  while (1) {
+    off = cfg->consumed & mask;
+    hdr = (void *) (cfg->ring + off);
+    while (hdr->seq != (uint32_t) (cfg->rx_seq + 1))
+      if (peer_gone(cfg, &spins))
+        return NULL;
+    cfg->rx_seq++;
+
+    if (hdr->len != RING_WRAP)
+      break;
+    cfg->consumed += cfg->ring_size - off;
+  }
+
+  *len = hdr->len;
+  trailer = (void *) (cfg->ring + off + frame_size(*len) - sizeof(uint64_t));
+  while (*trailer != cfg->rx_seq)
+    if (peer_gone(cfg, &spins))
+      return NULL;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  return cfg->ring + off + sizeof(*hdr);
+}
+
+static int ring_consume(struct ringmsg *cfg, uint32_t len)
+{
+  cfg->consumed += frame_size(len);
+  if (cfg->consumed - cfg->credited < cfg->credit)
+    return 0;
+
+  /* Inline, so credit_out may change before the write completes */
+  cfg->credited = cfg->consumed;
+  *cfg->credit_out = cfg->consumed;
+  return post_wr(cfg, IBV_WR_RDMA_WRITE, cfg->credit_out, sizeof(uint64_t),
+                 cfg->credit_out_mr, cfg->peer_credit_addr,
+                 cfg->peer_credit_rkey);
+}
+
+static void check_payload(struct ringmsg *cfg, const char *buf, uint32_t len)
+{
+  if (!cfg->check)
+    return;
+
+  if (len != cfg->size || pattern_verify(buf, len, PATTERN_PRBS, 0) >= 0)
+    cfg->bad++;
+}
+
+static int ring_echo(struct ringmsg *cfg)
+{
+  uint32_t len;
+  char *buf = ring_recv(cfg, &len);
+
+  if (!buf)
+    return -1;
+  check_payload(cfg, buf, len);
+  if (ring_send(cfg, buf, len))
+    return -1;
+  return ring_consume(cfg, len);
+}
+
+static int ring_wait(struct ringmsg *cfg)
+{
+  uint32_t len;
+  char *buf = ring_recv(cfg, &len);
+
+  if (!buf)
+    return -1;
+  check_payload(cfg, buf, len);
+  return ring_consume(cfg, len);
+}
+
+static int post_recv(struct ringmsg *cfg, unsigned i)
+{
+  return rdma_post_recv(cfg->id, (void *) (uintptr_t) i,
+                        cfg->rx_bufs + i * cfg->size, cfg->size, cfg->rx_mr);
+}
+
+static char *sr_recv(struct ringmsg *cfg, unsigned *slot)
+{
+  struct ibv_wc wc;
+  unsigned spins = 0;
+  int n;
+
+  while (!(n = ibv_poll_cq(cfg->id->recv_cq, 1, &wc)))
+    if (peer_gone(cfg, &spins))
+      return NULL;
+  if (n < 0 || wc.status) {
+    fprintf(stderr, "recv completion failed status %d\n", n < 0 ? n : wc.status);
+    return NULL;
+  }
+
+  *slot = wc.wr_id;
+  check_payload(cfg, cfg->rx_bufs + *slot * cfg->size, wc.byte_len);
+  return cfg->rx_bufs + *slot * cfg->size;
+}
+
+static int sr_send(struct ringmsg *cfg, const void *buf)
+{
+  memcpy(cfg->tx_buf, buf, cfg->size);
+  return post_wr(cfg, IBV_WR_SEND, cfg->tx_buf, cfg->size, cfg->tx_mr, 0, 0);
+}
+
+static int sr_echo(struct ringmsg *cfg)
+{
+  unsigned slot;
+  char *buf = sr_recv(cfg, &slot);
+
+  if (!buf || sr_send(cfg, buf))
+    return -1;
+  return post_recv(cfg, slot);
+}
+
+static int sr_wait(struct ringmsg *cfg)
+{
+  unsigned slot;
+
+  if (!sr_recv(cfg, &slot))
+    return -1;
+  return post_recv(cfg, slot);
+}
+
+static void report_phase(struct ringmsg *cfg, const char *label, double elapsed,
+                         int latency)
+{
+  fprintf(stdout, "%s: %ld msgs of %ld bytes in %.3f s = %.0f msgs/s\n",
+          label, cfg->iters, cfg->size, elapsed, cfg->iters / elapsed);
+  if (!latency)
+    return;
+
+  fprintf(stdout, "%s round trip: ", label);
+  report_latency_elapsed(stdout, NULL, cfg->lat, cfg->iters);
+  fprintf(stdout, "\n%s percentiles: ", label);
+  report_percentiles_elapsed(stdout, cfg->lat, cfg->iters);
+  fprintf(stdout, "\n");
+}
+
+/*
+ * The four tests, run in lock step by both sides: ping-pong then a
+ * one-way stream ended by a single reply, over the rings and then over
+ * SEND/RECV.
+ */
+
+static int run_tests(struct ringmsg *cfg)
+{
+  int client = cfg->addr != NULL;
+  double start, t;
+
+  start = now();
+  for (long i=0; i<cfg->iters; i++) {
+    t = now();
+    if (client ? ring_send(cfg, cfg->payload, cfg->size) || ring_wait(cfg) :
+        ring_echo(cfg))
+      return RUN_PROBLEM;
+    if (client)
+      cfg->lat[i] = now() - t;
+  }
+  if (client)
+    report_phase(cfg, "ring ping-pong", now() - start, 1);
+
+  start = now();
+  for (long i=0; i<cfg->iters; i++)
+    if (client ? ring_send(cfg, cfg->payload, cfg->size) : ring_wait(cfg))
+      return RUN_PROBLEM;
+  if (client ? ring_wait(cfg) : ring_send(cfg, cfg->payload, cfg->size))
+    return RUN_PROBLEM;
+  if (client)
+    report_phase(cfg, "ring stream", now() - start, 0);
+
+  start = now();
+  for (long i=0; i<cfg->iters; i++) {
+    t = now();
+    if (client ? sr_send(cfg, cfg->payload) || sr_wait(cfg) : sr_echo(cfg))
+      return RUN_PROBLEM;
+    if (client)
+      cfg->lat[i] = now() - t;
+  }
+  if (client)
+    report_phase(cfg, "send/recv ping-pong", now() - start, 1);
+
+  start = now();
+  for (long i=0; i<cfg->iters; i++)
+    if (client ? sr_send(cfg, cfg->payload) : sr_wait(cfg))
+      return RUN_PROBLEM;
+  if (client ? sr_wait(cfg) : sr_send(cfg, cfg->payload))
+    return RUN_PROBLEM;
+  if (client)
+    report_phase(cfg, "send/recv stream", now() - start, 0);
+
+  if (cfg->bad)
+    fprintf(stderr, "%lu bad payloads\n", cfg->bad);
+  return cfg->bad ? RUN_PROBLEM : 0;
+}
+
+static int connect_ep(struct ringmsg *cfg)
+{
+  struct rdma_addrinfo hints, *res;
+  struct ibv_qp_init_attr attr;
+  int ret;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_port_space = RDMA_PS_TCP;
+  if (!cfg->addr)
+    hints.ai_flags = RAI_PASSIVE;
+  ret = rdma_getaddrinfo(cfg->addr, cfg->port, &hints, &res);
+  if (ret)
+    return report("rdma_getaddrinfo", SETUP_PROBLEM);
+
+  memset(&attr, 0, sizeof(attr));
+  attr.cap.max_send_wr = cfg->depth;
+  attr.cap.max_recv_wr = cfg->depth + 1;
+  attr.cap.max_send_sge = attr.cap.max_recv_sge = 1;
+  attr.cap.max_inline_data = cfg->inline_size;
+  attr.sq_sig_all = 0;
+
+  ret = rdma_create_ep(cfg->addr ? &cfg->id : &cfg->lid, res, NULL, &attr);
+  rdma_freeaddrinfo(res);
+  if (ret)
+    return report("rdma_create_ep", SETUP_PROBLEM);
+
+  if (!cfg->addr) {
+    if (rdma_listen(cfg->lid, 0))
+      return report("rdma_listen", SETUP_PROBLEM);
+    if (rdma_get_request(cfg->lid, &cfg->id))
+      return report("rdma_get_request", SETUP_PROBLEM);
+  }
+
+  return 0;
+}
+
+static int setup_buffers(struct ringmsg *cfg)
+{
+  struct ibv_pd *pd = cfg->id->pd;
+  int flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE;
+
+  cfg->ring = aligned_alloc(4096, cfg->ring_size);
+  cfg->credit_out = aligned_alloc(64, 64);
+  cfg->credit_in = aligned_alloc(64, 64);
+  cfg->hello_mr = rdma_reg_msgs(cfg->id, &cfg->hello, sizeof(cfg->hello));
+  if (!cfg->ring || !cfg->credit_out || !cfg->credit_in || !cfg->hello_mr)
+    return report("buffers", NO_BUFFER);
+  memset(cfg->ring, 0, cfg->ring_size);
+  *cfg->credit_in = 0;
+
+  cfg->ring_mr = ibv_reg_mr(pd, cfg->ring, cfg->ring_size, flags);
+  cfg->credit_in_mr = ibv_reg_mr(pd, (void *) cfg->credit_in, 64, flags);
+  cfg->credit_out_mr = rdma_reg_msgs(cfg->id, cfg->credit_out, 64);
+  if (!cfg->ring_mr || !cfg->credit_in_mr || !cfg->credit_out_mr)
+    return report("ibv_reg_mr", SETUP_PROBLEM);
+
+  return 0;
+}
+
+/*
+ * Swap ring details. The client also tells the server what to run, so
+ * only the client needs --size, --iters and --check.
+ */
+
+static int exchange_hello(struct ringmsg *cfg)
+{
+  struct ibv_wc wc;
+  struct ring_hello *h = &cfg->hello;
+  uint64_t ring_addr = (uintptr_t) cfg->ring;
+  uint64_t credit_addr = (uintptr_t) cfg->credit_in;
+  uint32_t ring_rkey = cfg->ring_mr->rkey, credit_rkey = cfg->credit_in_mr->rkey;
+  int client = cfg->addr != NULL;
+
+  if (rdma_post_recv(cfg->id, NULL, h, sizeof(*h), cfg->hello_mr))
+    return report("rdma_post_recv", SETUP_PROBLEM);
+
+  if (client ? rdma_connect(cfg->id, NULL) : rdma_accept(cfg->id, NULL))
+    return report(client ? "rdma_connect" : "rdma_accept", SETUP_PROBLEM);
+
+  if (!client && (rdma_get_recv_comp(cfg->id, &wc) <= 0 || wc.status))
+    return report("hello", SETUP_PROBLEM);
+  if (!client) {
+    cfg->size = be32toh(h->size);
+    cfg->iters = be64toh(h->iters);
+    cfg->check = be32toh(h->check);
+    cfg->peer_ring_addr = be64toh(h->ring_addr);
+    cfg->peer_ring_rkey = be32toh(h->ring_rkey);
+    cfg->peer_ring_size = be32toh(h->ring_size);
+    cfg->peer_credit_addr = be64toh(h->credit_addr);
+    cfg->peer_credit_rkey = be32toh(h->credit_rkey);
+  }
+
+  h->ring_addr = htobe64(ring_addr);
+  h->ring_rkey = htobe32(ring_rkey);
+  h->ring_size = htobe32(cfg->ring_size);
+  h->credit_addr = htobe64(credit_addr);
+  h->credit_rkey = htobe32(credit_rkey);
+  h->size = htobe32(cfg->size);
+  h->iters = htobe64(cfg->iters);
+  h->check = htobe32(cfg->check);
+
+  /* Signaled, so the hello is out before it gets overwritten */
+  if (rdma_post_send(cfg->id, NULL, h, sizeof(*h), cfg->hello_mr,
+                     IBV_SEND_SIGNALED) ||
+      rdma_get_send_comp(cfg->id, &wc) <= 0 || wc.status)
+    return report("hello", SETUP_PROBLEM);
+
+  if (client) {
+    if (rdma_get_recv_comp(cfg->id, &wc) <= 0 || wc.status)
+      return report("hello", SETUP_PROBLEM);
+    cfg->peer_ring_addr = be64toh(h->ring_addr);
+    cfg->peer_ring_rkey = be32toh(h->ring_rkey);
+    cfg->peer_ring_size = be32toh(h->ring_size);
+    cfg->peer_credit_addr = be64toh(h->credit_addr);
+    cfg->peer_credit_rkey = be32toh(h->credit_rkey);
+  }
+
+  /* Done with the sync CM calls, see peer_gone() */
+  fcntl(cfg->id->channel->fd, F_SETFL,
+        fcntl(cfg->id->channel->fd, F_GETFL) | O_NONBLOCK);
+
+  /*
+   * A frame plus the wrap in front of it must fit in the space the
+   * receiver is sure to have handed back, ring - credit >= ring / 2.
+   */
+  if (4 * frame_size(cfg->size) > cfg->peer_ring_size) {
+    errno = EMSGSIZE;
+    return report("message too big for the peer's ring", SETUP_PROBLEM);
+  }
+
+  if (cfg->verbose)
+    fprintf(stdout, "Connected: %ld byte messages, peer ring %" PRIu64
+            " bytes, credit every %ld bytes.\n", cfg->size,
+            cfg->peer_ring_size, cfg->credit);
+  return 0;
+}
+
+static int setup_messages(struct ringmsg *cfg)
+{
+  cfg->mirror = aligned_alloc(4096, cfg->peer_ring_size);
+  cfg->rx_bufs = malloc(cfg->depth * cfg->size);
+  cfg->tx_buf = malloc(cfg->size);
+  cfg->payload = malloc(cfg->size);
+  cfg->lat = malloc(cfg->iters * sizeof(*cfg->lat));
+  if (!cfg->mirror || !cfg->rx_bufs || !cfg->tx_buf || !cfg->payload ||
+      !cfg->lat)
+    return report("malloc", NO_BUFFER);
+  pattern_fill(cfg->payload, cfg->size, PATTERN_PRBS, 0);
+
+  cfg->mirror_mr = rdma_reg_msgs(cfg->id, cfg->mirror, cfg->peer_ring_size);
+  cfg->rx_mr = rdma_reg_msgs(cfg->id, cfg->rx_bufs, cfg->depth * cfg->size);
+  cfg->tx_mr = rdma_reg_msgs(cfg->id, cfg->tx_buf, cfg->size);
+  if (!cfg->mirror_mr || !cfg->rx_mr || !cfg->tx_mr)
+    return report("rdma_reg_msgs", SETUP_PROBLEM);
+
+  /* RDMA WRITEs do not consume receives, these wait for SEND/RECV */
+  for (unsigned i=0; i<cfg->depth; i++)
+    if (post_recv(cfg, i))
+      return report("rdma_post_recv", SETUP_PROBLEM);
+
+  return 0;
+}
+
+static void cleanup(struct ringmsg *cfg)
+{
+  struct ibv_mr *mrs[] = {cfg->ring_mr, cfg->credit_in_mr, cfg->credit_out_mr,
+                          cfg->hello_mr, cfg->mirror_mr, cfg->rx_mr,
+                          cfg->tx_mr};
+
+  if (cfg->id)
+    rdma_disconnect(cfg->id);
+  for (unsigned i=0; i<sizeof(mrs)/sizeof(mrs[0]); i++)
+    if (mrs[i])
+      rdma_dereg_mr(mrs[i]);
+  if (cfg->id)
+    rdma_destroy_ep(cfg->id);
+  if (cfg->lid)
+    rdma_destroy_ep(cfg->lid);
+
+  free(cfg->ring);
+  free(cfg->credit_out);
+  free((void *) cfg->credit_in);
+  free(cfg->mirror);
+  free(cfg->rx_bufs);
+  free(cfg->tx_buf);
+  free(cfg->payload);
+  free(cfg->lat);
+}
+
+int main(int argc, char *argv[])
+{
+  struct ringmsg cfg;
+  int ret;
+
+  argconfig_append_usage("[SERVER_NAME]");
+  int args = argconfig_parse(argc, argv, program_desc, command_line_options,
+                             &defaults, &cfg, sizeof(cfg));
+  if (args > 1) {
+    argconfig_print_help(argv[0], program_desc, command_line_options);
+    return BAD_ARGS;
+  }
+  if (args == 1)
+    cfg.addr = argv[1];
+
+  if (cfg.size <= 0 || cfg.size > UINT32_MAX - 1 || cfg.iters <= 0 ||
+      cfg.ring_size < 64 || cfg.ring_size > UINT32_MAX ||
+      (cfg.ring_size & (cfg.ring_size - 1)) || 2 * cfg.signal > cfg.depth)
+    return report("bad arguments", BAD_ARGS);
+  if (!cfg.credit || cfg.credit > cfg.ring_size / 2)
+    cfg.credit = cfg.ring_size / 4;
+
+  ret = connect_ep(&cfg);
+  if (!ret)
+    ret = setup_buffers(&cfg);
+  if (!ret)
+    ret = exchange_hello(&cfg);
+  if (!ret)
+    ret = setup_messages(&cfg);
+  if (!ret)
+    ret = run_tests(&cfg);
+
+  cleanup(&cfg);
+  return ret;
+}
@@ -44,10 +44,19 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #include <rdma/rdma_cma.h>
 #include <infiniband/arch.h>
 
+#include "../argconfig/report.h"
+#include "../argconfig/suffix.h"
+#include "../checksum/crc32c.h"
+#include "../pattern/pattern.h"
+
 static int debug = 0;
 #define DEBUG_LOG if (debug) printf
 
@@ -62,6 +71,89 @@ static int debug = 0;
  * 	server rdma writes "pong" data to sink
  * 	server sends "go ahead" on rdma write completion
  * 	<repeat loop>
+ *
+ * With -Q depth the client keeps up to depth pings in flight, each in
+ * its own buffer slot. Advertisements and go-aheads are sent with
+ * immediate data holding the slot index and whether the message is
+ * about the source or the sink, so both sides can match them to
+ * slots. The server must be started with at least the client's depth.
+ *
+ * With -k chunk the server splits each RDMA READ and WRITE into chunk
+ * sized work requests posted as one chained list with only the last
+ * one signaled. If the chain does not fit in the send queue it is
+ * posted in batches, waiting for each batch to complete.
+ *
+ * With -P -w workers the persistent server runs a fixed pool of worker
+ * threads instead of two threads per connection. Each worker owns one
+ * CQ shared by the connections assigned to it, finds the connection
+ * for a completion by QP number and advances its lock-step state
+ * machine from there. New connections go to the least loaded worker.
+ *
+ * With -P -B persistent server connections share one PD per device and
+ * take their control block and RDMA buffer from slabs of memory that
+ * is registered ahead of time, so accepting a connection does not
+ * register memory unless a slab has to grow.
+ *
+ * With -I the client ends every ping with a CRC32C trailer, one
+ * checksum per -b sized block of the payload. The server checks it
+ * after the RDMA READ and the client checks it again on the echoed
+ * data, so neither side needs the other's copy. Both sides need the
+ * same -b.
+ *
+ * With -T pattern the client fills pings with one of the shared test
+ * patterns seeded by the ping number instead of the ASCII text, and -V
+ * checks the echo against the pattern itself and reports the first bad
+ * byte. Give the server the same -T so -v prints hex rather than text.
+ *
+ * With -A fadd or -A cas both sides run an atomics benchmark instead
+ * of pings. The server advertises an array of -n 8 byte targets and
+ * the client opens -j connections, each keeping -Q fetch-and-adds or
+ * compare-and-swaps in flight against randomly picked targets. Every
+ * op that succeeds adds one to a target, so when a client reports how
+ * many it did the server can check the targets add up. -C is the
+ * number of ops per connection, 100000 by default.
+ *
+ * With -L the lock-step client and server time each phase of every
+ * ping into histograms. At the end of a counted run the client sends
+ * one more advertisement with RPING_STATS_REQ set in the length; the
+ * server RDMA WRITEs its histograms into it and sends a go-ahead, so
+ * the client can print both sides in one breakdown table. The
+ * client's round trip less the server's time is what the messaging
+ * between them cost.
+ *
+ * With -R count the client does not ping at all. It opens count
+ * connections to a -P server, -j at a time, and disconnects each one as
+ * soon as it is established, timing every rdma_cm step on the way.
+ *
+ * With -D the lock-step client puts the source advertisement for its
+ * first ping in the rdma_connect() private data, so the server can
+ * start the first RDMA READ as soon as the connection is up instead of
+ * waiting for a SEND. A server that understands it says so in the
+ * rdma_accept() private data, along with the largest ping it takes;
+ * otherwise the client falls back to sending the advertisement. Both
+ * sides report the time to first byte with or without -D.
+ *
+ * With -i the lock-step client sets RPING_WRITE_IMM in its sink
+ * advertisements and the server echoes with RDMA WRITE WITH IMM,
+ * carrying the ping's sequence number, instead of an RDMA WRITE
+ * followed by a go-ahead SEND. The client learns the echo has landed
+ * from the receive completion. Both sides report messages and
+ * completions per ping.
+ *
+ * With -j conns and no -A or -R the client is a load generator. It
+ * opens conns lock-step connections and drives them from -w threads,
+ * one per core by default, each busy-polling its share of the
+ * connections. Connection i starts pinging -g usec after connection
+ * i - 1, and each runs -C pings, 10000 by default. The report merges
+ * all the samples and adds per-connection rates with Jain's fairness
+ * index; -v lists every connection.
+ */
+
+/*
+ * By default the client and server threads poll their own CQ and run
+ * the completion handler inline ("run to completion"). With -e a
+ * separate cq_thread sleeps on the completion channel instead and
+ * hands every state change to the main thread through cb->sem.
  */
 
 /*
@@ -91,9 +183,22 @@ struct rping_rdma_info {
 };
 
 /*
- * Default max buffer size for IO...
+ * rdma_cm private data for -D. The magic tells it apart from the zero
+ * padding IB adds to short private data.
  */
-#define RPING_BUFSIZE 64*1024
+#define RPING_CM_MAGIC		0x52504e47	/* "RPNG" */
+
+struct rping_cm_data {
+	uint32_t magic;
+	uint32_t reserved;
+	struct rping_rdma_info adv;
+};
+
+/*
+ * Max buffer size for IO. The server moves pings larger than -k in
+ * several chained RDMA work requests.
+ */
+#define RPING_BUFSIZE (1 << 30)
 #define RPING_SQ_DEPTH 16
 
 /* Default string for print data and
@@ -103,8 +208,157 @@ struct rping_rdma_info {
 #define stringify( _x ) _stringify( _x )
 
 #define RPING_MSG_FMT           "rdma-ping-%d: "
+
+#define RPING_IMM_SINK		1
+#define RPING_STATS_REQ		0x80000000	/* in rping_rdma_info.size */
+#define RPING_WRITE_IMM		0x40000000	/* sink adv, echo WITH_IMM */
 #define RPING_MIN_BUFSIZE       sizeof(stringify(INT_MAX)) + sizeof(RPING_MSG_FMT)
 
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+/*
+ * One in-flight ping in pipelined mode. Every work request posted for
+ * a slot carries the slot pointer in wr_id. The slot array itself is
+ * registered so send_buf and recv_buf can be used directly.
+ */
+struct rping_slot {
+	int index;
+	int ping;
+	struct timeval start;
+
+	struct ibv_recv_wr rq_wr;
+	struct ibv_sge recv_sgl;
+	struct rping_rdma_info recv_buf;
+
+	struct ibv_send_wr sq_wr;
+	struct ibv_sge send_sgl;
+	struct rping_rdma_info send_buf;
+
+	struct ibv_send_wr rdma_sq_wr;
+	struct ibv_sge rdma_sgl;
+	char *rdma_buf;			/* client sink, server staging */
+	char *start_buf;		/* client source */
+
+	uint32_t remote_rkey;
+	uint64_t remote_addr;
+	uint32_t remote_len;
+	uint32_t len;			/* bytes read for this ping */
+	struct timeval write_start;
+};
+
+/*
+ * Per-ping timestamps, grown on demand since the server does not know
+ * how many pings the client will send.
+ */
+struct rping_samples {
+	struct timeval *start;
+	struct timeval *end;
+	int count;
+	int alloced;
+};
+
+/*
+ * Log-linear latency histogram in nanoseconds, 8 buckets per power of
+ * two. Fixed size so the server can send its histograms to the client.
+ */
+#define RPING_HIST_SUB		8
+#define RPING_HIST_BUCKETS	(RPING_HIST_SUB * 62)
+
+struct rping_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint32_t bucket[RPING_HIST_BUCKETS];
+};
+
+/*
+ * Phases of a lock-step ping, as seen from each side (-L).
+ */
+enum rping_phase {
+	PH_CLIENT_READ,			/* source adv sent to go-ahead */
+	PH_CLIENT_TURN,			/* go-ahead to sink adv sent */
+	PH_CLIENT_WRITE,		/* sink adv sent to final go-ahead */
+	PH_CLIENT_PING,
+	PH_SERVER_READ,			/* source adv to RDMA READ done */
+	PH_SERVER_READ_ACK,		/* READ done to go-ahead posted */
+	PH_SERVER_SINK,			/* go-ahead to sink adv */
+	PH_SERVER_WRITE,		/* sink adv to RDMA WRITE done */
+	PH_SERVER_WRITE_ACK,		/* WRITE done to final go-ahead */
+	PH_SERVER_PING,
+	RPING_PHASES
+};
+
+#define RPING_SERVER_PHASES	(RPING_PHASES - PH_SERVER_READ)
+
+struct rping_cb;
+
+/*
+ * Fixed size objects carved out of registered chunks. Each object is
+ * preceded by a header pointing at its chunk's MR.
+ */
+struct rping_chunk {
+	struct rping_chunk *next;
+	struct ibv_mr *mr;
+	char *mem;
+};
+
+struct rping_obj {
+	struct ibv_mr *mr;
+	struct rping_obj *next;		/* while on the free list */
+};
+
+#define RPING_OBJ_HDR	64		/* keeps objects cache line aligned */
+#define RPING_POOL_INIT	64		/* objects in the first chunk */
+
+struct rping_pool {
+	pthread_mutex_t lock;
+	struct ibv_pd *pd;
+	int access;
+	size_t obj_size;
+	int grow;			/* objects in the next chunk */
+	struct rping_chunk *chunks;
+	struct rping_obj *free;
+};
+
+/*
+ * Per-device state shared by pooled (-B) connections.
+ */
+struct rping_device {
+	struct rping_device *next;
+	struct ibv_context *verbs;
+	struct ibv_pd *pd;
+	struct rping_pool cbs;		/* control blocks, incl. send/recv bufs */
+	struct rping_pool bufs;		/* rdma_buf */
+};
+
+/*
+ * Persistent server worker (-w).
+ */
+struct rping_worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct ibv_comp_channel *channel;
+	struct ibv_cq *cq;
+	int cqe;
+	int use_events;
+	int running;			/* thread created */
+
+	struct rping_cb **conns;	/* sorted by qp_num */
+	int nconns;
+	int alloced;
+
+	unsigned long served;
+	unsigned long pings;
+	unsigned long completions;
+};
+
 /*
  * Control block struct.
  */
@@ -141,6 +395,72 @@ struct rping_cb {
 
 	enum test_state state;		/* used for cond/signalling */
 	sem_t sem;
+	int use_events;			/* cq_thread instead of polling */
+	int pending;			/* unconsumed events when polling */
+
+	struct rping_samples pings;	/* per-ping latency */
+	struct rping_samples reads;	/* server RDMA READ/WRITE times */
+	struct rping_samples writes;
+
+	uint64_t msgs;			/* WRs posted and SENDs received */
+	uint64_t cqes;
+	int write_imm;			/* -i, or the sink adv asked for it */
+	uint32_t imm_seq;		/* sequence number of the next echo */
+
+	int chunk;			/* bytes per RDMA WR, 0 for one WR */
+	int sq_depth;
+	int max_chain;			/* RDMA WRs per ibv_post_send */
+	struct ibv_send_wr *chain;
+	struct ibv_sge *chain_sgl;
+
+	int workers;			/* persistent server pool size */
+	struct rping_worker *worker;	/* set on connections in the pool */
+	uint32_t rdma_offset;		/* progress of the current READ/WRITE */
+	uint32_t rdma_len;
+
+	int integrity;			/* -I */
+	int block;			/* bytes per checksum, 0 for one */
+	int payload;			/* size less the checksum trailer */
+	int pattern;			/* -T, -1 for the ASCII text */
+	double csum_time;
+	uint64_t csum_bytes;
+
+	int persistent;
+	int pooled;			/* -B */
+	struct rping_device *dev;	/* set on connections using the pool */
+	struct ibv_mr *cb_mr;		/* registration covering this cb */
+	struct timeval connect_time;	/* CONNECT_REQUEST arrival */
+
+	int phases;			/* -L */
+	struct rping_hist *phase;	/* RPING_PHASES histograms */
+
+	int atomic;			/* -A */
+	enum ibv_wr_opcode atomic_op;
+	int atomic_depth;		/* atomics in flight per connection */
+	int targets;
+	int conns;			/* client connections, -A and -R too */
+	int conn_index;
+	int gap;			/* usec between load connection starts */
+	uint64_t load_at;		/* when this load connection starts */
+	int load_started;
+	int load_done;
+	struct timeval load_start;	/* of the ping in flight */
+	struct rping_hist *load_hist;
+	int storm;			/* -R connections to open */
+	struct ibv_mr *atomic_mr;
+	uint64_t atomic_ok;		/* ops that added one to a target */
+	int thread_ret;
+
+	int depth;			/* pings in flight */
+	struct rping_slot *slots;
+	struct ibv_mr *slots_mr;
+	uint8_t peer_responder;		/* from the connect request */
+	uint8_t peer_initiator;
+	int cm_adv;			/* -D */
+	int cm_fallback;		/* the server did not take it */
+	int peer_adv_valid;		/* peer_adv came with the connection */
+	struct rping_rdma_info peer_adv;
+	uint64_t connect_start;
 
 	struct sockaddr_storage sin;
 	uint16_t port;			/* dst port in NBO */
@@ -157,6 +477,440 @@ struct rping_cb {
 	struct rdma_cm_id *child_cm_id;	/* connection on server side */
 };
 
+/*
+ * Hand a CQ driven state change to whoever is waiting for it. The CM
+ * thread always uses cb->sem directly.
+ */
+static void rping_signal(struct rping_cb *cb)
+{
+	if (cb->use_events)
+		sem_post(&cb->sem);
+	else
+		cb->pending++;
+}
+
+static int rping_cq_event_handler(struct rping_cb *cb);
+
+/*
+ * Wait for the next state change on the data path. When polling, this
+ * thread drives the CQ itself until the completion handler reports
+ * one.
+ */
+static int rping_wait_event(struct rping_cb *cb)
+{
+	if (cb->use_events)
+		return sem_wait(&cb->sem);
+
+	while (!cb->pending) {
+		if (rping_cq_event_handler(cb))
+			break;
+	}
+	if (cb->pending)
+		cb->pending--;
+
+	return 0;
+}
+
+static int rping_add_sample(struct rping_samples *s, struct timeval *start,
+			    struct timeval *end)
+{
+	if (s->count == s->alloced) {
+		int alloced = s->alloced ? s->alloced * 2 : 1024;
+		struct timeval *st, *en;
+
+		st = realloc(s->start, alloced * sizeof(*st));
+		if (!st)
+			return -ENOMEM;
+		s->start = st;
+		en = realloc(s->end, alloced * sizeof(*en));
+		if (!en)
+			return -ENOMEM;
+		s->end = en;
+		s->alloced = alloced;
+	}
+
+	s->start[s->count] = *start;
+	s->end[s->count] = *end;
+	s->count++;
+	return 0;
+}
+
+static void rping_report_samples(const char *label, struct rping_samples *s,
+				 size_t bytes)
+{
+	struct timeval *first = &s->start[0];
+	int i;
+
+	if (!s->count)
+		return;
+
+	/* Pipelined pings do not necessarily complete in order */
+	for (i = 1; i < s->count; i++)
+		if (timercmp(&s->start[i], first, <))
+			first = &s->start[i];
+
+	printf("%s: ", label);
+	report_transfer_rate(stdout, first, &s->end[s->count - 1],
+			     bytes * s->count);
+	printf("\n%s latency: ", label);
+	report_latency_pairs(stdout, NULL, s->start, s->end, s->count);
+	printf("\n%s percentiles: ", label);
+	report_percentiles(stdout, s->start, s->end, s->count);
+	printf("\n");
+}
+
+/*
+ * Bandwidth while the RDMA operations were in flight, leaving out the
+ * messaging in between that rping_report_samples() includes.
+ */
+static void rping_report_rdma(const char *label, struct rping_samples *s,
+			      size_t bytes)
+{
+	double busy = 0;
+	int i;
+
+	if (!s->count)
+		return;
+
+	for (i = 0; i < s->count; i++)
+		busy += (s->end[i].tv_sec - s->start[i].tv_sec) +
+			(s->end[i].tv_usec - s->start[i].tv_usec) / 1e6;
+
+	printf("%s: ", label);
+	report_transfer_rate_elapsed(stdout, busy, bytes * s->count);
+	printf("\n%s latency: ", label);
+	report_latency_pairs(stdout, NULL, s->start, s->end, s->count);
+	printf("\n");
+}
+
+static void rping_free_samples(struct rping_samples *s)
+{
+	free(s->start);
+	free(s->end);
+	memset(s, 0, sizeof(*s));
+}
+
+static double rping_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t rping_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int rping_hist_index(uint64_t ns)
+{
+	int e;
+
+	if (ns < RPING_HIST_SUB)
+		return ns;
+	e = 63 - __builtin_clzll(ns);
+	return RPING_HIST_SUB * (e - 2) + ((ns >> (e - 3)) & 7);
+}
+
+/* Middle of a bucket, in nanoseconds */
+static double rping_hist_value(int i)
+{
+	int e = i / RPING_HIST_SUB + 2;
+
+	if (i < RPING_HIST_SUB)
+		return i;
+	return ((RPING_HIST_SUB + i % RPING_HIST_SUB) + 0.5) *
+	       (1ull << (e - 3));
+}
+
+static void rping_hist_add(struct rping_hist *h, uint64_t ns)
+{
+	if (!h->count || ns < h->min)
+		h->min = ns;
+	if (ns > h->max)
+		h->max = ns;
+	h->count++;
+	h->sum += ns;
+	h->bucket[rping_hist_index(ns)]++;
+}
+
+static double rping_hist_pct(struct rping_hist *h, double pct)
+{
+	uint64_t want = pct * h->count, seen = 0;
+	double v;
+	int i;
+
+	for (i = 0; i < RPING_HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen > want)
+			break;
+	}
+	v = rping_hist_value(MIN(i, RPING_HIST_BUCKETS - 1));
+	return MAX(MIN(v, h->max), h->min);
+}
+
+static void rping_hist_swap(struct rping_hist *h, int n, int to_net)
+{
+	int i, j;
+
+	for (i = 0; i < n; i++, h++) {
+		if (to_net) {
+			h->count = htonll(h->count);
+			h->sum = htonll(h->sum);
+			h->min = htonll(h->min);
+			h->max = htonll(h->max);
+		} else {
+			h->count = ntohll(h->count);
+			h->sum = ntohll(h->sum);
+			h->min = ntohll(h->min);
+			h->max = ntohll(h->max);
+		}
+		for (j = 0; j < RPING_HIST_BUCKETS; j++)
+			h->bucket[j] = to_net ? htonl(h->bucket[j]) :
+						ntohl(h->bucket[j]);
+	}
+}
+
+static void rping_phase_add(struct rping_cb *cb, enum rping_phase ph,
+			    uint64_t from, uint64_t to)
+{
+	if (cb->phase)
+		rping_hist_add(&cb->phase[ph], to - from);
+}
+
+static const char *rping_phase_names[RPING_PHASES] = {
+	[PH_CLIENT_READ]	= "client src adv..go-ahead",
+	[PH_CLIENT_TURN]	= "client go-ahead..sink adv",
+	[PH_CLIENT_WRITE]	= "client sink adv..go-ahead",
+	[PH_CLIENT_PING]	= "client ping",
+	[PH_SERVER_READ]	= "server rdma read",
+	[PH_SERVER_READ_ACK]	= "server read..go-ahead",
+	[PH_SERVER_SINK]	= "server go-ahead..sink adv",
+	[PH_SERVER_WRITE]	= "server rdma write",
+	[PH_SERVER_WRITE_ACK]	= "server write..go-ahead",
+	[PH_SERVER_PING]	= "server ping",
+};
+
+static double rping_phase_mean(struct rping_cb *cb, enum rping_phase ph)
+{
+	struct rping_hist *h = &cb->phase[ph];
+
+	return h->count ? (double) h->sum / h->count : 0;
+}
+
+static void rping_print_hist_header(const char *what, const char *of)
+{
+	printf("%-28s %9s %9s %9s %9s %9s %7s\n", what, "count", "mean",
+	       "p50", "p99", "max", of);
+}
+
+/* One table row in usec, with the mean as a share of total */
+static void rping_print_hist(const char *name, struct rping_hist *h,
+			     double total)
+{
+	double mean;
+
+	if (!h->count)
+		return;
+
+	mean = (double) h->sum / h->count;
+	printf("%-28s %9" PRIu64 " %9.2f %9.2f %9.2f %9.2f %6.1f%%\n",
+	       name, h->count, mean / 1e3, rping_hist_pct(h, 0.5) / 1e3,
+	       rping_hist_pct(h, 0.99) / 1e3, h->max / 1e3,
+	       total ? 100 * mean / total : 0);
+}
+
+/*
+ * Breakdown table of phases [first, last). The messaging rows are the
+ * client's halves less what the server spent on them, from the means.
+ */
+static void rping_report_phases(struct rping_cb *cb, int first, int last)
+{
+	double ping, msg;
+	int ph;
+
+	ping = rping_phase_mean(cb, first == PH_CLIENT_READ ?
+				PH_CLIENT_PING : PH_SERVER_PING);
+	if (!ping)
+		return;
+
+	rping_print_hist_header("phase (usec)", "of ping");
+	for (ph = first; ph < last; ph++)
+		rping_print_hist(rping_phase_names[ph], &cb->phase[ph], ping);
+
+	if (first != PH_CLIENT_READ || !cb->phase[PH_SERVER_PING].count)
+		return;
+
+	msg = rping_phase_mean(cb, PH_CLIENT_READ) -
+	      rping_phase_mean(cb, PH_SERVER_READ) -
+	      rping_phase_mean(cb, PH_SERVER_READ_ACK);
+	printf("%-28s %9s %9.2f %9s %9s %9s %6.1f%%\n",
+	       "src adv + go-ahead msgs", "", msg / 1e3, "", "", "",
+	       100 * msg / ping);
+	msg = rping_phase_mean(cb, PH_CLIENT_WRITE) -
+	      rping_phase_mean(cb, PH_SERVER_WRITE) -
+	      rping_phase_mean(cb, PH_SERVER_WRITE_ACK);
+	printf("%-28s %9s %9.2f %9s %9s %9s %6.1f%%\n",
+	       "sink adv + go-ahead msgs", "", msg / 1e3, "", "", "",
+	       100 * msg / ping);
+}
+
+static void rping_seal(struct rping_cb *cb, char *buf, size_t len)
+{
+	double start = rping_now();
+
+	crc32c_seal(buf, len, cb->block);
+	cb->csum_time += rping_now() - start;
+	cb->csum_bytes += len;
+}
+
+static int rping_check(struct rping_cb *cb, const char *buf, size_t len)
+{
+	double start = rping_now();
+	long bad;
+
+	bad = crc32c_check(buf, len, cb->block);
+	cb->csum_time += rping_now() - start;
+	cb->csum_bytes += len;
+
+	if (bad >= 0) {
+		fprintf(stderr, "checksum mismatch in block %ld (bytes %ld+)\n",
+			bad, bad * (long) cb->block);
+		return -1;
+	}
+	return 0;
+}
+
+static void rping_print_data(struct rping_cb *cb, const char *label,
+			     const char *buf)
+{
+	int i;
+
+	if (cb->pattern < 0) {
+		printf("%s: %s\n", label, buf);
+		return;
+	}
+
+	printf("%s:", label);
+	for (i = 0; i < 16 && i < cb->payload; i++)
+		printf(" %02x", (unsigned char) buf[i]);
+	printf(" ...\n");
+}
+
+static void rping_report_integrity(struct rping_cb *cb, const char *label)
+{
+	if (!cb->integrity || !cb->csum_bytes)
+		return;
+
+	printf("%s integrity (crc32c %s, ", label, crc32c_impl());
+	if (cb->block)
+		printf("%d byte blocks): ", cb->block);
+	else
+		printf("whole ping): ");
+	report_transfer_rate_elapsed(stdout, cb->csum_time, cb->csum_bytes);
+	printf(", %.3f sec\n", cb->csum_time);
+	cb->csum_time = 0;
+	cb->csum_bytes = 0;
+}
+
+static int rping_parse_cm_data(struct rdma_conn_param *param,
+			       struct rping_rdma_info *adv)
+{
+	const struct rping_cm_data *data = param->private_data;
+
+	if (!data || param->private_data_len < sizeof *data ||
+	    ntohl(data->magic) != RPING_CM_MAGIC)
+		return 0;
+	*adv = data->adv;
+	return 1;
+}
+
+static void rping_take_cm_data(struct rping_cb *cb,
+			       struct rdma_conn_param *param)
+{
+	cb->peer_adv_valid = rping_parse_cm_data(param, &cb->peer_adv);
+}
+
+/*
+ * Connect requests for a persistent server, queued by the CM thread
+ * and taken one per sem_post by the accept loop. With a listen backlog
+ * several can arrive while the loop is still setting up the last one.
+ */
+struct rping_conn_req {
+	struct rdma_cm_id *cm_id;
+	struct timeval connect_time;
+	uint8_t peer_responder;
+	uint8_t peer_initiator;
+	int peer_adv_valid;
+	struct rping_rdma_info peer_adv;
+	struct rping_conn_req *next;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct rping_conn_req *head;
+	struct rping_conn_req **tail;
+} rping_conn_reqs = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.tail = &rping_conn_reqs.head,
+};
+
+static int rping_queue_conn_req(struct rdma_cm_id *cma_id,
+				struct rdma_cm_event *event)
+{
+	struct rping_conn_req *req;
+
+	req = calloc(1, sizeof *req);
+	if (!req)
+		return -ENOMEM;
+
+	req->cm_id = cma_id;
+	gettimeofday(&req->connect_time, NULL);
+	req->peer_responder = event->param.conn.responder_resources;
+	req->peer_initiator = event->param.conn.initiator_depth;
+	req->peer_adv_valid = rping_parse_cm_data(&event->param.conn,
+						  &req->peer_adv);
+
+	pthread_mutex_lock(&rping_conn_reqs.lock);
+	*rping_conn_reqs.tail = req;
+	rping_conn_reqs.tail = &req->next;
+	pthread_mutex_unlock(&rping_conn_reqs.lock);
+	return 0;
+}
+
+/*
+ * Move the oldest queued request into the listening cb, where
+ * clone_cb() picks it up. Only the accept loop writes these fields.
+ */
+static int rping_next_conn_req(struct rping_cb *listening_cb)
+{
+	struct rping_conn_req *req;
+
+	pthread_mutex_lock(&rping_conn_reqs.lock);
+	req = rping_conn_reqs.head;
+	if (req) {
+		rping_conn_reqs.head = req->next;
+		if (!rping_conn_reqs.head)
+			rping_conn_reqs.tail = &rping_conn_reqs.head;
+	}
+	pthread_mutex_unlock(&rping_conn_reqs.lock);
+	if (!req)
+		return -1;
+
+	listening_cb->child_cm_id = req->cm_id;
+	listening_cb->connect_time = req->connect_time;
+	listening_cb->peer_responder = req->peer_responder;
+	listening_cb->peer_initiator = req->peer_initiator;
+	listening_cb->peer_adv_valid = req->peer_adv_valid;
+	listening_cb->peer_adv = req->peer_adv;
+	free(req);
+	return 0;
+}
+
 static int rping_cma_event_handler(struct rdma_cm_id *cma_id,
 				    struct rdma_cm_event *event)
 {
@@ -184,8 +938,23 @@ static int rping_cma_event_handler(struct rdma_cm_id *cma_id,
 		break;
 
 	case RDMA_CM_EVENT_CONNECT_REQUEST:
+		if (cb->persistent) {
+			if (rping_queue_conn_req(cma_id, event)) {
+				fprintf(stderr, "no memory for connect "
+					"request, rejecting\n");
+				rdma_reject(cma_id, NULL, 0);
+				break;
+			}
+			cb->state = CONNECT_REQUEST;
+			sem_post(&cb->sem);
+			break;
+		}
 		cb->state = CONNECT_REQUEST;
+		gettimeofday(&cb->connect_time, NULL);
 		cb->child_cm_id = cma_id;
+		cb->peer_responder = event->param.conn.responder_resources;
+		cb->peer_initiator = event->param.conn.initiator_depth;
+		rping_take_cm_data(cb, &event->param.conn);
 		DEBUG_LOG("child cma %p\n", cb->child_cm_id);
 		sem_post(&cb->sem);
 		break;
@@ -197,6 +966,7 @@ static int rping_cma_event_handler(struct rdma_cm_id *cma_id,
 		 * Server will wake up when first RECV completes.
 		 */
 		if (!cb->server) {
+			rping_take_cm_data(cb, &event->param.conn);
 			cb->state = CONNECTED;
 		}
 		sem_post(&cb->sem);
@@ -233,6 +1003,18 @@ static int rping_cma_event_handler(struct rdma_cm_id *cma_id,
 	return ret;
 }
 
+static void rping_take_adv(struct rping_cb *cb,
+			   const struct rping_rdma_info *info)
+{
+	cb->remote_rkey = ntohl(info->rkey);
+	cb->remote_addr = ntohll(info->buf);
+	cb->remote_len  = ntohl(info->size);
+	cb->write_imm = !!(cb->remote_len & RPING_WRITE_IMM);
+	cb->remote_len &= ~RPING_WRITE_IMM;
+	DEBUG_LOG("Received rkey %x addr %" PRIx64 " len %d from peer\n",
+		  cb->remote_rkey, cb->remote_addr, cb->remote_len);
+}
+
 static int server_recv(struct rping_cb *cb, struct ibv_wc *wc)
 {
 	if (wc->byte_len != sizeof(cb->recv_buf)) {
@@ -240,11 +1022,7 @@ static int server_recv(struct rping_cb *cb, struct ibv_wc *wc)
 		return -1;
 	}
 
-	cb->remote_rkey = ntohl(cb->recv_buf.rkey);
-	cb->remote_addr = ntohll(cb->recv_buf.buf);
-	cb->remote_len  = ntohl(cb->recv_buf.size);
-	DEBUG_LOG("Received rkey %x addr %" PRIx64 " len %d from peer\n",
-		  cb->remote_rkey, cb->remote_addr, cb->remote_len);
+	rping_take_adv(cb, &cb->recv_buf);
 
 	if (cb->state <= CONNECTED || cb->state == RDMA_WRITE_COMPLETE)
 		cb->state = RDMA_READ_ADV;
@@ -269,6 +1047,21 @@ static int client_recv(struct rping_cb *cb, struct ibv_wc *wc)
 	return 0;
 }
 
+/* -i: the echo itself says it has landed */
+static int client_recv_imm(struct rping_cb *cb, struct ibv_wc *wc)
+{
+	if (cb->server || cb->state != RDMA_WRITE_ADV ||
+	    ntohl(wc->imm_data) != cb->imm_seq) {
+		fprintf(stderr, "Unexpected echo %u, state %d\n",
+			ntohl(wc->imm_data), cb->state);
+		return -1;
+	}
+
+	cb->imm_seq++;
+	cb->state = RDMA_WRITE_COMPLETE;
+	return 0;
+}
+
 static int rping_cq_event_handler(struct rping_cb *cb)
 {
 	struct ibv_wc wc;
@@ -277,6 +1070,7 @@ static int rping_cq_event_handler(struct rping_cb *cb)
 
 	while ((ret = ibv_poll_cq(cb->cq, 1, &wc)) == 1) {
 		ret = 0;
+		cb->cqes++;
 
 		if (wc.status) {
 			if (wc.status != IBV_WC_WR_FLUSH_ERR)
@@ -294,19 +1088,25 @@ static int rping_cq_event_handler(struct rping_cb *cb)
 		case IBV_WC_RDMA_WRITE:
 			DEBUG_LOG("rdma write completion\n");
 			cb->state = RDMA_WRITE_COMPLETE;
-			sem_post(&cb->sem);
+			rping_signal(cb);
 			break;
 
 		case IBV_WC_RDMA_READ:
 			DEBUG_LOG("rdma read completion\n");
 			cb->state = RDMA_READ_COMPLETE;
-			sem_post(&cb->sem);
+			rping_signal(cb);
 			break;
 
 		case IBV_WC_RECV:
+		case IBV_WC_RECV_RDMA_WITH_IMM:
 			DEBUG_LOG("recv completion\n");
-			ret = cb->server ? server_recv(cb, &wc) :
-					   client_recv(cb, &wc);
+			cb->msgs++;
+			if (wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM)
+				ret = client_recv_imm(cb, &wc);
+			else if (cb->server)
+				ret = server_recv(cb, &wc);
+			else
+				ret = client_recv(cb, &wc);
 			if (ret) {
 				fprintf(stderr, "recv wc error: %d\n", ret);
 				goto error;
@@ -317,7 +1117,7 @@ static int rping_cq_event_handler(struct rping_cb *cb)
 				fprintf(stderr, "post recv error: %d\n", ret);
 				goto error;
 			}
-			sem_post(&cb->sem);
+			rping_signal(cb);
 			break;
 
 		default:
@@ -334,31 +1134,94 @@ static int rping_cq_event_handler(struct rping_cb *cb)
 
 error:
 	cb->state = ERROR;
-	sem_post(&cb->sem);
+	rping_signal(cb);
 	return ret;
 }
 
-static int rping_accept(struct rping_cb *cb)
+/*
+ * Ask for as many outstanding RDMA READs (or atomics) as there are
+ * pings in flight, up to what the device supports.
+ */
+static void rping_rd_atom(struct rping_cb *cb, struct ibv_context *verbs,
+			  struct rdma_conn_param *conn_param)
+{
+	struct ibv_device_attr attr;
+	int depth = cb->atomic ? cb->atomic_depth : cb->depth;
+
+	conn_param->responder_resources = 1;
+	conn_param->initiator_depth = 1;
+
+	if (ibv_query_device(verbs, &attr))
+		return;
+
+	/* The server does not know how deep atomics clients will go */
+	if (cb->atomic && cb->server)
+		depth = attr.max_qp_rd_atom;
+
+	conn_param->responder_resources =
+		MAX(1, MIN(depth, attr.max_qp_rd_atom));
+	conn_param->initiator_depth =
+		MAX(1, MIN(depth, attr.max_qp_init_rd_atom));
+}
+
+static void rping_accepted(struct rping_cb *cb);
+static void rping_closed(void);
+
+static int rping_post_accept(struct rping_cb *cb)
 {
 	struct rdma_conn_param conn_param;
+	struct rping_cm_data data;
 	int ret;
 
 	DEBUG_LOG("accepting client connection request\n");
 
 	memset(&conn_param, 0, sizeof conn_param);
-	conn_param.responder_resources = 1;
-	conn_param.initiator_depth = 1;
+	rping_rd_atom(cb, cb->child_cm_id->verbs, &conn_param);
+	if (cb->peer_initiator)
+		conn_param.responder_resources =
+			MIN(conn_param.responder_resources, cb->peer_initiator);
+	if (cb->peer_responder)
+		conn_param.initiator_depth =
+			MIN(conn_param.initiator_depth, cb->peer_responder);
+	if (cb->depth > 1)
+		printf("server: depth %d ird %d ord %d\n", cb->depth,
+		       conn_param.responder_resources,
+		       conn_param.initiator_depth);
+
+	/* Only the lock-step server threads can start from a -D adv */
+	if (cb->peer_adv_valid && (cb->workers || cb->depth > 1 ||
+				   cb->atomic))
+		cb->peer_adv_valid = 0;
+	if (cb->peer_adv_valid) {
+		memset(&data, 0, sizeof data);
+		data.magic = htonl(RPING_CM_MAGIC);
+		data.adv.size = htonl(cb->size);
+		conn_param.private_data = &data;
+		conn_param.private_data_len = sizeof data;
+	}
 
 	ret = rdma_accept(cb->child_cm_id, &conn_param);
-	if (ret) {
+	if (ret)
 		perror("rdma_accept");
-		return ret;
-	}
+	else if (cb->persistent)
+		rping_accepted(cb);
+	return ret;
+}
 
-	sem_wait(&cb->sem);
-	if (cb->state == ERROR) {
-		fprintf(stderr, "wait for CONNECTED state %d\n", cb->state);
-		return -1;
+static int rping_accept(struct rping_cb *cb)
+{
+	int ret;
+
+	ret = rping_post_accept(cb);
+	if (ret)
+		return ret;
+
+	sem_wait(&cb->sem);
+	if (cb->state == ERROR) {
+		fprintf(stderr, "wait for CONNECTED state %d\n", cb->state);
+		if (cb->persistent)
+			rping_closed();
+		return -1;
 	}
 	return 0;
 }
@@ -387,10 +1250,302 @@ static void rping_setup_wr(struct rping_cb *cb)
 	cb->rdma_sq_wr.num_sge = 1;
 }
 
+static int rping_pool_grow(struct rping_pool *pool)
+{
+	size_t stride = RPING_OBJ_HDR + pool->obj_size;
+	struct rping_chunk *chunk;
+	struct rping_obj *obj;
+	int i;
+
+	stride = (stride + RPING_OBJ_HDR - 1) & ~(size_t) (RPING_OBJ_HDR - 1);
+
+	chunk = calloc(1, sizeof(*chunk));
+	if (!chunk)
+		return -ENOMEM;
+
+	if (posix_memalign((void **) &chunk->mem, 4096, stride * pool->grow)) {
+		free(chunk);
+		return -ENOMEM;
+	}
+
+	chunk->mr = ibv_reg_mr(pool->pd, chunk->mem, stride * pool->grow,
+			       pool->access);
+	if (!chunk->mr) {
+		fprintf(stderr, "pool reg_mr failed\n");
+		free(chunk->mem);
+		free(chunk);
+		return errno;
+	}
+	DEBUG_LOG("pool %p grew by %d objects of %zu bytes\n", pool,
+		  pool->grow, pool->obj_size);
+
+	for (i = 0; i < pool->grow; i++) {
+		obj = (struct rping_obj *) (chunk->mem + i * stride);
+		obj->mr = chunk->mr;
+		obj->next = pool->free;
+		pool->free = obj;
+	}
+
+	chunk->next = pool->chunks;
+	pool->chunks = chunk;
+	pool->grow *= 2;
+	return 0;
+}
+
+static void *rping_pool_get(struct rping_pool *pool, struct ibv_mr **mr)
+{
+	struct rping_obj *obj;
+
+	pthread_mutex_lock(&pool->lock);
+	if (!pool->free && rping_pool_grow(pool)) {
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+	obj = pool->free;
+	pool->free = obj->next;
+	pthread_mutex_unlock(&pool->lock);
+
+	*mr = obj->mr;
+	return (char *) obj + RPING_OBJ_HDR;
+}
+
+static void rping_pool_put(struct rping_pool *pool, void *p)
+{
+	struct rping_obj *obj = (struct rping_obj *) ((char *) p - RPING_OBJ_HDR);
+
+	pthread_mutex_lock(&pool->lock);
+	obj->next = pool->free;
+	pool->free = obj;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static int rping_pool_init(struct rping_pool *pool, struct ibv_pd *pd,
+			   size_t obj_size, int access)
+{
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->pd = pd;
+	pool->obj_size = obj_size;
+	pool->access = access;
+	pool->grow = RPING_POOL_INIT;
+	return rping_pool_grow(pool);
+}
+
+static void rping_pool_destroy(struct rping_pool *pool)
+{
+	struct rping_chunk *chunk;
+
+	while ((chunk = pool->chunks)) {
+		pool->chunks = chunk->next;
+		ibv_dereg_mr(chunk->mr);
+		free(chunk->mem);
+		free(chunk);
+	}
+	pool->free = NULL;
+}
+
+static struct rping_device *rping_devices;
+static pthread_mutex_t rping_devices_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Find or create the shared PD and pools for a device. They live as
+ * long as the server does.
+ */
+static struct rping_device *rping_get_device(struct ibv_context *verbs,
+					     size_t buf_size)
+{
+	struct rping_device *dev;
+
+	pthread_mutex_lock(&rping_devices_lock);
+	for (dev = rping_devices; dev; dev = dev->next)
+		if (dev->verbs == verbs)
+			goto out;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		goto out;
+	dev->verbs = verbs;
+
+	dev->pd = ibv_alloc_pd(verbs);
+	if (!dev->pd) {
+		fprintf(stderr, "ibv_alloc_pd failed\n");
+		goto err1;
+	}
+
+	if (rping_pool_init(&dev->cbs, dev->pd, sizeof(struct rping_cb),
+			    IBV_ACCESS_LOCAL_WRITE))
+		goto err2;
+
+	/*
+	 * The server only moves data with its own READs and WRITEs, so the
+	 * pool's one rkey, shared by every connection, grants nothing.
+	 */
+	if (rping_pool_init(&dev->bufs, dev->pd, buf_size,
+			    IBV_ACCESS_LOCAL_WRITE))
+		goto err3;
+
+	dev->next = rping_devices;
+	rping_devices = dev;
+out:
+	pthread_mutex_unlock(&rping_devices_lock);
+	return dev;
+
+err3:
+	rping_pool_destroy(&dev->cbs);
+err2:
+	ibv_dealloc_pd(dev->pd);
+err1:
+	free(dev);
+	pthread_mutex_unlock(&rping_devices_lock);
+	return NULL;
+}
+
+static int rping_get_pd(struct rping_cb *cb, struct ibv_context *verbs)
+{
+	if (cb->dev) {
+		cb->pd = cb->dev->pd;
+		return 0;
+	}
+
+	cb->pd = ibv_alloc_pd(verbs);
+	if (!cb->pd) {
+		fprintf(stderr, "ibv_alloc_pd failed\n");
+		return errno;
+	}
+	return 0;
+}
+
+static void rping_put_pd(struct rping_cb *cb)
+{
+	if (!cb->dev)
+		ibv_dealloc_pd(cb->pd);
+}
+
+static int rping_setup_slots(struct rping_cb *cb)
+{
+	struct rping_slot *slot;
+	int i;
+
+	cb->slots = calloc(cb->depth, sizeof *cb->slots);
+	if (!cb->slots) {
+		fprintf(stderr, "slots malloc failed\n");
+		return -ENOMEM;
+	}
+
+	cb->slots_mr = ibv_reg_mr(cb->pd, cb->slots,
+				  cb->depth * sizeof *cb->slots,
+				  IBV_ACCESS_LOCAL_WRITE);
+	if (!cb->slots_mr) {
+		fprintf(stderr, "slots reg_mr failed\n");
+		free(cb->slots);
+		return errno;
+	}
+
+	for (i = 0; i < cb->depth; i++) {
+		slot = &cb->slots[i];
+		slot->index = i;
+		slot->rdma_buf = cb->rdma_buf + (size_t) i * cb->size;
+		if (!cb->server)
+			slot->start_buf = cb->start_buf + (size_t) i * cb->size;
+
+		slot->recv_sgl.addr = (uint64_t) (unsigned long) &slot->recv_buf;
+		slot->recv_sgl.length = sizeof slot->recv_buf;
+		slot->recv_sgl.lkey = cb->slots_mr->lkey;
+		slot->rq_wr.wr_id = (uint64_t) (unsigned long) slot;
+		slot->rq_wr.sg_list = &slot->recv_sgl;
+		slot->rq_wr.num_sge = 1;
+
+		/* The server's go-ahead carries nothing but the immediate */
+		slot->send_sgl.addr = (uint64_t) (unsigned long) &slot->send_buf;
+		slot->send_sgl.length = sizeof slot->send_buf;
+		slot->send_sgl.lkey = cb->slots_mr->lkey;
+		slot->sq_wr.wr_id = (uint64_t) (unsigned long) slot;
+		slot->sq_wr.opcode = IBV_WR_SEND_WITH_IMM;
+		slot->sq_wr.send_flags = IBV_SEND_SIGNALED;
+		slot->sq_wr.sg_list = &slot->send_sgl;
+		slot->sq_wr.num_sge = cb->server ? 0 : 1;
+
+		slot->rdma_sgl.addr = (uint64_t) (unsigned long) slot->rdma_buf;
+		slot->rdma_sgl.lkey = cb->rdma_mr->lkey;
+		slot->rdma_sq_wr.wr_id = (uint64_t) (unsigned long) slot;
+		slot->rdma_sq_wr.send_flags = IBV_SEND_SIGNALED;
+		slot->rdma_sq_wr.sg_list = &slot->rdma_sgl;
+		slot->rdma_sq_wr.num_sge = 1;
+	}
+
+	return 0;
+}
+
+static void rping_free_slots(struct rping_cb *cb)
+{
+	if (!cb->slots)
+		return;
+	ibv_dereg_mr(cb->slots_mr);
+	free(cb->slots);
+	cb->slots = NULL;
+}
+
+/*
+ * Work request chain and pipeline slots, which are per connection
+ * whether or not the buffers come from the pool.
+ */
+static int rping_setup_chain(struct rping_cb *cb)
+{
+	int ret;
+
+	cb->chain = calloc(cb->max_chain, sizeof *cb->chain);
+	cb->chain_sgl = calloc(cb->max_chain, sizeof *cb->chain_sgl);
+	if (!cb->chain || !cb->chain_sgl) {
+		fprintf(stderr, "chain malloc failed\n");
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	if (cb->depth > 1) {
+		ret = rping_setup_slots(cb);
+		if (ret)
+			goto err;
+	}
+	return 0;
+
+err:
+	free(cb->chain);
+	free(cb->chain_sgl);
+	return ret;
+}
+
+/*
+ * Pooled server connections keep their send and receive buffers in
+ * the cb, which came out of registered memory, and borrow rdma_buf.
+ */
+static int rping_setup_pooled_buffers(struct rping_cb *cb)
+{
+	int ret;
+
+	cb->recv_mr = cb->cb_mr;
+	cb->send_mr = cb->cb_mr;
+	cb->rdma_buf = rping_pool_get(&cb->dev->bufs, &cb->rdma_mr);
+	if (!cb->rdma_buf) {
+		fprintf(stderr, "rdma_buf pool exhausted\n");
+		return -ENOMEM;
+	}
+
+	rping_setup_wr(cb);
+
+	ret = rping_setup_chain(cb);
+	if (ret)
+		rping_pool_put(&cb->dev->bufs, cb->rdma_buf);
+	return ret;
+}
+
 static int rping_setup_buffers(struct rping_cb *cb)
 {
+	size_t len = MAX((size_t) cb->size * cb->depth,
+			 cb->atomic_depth * sizeof(uint64_t));
 	int ret;
 
+	if (cb->dev)
+		return rping_setup_pooled_buffers(cb);
+
 	DEBUG_LOG("rping_setup_buffers called on cb %p\n", cb);
 
 	cb->recv_mr = ibv_reg_mr(cb->pd, &cb->recv_buf, sizeof cb->recv_buf,
@@ -407,14 +1562,14 @@ static int rping_setup_buffers(struct rping_cb *cb)
 		goto err1;
 	}
 
-	cb->rdma_buf = malloc(cb->size);
+	cb->rdma_buf = malloc(len);
 	if (!cb->rdma_buf) {
 		fprintf(stderr, "rdma_buf malloc failed\n");
 		ret = -ENOMEM;
 		goto err2;
 	}
 
-	cb->rdma_mr = ibv_reg_mr(cb->pd, cb->rdma_buf, cb->size,
+	cb->rdma_mr = ibv_reg_mr(cb->pd, cb->rdma_buf, len,
 				 IBV_ACCESS_LOCAL_WRITE |
 				 IBV_ACCESS_REMOTE_READ |
 				 IBV_ACCESS_REMOTE_WRITE);
@@ -425,14 +1580,14 @@ static int rping_setup_buffers(struct rping_cb *cb)
 	}
 
 	if (!cb->server) {
-		cb->start_buf = malloc(cb->size);
+		cb->start_buf = malloc(len);
 		if (!cb->start_buf) {
 			fprintf(stderr, "start_buf malloc failed\n");
 			ret = -ENOMEM;
 			goto err4;
 		}
 
-		cb->start_mr = ibv_reg_mr(cb->pd, cb->start_buf, cb->size,
+		cb->start_mr = ibv_reg_mr(cb->pd, cb->start_buf, len,
 					  IBV_ACCESS_LOCAL_WRITE | 
 					  IBV_ACCESS_REMOTE_READ |
 					  IBV_ACCESS_REMOTE_WRITE);
@@ -444,9 +1599,16 @@ static int rping_setup_buffers(struct rping_cb *cb)
 	}
 
 	rping_setup_wr(cb);
+
+	ret = rping_setup_chain(cb);
+	if (ret)
+		goto err6;
 	DEBUG_LOG("allocated & registered buffers...\n");
 	return 0;
 
+err6:
+	if (!cb->server)
+		ibv_dereg_mr(cb->start_mr);
 err5:
 	free(cb->start_buf);
 err4:
@@ -463,6 +1625,13 @@ err1:
 static void rping_free_buffers(struct rping_cb *cb)
 {
 	DEBUG_LOG("rping_free_buffers called on cb %p\n", cb);
+	rping_free_slots(cb);
+	free(cb->chain);
+	free(cb->chain_sgl);
+	if (cb->dev) {
+		rping_pool_put(&cb->dev->bufs, cb->rdma_buf);
+		return;
+	}
 	ibv_dereg_mr(cb->recv_mr);
 	ibv_dereg_mr(cb->send_mr);
 	ibv_dereg_mr(cb->rdma_mr);
@@ -479,8 +1648,8 @@ static int rping_create_qp(struct rping_cb *cb)
 	int ret;
 
 	memset(&init_attr, 0, sizeof(init_attr));
-	init_attr.cap.max_send_wr = RPING_SQ_DEPTH;
-	init_attr.cap.max_recv_wr = 2;
+	init_attr.cap.max_send_wr = cb->sq_depth;
+	init_attr.cap.max_recv_wr = MAX(2, cb->depth);
 	init_attr.cap.max_recv_sge = 1;
 	init_attr.cap.max_send_sge = 1;
 	init_attr.qp_type = IBV_QPT_RC;
@@ -505,19 +1674,49 @@ static void rping_free_qp(struct rping_cb *cb)
 	ibv_destroy_qp(cb->qp);
 	ibv_destroy_cq(cb->cq);
 	ibv_destroy_comp_channel(cb->channel);
-	ibv_dealloc_pd(cb->pd);
+	rping_put_pd(cb);
+}
+
+/*
+ * Size the send queue for depth pings of chunked RDMA plus a go-ahead
+ * each. Lock-step mode posts chains that do not fit in batches;
+ * pipelined mode needs every chain to fit.
+ */
+static int rping_size_sq(struct rping_cb *cb, struct ibv_context *verbs)
+{
+	struct ibv_device_attr attr;
+	int nchunks = 1;
+
+	if (cb->chunk)
+		nchunks = (cb->size + cb->chunk - 1) / cb->chunk;
+
+	cb->sq_depth = MAX(RPING_SQ_DEPTH, cb->depth * (nchunks + 1));
+	cb->sq_depth = MAX(cb->sq_depth, cb->atomic_depth + 1);
+	if (!ibv_query_device(verbs, &attr))
+		cb->sq_depth = MIN(cb->sq_depth, attr.max_qp_wr);
+
+	if (cb->depth > 1 && cb->sq_depth < cb->depth * (nchunks + 1)) {
+		fprintf(stderr, "depth %d with %d chunks per ping does not fit "
+			"in a send queue of %d\n", cb->depth, nchunks,
+			cb->sq_depth);
+		return EINVAL;
+	}
+
+	cb->max_chain = MIN(nchunks, cb->sq_depth - 1);
+	if (cb->server && cb->chunk)
+		printf("server: chunk %d, %d chunks per ping, %d per post\n",
+		       cb->chunk, nchunks, cb->max_chain);
+	return 0;
 }
 
 static int rping_setup_qp(struct rping_cb *cb, struct rdma_cm_id *cm_id)
 {
 	int ret;
 
-	cb->pd = ibv_alloc_pd(cm_id->verbs);
-	if (!cb->pd) {
-		fprintf(stderr, "ibv_alloc_pd failed\n");
-		return errno;
-	}
-	DEBUG_LOG("created pd %p\n", cb->pd);
+	ret = rping_get_pd(cb, cm_id->verbs);
+	if (ret)
+		return ret;
+	DEBUG_LOG("using pd %p\n", cb->pd);
 
 	cb->channel = ibv_create_comp_channel(cm_id->verbs);
 	if (!cb->channel) {
@@ -527,7 +1726,12 @@ static int rping_setup_qp(struct rping_cb *cb, struct rdma_cm_id *cm_id)
 	}
 	DEBUG_LOG("created channel %p\n", cb->channel);
 
-	cb->cq = ibv_create_cq(cm_id->verbs, RPING_SQ_DEPTH * 2, cb,
+	ret = rping_size_sq(cb, cm_id->verbs);
+	if (ret)
+		goto err2;
+
+	cb->cq = ibv_create_cq(cm_id->verbs,
+			       cb->sq_depth + MAX(2, cb->depth), cb,
 				cb->channel, 0);
 	if (!cb->cq) {
 		fprintf(stderr, "ibv_create_cq failed\n");
@@ -536,11 +1740,13 @@ static int rping_setup_qp(struct rping_cb *cb, struct rdma_cm_id *cm_id)
 	}
 	DEBUG_LOG("created cq %p\n", cb->cq);
 
-	ret = ibv_req_notify_cq(cb->cq, 0);
-	if (ret) {
-		fprintf(stderr, "ibv_create_cq failed\n");
-		ret = errno;
-		goto err3;
+	if (cb->use_events) {
+		ret = ibv_req_notify_cq(cb->cq, 0);
+		if (ret) {
+			fprintf(stderr, "ibv_create_cq failed\n");
+			ret = errno;
+			goto err3;
+		}
 	}
 
 	ret = rping_create_qp(cb);
@@ -556,7 +1762,7 @@ err3:
 err2:
 	ibv_destroy_comp_channel(cb->channel);
 err1:
-	ibv_dealloc_pd(cb->pd);
+	rping_put_pd(cb);
 	return ret;
 }
 
@@ -612,119 +1818,1950 @@ static void *cq_thread(void *arg)
 	}
 }
 
-static void rping_format_send(struct rping_cb *cb, char *buf, struct ibv_mr *mr)
+static int rping_has_cq_thread(struct rping_cb *cb)
 {
-	struct rping_rdma_info *info = &cb->send_buf;
+	/* Atomics and load clients poll for themselves */
+	return cb->use_events && cb->depth == 1 &&
+	       (cb->server || (!cb->atomic && cb->conns == 1));
+}
 
-	info->buf = htonll((uint64_t) (unsigned long) buf);
-	info->rkey = htonl(mr->rkey);
-	info->size = htonl(cb->size);
+static int rping_post_recvs(struct rping_cb *cb)
+{
+	struct ibv_recv_wr *bad_wr;
+	int i, ret;
 
-	DEBUG_LOG("RDMA addr %" PRIx64" rkey %x len %d\n",
-		  ntohll(info->buf), ntohl(info->rkey), ntohl(info->size));
+	if (cb->depth == 1)
+		return ibv_post_recv(cb->qp, &cb->rq_wr, &bad_wr);
+
+	for (i = 0; i < cb->depth; i++) {
+		ret = ibv_post_recv(cb->qp, &cb->slots[i].rq_wr, &bad_wr);
+		if (ret)
+			return ret;
+	}
+	return 0;
 }
 
-static int rping_test_server(struct rping_cb *cb)
+/*
+ * Pipelined mode drives the CQ from the client or server thread. With
+ * -e it sleeps on the completion channel between completions instead
+ * of spinning.
+ */
+static int rping_pipe_poll(struct rping_cb *cb, struct ibv_wc *wc)
 {
-	struct ibv_send_wr *bad_wr;
+	struct ibv_cq *ev_cq;
+	void *ev_ctx;
 	int ret;
 
-	while (1) {
-		/* Wait for client's Start STAG/TO/Len */
-		sem_wait(&cb->sem);
-		if (cb->state != RDMA_READ_ADV) {
-			fprintf(stderr, "wait for RDMA_READ_ADV state %d\n",
-				cb->state);
-			ret = -1;
-			break;
-		}
-
-		DEBUG_LOG("server received sink adv\n");
-
-		/* Issue RDMA Read. */
-		cb->rdma_sq_wr.opcode = IBV_WR_RDMA_READ;
-		cb->rdma_sq_wr.wr.rdma.rkey = cb->remote_rkey;
-		cb->rdma_sq_wr.wr.rdma.remote_addr = cb->remote_addr;
-		cb->rdma_sq_wr.sg_list->length = cb->remote_len;
+	while (!(ret = ibv_poll_cq(cb->cq, 1, wc))) {
+		if (!cb->use_events)
+			continue;
 
-		ret = ibv_post_send(cb->qp, &cb->rdma_sq_wr, &bad_wr);
-		if (ret) {
-			fprintf(stderr, "post send error %d\n", ret);
-			break;
+		if (ibv_req_notify_cq(cb->cq, 0)) {
+			fprintf(stderr, "Failed to set notify!\n");
+			return -1;
 		}
-		DEBUG_LOG("server posted rdma read req \n");
 
-		/* Wait for read completion */
-		sem_wait(&cb->sem);
-		if (cb->state != RDMA_READ_COMPLETE) {
-			fprintf(stderr, "wait for RDMA_READ_COMPLETE state %d\n",
-				cb->state);
-			ret = -1;
+		/* Catch anything that completed before the CQ was armed */
+		ret = ibv_poll_cq(cb->cq, 1, wc);
+		if (ret)
 			break;
-		}
-		DEBUG_LOG("server received read complete\n");
 
-		/* Display data in recv buf */
-		if (cb->verbose)
-			printf("server ping data: %s\n", cb->rdma_buf);
-
-		/* Tell client to continue */
-		ret = ibv_post_send(cb->qp, &cb->sq_wr, &bad_wr);
-		if (ret) {
-			fprintf(stderr, "post send error %d\n", ret);
-			break;
+		if (ibv_get_cq_event(cb->channel, &ev_cq, &ev_ctx)) {
+			fprintf(stderr, "Failed to get cq event!\n");
+			return -1;
 		}
-		DEBUG_LOG("server posted go ahead\n");
+		ibv_ack_cq_events(ev_cq, 1);
+	}
+	if (ret < 0) {
+		fprintf(stderr, "poll error %d\n", ret);
+		return ret;
+	}
 
-		/* Wait for client's RDMA STAG/TO/Len */
-		sem_wait(&cb->sem);
-		if (cb->state != RDMA_WRITE_ADV) {
-			fprintf(stderr, "wait for RDMA_WRITE_ADV state %d\n",
-				cb->state);
-			ret = -1;
-			break;
-		}
-		DEBUG_LOG("server received sink adv\n");
+	if (wc->status) {
+		if (wc->status != IBV_WC_WR_FLUSH_ERR)
+			fprintf(stderr, "cq completion failed status %d\n",
+				wc->status);
+		return -1;
+	}
 
-		/* RDMA Write echo data */
-		cb->rdma_sq_wr.opcode = IBV_WR_RDMA_WRITE;
-		cb->rdma_sq_wr.wr.rdma.rkey = cb->remote_rkey;
-		cb->rdma_sq_wr.wr.rdma.remote_addr = cb->remote_addr;
-		cb->rdma_sq_wr.sg_list->length = strlen(cb->rdma_buf) + 1;
-		DEBUG_LOG("rdma write from lkey %x laddr %" PRIx64 " len %d\n",
-			  cb->rdma_sq_wr.sg_list->lkey,
-			  cb->rdma_sq_wr.sg_list->addr,
-			  cb->rdma_sq_wr.sg_list->length);
+	return 0;
+}
 
-		ret = ibv_post_send(cb->qp, &cb->rdma_sq_wr, &bad_wr);
-		if (ret) {
-			fprintf(stderr, "post send error %d\n", ret);
-			break;
-		}
+/*
+ * Find the slot a received advertisement or go-ahead refers to.
+ */
+static struct rping_slot *rping_pipe_slot(struct rping_cb *cb,
+					  struct ibv_wc *wc, int *sink)
+{
+	uint32_t imm;
 
-		/* Wait for completion */
-		ret = sem_wait(&cb->sem);
-		if (cb->state != RDMA_WRITE_COMPLETE) {
-			fprintf(stderr, "wait for RDMA_WRITE_COMPLETE state %d\n",
-				cb->state);
-			ret = -1;
-			break;
-		}
-		DEBUG_LOG("server rdma write complete \n");
+	if (!(wc->wc_flags & IBV_WC_WITH_IMM)) {
+		fprintf(stderr, "Received message without slot, "
+			"is -Q set on both sides?\n");
+		return NULL;
+	}
 
-		/* Tell client to begin again */
-		ret = ibv_post_send(cb->qp, &cb->sq_wr, &bad_wr);
-		if (ret) {
-			fprintf(stderr, "post send error %d\n", ret);
-			break;
-		}
-		DEBUG_LOG("server posted go ahead\n");
+	imm = ntohl(wc->imm_data);
+	if ((imm >> 1) >= cb->depth) {
+		fprintf(stderr, "Received slot %d beyond depth %d\n",
+			imm >> 1, cb->depth);
+		return NULL;
 	}
 
-	return ret;
+	*sink = imm & RPING_IMM_SINK;
+	return &cb->slots[imm >> 1];
 }
 
-static int rping_bind_server(struct rping_cb *cb)
+static int rping_pipe_send(struct rping_cb *cb, struct rping_slot *slot,
+			   int sink)
+{
+	struct rping_rdma_info *info = &slot->send_buf;
+	struct ibv_send_wr *bad_wr;
+
+	if (!cb->server) {
+		info->buf = htonll((uint64_t) (unsigned long)
+				   (sink ? slot->rdma_buf : slot->start_buf));
+		info->rkey = htonl(sink ? cb->rdma_mr->rkey :
+				   cb->start_mr->rkey);
+		info->size = htonl(cb->size);
+	}
+
+	slot->sq_wr.imm_data = htonl(slot->index << 1 |
+				     (sink ? RPING_IMM_SINK : 0));
+	return ibv_post_send(cb->qp, &slot->sq_wr, &bad_wr);
+}
+
+static void rping_format_send(struct rping_cb *cb, char *buf, struct ibv_mr *mr)
+{
+	struct rping_rdma_info *info = &cb->send_buf;
+
+	info->buf = htonll((uint64_t) (unsigned long) buf);
+	info->rkey = htonl(mr->rkey);
+	info->size = htonl(cb->size);
+
+	DEBUG_LOG("RDMA addr %" PRIx64" rkey %x len %d\n",
+		  ntohll(info->buf), ntohl(info->rkey), ntohl(info->size));
+}
+
+static void rping_report_messages(struct rping_cb *cb, const char *label)
+{
+	if (!cb->pings.count)
+		return;
+	printf("%s: %.2f messages and %.2f completions per ping%s\n", label,
+	       (double) cb->msgs / cb->pings.count,
+	       (double) cb->cqes / cb->pings.count,
+	       cb->write_imm ? ", echo WITH_IMM" : "");
+}
+
+static void rping_report_server(struct rping_cb *cb, uint32_t len)
+{
+	if (cb->phase) {
+		rping_report_phases(cb, PH_SERVER_READ, RPING_PHASES);
+		free(cb->phase);
+		cb->phase = NULL;
+	}
+	rping_report_samples("server", &cb->pings, 2 * len);
+	rping_report_messages(cb, "server");
+	rping_report_integrity(cb, "server");
+	rping_report_rdma("rdma read", &cb->reads, len);
+	rping_report_rdma("rdma write", &cb->writes, len);
+	rping_free_samples(&cb->pings);
+	rping_free_samples(&cb->reads);
+	rping_free_samples(&cb->writes);
+}
+
+/*
+ * Post len bytes of the RDMA READ or WRITE described by wr, starting
+ * at *offset, as a chain of chunk sized work requests. Only the last
+ * one is signaled and carries wr's wr_id. *offset is advanced past
+ * what was posted, which falls short of len if the chain was capped
+ * at max_chain.
+ */
+static int rping_post_rdma(struct rping_cb *cb, struct ibv_send_wr *wr,
+			   uint32_t *offset, uint32_t len)
+{
+	struct ibv_send_wr *bad_wr;
+	uint32_t chunk = cb->chunk ? cb->chunk : len;
+	int n = 0;
+
+	while (*offset < len && n < cb->max_chain) {
+		cb->chain_sgl[n] = wr->sg_list[0];
+		cb->chain_sgl[n].addr += *offset;
+		cb->chain_sgl[n].length = MIN(chunk, len - *offset);
+
+		cb->chain[n] = *wr;
+		cb->chain[n].sg_list = &cb->chain_sgl[n];
+		cb->chain[n].num_sge = 1;
+		cb->chain[n].wr.rdma.remote_addr += *offset;
+		cb->chain[n].send_flags = 0;
+		cb->chain[n].next = &cb->chain[n + 1];
+
+		*offset += cb->chain_sgl[n].length;
+		/* Only the last chunk of an echo carries the immediate */
+		if (wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM && *offset < len)
+			cb->chain[n].opcode = IBV_WR_RDMA_WRITE;
+		n++;
+	}
+	if (!n)
+		return 0;
+	cb->msgs += n;
+	cb->chain[n - 1].send_flags = IBV_SEND_SIGNALED;
+	cb->chain[n - 1].next = NULL;
+
+	return ibv_post_send(cb->qp, cb->chain, &bad_wr);
+}
+
+/*
+ * Move len bytes with the RDMA operation set up in rdma_sq_wr, one
+ * batch at a time, waiting for the handler to report state for each.
+ */
+static int rping_rdma_lockstep(struct rping_cb *cb, uint32_t len,
+			       enum test_state state)
+{
+	uint32_t offset = 0;
+	int ret;
+
+	while (offset < len) {
+		ret = rping_post_rdma(cb, &cb->rdma_sq_wr, &offset, len);
+		if (ret) {
+			fprintf(stderr, "post send error %d\n", ret);
+			return ret;
+		}
+
+		rping_wait_event(cb);
+		if (cb->state != state) {
+			fprintf(stderr, "wait for %s state %d\n",
+				state == RDMA_READ_COMPLETE ?
+				"RDMA_READ_COMPLETE" : "RDMA_WRITE_COMPLETE",
+				cb->state);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Answer the client's RPING_STATS_REQ by writing the server's phase
+ * histograms into its buffer, or nothing without -L, then a go-ahead.
+ */
+static int rping_send_phases(struct rping_cb *cb)
+{
+	size_t len = RPING_SERVER_PHASES * sizeof(struct rping_hist);
+	struct ibv_send_wr wr, *bad_wr;
+	struct rping_hist *copy = NULL;
+	struct ibv_mr *mr = NULL;
+	struct ibv_sge sge;
+	int ret;
+
+	if (cb->phase && (cb->remote_len & ~RPING_STATS_REQ) >= len) {
+		copy = malloc(len);
+		if (!copy)
+			return -ENOMEM;
+		memcpy(copy, &cb->phase[PH_SERVER_READ], len);
+		rping_hist_swap(copy, RPING_SERVER_PHASES, 1);
+
+		mr = ibv_reg_mr(cb->pd, copy, len, IBV_ACCESS_LOCAL_WRITE);
+		if (!mr) {
+			ret = errno;
+			goto out;
+		}
+
+		memset(&sge, 0, sizeof sge);
+		sge.addr = (uint64_t) (unsigned long) copy;
+		sge.length = len;
+		sge.lkey = mr->lkey;
+		memset(&wr, 0, sizeof wr);
+		wr.opcode = IBV_WR_RDMA_WRITE;
+		wr.send_flags = IBV_SEND_SIGNALED;
+		wr.sg_list = &sge;
+		wr.num_sge = 1;
+		wr.wr.rdma.rkey = cb->remote_rkey;
+		wr.wr.rdma.remote_addr = cb->remote_addr;
+
+		ret = ibv_post_send(cb->qp, &wr, &bad_wr);
+		if (ret)
+			goto out;
+		rping_wait_event(cb);
+		if (cb->state != RDMA_WRITE_COMPLETE) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+	/* The next advertisement starts a new ping */
+	cb->state = RDMA_WRITE_COMPLETE;
+	ret = ibv_post_send(cb->qp, &cb->sq_wr, &bad_wr);
+out:
+	if (mr)
+		ibv_dereg_mr(mr);
+	free(copy);
+	return ret;
+}
+
+static int rping_test_server(struct rping_cb *cb)
+{
+	struct ibv_send_wr *bad_wr;
+	struct timeval start, end, op_start, op_end;
+	uint64_t t[5];
+	uint32_t len = 0;
+	int first = 1;
+	int ret;
+
+	if (cb->phases) {
+		cb->phase = calloc(RPING_PHASES, sizeof *cb->phase);
+		if (!cb->phase)
+			return -ENOMEM;
+	}
+
+	while (1) {
+		if (cb->peer_adv_valid) {
+			/* -D: the first source adv came with the connection */
+			rping_take_adv(cb, &cb->peer_adv);
+			cb->peer_adv_valid = 0;
+			cb->state = RDMA_READ_ADV;
+		} else {
+			/* Wait for client's Start STAG/TO/Len */
+			rping_wait_event(cb);
+			if (cb->state != RDMA_READ_ADV) {
+				fprintf(stderr, "wait for RDMA_READ_ADV "
+					"state %d\n", cb->state);
+				ret = -1;
+				break;
+			}
+		}
+
+		DEBUG_LOG("server received sink adv\n");
+		gettimeofday(&start, NULL);
+		t[0] = rping_ns();
+
+		if (cb->remote_len & RPING_STATS_REQ) {
+			ret = rping_send_phases(cb);
+			if (ret)
+				break;
+			continue;
+		}
+
+		if (cb->remote_len > cb->size) {
+			fprintf(stderr, "Ping size %d larger than server "
+				"size %d\n", cb->remote_len, cb->size);
+			ret = -1;
+			break;
+		}
+		len = cb->remote_len;
+
+		/* Issue RDMA Read and wait for it to complete. */
+		cb->rdma_sq_wr.opcode = IBV_WR_RDMA_READ;
+		cb->rdma_sq_wr.wr.rdma.rkey = cb->remote_rkey;
+		cb->rdma_sq_wr.wr.rdma.remote_addr = cb->remote_addr;
+
+		gettimeofday(&op_start, NULL);
+		ret = rping_rdma_lockstep(cb, len, RDMA_READ_COMPLETE);
+		if (ret)
+			break;
+		gettimeofday(&op_end, NULL);
+		t[1] = rping_ns();
+		ret = rping_add_sample(&cb->reads, &op_start, &op_end);
+		if (ret)
+			break;
+		DEBUG_LOG("server received read complete\n");
+
+		if (first) {
+			printf("server: time to first byte %.1f usec\n",
+			       (op_end.tv_sec - cb->connect_time.tv_sec) * 1e6 +
+			       (op_end.tv_usec - cb->connect_time.tv_usec));
+			first = 0;
+		}
+
+		if (cb->integrity && rping_check(cb, cb->rdma_buf, len)) {
+			ret = -1;
+			break;
+		}
+
+		/* Display data in recv buf */
+		if (cb->verbose)
+			rping_print_data(cb, "server ping data", cb->rdma_buf);
+
+		/* Tell client to continue */
+		ret = ibv_post_send(cb->qp, &cb->sq_wr, &bad_wr);
+		if (ret) {
+			fprintf(stderr, "post send error %d\n", ret);
+			break;
+		}
+		cb->msgs++;
+		DEBUG_LOG("server posted go ahead\n");
+		t[2] = rping_ns();
+
+		/* Wait for client's RDMA STAG/TO/Len */
+		rping_wait_event(cb);
+		if (cb->state != RDMA_WRITE_ADV) {
+			fprintf(stderr, "wait for RDMA_WRITE_ADV state %d\n",
+				cb->state);
+			ret = -1;
+			break;
+		}
+		DEBUG_LOG("server received sink adv\n");
+		t[3] = rping_ns();
+
+		/* RDMA Write echo data, no more than the sink can take */
+		if (cb->write_imm) {
+			cb->rdma_sq_wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+			cb->rdma_sq_wr.imm_data = htonl(cb->imm_seq++);
+		} else {
+			cb->rdma_sq_wr.opcode = IBV_WR_RDMA_WRITE;
+		}
+		cb->rdma_sq_wr.wr.rdma.rkey = cb->remote_rkey;
+		cb->rdma_sq_wr.wr.rdma.remote_addr = cb->remote_addr;
+		len = MIN(len, cb->remote_len);
+		DEBUG_LOG("rdma write from lkey %x laddr %" PRIx64 " len %d\n",
+			  cb->rdma_sq_wr.sg_list->lkey,
+			  cb->rdma_sq_wr.sg_list->addr, len);
+
+		gettimeofday(&op_start, NULL);
+		ret = rping_rdma_lockstep(cb, len, RDMA_WRITE_COMPLETE);
+		if (ret)
+			break;
+		gettimeofday(&op_end, NULL);
+		t[4] = rping_ns();
+		ret = rping_add_sample(&cb->writes, &op_start, &op_end);
+		if (ret)
+			break;
+		DEBUG_LOG("server rdma write complete \n");
+
+		/* Tell client to begin again, unless the echo already did */
+		if (!cb->write_imm) {
+			ret = ibv_post_send(cb->qp, &cb->sq_wr, &bad_wr);
+			if (ret) {
+				fprintf(stderr, "post send error %d\n", ret);
+				break;
+			}
+			cb->msgs++;
+			DEBUG_LOG("server posted go ahead\n");
+		}
+
+		rping_phase_add(cb, PH_SERVER_READ, t[0], t[1]);
+		rping_phase_add(cb, PH_SERVER_READ_ACK, t[1], t[2]);
+		rping_phase_add(cb, PH_SERVER_SINK, t[2], t[3]);
+		rping_phase_add(cb, PH_SERVER_WRITE, t[3], t[4]);
+		rping_phase_add(cb, PH_SERVER_WRITE_ACK, t[4], rping_ns());
+		rping_phase_add(cb, PH_SERVER_PING, t[0], rping_ns());
+
+		gettimeofday(&end, NULL);
+		ret = rping_add_sample(&cb->pings, &start, &end);
+		if (ret)
+			break;
+	}
+
+	rping_report_server(cb, len);
+
+	return ret;
+}
+
+static int rping_test_server_pipelined(struct rping_cb *cb)
+{
+	struct ibv_recv_wr *bad_recv_wr;
+	struct rping_slot *slot, *rslot;
+	struct timeval end;
+	struct ibv_wc wc;
+	uint32_t offset, len = 0;
+	int sink, ret;
+
+	while (1) {
+		ret = rping_pipe_poll(cb, &wc);
+		if (ret)
+			break;
+
+		slot = (struct rping_slot *) (unsigned long) wc.wr_id;
+
+		switch (wc.opcode) {
+		case IBV_WC_SEND:
+			break;
+
+		case IBV_WC_RECV:
+			rslot = slot;
+			if (wc.byte_len != sizeof(rslot->recv_buf)) {
+				fprintf(stderr, "Received bogus data, size %d\n",
+					wc.byte_len);
+				ret = -1;
+				break;
+			}
+			slot = rping_pipe_slot(cb, &wc, &sink);
+			if (!slot) {
+				ret = -1;
+				break;
+			}
+
+			slot->remote_rkey = ntohl(rslot->recv_buf.rkey);
+			slot->remote_addr = ntohll(rslot->recv_buf.buf);
+			slot->remote_len  = ntohl(rslot->recv_buf.size);
+			DEBUG_LOG("slot %d received %s rkey %x addr %" PRIx64
+				  " len %d\n", slot->index,
+				  sink ? "sink" : "source", slot->remote_rkey,
+				  slot->remote_addr, slot->remote_len);
+
+			ret = ibv_post_recv(cb->qp, &rslot->rq_wr, &bad_recv_wr);
+			if (ret) {
+				fprintf(stderr, "post recv error: %d\n", ret);
+				break;
+			}
+
+			if (!sink) {
+				if (!slot->remote_len ||
+				    slot->remote_len > cb->size) {
+					fprintf(stderr, "Bad ping size %d, "
+						"server size %d\n",
+						slot->remote_len, cb->size);
+					ret = -1;
+					break;
+				}
+				gettimeofday(&slot->start, NULL);
+				slot->len = slot->remote_len;
+				slot->rdma_sq_wr.opcode = IBV_WR_RDMA_READ;
+			} else {
+				slot->rdma_sq_wr.opcode = IBV_WR_RDMA_WRITE;
+			}
+			slot->rdma_sq_wr.wr.rdma.rkey = slot->remote_rkey;
+			slot->rdma_sq_wr.wr.rdma.remote_addr = slot->remote_addr;
+			if (sink) {
+				slot->len = MIN(slot->len, slot->remote_len);
+				gettimeofday(&slot->write_start, NULL);
+			}
+
+			/* rping_size_sq() made sure the whole chain fits */
+			offset = 0;
+			ret = rping_post_rdma(cb, &slot->rdma_sq_wr, &offset,
+					      slot->len);
+			if (ret)
+				fprintf(stderr, "post send error %d\n", ret);
+			break;
+
+		case IBV_WC_RDMA_READ:
+			gettimeofday(&end, NULL);
+			ret = rping_add_sample(&cb->reads, &slot->start, &end);
+			if (ret)
+				break;
+
+			if (cb->integrity &&
+			    rping_check(cb, slot->rdma_buf, slot->len)) {
+				ret = -1;
+				break;
+			}
+
+			if (cb->verbose)
+				rping_print_data(cb, "server ping data",
+						 slot->rdma_buf);
+
+			ret = rping_pipe_send(cb, slot, 0);
+			if (ret)
+				fprintf(stderr, "post send error %d\n", ret);
+			break;
+
+		case IBV_WC_RDMA_WRITE:
+			ret = rping_pipe_send(cb, slot, 1);
+			if (ret) {
+				fprintf(stderr, "post send error %d\n", ret);
+				break;
+			}
+
+			gettimeofday(&end, NULL);
+			ret = rping_add_sample(&cb->writes, &slot->write_start,
+					       &end);
+			if (ret)
+				break;
+			ret = rping_add_sample(&cb->pings, &slot->start, &end);
+			len = slot->len;
+			break;
+
+		default:
+			DEBUG_LOG("unknown!!!!! completion\n");
+			ret = -1;
+			break;
+		}
+		if (ret)
+			break;
+	}
+
+	rping_report_server(cb, len);
+	return ret;
+}
+
+/*
+ * Atomic targets shared by every connection to an -A server.
+ */
+static struct {
+	uint64_t *buf;
+	int count;
+	uint64_t reported;		/* ops clients say they did */
+} rping_targets;
+
+static int rping_test_server_atomic(struct rping_cb *cb)
+{
+	struct ibv_send_wr *bad_wr;
+	uint64_t sum = 0, reported;
+	int i, ret;
+
+	cb->atomic_mr = ibv_reg_mr(cb->pd, rping_targets.buf,
+				   rping_targets.count * sizeof(uint64_t),
+				   IBV_ACCESS_LOCAL_WRITE |
+				   IBV_ACCESS_REMOTE_READ |
+				   IBV_ACCESS_REMOTE_WRITE |
+				   IBV_ACCESS_REMOTE_ATOMIC);
+	if (!cb->atomic_mr) {
+		fprintf(stderr, "atomic targets reg_mr failed\n");
+		return errno;
+	}
+
+	cb->send_buf.buf = htonll((uint64_t) (unsigned long) rping_targets.buf);
+	cb->send_buf.rkey = htonl(cb->atomic_mr->rkey);
+	cb->send_buf.size = htonl(rping_targets.count * sizeof(uint64_t));
+	ret = ibv_post_send(cb->qp, &cb->sq_wr, &bad_wr);
+	if (ret) {
+		fprintf(stderr, "post send error %d\n", ret);
+		goto out;
+	}
+
+	/* The client sends its op count in place of an address when done */
+	rping_wait_event(cb);
+	if (cb->state != RDMA_READ_ADV) {
+		fprintf(stderr, "wait for atomic count state %d\n", cb->state);
+		ret = -1;
+		goto out;
+	}
+
+	reported = __sync_add_and_fetch(&rping_targets.reported,
+					cb->remote_addr);
+	for (i = 0; i < rping_targets.count; i++)
+		sum += ((volatile uint64_t *) rping_targets.buf)[i];
+	printf("server: client did %" PRIu64 " atomic ops, targets sum %"
+	       PRIu64 " of %" PRIu64 " reported so far\n", cb->remote_addr,
+	       sum, reported);
+
+out:
+	ibv_dereg_mr(cb->atomic_mr);
+	return ret;
+}
+
+static int rping_bind_server(struct rping_cb *cb)
+{
+	int ret;
+
+	if (cb->sin.ss_family == AF_INET)
+		((struct sockaddr_in *) &cb->sin)->sin_port = cb->port;
+	else
+		((struct sockaddr_in6 *) &cb->sin)->sin6_port = cb->port;
+
+	ret = rdma_bind_addr(cb->cm_id, (struct sockaddr *) &cb->sin);
+	if (ret) {
+		perror("rdma_bind_addr");
+		return ret;
+	}
+	DEBUG_LOG("rdma_bind_addr successful\n");
+
+	DEBUG_LOG("rdma_listen\n");
+	ret = rdma_listen(cb->cm_id, cb->workers ? 1024 : 3);
+	if (ret) {
+		perror("rdma_listen");
+		return ret;
+	}
+
+	return 0;
+}
+
+static struct rping_cb *clone_cb(struct rping_cb *listening_cb)
+{
+	struct rping_device *dev = NULL;
+	struct ibv_mr *mr = NULL;
+	struct rping_cb *cb;
+
+	if (listening_cb->pooled) {
+		dev = rping_get_device(listening_cb->child_cm_id->verbs,
+				       (size_t) listening_cb->size *
+				       listening_cb->depth);
+		if (!dev)
+			return NULL;
+		cb = rping_pool_get(&dev->cbs, &mr);
+	} else {
+		cb = malloc(sizeof *cb);
+	}
+	if (!cb)
+		return NULL;
+	*cb = *listening_cb;
+	cb->dev = dev;
+	cb->cb_mr = mr;
+	cb->child_cm_id->context = cb;
+	return cb;
+}
+
+static void free_cb(struct rping_cb *cb)
+{
+	if (cb->dev)
+		rping_pool_put(&cb->dev->cbs, cb);
+	else
+		free(cb);
+}
+
+static long rping_rss(void)
+{
+	long size, resident = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * Persistent server accept latency, from the CONNECT_REQUEST event to
+ * rdma_accept() returning. It is printed with RSS each time the number
+ * of open connections reaches a new power of two.
+ */
+static struct {
+	pthread_mutex_t lock;
+	struct rping_samples samples;
+	int active;
+	int report_at;
+	long base_rss;
+} accept_stats = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.report_at = 1,
+};
+
+static void rping_accepted(struct rping_cb *cb)
+{
+	struct timeval now;
+	long rss;
+
+	gettimeofday(&now, NULL);
+
+	pthread_mutex_lock(&accept_stats.lock);
+	rping_add_sample(&accept_stats.samples, &cb->connect_time, &now);
+	accept_stats.active++;
+
+	if (accept_stats.active >= accept_stats.report_at) {
+		rss = rping_rss();
+		printf("server: %d connections, rss %ld KiB, %ld B/conn, "
+		       "accept ", accept_stats.active, rss / 1024,
+		       (rss - accept_stats.base_rss) / accept_stats.active);
+		report_latency_pairs(stdout, NULL, accept_stats.samples.start,
+				     accept_stats.samples.end,
+				     accept_stats.samples.count);
+		printf("\n");
+		rping_free_samples(&accept_stats.samples);
+		accept_stats.report_at *= 2;
+	}
+	pthread_mutex_unlock(&accept_stats.lock);
+}
+
+static void rping_closed(void)
+{
+	pthread_mutex_lock(&accept_stats.lock);
+	accept_stats.active--;
+	pthread_mutex_unlock(&accept_stats.lock);
+}
+
+static void *rping_persistent_server_thread(void *arg)
+{
+	struct rping_cb *cb = arg;
+	int ret;
+
+	ret = rping_setup_qp(cb, cb->child_cm_id);
+	if (ret) {
+		fprintf(stderr, "setup_qp failed: %d\n", ret);
+		goto err0;
+	}
+
+	ret = rping_setup_buffers(cb);
+	if (ret) {
+		fprintf(stderr, "rping_setup_buffers failed: %d\n", ret);
+		goto err1;
+	}
+
+	ret = rping_post_recvs(cb);
+	if (ret) {
+		fprintf(stderr, "ibv_post_recv failed: %d\n", ret);
+		goto err2;
+	}
+
+	if (rping_has_cq_thread(cb))
+		pthread_create(&cb->cqthread, NULL, cq_thread, cb);
+
+	ret = rping_accept(cb);
+	if (ret) {
+		fprintf(stderr, "connect error %d\n", ret);
+		goto err3;
+	}
+
+	if (cb->atomic)
+		rping_test_server_atomic(cb);
+	else if (cb->depth > 1)
+		rping_test_server_pipelined(cb);
+	else
+		rping_test_server(cb);
+	rdma_disconnect(cb->child_cm_id);
+	if (rping_has_cq_thread(cb))
+		pthread_join(cb->cqthread, NULL);
+	rping_free_buffers(cb);
+	rping_free_qp(cb);
+	rdma_destroy_id(cb->child_cm_id);
+	free_cb(cb);
+	rping_closed();
+	return NULL;
+err3:
+	if (rping_has_cq_thread(cb)) {
+		pthread_cancel(cb->cqthread);
+		pthread_join(cb->cqthread, NULL);
+	}
+err2:
+	rping_free_buffers(cb);
+err1:
+	rping_free_qp(cb);
+err0:
+	free_cb(cb);
+	return NULL;
+}
+
+/*
+ * One completion's worth of the lock-step server, for connections
+ * driven by a worker rather than their own thread.
+ */
+static int rping_server_step(struct rping_cb *cb, struct ibv_wc *wc)
+{
+	struct ibv_recv_wr *bad_recv_wr;
+	struct ibv_send_wr *bad_wr;
+	int ret;
+
+	if (wc->status) {
+		if (wc->status != IBV_WC_WR_FLUSH_ERR)
+			fprintf(stderr, "cq completion failed status %d\n",
+				wc->status);
+		return -1;
+	}
+
+	switch (wc->opcode) {
+	case IBV_WC_SEND:
+		return 0;
+
+	case IBV_WC_RECV:
+		ret = server_recv(cb, wc);
+		if (ret)
+			return ret;
+
+		ret = ibv_post_recv(cb->qp, &cb->rq_wr, &bad_recv_wr);
+		if (ret) {
+			fprintf(stderr, "post recv error: %d\n", ret);
+			return ret;
+		}
+
+		/* Phase stats (-L) are only kept by lock-step threads */
+		if (cb->state == RDMA_READ_ADV &&
+		    cb->remote_len & RPING_STATS_REQ) {
+			cb->state = RDMA_WRITE_COMPLETE;
+			ret = ibv_post_send(cb->qp, &cb->sq_wr, &bad_wr);
+			if (ret)
+				fprintf(stderr, "post send error %d\n", ret);
+			return ret;
+		}
+
+		if (cb->state == RDMA_READ_ADV) {
+			if (!cb->remote_len || cb->remote_len > cb->size) {
+				fprintf(stderr, "Bad ping size %d, "
+					"server size %d\n", cb->remote_len,
+					cb->size);
+				return -1;
+			}
+			cb->rdma_len = cb->remote_len;
+			cb->rdma_sq_wr.opcode = IBV_WR_RDMA_READ;
+		} else {
+			cb->rdma_len = MIN(cb->rdma_len, cb->remote_len);
+			if (cb->write_imm) {
+				cb->rdma_sq_wr.opcode =
+					IBV_WR_RDMA_WRITE_WITH_IMM;
+				cb->rdma_sq_wr.imm_data = htonl(cb->imm_seq++);
+			} else {
+				cb->rdma_sq_wr.opcode = IBV_WR_RDMA_WRITE;
+			}
+		}
+		cb->rdma_sq_wr.wr.rdma.rkey = cb->remote_rkey;
+		cb->rdma_sq_wr.wr.rdma.remote_addr = cb->remote_addr;
+		cb->rdma_offset = 0;
+		break;
+
+	case IBV_WC_RDMA_READ:
+	case IBV_WC_RDMA_WRITE:
+		if (cb->rdma_offset < cb->rdma_len)
+			break;
+
+		if (wc->opcode == IBV_WC_RDMA_READ) {
+			cb->state = RDMA_READ_COMPLETE;
+			if (cb->integrity &&
+			    rping_check(cb, cb->rdma_buf, cb->rdma_len))
+				return -1;
+			if (cb->verbose)
+				rping_print_data(cb, "server ping data", cb->rdma_buf);
+		} else {
+			cb->state = RDMA_WRITE_COMPLETE;
+			cb->worker->pings++;
+			if (cb->write_imm)
+				return 0;
+		}
+
+		/* Tell client to continue */
+		ret = ibv_post_send(cb->qp, &cb->sq_wr, &bad_wr);
+		if (ret)
+			fprintf(stderr, "post send error %d\n", ret);
+		return ret;
+
+	default:
+		DEBUG_LOG("unknown!!!!! completion\n");
+		return -1;
+	}
+
+	/* Start the transfer, or post the next batch of it */
+	ret = rping_post_rdma(cb, &cb->rdma_sq_wr, &cb->rdma_offset,
+			      cb->rdma_len);
+	if (ret)
+		fprintf(stderr, "post send error %d\n", ret);
+	return ret;
+}
+
+static int rping_worker_find(struct rping_worker *w, uint32_t qp_num)
+{
+	int lo = 0, hi = w->nconns;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (w->conns[mid]->qp->qp_num < qp_num)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static struct rping_cb *rping_worker_lookup(struct rping_worker *w,
+					    uint32_t qp_num)
+{
+	int i = rping_worker_find(w, qp_num);
+
+	if (i < w->nconns && w->conns[i]->qp->qp_num == qp_num)
+		return w->conns[i];
+	return NULL;
+}
+
+/*
+ * Called with the worker lock held. Makes room on the shared CQ for
+ * the new connection's send and receive queues.
+ */
+static int rping_worker_add(struct rping_worker *w, struct rping_cb *cb)
+{
+	int need = (w->nconns + 1) * (cb->sq_depth + 2);
+	int i;
+
+	if (need > w->cqe) {
+		if (ibv_resize_cq(w->cq, MAX(need, 2 * w->cqe))) {
+			fprintf(stderr, "ibv_resize_cq to %d failed\n",
+				MAX(need, 2 * w->cqe));
+			return -1;
+		}
+		w->cqe = w->cq->cqe;
+	}
+
+	if (w->nconns == w->alloced) {
+		int alloced = w->alloced ? w->alloced * 2 : 64;
+		struct rping_cb **conns;
+
+		conns = realloc(w->conns, alloced * sizeof(*conns));
+		if (!conns)
+			return -ENOMEM;
+		w->conns = conns;
+		w->alloced = alloced;
+	}
+
+	i = rping_worker_find(w, cb->qp->qp_num);
+	memmove(&w->conns[i + 1], &w->conns[i],
+		(w->nconns - i) * sizeof(*w->conns));
+	w->conns[i] = cb;
+	w->nconns++;
+	return 0;
+}
+
+static void rping_worker_del(struct rping_worker *w, struct rping_cb *cb)
+{
+	int i = rping_worker_find(w, cb->qp->qp_num);
+
+	if (i == w->nconns || w->conns[i] != cb)
+		return;
+	memmove(&w->conns[i], &w->conns[i + 1],
+		(w->nconns - i - 1) * sizeof(*w->conns));
+	w->nconns--;
+}
+
+/*
+ * Like rping_setup_qp() but the QP completes onto the worker's CQ.
+ */
+static int rping_setup_worker_qp(struct rping_cb *cb, struct rping_worker *w)
+{
+	struct rdma_cm_id *cm_id = cb->child_cm_id;
+	int ret;
+
+	ret = rping_get_pd(cb, cm_id->verbs);
+	if (ret)
+		return ret;
+
+	ret = rping_size_sq(cb, cm_id->verbs);
+	if (ret)
+		goto err1;
+
+	cb->worker = w;
+	cb->channel = NULL;
+	cb->cq = w->cq;
+	ret = rping_create_qp(cb);
+	if (ret) {
+		perror("rdma_create_qp");
+		goto err1;
+	}
+	return 0;
+
+err1:
+	rping_put_pd(cb);
+	return ret;
+}
+
+/*
+ * Tear down a pooled connection. Completions still queued for its QP
+ * are dropped by the QP number lookup.
+ */
+static void rping_worker_close(struct rping_worker *w, struct rping_cb *cb)
+{
+	rping_worker_del(w, cb);
+	rdma_disconnect(cb->child_cm_id);
+	ibv_destroy_qp(cb->qp);
+	rdma_destroy_id(cb->child_cm_id);
+	rping_free_buffers(cb);
+	rping_put_pd(cb);
+	free_cb(cb);
+}
+
+static void *rping_worker_thread(void *arg)
+{
+	struct rping_worker *w = arg;
+	struct ibv_wc wc[16];
+	struct ibv_cq *ev_cq;
+	struct rping_cb *cb;
+	void *ev_ctx;
+	int i, n;
+
+	/*
+	 * rping_stop_workers() cancels the thread, which may only happen
+	 * between batches, never with the table locked.
+	 */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	while (1) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		pthread_testcancel();
+		if (w->use_events &&
+		    ibv_get_cq_event(w->channel, &ev_cq, &ev_ctx)) {
+			fprintf(stderr, "Failed to get cq event!\n");
+			return NULL;
+		}
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (w->use_events) {
+			ibv_ack_cq_events(ev_cq, 1);
+			if (ibv_req_notify_cq(w->cq, 0)) {
+				fprintf(stderr, "Failed to set notify!\n");
+				return NULL;
+			}
+		}
+
+		/*
+		 * The lock only guards the connection table, so spinning on
+		 * an empty CQ does not hold off the accepting thread.
+		 */
+		while ((n = ibv_poll_cq(w->cq, 16, wc)) > 0) {
+			pthread_mutex_lock(&w->lock);
+			for (i = 0; i < n; i++) {
+				cb = rping_worker_lookup(w, wc[i].qp_num);
+				if (!cb)
+					continue;
+				w->completions++;
+				if (rping_server_step(cb, &wc[i])) {
+					rping_worker_close(w, cb);
+					rping_closed();
+				}
+			}
+			pthread_mutex_unlock(&w->lock);
+		}
+
+		if (n < 0) {
+			fprintf(stderr, "poll error %d\n", n);
+			return NULL;
+		}
+	}
+}
+
+static int rping_start_workers(struct rping_cb *listening_cb,
+			       struct ibv_context *verbs,
+			       struct rping_worker *workers)
+{
+	struct rping_worker *w;
+	int i;
+
+	for (i = 0; i < listening_cb->workers; i++) {
+		w = &workers[i];
+		pthread_mutex_init(&w->lock, NULL);
+		w->use_events = listening_cb->use_events;
+
+		w->channel = ibv_create_comp_channel(verbs);
+		if (!w->channel) {
+			fprintf(stderr, "ibv_create_comp_channel failed\n");
+			return errno;
+		}
+
+		w->cqe = 1024;
+		w->cq = ibv_create_cq(verbs, w->cqe, w, w->channel, 0);
+		if (!w->cq) {
+			fprintf(stderr, "ibv_create_cq failed\n");
+			return errno;
+		}
+		w->cqe = w->cq->cqe;
+
+		if (w->use_events && ibv_req_notify_cq(w->cq, 0)) {
+			fprintf(stderr, "ibv_req_notify_cq failed\n");
+			return errno;
+		}
+
+		errno = pthread_create(&w->thread, NULL, rping_worker_thread,
+				       w);
+		if (errno) {
+			perror("pthread_create");
+			return errno;
+		}
+		w->running = 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Stop the worker threads that were started, close the connections
+ * they still serve and free what rping_start_workers() set up.
+ */
+static void rping_stop_workers(struct rping_cb *listening_cb,
+			       struct rping_worker *workers)
+{
+	struct rping_worker *w;
+	int i;
+
+	for (i = 0; i < listening_cb->workers; i++) {
+		w = &workers[i];
+		if (w->running) {
+			pthread_cancel(w->thread);
+			pthread_join(w->thread, NULL);
+		}
+		while (w->nconns)
+			rping_worker_close(w, w->conns[0]);
+		free(w->conns);
+		if (w->cq)
+			ibv_destroy_cq(w->cq);
+		if (w->channel)
+			ibv_destroy_comp_channel(w->channel);
+	}
+	free(workers);
+}
+
+struct rping_pool_stats {
+	struct timeval time;
+	unsigned long pings;
+	unsigned long completions;
+};
+
+static void rping_report_workers(struct rping_cb *listening_cb,
+				 struct rping_worker *workers, long base_rss,
+				 struct rping_pool_stats *last)
+{
+	struct rping_pool_stats now;
+	unsigned long served = 0;
+	int i, active = 0;
+	double elapsed;
+	long rss;
+
+	memset(&now, 0, sizeof now);
+	gettimeofday(&now.time, NULL);
+	for (i = 0; i < listening_cb->workers; i++) {
+		pthread_mutex_lock(&workers[i].lock);
+		active += workers[i].nconns;
+		served += workers[i].served;
+		now.pings += workers[i].pings;
+		now.completions += workers[i].completions;
+		pthread_mutex_unlock(&workers[i].lock);
+	}
+
+	if (now.completions == last->completions && !active) {
+		*last = now;
+		return;
+	}
+
+	elapsed = (now.time.tv_sec - last->time.tv_sec) +
+		(now.time.tv_usec - last->time.tv_usec) / 1e6;
+	rss = rping_rss();
+
+	printf("server: %lu served, %d active, %.0f pings/sec, "
+	       "%.0f msgs/sec, rss %ld KiB", served, active,
+	       (now.pings - last->pings) / elapsed,
+	       (now.completions - last->completions) / elapsed,
+	       rss / 1024);
+	if (active)
+		printf(", %ld B/conn", (rss - base_rss) / active);
+	printf("\n");
+
+	*last = now;
+}
+
+/*
+ * Pooled persistent server. The main thread accepts connections and
+ * hands them to workers, and prints pool statistics every few seconds.
+ */
+static int rping_run_worker_server(struct rping_cb *listening_cb)
+{
+	struct rping_worker *workers, *w;
+	struct rping_pool_stats last;
+	struct rping_cb *cb;
+	struct timespec deadline;
+	long base_rss = 0;
+	int i, ret;
+
+	workers = calloc(listening_cb->workers, sizeof(*workers));
+	if (!workers)
+		return -ENOMEM;
+
+	ret = rping_bind_server(listening_cb);
+	if (ret)
+		goto out;
+
+	printf("server: %d workers\n", listening_cb->workers);
+	memset(&last, 0, sizeof last);
+	gettimeofday(&last.time, NULL);
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += 5;
+
+	while (1) {
+		if (sem_timedwait(&listening_cb->sem, &deadline)) {
+			if (errno == EINTR)
+				continue;
+			if (errno != ETIMEDOUT) {
+				ret = errno;
+				goto out;
+			}
+
+			if (workers[0].cq)
+				rping_report_workers(listening_cb, workers,
+						     base_rss, &last);
+			deadline.tv_sec += 5;
+			continue;
+		}
+
+		if (listening_cb->state != CONNECT_REQUEST ||
+		    rping_next_conn_req(listening_cb)) {
+			fprintf(stderr, "wait for CONNECT_REQUEST state %d\n",
+				listening_cb->state);
+			ret = -1;
+			goto out;
+		}
+
+		/* The pool is created on the device of the first client */
+		if (!workers[0].cq) {
+			base_rss = rping_rss();
+			ret = rping_start_workers(listening_cb,
+						  listening_cb->child_cm_id->verbs,
+						  workers);
+			if (ret)
+				goto out;
+		}
+
+		cb = clone_cb(listening_cb);
+		if (!cb) {
+			ret = -1;
+			goto out;
+		}
+
+		w = &workers[0];
+		for (i = 1; i < listening_cb->workers; i++)
+			if (workers[i].nconns < w->nconns)
+				w = &workers[i];
+
+		if (cb->child_cm_id->verbs != w->cq->context) {
+			fprintf(stderr, "connection on a second device, "
+				"rejecting\n");
+			goto err0;
+		}
+
+		ret = rping_setup_worker_qp(cb, w);
+		if (ret) {
+			fprintf(stderr, "setup_qp failed: %d\n", ret);
+			goto err0;
+		}
+
+		ret = rping_setup_buffers(cb);
+		if (ret) {
+			fprintf(stderr, "rping_setup_buffers failed: %d\n", ret);
+			goto err1;
+		}
+
+		ret = rping_post_recvs(cb);
+		if (ret) {
+			fprintf(stderr, "ibv_post_recv failed: %d\n", ret);
+			goto err2;
+		}
+
+		pthread_mutex_lock(&w->lock);
+		ret = rping_worker_add(w, cb);
+		if (!ret)
+			w->served++;
+		pthread_mutex_unlock(&w->lock);
+		if (ret)
+			goto err2;
+
+		/* ESTABLISHED is not waited for, the first RECV starts it */
+		ret = rping_post_accept(cb);
+		if (ret) {
+			pthread_mutex_lock(&w->lock);
+			rping_worker_close(w, cb);
+			pthread_mutex_unlock(&w->lock);
+		}
+		continue;
+
+err2:
+		rping_free_buffers(cb);
+err1:
+		ibv_destroy_qp(cb->qp);
+		rping_put_pd(cb);
+err0:
+		rdma_reject(cb->child_cm_id, NULL, 0);
+		rdma_destroy_id(cb->child_cm_id);
+		free_cb(cb);
+	}
+
+out:
+	rping_stop_workers(listening_cb, workers);
+	return ret;
+}
+
+static int rping_run_persistent_server(struct rping_cb *listening_cb)
+{
+	int ret;
+	struct rping_cb *cb;
+
+	accept_stats.base_rss = rping_rss();
+	if (listening_cb->workers)
+		return rping_run_worker_server(listening_cb);
+
+	ret = rping_bind_server(listening_cb);
+	if (ret)
+		return ret;
+
+	while (1) {
+		sem_wait(&listening_cb->sem);
+		if (listening_cb->state != CONNECT_REQUEST ||
+		    rping_next_conn_req(listening_cb)) {
+			fprintf(stderr, "wait for CONNECT_REQUEST state %d\n",
+				listening_cb->state);
+			return -1;
+		}
+
+		cb = clone_cb(listening_cb);
+		if (!cb)
+			return -1;
+		pthread_create(&cb->persistent_server_thread, NULL, rping_persistent_server_thread, cb);
+	}
+	return 0;
+}
+
+static int rping_run_server(struct rping_cb *cb)
+{
+	int ret;
+
+	ret = rping_bind_server(cb);
+	if (ret)
+		return ret;
+
+	sem_wait(&cb->sem);
+	if (cb->state != CONNECT_REQUEST) {
+		fprintf(stderr, "wait for CONNECT_REQUEST state %d\n",
+			cb->state);
+		return -1;
+	}
+
+	ret = rping_setup_qp(cb, cb->child_cm_id);
+	if (ret) {
+		fprintf(stderr, "setup_qp failed: %d\n", ret);
+		return ret;
+	}
+
+	ret = rping_setup_buffers(cb);
+	if (ret) {
+		fprintf(stderr, "rping_setup_buffers failed: %d\n", ret);
+		goto err1;
+	}
+
+	ret = rping_post_recvs(cb);
+	if (ret) {
+		fprintf(stderr, "ibv_post_recv failed: %d\n", ret);
+		goto err2;
+	}
+
+	if (rping_has_cq_thread(cb))
+		pthread_create(&cb->cqthread, NULL, cq_thread, cb);
+
+	ret = rping_accept(cb);
+	if (ret) {
+		fprintf(stderr, "connect error %d\n", ret);
+		goto err2;
+	}
+
+	if (cb->atomic)
+		rping_test_server_atomic(cb);
+	else if (cb->depth > 1)
+		rping_test_server_pipelined(cb);
+	else
+		rping_test_server(cb);
+	rdma_disconnect(cb->child_cm_id);
+	if (rping_has_cq_thread(cb))
+		pthread_join(cb->cqthread, NULL);
+	rdma_destroy_id(cb->child_cm_id);
+err2:
+	rping_free_buffers(cb);
+err1:
+	rping_free_qp(cb);
+
+	return ret;
+}
+
+/*
+ * Put some ascii text in the buffer, rotating the starting letter by
+ * one on every ping, or the -T pattern seeded with the ping number.
+ */
+static void rping_format_ping(struct rping_cb *cb, char *buf, int ping)
+{
+	unsigned char c;
+	int cc, i;
+
+	if (cb->pattern >= 0) {
+		pattern_fill(buf, cb->payload, cb->pattern, ping);
+		goto seal;
+	}
+
+	cc = sprintf(buf, RPING_MSG_FMT, ping);
+	for (i = cc, c = 65 + ping % 58; i < cb->payload; i++) {
+		buf[i] = c;
+		c++;
+		if (c > 122)
+			c = 65;
+	}
+	buf[cb->payload - 1] = 0;
+
+seal:
+	if (cb->integrity)
+		rping_seal(cb, buf, cb->size);
+}
+
+static int rping_validate(struct rping_cb *cb, const char *sent,
+			  const char *echo, int ping)
+{
+	ssize_t bad;
+
+	if (cb->pattern < 0) {
+		if (!memcmp(sent, echo, cb->size))
+			return 0;
+		fprintf(stderr, "data mismatch on ping %d!\n", ping);
+		return -1;
+	}
+
+	bad = pattern_verify(echo, cb->payload, cb->pattern, ping);
+	if (bad < 0)
+		return 0;
+	fprintf(stderr, "data mismatch on ping %d at byte %zd: got 0x%02x "
+		"expected 0x%02x\n", ping, bad, (unsigned char) echo[bad],
+		pattern_byte(cb->pattern, ping, bad));
+	return -1;
+}
+
+/*
+ * Ask the server for its phase histograms at the end of a -L run.
+ */
+static int rping_fetch_phases(struct rping_cb *cb)
+{
+	size_t len = RPING_SERVER_PHASES * sizeof(struct rping_hist);
+	struct rping_hist *server = &cb->phase[PH_SERVER_READ];
+	struct ibv_send_wr *bad_wr;
+	struct ibv_mr *mr;
+	int ret;
+
+	mr = ibv_reg_mr(cb->pd, server, len,
+			IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+	if (!mr) {
+		fprintf(stderr, "phase stats reg_mr failed\n");
+		return errno;
+	}
+
+	cb->state = RDMA_READ_ADV;
+	rping_format_send(cb, (char *) server, mr);
+	cb->send_buf.size = htonl(len | RPING_STATS_REQ);
+	ret = ibv_post_send(cb->qp, &cb->sq_wr, &bad_wr);
+	if (ret) {
+		fprintf(stderr, "post send error %d\n", ret);
+		goto out;
+	}
+
+	rping_wait_event(cb);
+	if (cb->state != RDMA_WRITE_ADV) {
+		fprintf(stderr, "wait for phase stats state %d\n", cb->state);
+		ret = -1;
+		goto out;
+	}
+
+	rping_hist_swap(server, RPING_SERVER_PHASES, 0);
+	if (!cb->phase[PH_SERVER_PING].count)
+		printf("server sent no phase stats, run it with -L and "
+		       "without -w\n");
+out:
+	ibv_dereg_mr(mr);
+	return ret;
+}
+
+static int rping_test_client(struct rping_cb *cb)
+{
+	int ping, ret = 0;
+	struct ibv_send_wr *bad_wr;
+	struct timeval tstart, tend;
+	uint64_t t[3];
+
+	if (cb->phases) {
+		cb->phase = calloc(RPING_PHASES, sizeof *cb->phase);
+		if (!cb->phase)
+			return -ENOMEM;
+	}
+
+	for (ping = 0; !cb->count || ping < cb->count; ping++) {
+		cb->state = RDMA_READ_ADV;
+
+		if (cb->peer_adv_valid) {
+			/* -D: ping 0 went out with the connect request */
+			cb->peer_adv_valid = 0;
+			gettimeofday(&tstart, NULL);
+			t[0] = rping_ns();
+		} else {
+			rping_format_ping(cb, cb->start_buf, ping);
+
+			gettimeofday(&tstart, NULL);
+			t[0] = rping_ns();
+			rping_format_send(cb, cb->start_buf, cb->start_mr);
+			ret = ibv_post_send(cb->qp, &cb->sq_wr, &bad_wr);
+			if (ret) {
+				fprintf(stderr, "post send error %d\n", ret);
+				break;
+			}
+			cb->msgs++;
+		}
+
+		/* Wait for server to ACK */
+		rping_wait_event(cb);
+		if (cb->state != RDMA_WRITE_ADV) {
+			fprintf(stderr, "wait for RDMA_WRITE_ADV state %d\n",
+				cb->state);
+			ret = -1;
+			break;
+		}
+		t[1] = rping_ns();
+		if (!ping)
+			printf("client: time to first byte %.1f usec, first "
+			       "adv %s\n", (t[1] - cb->connect_start) / 1e3,
+			       cb->cm_adv && !cb->cm_fallback ?
+			       "in private data" : "sent");
+
+		rping_format_send(cb, cb->rdma_buf, cb->rdma_mr);
+		if (cb->write_imm)
+			cb->send_buf.size |= htonl(RPING_WRITE_IMM);
+		ret = ibv_post_send(cb->qp, &cb->sq_wr, &bad_wr);
+		if (ret) {
+			fprintf(stderr, "post send error %d\n", ret);
+			break;
+		}
+		cb->msgs++;
+		t[2] = rping_ns();
+
+		/* Wait for the server to say the RDMA Write is complete. */
+		rping_wait_event(cb);
+		if (cb->state != RDMA_WRITE_COMPLETE) {
+			fprintf(stderr, "wait for RDMA_WRITE_COMPLETE state %d\n",
+				cb->state);
+			ret = -1;
+			break;
+		}
+		gettimeofday(&tend, NULL);
+		rping_phase_add(cb, PH_CLIENT_READ, t[0], t[1]);
+		rping_phase_add(cb, PH_CLIENT_TURN, t[1], t[2]);
+		rping_phase_add(cb, PH_CLIENT_WRITE, t[2], rping_ns());
+		rping_phase_add(cb, PH_CLIENT_PING, t[0], rping_ns());
+		ret = rping_add_sample(&cb->pings, &tstart, &tend);
+		if (ret)
+			break;
+
+		if (cb->validate && rping_validate(cb, cb->start_buf,
+						   cb->rdma_buf, ping)) {
+			ret = -1;
+			break;
+		}
+
+		if (cb->integrity && rping_check(cb, cb->rdma_buf, cb->size)) {
+			fprintf(stderr, "ping %d corrupted on the way back\n",
+				ping);
+			ret = -1;
+			break;
+		}
+
+		if (cb->verbose)
+			rping_print_data(cb, "ping data", cb->rdma_buf);
+	}
+
+	if (!ret && cb->phase)
+		ret = rping_fetch_phases(cb);
+
+	if (!ret) {
+		rping_report_samples("client", &cb->pings, 2 * cb->size);
+		rping_report_messages(cb, "client");
+		rping_report_integrity(cb, "client");
+		if (cb->phase)
+			rping_report_phases(cb, PH_CLIENT_READ, RPING_PHASES);
+	}
+	free(cb->phase);
+	cb->phase = NULL;
+	rping_free_samples(&cb->pings);
+	return ret;
+}
+
+static int rping_pipe_start(struct rping_cb *cb, struct rping_slot *slot,
+			    int ping)
+{
+	rping_format_ping(cb, slot->start_buf, ping);
+	slot->ping = ping;
+	gettimeofday(&slot->start, NULL);
+	return rping_pipe_send(cb, slot, 0);
+}
+
+/*
+ * Run count pings (forever if count is 0) keeping depth of them in
+ * flight. ping numbers the pings across calls.
+ */
+static int rping_pipe_client_run(struct rping_cb *cb, int depth, int *ping)
+{
+	struct ibv_recv_wr *bad_wr;
+	struct rping_slot *slot, *rslot;
+	struct timeval end;
+	struct ibv_wc wc;
+	int issued = 0, done = 0;
+	int i, sink, ret;
+
+	for (i = 0; i < depth && (!cb->count || issued < cb->count); i++) {
+		ret = rping_pipe_start(cb, &cb->slots[i], (*ping)++);
+		if (ret) {
+			fprintf(stderr, "post send error %d\n", ret);
+			return ret;
+		}
+		issued++;
+	}
+
+	while (!cb->count || done < cb->count) {
+		ret = rping_pipe_poll(cb, &wc);
+		if (ret)
+			return ret;
+
+		if (wc.opcode == IBV_WC_SEND)
+			continue;
+		if (wc.opcode != IBV_WC_RECV) {
+			DEBUG_LOG("unknown!!!!! completion\n");
+			return -1;
+		}
+
+		rslot = (struct rping_slot *) (unsigned long) wc.wr_id;
+		ret = ibv_post_recv(cb->qp, &rslot->rq_wr, &bad_wr);
+		if (ret) {
+			fprintf(stderr, "post recv error: %d\n", ret);
+			return ret;
+		}
+
+		slot = rping_pipe_slot(cb, &wc, &sink);
+		if (!slot)
+			return -1;
+
+		/* Source has been read, hand over the sink */
+		if (!sink) {
+			ret = rping_pipe_send(cb, slot, 1);
+			if (ret) {
+				fprintf(stderr, "post send error %d\n", ret);
+				return ret;
+			}
+			continue;
+		}
+
+		gettimeofday(&end, NULL);
+		ret = rping_add_sample(&cb->pings, &slot->start, &end);
+		if (ret)
+			return ret;
+		done++;
+
+		if (cb->validate && rping_validate(cb, slot->start_buf,
+						   slot->rdma_buf, slot->ping))
+			return -1;
+
+		if (cb->integrity &&
+		    rping_check(cb, slot->rdma_buf, cb->size)) {
+			fprintf(stderr, "ping %d corrupted on the way back\n",
+				slot->ping);
+			return -1;
+		}
+
+		if (cb->verbose)
+			rping_print_data(cb, "ping data", slot->rdma_buf);
+
+		if (cb->count && issued == cb->count)
+			continue;
+
+		ret = rping_pipe_start(cb, slot, (*ping)++);
+		if (ret) {
+			fprintf(stderr, "post send error %d\n", ret);
+			return ret;
+		}
+		issued++;
+	}
+
+	return 0;
+}
+
+/*
+ * Step the pipeline depth up in powers of two to -Q, running -C pings
+ * at each depth and reporting throughput and latency for each step.
+ */
+static int rping_test_client_pipelined(struct rping_cb *cb)
+{
+	char label[32];
+	int depth = cb->count ? 1 : cb->depth;
+	int ping = 0;
+	int ret;
+
+	while (1) {
+		ret = rping_pipe_client_run(cb, depth, &ping);
+		if (ret)
+			break;
+
+		snprintf(label, sizeof label, "depth %d", depth);
+		rping_report_samples(label, &cb->pings, 2 * cb->size);
+		rping_report_integrity(cb, label);
+		rping_free_samples(&cb->pings);
+
+		if (depth == cb->depth)
+			break;
+		depth = MIN(depth * 2, cb->depth);
+	}
+
+	rping_free_samples(&cb->pings);
+	return ret;
+}
+
+static int rping_post_atomic(struct rping_cb *cb, struct ibv_send_wr *wr,
+			     int slot, int target, uint64_t expect)
+{
+	struct ibv_send_wr *bad_wr;
+
+	wr->wr_id = slot;
+	wr->sg_list->addr = (uint64_t) (unsigned long)
+			    (cb->rdma_buf + slot * sizeof(uint64_t));
+	wr->wr.atomic.remote_addr = cb->remote_addr +
+				    target * sizeof(uint64_t);
+	if (cb->atomic_op == IBV_WR_ATOMIC_FETCH_AND_ADD) {
+		wr->wr.atomic.compare_add = 1;
+	} else {
+		wr->wr.atomic.compare_add = expect;
+		wr->wr.atomic.swap = expect + 1;
+	}
+
+	return ibv_post_send(cb->qp, wr, &bad_wr);
+}
+
+/*
+ * Keep atomic_depth atomics in flight against random targets. A
+ * compare-and-swap expects the last value this connection saw in the
+ * target, so it only succeeds if nobody else got there first.
+ */
+static int rping_test_client_atomic(struct rping_cb *cb)
+{
+	struct ibv_send_wr wr, *bad_wr;
+	struct ibv_sge sge;
+	struct ibv_wc wc;
+	struct timeval *start = NULL, end;
+	uint64_t *result = (uint64_t *) cb->rdma_buf;
+	uint64_t *seen = NULL;
+	int *target = NULL;
+	int issued = 0, done = 0, i, t, ret;
+	unsigned seed = getpid() ^ (cb->conn_index << 16);
+
+	/* The server's advertisement is the only message before the run */
+	ret = rping_pipe_poll(cb, &wc);
+	if (ret)
+		return ret;
+	if (wc.opcode != IBV_WC_RECV || wc.byte_len != sizeof cb->recv_buf) {
+		fprintf(stderr, "expected the server's atomic targets\n");
+		return -1;
+	}
+	cb->remote_rkey = ntohl(cb->recv_buf.rkey);
+	cb->remote_addr = ntohll(cb->recv_buf.buf);
+	cb->targets = MIN(cb->targets,
+			  ntohl(cb->recv_buf.size) / sizeof(uint64_t));
+	if (cb->targets < 1) {
+		fprintf(stderr, "server has no atomic targets, is it "
+			"running with -A?\n");
+		return -1;
+	}
+
+	start = calloc(cb->atomic_depth, sizeof *start);
+	target = calloc(cb->atomic_depth, sizeof *target);
+	seen = calloc(cb->targets, sizeof *seen);
+	if (!start || !target || !seen) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	memset(&sge, 0, sizeof sge);
+	sge.length = sizeof(uint64_t);
+	sge.lkey = cb->rdma_mr->lkey;
+	memset(&wr, 0, sizeof wr);
+	wr.opcode = cb->atomic_op;
+	wr.send_flags = IBV_SEND_SIGNALED;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.wr.atomic.rkey = cb->remote_rkey;
+
+	for (i = 0; i < cb->atomic_depth && issued < cb->count; i++) {
+		target[i] = rand_r(&seed) % cb->targets;
+		gettimeofday(&start[i], NULL);
+		ret = rping_post_atomic(cb, &wr, i, target[i],
+					seen[target[i]]);
+		if (ret)
+			goto post_err;
+		issued++;
+	}
+
+	while (done < issued) {
+		ret = rping_pipe_poll(cb, &wc);
+		if (ret)
+			goto out;
+		gettimeofday(&end, NULL);
+
+		i = wc.wr_id;
+		ret = rping_add_sample(&cb->pings, &start[i], &end);
+		if (ret)
+			goto out;
+		done++;
+
+		t = target[i];
+		if (cb->atomic_op == IBV_WR_ATOMIC_FETCH_AND_ADD ||
+		    result[i] == seen[t]) {
+			cb->atomic_ok++;
+			seen[t] = result[i] + 1;
+		} else {
+			seen[t] = result[i];
+		}
+
+		if (issued == cb->count)
+			continue;
+		target[i] = rand_r(&seed) % cb->targets;
+		gettimeofday(&start[i], NULL);
+		ret = rping_post_atomic(cb, &wr, i, target[i],
+					seen[target[i]]);
+		if (ret)
+			goto post_err;
+		issued++;
+	}
+
+	cb->send_buf.buf = htonll(cb->atomic_ok);
+	cb->send_buf.rkey = 0;
+	cb->send_buf.size = 0;
+	ret = ibv_post_send(cb->qp, &cb->sq_wr, &bad_wr);
+	if (ret)
+		goto post_err;
+	ret = rping_pipe_poll(cb, &wc);
+	goto out;
+
+post_err:
+	fprintf(stderr, "post send error %d\n", ret);
+out:
+	free(start);
+	free(target);
+	free(seen);
+	return ret;
+}
+
+static int rping_connect_client(struct rping_cb *cb)
+{
+	struct rdma_conn_param conn_param;
+	struct rping_cm_data data;
+	int ret;
+
+	memset(&conn_param, 0, sizeof conn_param);
+	rping_rd_atom(cb, cb->cm_id->verbs, &conn_param);
+	conn_param.retry_count = 10;
+	if (cb->depth > 1)
+		printf("client: depth %d ird %d ord %d\n", cb->depth,
+		       conn_param.responder_resources,
+		       conn_param.initiator_depth);
+
+	if (cb->cm_adv) {
+		/* The server may read ping 0 as soon as it accepts */
+		rping_format_ping(cb, cb->start_buf, 0);
+		rping_format_send(cb, cb->start_buf, cb->start_mr);
+		memset(&data, 0, sizeof data);
+		data.magic = htonl(RPING_CM_MAGIC);
+		data.adv = cb->send_buf;
+		conn_param.private_data = &data;
+		conn_param.private_data_len = sizeof data;
+	}
+
+	cb->connect_start = rping_ns();
+	ret = rdma_connect(cb->cm_id, &conn_param);
+	if (ret) {
+		perror("rdma_connect");
+		return ret;
+	}
+
+	sem_wait(&cb->sem);
+	if (cb->state != CONNECTED) {
+		fprintf(stderr, "wait for CONNECTED state %d\n", cb->state);
+		return -1;
+	}
+
+	if (cb->cm_adv && !cb->peer_adv_valid) {
+		printf("client: server ignored the private data adv, "
+		       "sending it\n");
+		cb->cm_fallback = 1;
+	} else if (cb->cm_adv && ntohl(cb->peer_adv.size) < cb->size) {
+		fprintf(stderr, "server takes pings up to %u bytes\n",
+			ntohl(cb->peer_adv.size));
+		return -1;
+	}
+	if (!cb->cm_adv)
+		cb->peer_adv_valid = 0;
+
+	DEBUG_LOG("rmda_connect successful\n");
+	return 0;
+}
+
+static int rping_bind_client(struct rping_cb *cb)
 {
 	int ret;
 
@@ -733,48 +3770,35 @@ static int rping_bind_server(struct rping_cb *cb)
 	else
 		((struct sockaddr_in6 *) &cb->sin)->sin6_port = cb->port;
 
-	ret = rdma_bind_addr(cb->cm_id, (struct sockaddr *) &cb->sin);
+	ret = rdma_resolve_addr(cb->cm_id, NULL, (struct sockaddr *) &cb->sin, 2000);
 	if (ret) {
-		perror("rdma_bind_addr");
+		perror("rdma_resolve_addr");
 		return ret;
 	}
-	DEBUG_LOG("rdma_bind_addr successful\n");
 
-	DEBUG_LOG("rdma_listen\n");
-	ret = rdma_listen(cb->cm_id, 3);
-	if (ret) {
-		perror("rdma_listen");
-		return ret;
+	sem_wait(&cb->sem);
+	if (cb->state != ROUTE_RESOLVED) {
+		fprintf(stderr, "waiting for addr/route resolution state %d\n",
+			cb->state);
+		return -1;
 	}
 
+	DEBUG_LOG("rdma_resolve_addr - rdma_resolve_route successful\n");
 	return 0;
 }
 
-static struct rping_cb *clone_cb(struct rping_cb *listening_cb)
-{
-	struct rping_cb *cb = malloc(sizeof *cb);
-	if (!cb)
-		return NULL;
-	*cb = *listening_cb;
-	cb->child_cm_id->context = cb;
-	return cb;
-}
-
-static void free_cb(struct rping_cb *cb)
-{
-	free(cb);
-}
-
-static void *rping_persistent_server_thread(void *arg)
+static int rping_run_client(struct rping_cb *cb)
 {
-	struct rping_cb *cb = arg;
-	struct ibv_recv_wr *bad_wr;
 	int ret;
 
-	ret = rping_setup_qp(cb, cb->child_cm_id);
+	ret = rping_bind_client(cb);
+	if (ret)
+		return ret;
+
+	ret = rping_setup_qp(cb, cb->cm_id);
 	if (ret) {
 		fprintf(stderr, "setup_qp failed: %d\n", ret);
-		goto err0;
+		return ret;
 	}
 
 	ret = rping_setup_buffers(cb);
@@ -783,289 +3807,860 @@ static void *rping_persistent_server_thread(void *arg)
 		goto err1;
 	}
 
-	ret = ibv_post_recv(cb->qp, &cb->rq_wr, &bad_wr);
+	ret = rping_post_recvs(cb);
 	if (ret) {
 		fprintf(stderr, "ibv_post_recv failed: %d\n", ret);
 		goto err2;
 	}
 
-	pthread_create(&cb->cqthread, NULL, cq_thread, cb);
+	if (rping_has_cq_thread(cb))
+		pthread_create(&cb->cqthread, NULL, cq_thread, cb);
 
-	ret = rping_accept(cb);
+	ret = rping_connect_client(cb);
 	if (ret) {
 		fprintf(stderr, "connect error %d\n", ret);
-		goto err3;
+		goto err2;
 	}
 
-	rping_test_server(cb);
-	rdma_disconnect(cb->child_cm_id);
-	pthread_join(cb->cqthread, NULL);
-	rping_free_buffers(cb);
-	rping_free_qp(cb);
-	rdma_destroy_id(cb->child_cm_id);
-	free_cb(cb);
-	return NULL;
+	if (cb->atomic)
+		ret = rping_test_client_atomic(cb);
+	else if (cb->depth > 1)
+		ret = rping_test_client_pipelined(cb);
+	else
+		ret = rping_test_client(cb);
+	if (ret) {
+		fprintf(stderr, "rping client failed: %d\n", ret);
+		goto err3;
+	}
+	ret = 0;
 err3:
-	pthread_cancel(cb->cqthread);
-	pthread_join(cb->cqthread, NULL);
+	rdma_disconnect(cb->cm_id);
 err2:
+	if (rping_has_cq_thread(cb))
+		pthread_join(cb->cqthread, NULL);
 	rping_free_buffers(cb);
 err1:
 	rping_free_qp(cb);
-err0:
-	free_cb(cb);
+
+	return ret;
+}
+
+static void *rping_atomic_client_thread(void *arg)
+{
+	struct rping_cb *cb = arg;
+
+	cb->thread_ret = rping_run_client(cb);
 	return NULL;
 }
 
-static int rping_run_persistent_server(struct rping_cb *listening_cb)
+static void rping_report_atomic(struct rping_cb *conns, int n)
 {
-	int ret;
-	struct rping_cb *cb;
+	struct rping_samples all;
+	struct timeval first, last;
+	uint64_t ok = 0;
+	double elapsed;
+	int i, j;
+
+	memset(&all, 0, sizeof all);
+	for (i = 0; i < n; i++) {
+		ok += conns[i].atomic_ok;
+		for (j = 0; j < conns[i].pings.count; j++)
+			if (rping_add_sample(&all, &conns[i].pings.start[j],
+					     &conns[i].pings.end[j]))
+				goto out;
+	}
+	if (!all.count)
+		goto out;
 
-	ret = rping_bind_server(listening_cb);
-	if (ret)
-		return ret;
+	first = all.start[0];
+	last = all.end[0];
+	for (i = 1; i < all.count; i++) {
+		if (timercmp(&all.start[i], &first, <))
+			first = all.start[i];
+		if (timercmp(&all.end[i], &last, >))
+			last = all.end[i];
+	}
+	elapsed = (last.tv_sec - first.tv_sec) +
+		  (last.tv_usec - first.tv_usec) / 1e6;
+
+	printf("atomic %s: %d conns, depth %d, %d targets: %d ops in %.3f "
+	       "sec = %.0f ops/sec\n",
+	       conns[0].atomic_op == IBV_WR_ATOMIC_FETCH_AND_ADD ?
+	       "fadd" : "cas", n, conns[0].atomic_depth, conns[0].targets,
+	       all.count, elapsed, all.count / elapsed);
+	if (conns[0].atomic_op == IBV_WR_ATOMIC_CMP_AND_SWP)
+		printf("atomic cas: %" PRIu64 " swapped, %.1f%% lost to "
+		       "contention\n", ok, 100.0 * (all.count - ok) /
+		       all.count);
+	printf("atomic latency: ");
+	report_latency_pairs(stdout, NULL, all.start, all.end, all.count);
+	printf("\natomic percentiles: ");
+	report_percentiles(stdout, all.start, all.end, all.count);
+	printf("\n");
 
-	while (1) {
-		sem_wait(&listening_cb->sem);
-		if (listening_cb->state != CONNECT_REQUEST) {
-			fprintf(stderr, "wait for CONNECT_REQUEST state %d\n",
-				listening_cb->state);
-			return -1;
+out:
+	rping_free_samples(&all);
+}
+
+/*
+ * Run -j atomics connections, each in its own thread with its own CM
+ * channel, and report them together.
+ */
+static int rping_run_atomic_clients(struct rping_cb *cb)
+{
+	struct rping_cb *conns;
+	pthread_t *threads;
+	int i, n = 0, ret = 0;
+
+	conns = calloc(cb->conns, sizeof *conns);
+	threads = calloc(cb->conns, sizeof *threads);
+	if (!conns || !threads) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (n = 0; n < cb->conns; n++) {
+		struct rping_cb *c = &conns[n];
+
+		*c = *cb;
+		c->conn_index = n;
+		sem_init(&c->sem, 0, 0);
+		c->cm_channel = rdma_create_event_channel();
+		if (!c->cm_channel) {
+			perror("rdma_create_event_channel");
+			ret = errno;
+			break;
+		}
+		ret = rdma_create_id(c->cm_channel, &c->cm_id, c, RDMA_PS_TCP);
+		if (ret) {
+			perror("rdma_create_id");
+			rdma_destroy_event_channel(c->cm_channel);
+			break;
+		}
+		ret = pthread_create(&c->cmthread, NULL, cm_thread, c);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			rdma_destroy_id(c->cm_id);
+			rdma_destroy_event_channel(c->cm_channel);
+			break;
 		}
+		ret = pthread_create(&threads[n], NULL,
+				     rping_atomic_client_thread, c);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			/* Nothing was started on the id, so no event is due */
+			pthread_cancel(c->cmthread);
+			pthread_join(c->cmthread, NULL);
+			rdma_destroy_id(c->cm_id);
+			rdma_destroy_event_channel(c->cm_channel);
+			break;
+		}
+	}
 
-		cb = clone_cb(listening_cb);
-		if (!cb)
-			return -1;
-		pthread_create(&cb->persistent_server_thread, NULL, rping_persistent_server_thread, cb);
+	for (i = 0; i < n; i++) {
+		pthread_join(threads[i], NULL);
+		if (conns[i].thread_ret && !ret)
+			ret = conns[i].thread_ret;
 	}
-	return 0;
+
+	if (!ret)
+		rping_report_atomic(conns, n);
+
+	for (i = 0; i < n; i++) {
+		rping_free_samples(&conns[i].pings);
+		rdma_destroy_id(conns[i].cm_id);
+		rdma_destroy_event_channel(conns[i].cm_channel);
+	}
+out:
+	free(conns);
+	free(threads);
+	return ret;
 }
 
-static int rping_run_server(struct rping_cb *cb)
+/*
+ * Load generator (-j with pings). Connections are set up one after
+ * the other from the main thread, then -w threads each busy-poll every
+ * nthreads'th connection and drive it with rping_client_step().
+ */
+struct rping_load_thread {
+	struct rping_cb *conns;
+	int n;
+	int nthreads;
+	int index;
+	pthread_t thread;
+	int ret;
+};
+
+static int rping_load_send(struct rping_cb *cb, char *buf,
+			   struct ibv_mr *mr, int sink)
 {
-	struct ibv_recv_wr *bad_wr;
+	struct ibv_send_wr *bad_wr;
 	int ret;
 
-	ret = rping_bind_server(cb);
+	rping_format_send(cb, buf, mr);
+	if (sink && cb->write_imm)
+		cb->send_buf.size |= htonl(RPING_WRITE_IMM);
+	ret = ibv_post_send(cb->qp, &cb->sq_wr, &bad_wr);
 	if (ret)
-		return ret;
+		fprintf(stderr, "post send error %d\n", ret);
+	cb->msgs++;
+	return ret;
+}
 
-	sem_wait(&cb->sem);
-	if (cb->state != CONNECT_REQUEST) {
-		fprintf(stderr, "wait for CONNECT_REQUEST state %d\n",
-			cb->state);
+static int rping_load_ping(struct rping_cb *cb)
+{
+	cb->state = RDMA_READ_ADV;
+	if (cb->peer_adv_valid) {
+		/* -D: ping 0 went out with the connect request */
+		cb->peer_adv_valid = 0;
+		gettimeofday(&cb->load_start, NULL);
+		return 0;
+	}
+
+	rping_format_ping(cb, cb->start_buf, cb->pings.count);
+	gettimeofday(&cb->load_start, NULL);
+	return rping_load_send(cb, cb->start_buf, cb->start_mr, 0);
+}
+
+/*
+ * One completion's worth of the lock-step client, the counterpart of
+ * rping_server_step().
+ */
+static int rping_client_step(struct rping_cb *cb, struct ibv_wc *wc)
+{
+	struct ibv_recv_wr *bad_recv_wr;
+	struct timeval end;
+	int ping, ret;
+
+	cb->cqes++;
+	if (wc->status) {
+		if (wc->status != IBV_WC_WR_FLUSH_ERR)
+			fprintf(stderr, "cq completion failed status %d\n",
+				wc->status);
 		return -1;
 	}
 
-	ret = rping_setup_qp(cb, cb->child_cm_id);
+	switch (wc->opcode) {
+	case IBV_WC_SEND:
+		return 0;
+
+	case IBV_WC_RECV:
+		ret = client_recv(cb, wc);
+		break;
+
+	case IBV_WC_RECV_RDMA_WITH_IMM:
+		ret = client_recv_imm(cb, wc);
+		break;
+
+	default:
+		DEBUG_LOG("unknown!!!!! completion\n");
+		return -1;
+	}
+	if (ret)
+		return ret;
+
+	cb->msgs++;
+	ret = ibv_post_recv(cb->qp, &cb->rq_wr, &bad_recv_wr);
 	if (ret) {
-		fprintf(stderr, "setup_qp failed: %d\n", ret);
+		fprintf(stderr, "post recv error: %d\n", ret);
 		return ret;
 	}
 
-	ret = rping_setup_buffers(cb);
-	if (ret) {
-		fprintf(stderr, "rping_setup_buffers failed: %d\n", ret);
-		goto err1;
+	/* The server has read the ping, give it the sink */
+	if (cb->state == RDMA_WRITE_ADV)
+		return rping_load_send(cb, cb->rdma_buf, cb->rdma_mr, 1);
+
+	/* The echo is in */
+	gettimeofday(&end, NULL);
+	rping_hist_add(cb->load_hist,
+		       (end.tv_sec - cb->load_start.tv_sec) * 1000000000ULL +
+		       (end.tv_usec - cb->load_start.tv_usec) * 1000LL);
+	ping = cb->pings.count;
+	ret = rping_add_sample(&cb->pings, &cb->load_start, &end);
+	if (ret)
+		return ret;
+
+	if (cb->validate && rping_validate(cb, cb->start_buf, cb->rdma_buf,
+					   ping))
+		return -1;
+	if (cb->integrity && rping_check(cb, cb->rdma_buf, cb->size)) {
+		fprintf(stderr, "connection %d ping %d corrupted on the way "
+			"back\n", cb->conn_index, ping);
+		return -1;
 	}
 
-	ret = ibv_post_recv(cb->qp, &cb->rq_wr, &bad_wr);
-	if (ret) {
-		fprintf(stderr, "ibv_post_recv failed: %d\n", ret);
-		goto err2;
+	if (cb->pings.count == cb->count) {
+		cb->load_done = 1;
+		return 0;
+	}
+	return rping_load_ping(cb);
+}
+
+static void *rping_load_thread(void *arg)
+{
+	struct rping_load_thread *t = arg;
+	struct ibv_wc wc[16];
+	struct rping_cb *cb;
+	int i, j, n, active = 0, ret;
+
+	for (i = t->index; i < t->n; i += t->nthreads)
+		active++;
+
+	while (active) {
+		uint64_t now = rping_ns();
+
+		for (i = t->index; i < t->n; i += t->nthreads) {
+			cb = &t->conns[i];
+			if (cb->load_done)
+				continue;
+
+			ret = 0;
+			if (!cb->load_started) {
+				if (now < cb->load_at)
+					continue;
+				cb->load_started = 1;
+				ret = rping_load_ping(cb);
+			} else {
+				n = ibv_poll_cq(cb->cq, 16, wc);
+				if (n < 0) {
+					fprintf(stderr, "poll error %d\n", n);
+					ret = n;
+				}
+				for (j = 0; j < n && !ret; j++)
+					ret = rping_client_step(cb, &wc[j]);
+			}
+
+			if (ret) {
+				fprintf(stderr, "connection %d failed: %d\n",
+					i, ret);
+				t->ret = ret;
+				cb->load_done = 1;
+			}
+			if (cb->load_done)
+				active--;
+		}
 	}
 
-	pthread_create(&cb->cqthread, NULL, cq_thread, cb);
+	return NULL;
+}
 
-	ret = rping_accept(cb);
+static double rping_elapsed(struct rping_samples *s, struct timeval *first,
+			    struct timeval *last)
+{
+	int i;
+
+	*first = s->start[0];
+	*last = s->end[0];
+	for (i = 1; i < s->count; i++) {
+		if (timercmp(&s->start[i], first, <))
+			*first = s->start[i];
+		if (timercmp(&s->end[i], last, >))
+			*last = s->end[i];
+	}
+	return (last->tv_sec - first->tv_sec) +
+	       (last->tv_usec - first->tv_usec) / 1e6;
+}
+
+static void rping_print_load_row(const char *name, struct rping_hist *h,
+				 double rate)
+{
+	printf("%-28s %9" PRIu64 " %9.2f %9.2f %9.2f %9.2f %7.0f\n", name,
+	       h->count, (double) h->sum / h->count / 1e3,
+	       rping_hist_pct(h, 0.5) / 1e3, rping_hist_pct(h, 0.99) / 1e3,
+	       h->max / 1e3, rate);
+}
+
+static void rping_report_load(struct rping_cb *conns, int n, int nthreads)
+{
+	struct rping_samples all;
+	struct rping_hist *hist;
+	struct timeval first, last;
+	double elapsed, *rate, sum = 0, sum2 = 0, lo = 0, hi = 0;
+	char name[32];
+	int i, j, k;
+
+	hist = calloc(1, sizeof *hist);
+	rate = calloc(n, sizeof *rate);
+	memset(&all, 0, sizeof all);
+	if (!hist || !rate)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		struct rping_cb *cb = &conns[i];
+		struct rping_hist *h = cb->load_hist;
+
+		if (!cb->pings.count)
+			continue;
+
+		rate[i] = cb->pings.count /
+			  rping_elapsed(&cb->pings, &first, &last);
+		sum += rate[i];
+		sum2 += rate[i] * rate[i];
+		lo = lo && lo < rate[i] ? lo : rate[i];
+		hi = MAX(hi, rate[i]);
+
+		hist->min = hist->count ? MIN(hist->min, h->min) : h->min;
+		hist->max = MAX(hist->max, h->max);
+		hist->count += h->count;
+		hist->sum += h->sum;
+		for (k = 0; k < RPING_HIST_BUCKETS; k++)
+			hist->bucket[k] += h->bucket[k];
+
+		for (j = 0; j < cb->pings.count; j++)
+			if (rping_add_sample(&all, &cb->pings.start[j],
+					     &cb->pings.end[j]))
+				goto out;
+	}
+	if (!all.count)
+		goto out;
+
+	elapsed = rping_elapsed(&all, &first, &last);
+	printf("load: %d conns on %d threads, %d pings in %.3f sec = "
+	       "%.0f pings/sec\n", n, nthreads, all.count, elapsed,
+	       all.count / elapsed);
+	printf("load: ");
+	report_transfer_rate(stdout, &first, &last,
+			     (size_t) 2 * conns[0].size * all.count);
+	printf("\nload percentiles: ");
+	report_percentiles(stdout, all.start, all.end, all.count);
+	printf("\n");
+
+	rping_print_hist_header("latency (usec)", "pings/s");
+	rping_print_load_row("all connections", hist, all.count / elapsed);
+	for (i = 0; conns[0].verbose && i < n; i++) {
+		if (!conns[i].pings.count)
+			continue;
+		snprintf(name, sizeof name, "conn %d", i);
+		rping_print_load_row(name, conns[i].load_hist, rate[i]);
+	}
+
+	printf("load fairness: pings/sec per connection min %.0f mean %.0f "
+	       "max %.0f, Jain's index %.4f\n", lo, sum / n, hi,
+	       sum * sum / (n * sum2));
+
+out:
+	rping_free_samples(&all);
+	free(rate);
+	free(hist);
+}
+
+static void rping_load_close(struct rping_cb *c)
+{
+	if (c->qp) {
+		rdma_disconnect(c->cm_id);
+		rping_free_buffers(c);
+		rping_free_qp(c);
+	}
+	rdma_destroy_id(c->cm_id);
+	rdma_destroy_event_channel(c->cm_channel);
+	rping_free_samples(&c->pings);
+	free(c->load_hist);
+}
+
+static int rping_load_connect(struct rping_cb *c)
+{
+	int ret;
+
+	ret = rping_bind_client(c);
+	if (ret)
+		return ret;
+
+	ret = rping_setup_qp(c, c->cm_id);
 	if (ret) {
-		fprintf(stderr, "connect error %d\n", ret);
-		goto err2;
+		fprintf(stderr, "setup_qp failed: %d\n", ret);
+		return ret;
 	}
 
-	rping_test_server(cb);
-	rdma_disconnect(cb->child_cm_id);
-	pthread_join(cb->cqthread, NULL);
-	rdma_destroy_id(cb->child_cm_id);
-err2:
-	rping_free_buffers(cb);
-err1:
-	rping_free_qp(cb);
+	ret = rping_setup_buffers(c);
+	if (ret) {
+		fprintf(stderr, "rping_setup_buffers failed: %d\n", ret);
+		rping_free_qp(c);
+		return ret;
+	}
 
+	ret = rping_post_recvs(c);
+	if (!ret)
+		ret = rping_connect_client(c);
+	if (ret) {
+		fprintf(stderr, "connection %d failed: %d\n",
+			c->conn_index, ret);
+		rping_free_buffers(c);
+		rping_free_qp(c);
+	}
 	return ret;
 }
 
-static int rping_test_client(struct rping_cb *cb)
+static int rping_run_load(struct rping_cb *cb)
 {
-	int ping, start, cc, i, ret = 0;
-	struct ibv_send_wr *bad_wr;
-	unsigned char c;
+	struct rping_load_thread *threads = NULL;
+	struct rping_cb *conns;
+	int i, n = 0, nthreads, started, ret = 0;
+	uint64_t start;
+
+	nthreads = cb->workers ? cb->workers : sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = MAX(1, MIN(nthreads, cb->conns));
+
+	conns = calloc(cb->conns, sizeof *conns);
+	threads = calloc(nthreads, sizeof *threads);
+	if (!conns || !threads) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
-	start = 65;
-	for (ping = 0; !cb->count || ping < cb->count; ping++) {
-		cb->state = RDMA_READ_ADV;
+	for (n = 0; n < cb->conns; n++) {
+		struct rping_cb *c = &conns[n];
 
-		/* Put some ascii text in the buffer. */
-		cc = sprintf(cb->start_buf, RPING_MSG_FMT, ping);
-		for (i = cc, c = start; i < cb->size; i++) {
-			cb->start_buf[i] = c;
-			c++;
-			if (c > 122)
-				c = 65;
+		*c = *cb;
+		c->conn_index = n;
+		c->use_events = 0;
+		sem_init(&c->sem, 0, 0);
+		c->load_hist = calloc(1, sizeof *c->load_hist);
+		if (!c->load_hist) {
+			ret = -ENOMEM;
+			break;
 		}
-		start++;
-		if (start > 122)
-			start = 65;
-		cb->start_buf[cb->size - 1] = 0;
-
-		rping_format_send(cb, cb->start_buf, cb->start_mr);
-		ret = ibv_post_send(cb->qp, &cb->sq_wr, &bad_wr);
+		c->cm_channel = rdma_create_event_channel();
+		if (!c->cm_channel) {
+			perror("rdma_create_event_channel");
+			ret = errno;
+			free(c->load_hist);
+			break;
+		}
+		ret = rdma_create_id(c->cm_channel, &c->cm_id, c, RDMA_PS_TCP);
 		if (ret) {
-			fprintf(stderr, "post send error %d\n", ret);
+			perror("rdma_create_id");
+			rdma_destroy_event_channel(c->cm_channel);
+			free(c->load_hist);
 			break;
 		}
-
-		/* Wait for server to ACK */
-		sem_wait(&cb->sem);
-		if (cb->state != RDMA_WRITE_ADV) {
-			fprintf(stderr, "wait for RDMA_WRITE_ADV state %d\n",
-				cb->state);
-			ret = -1;
+		ret = pthread_create(&c->cmthread, NULL, cm_thread, c);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			rdma_destroy_id(c->cm_id);
+			rdma_destroy_event_channel(c->cm_channel);
+			free(c->load_hist);
 			break;
 		}
 
-		rping_format_send(cb, cb->rdma_buf, cb->rdma_mr);
-		ret = ibv_post_send(cb->qp, &cb->sq_wr, &bad_wr);
+		ret = rping_load_connect(c);
 		if (ret) {
-			fprintf(stderr, "post send error %d\n", ret);
+			c->qp = NULL;
+			n++;
 			break;
 		}
-
-		/* Wait for the server to say the RDMA Write is complete. */
-		sem_wait(&cb->sem);
-		if (cb->state != RDMA_WRITE_COMPLETE) {
-			fprintf(stderr, "wait for RDMA_WRITE_COMPLETE state %d\n",
-				cb->state);
-			ret = -1;
+	}
+	if (ret)
+		goto close;
+
+	printf("load: %d connections up\n", n);
+	start = rping_ns();
+	for (i = 0; i < n; i++)
+		conns[i].load_at = start + (uint64_t) i * cb->gap * 1000;
+
+	for (started = 0; started < nthreads; started++) {
+		threads[started].conns = conns;
+		threads[started].n = n;
+		threads[started].nthreads = nthreads;
+		threads[started].index = started;
+		ret = pthread_create(&threads[started].thread, NULL,
+				     rping_load_thread, &threads[started]);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
 			break;
 		}
-
-		if (cb->validate)
-			if (memcmp(cb->start_buf, cb->rdma_buf, cb->size)) {
-				fprintf(stderr, "data mismatch!\n");
-				ret = -1;
-				break;
-			}
-
-		if (cb->verbose)
-			printf("ping data: %s\n", cb->rdma_buf);
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].ret && !ret)
+			ret = threads[i].ret;
 	}
 
+	if (!ret)
+		rping_report_load(conns, n, nthreads);
+close:
+	for (i = 0; i < n; i++)
+		rping_load_close(&conns[i]);
+out:
+	free(conns);
+	free(threads);
 	return ret;
 }
 
-static int rping_connect_client(struct rping_cb *cb)
+/*
+ * Connect storm (-R). One thread drives all connections through a
+ * non-blocking CM channel so a slow step on one connection never
+ * holds up the others, and errors count against the run instead of
+ * exiting like cm_thread does.
+ */
+enum rping_storm_phase {
+	ST_ADDR,
+	ST_ROUTE,
+	ST_QP,
+	ST_CONNECT,
+	ST_TOTAL,
+	ST_DISCONNECT,
+	RPING_STORM_PHASES
+};
+
+static const char *rping_storm_names[RPING_STORM_PHASES] = {
+	[ST_ADDR]	= "addr resolve",
+	[ST_ROUTE]	= "route resolve",
+	[ST_QP]		= "qp create",
+	[ST_CONNECT]	= "connect to established",
+	[ST_TOTAL]	= "total to established",
+	[ST_DISCONNECT]	= "disconnect",
+};
+
+struct rping_storm_conn {
+	struct rdma_cm_id *id;
+	uint64_t start;
+	uint64_t last;			/* time of the previous step */
+};
+
+struct rping_storm {
+	struct rping_cb *cb;
+	struct rdma_event_channel *channel;
+	struct ibv_pd *pd;		/* shared by all connections */
+	struct ibv_cq *cq;
+	struct rping_hist phase[RPING_STORM_PHASES];
+	int started;
+	int active;
+	int established;
+	int failed;
+	uint64_t first;
+	uint64_t last_established;
+};
+
+static void rping_storm_step(struct rping_storm *st,
+			     struct rping_storm_conn *conn,
+			     enum rping_storm_phase ph)
 {
-	struct rdma_conn_param conn_param;
+	uint64_t now = rping_ns();
+
+	rping_hist_add(&st->phase[ph], now - conn->last);
+	conn->last = now;
+}
+
+static void rping_storm_close(struct rping_storm *st,
+			      struct rping_storm_conn *conn, int failed)
+{
+	if (conn->id->qp)
+		rdma_destroy_qp(conn->id);
+	rdma_destroy_id(conn->id);
+	free(conn);
+	st->active--;
+	st->failed += failed;
+}
+
+static int rping_storm_start(struct rping_storm *st)
+{
+	struct rping_storm_conn *conn;
 	int ret;
 
-	memset(&conn_param, 0, sizeof conn_param);
-	conn_param.responder_resources = 1;
-	conn_param.initiator_depth = 1;
-	conn_param.retry_count = 10;
+	conn = calloc(1, sizeof *conn);
+	if (!conn)
+		return -ENOMEM;
 
-	ret = rdma_connect(cb->cm_id, &conn_param);
+	ret = rdma_create_id(st->channel, &conn->id, conn, RDMA_PS_TCP);
 	if (ret) {
-		perror("rdma_connect");
+		perror("rdma_create_id");
+		free(conn);
 		return ret;
 	}
 
-	sem_wait(&cb->sem);
-	if (cb->state != CONNECTED) {
-		fprintf(stderr, "wait for CONNECTED state %d\n", cb->state);
-		return -1;
-	}
+	st->started++;
+	st->active++;
+	conn->start = conn->last = rping_ns();
+	if (!st->first)
+		st->first = conn->start;
 
-	DEBUG_LOG("rmda_connect successful\n");
+	ret = rdma_resolve_addr(conn->id, NULL,
+			       (struct sockaddr *) &st->cb->sin, 2000);
+	if (ret) {
+		perror("rdma_resolve_addr");
+		rping_storm_close(st, conn, 1);
+	}
 	return 0;
 }
 
-static int rping_bind_client(struct rping_cb *cb)
+static int rping_storm_connect(struct rping_storm *st,
+			       struct rping_storm_conn *conn)
 {
-	int ret;
+	struct rdma_conn_param conn_param;
+	struct ibv_qp_init_attr attr;
+	struct rdma_cm_id *id = conn->id;
+
+	if (!st->pd) {
+		st->pd = ibv_alloc_pd(id->verbs);
+		if (!st->pd)
+			return errno;
+		st->cq = ibv_create_cq(id->verbs, 16, NULL, NULL, 0);
+		if (!st->cq) {
+			int ret = errno;
+
+			/* the next connection sets both up again */
+			ibv_dealloc_pd(st->pd);
+			st->pd = NULL;
+			errno = ret;
+			return ret;
+		}
+	}
 
-	if (cb->sin.ss_family == AF_INET)
-		((struct sockaddr_in *) &cb->sin)->sin_port = cb->port;
-	else
-		((struct sockaddr_in6 *) &cb->sin)->sin6_port = cb->port;
+	memset(&attr, 0, sizeof attr);
+	attr.cap.max_send_wr = 1;
+	attr.cap.max_recv_wr = 1;
+	attr.cap.max_send_sge = 1;
+	attr.cap.max_recv_sge = 1;
+	attr.qp_type = IBV_QPT_RC;
+	attr.send_cq = st->cq;
+	attr.recv_cq = st->cq;
+	if (rdma_create_qp(id, st->pd, &attr))
+		return errno;
+	rping_storm_step(st, conn, ST_QP);
 
-	ret = rdma_resolve_addr(cb->cm_id, NULL, (struct sockaddr *) &cb->sin, 2000);
-	if (ret) {
-		perror("rdma_resolve_addr");
-		return ret;
-	}
+	memset(&conn_param, 0, sizeof conn_param);
+	rping_rd_atom(st->cb, id->verbs, &conn_param);
+	conn_param.retry_count = 10;
+	return rdma_connect(id, &conn_param);
+}
 
-	sem_wait(&cb->sem);
-	if (cb->state != ROUTE_RESOLVED) {
-		fprintf(stderr, "waiting for addr/route resolution state %d\n",
-			cb->state);
-		return -1;
+static void rping_storm_event(struct rping_storm *st,
+			      struct rdma_cm_event *event)
+{
+	struct rping_storm_conn *conn = event->id->context;
+	enum rdma_cm_event_type type = event->event;
+	int status = event->status;
+	uint64_t now;
+
+	/* Ack first, rdma_destroy_id() waits for every event to be acked */
+	rdma_ack_cm_event(event);
+
+	switch (type) {
+	case RDMA_CM_EVENT_ADDR_RESOLVED:
+		rping_storm_step(st, conn, ST_ADDR);
+		if (rdma_resolve_route(conn->id, 2000)) {
+			perror("rdma_resolve_route");
+			rping_storm_close(st, conn, 1);
+		}
+		break;
+
+	case RDMA_CM_EVENT_ROUTE_RESOLVED:
+		rping_storm_step(st, conn, ST_ROUTE);
+		if (rping_storm_connect(st, conn)) {
+			perror("rping_storm_connect");
+			rping_storm_close(st, conn, 1);
+		}
+		break;
+
+	case RDMA_CM_EVENT_ESTABLISHED:
+		rping_storm_step(st, conn, ST_CONNECT);
+		now = conn->last;
+		rping_hist_add(&st->phase[ST_TOTAL], now - conn->start);
+		st->established++;
+		st->last_established = now;
+		if (rdma_disconnect(conn->id))
+			rping_storm_close(st, conn, 0);
+		break;
+
+	case RDMA_CM_EVENT_DISCONNECTED:
+		rping_storm_step(st, conn, ST_DISCONNECT);
+		rping_storm_close(st, conn, 0);
+		break;
+
+	case RDMA_CM_EVENT_ADDR_ERROR:
+	case RDMA_CM_EVENT_ROUTE_ERROR:
+	case RDMA_CM_EVENT_CONNECT_ERROR:
+	case RDMA_CM_EVENT_UNREACHABLE:
+	case RDMA_CM_EVENT_REJECTED:
+		if (st->failed < 10)
+			fprintf(stderr, "cma event %s, error %d\n",
+				rdma_event_str(type), status);
+		rping_storm_close(st, conn, 1);
+		break;
+
+	default:
+		DEBUG_LOG("storm ignoring %s\n", rdma_event_str(type));
+		break;
 	}
+}
 
-	DEBUG_LOG("rdma_resolve_addr - rdma_resolve_route successful\n");
-	return 0;
+static void rping_report_storm(struct rping_storm *st, uint64_t end)
+{
+	double total = (double) st->phase[ST_TOTAL].sum /
+		       MAX(1, st->phase[ST_TOTAL].count);
+	int ph;
+
+	printf("storm: %d connections, %d failed, -j %d\n", st->started,
+	       st->failed, st->cb->conns);
+	if (st->established)
+		printf("storm: %.0f connects/sec, %.0f connect+disconnect "
+		       "cycles/sec\n", st->established /
+		       ((st->last_established - st->first) / 1e9),
+		       st->established / ((end - st->first) / 1e9));
+
+	rping_print_hist_header("rdma_cm step (usec)", "of conn");
+	for (ph = 0; ph < RPING_STORM_PHASES; ph++)
+		rping_print_hist(rping_storm_names[ph], &st->phase[ph], total);
 }
 
-static int rping_run_client(struct rping_cb *cb)
+static int rping_run_storm(struct rping_cb *cb)
 {
-	struct ibv_recv_wr *bad_wr;
-	int ret;
+	struct rdma_cm_event *event;
+	struct rping_storm st;
+	struct pollfd pfd;
+	int ret = 0;
 
-	ret = rping_bind_client(cb);
-	if (ret)
-		return ret;
+	memset(&st, 0, sizeof st);
+	st.cb = cb;
 
-	ret = rping_setup_qp(cb, cb->cm_id);
-	if (ret) {
-		fprintf(stderr, "setup_qp failed: %d\n", ret);
-		return ret;
-	}
+	if (cb->sin.ss_family == AF_INET)
+		((struct sockaddr_in *) &cb->sin)->sin_port = cb->port;
+	else
+		((struct sockaddr_in6 *) &cb->sin)->sin6_port = cb->port;
 
-	ret = rping_setup_buffers(cb);
-	if (ret) {
-		fprintf(stderr, "rping_setup_buffers failed: %d\n", ret);
-		goto err1;
+	st.channel = rdma_create_event_channel();
+	if (!st.channel) {
+		perror("rdma_create_event_channel");
+		return errno;
 	}
+	fcntl(st.channel->fd, F_SETFL,
+	      fcntl(st.channel->fd, F_GETFL) | O_NONBLOCK);
 
-	ret = ibv_post_recv(cb->qp, &cb->rq_wr, &bad_wr);
-	if (ret) {
-		fprintf(stderr, "ibv_post_recv failed: %d\n", ret);
-		goto err2;
-	}
+	pfd.fd = st.channel->fd;
+	pfd.events = POLLIN;
 
-	pthread_create(&cb->cqthread, NULL, cq_thread, cb);
+	while (st.started < cb->storm || st.active) {
+		while (!ret && st.active < cb->conns && st.started < cb->storm)
+			ret = rping_storm_start(&st);
+		if (ret && !st.active)
+			break;
 
-	ret = rping_connect_client(cb);
-	if (ret) {
-		fprintf(stderr, "connect error %d\n", ret);
-		goto err2;
-	}
+		if (poll(&pfd, 1, 1000) < 0 && errno != EINTR) {
+			perror("poll");
+			ret = errno;
+			break;
+		}
 
-	ret = rping_test_client(cb);
-	if (ret) {
-		fprintf(stderr, "rping client failed: %d\n", ret);
-		goto err3;
+		while (!rdma_get_cm_event(st.channel, &event))
+			rping_storm_event(&st, event);
+		if (errno != EAGAIN) {
+			perror("rdma_get_cm_event");
+			ret = errno;
+			break;
+		}
 	}
-	ret = 0;
-err3:
-	rdma_disconnect(cb->cm_id);
-err2:
-	pthread_join(cb->cqthread, NULL);
-	rping_free_buffers(cb);
-err1:
-	rping_free_qp(cb);
 
+	rping_report_storm(&st, rping_ns());
+
+	if (st.cq)
+		ibv_destroy_cq(st.cq);
+	if (st.pd)
+		ibv_dealloc_pd(st.pd);
+	rdma_destroy_event_channel(st.channel);
 	return ret;
 }
 
@@ -1093,25 +4688,45 @@ static int get_addr(char *dst, struct sockaddr *addr)
 
 static void usage(char *name)
 {
-	printf("%s -s [-vVd] [-S size] [-C count] [-a addr] [-p port]\n", 
+	printf("%s -s [-vVde] [-S size] [-C count] [-Q depth] [-k chunk] [-P [-w workers] [-B]] [-I [-b block]] [-T pattern] [-A op [-n targets]] [-L] [-a addr] [-p port]\n", 
 	       name);
-	printf("%s -c [-vVd] [-S size] [-C count] -a addr [-p port]\n", 
+	printf("%s -c [-vVde] [-S size] [-C count] [-Q depth] [-I [-b block]] [-T pattern] [-A op [-n targets] [-j conns]] [-L] [-D] [-i] [-j conns [-w threads] [-g gap]] [-R count [-j conns]] -a addr [-p port]\n", 
 	       name);
 	printf("\t-c\t\tclient side\n");
 	printf("\t-s\t\tserver side.  To bind to any address with IPv6 use -a ::0\n");
 	printf("\t-v\t\tdisplay ping data to stdout\n");
 	printf("\t-V\t\tvalidate ping data\n");
 	printf("\t-d\t\tdebug printfs\n");
-	printf("\t-S size \tping data size\n");
+	printf("\t-S size \tping data size, with optional K/M/G suffix\n");
 	printf("\t-C count\tping count times\n");
 	printf("\t-a addr\t\taddress\n");
 	printf("\t-p port\t\tport\n");
 	printf("\t-P\t\tpersistent server mode allowing multiple connections\n");
+	printf("\t-e\t\tsleep on CQ events in a separate thread (default poll)\n");
+	printf("\t-Q depth\tpings in flight, server needs at least the client's depth\n");
+	printf("\t-k chunk\tserver splits RDMA READ/WRITE into chunk sized WRs\n");
+	printf("\t-w workers\twith -P, serve all connections from a pool of workers (0 = one per core),\n"
+	       "\t\t\tor client threads driving -j connections (default one per core)\n");
+	printf("\t-B\t\twith -P, share one PD per device and pools of pre-registered buffers\n");
+	printf("\t-I\t\tend-to-end CRC32C integrity check, on both sides\n");
+	printf("\t-b block\tbytes per checksum with -I, 0 for one per ping (default 4K)\n");
+	printf("\t-T pattern\tconstant, increment, prbs or sequence data instead of text (%s)\n",
+	       pattern_impl());
+	printf("\t-A op\t\tfadd or cas atomics benchmark instead of pings, on both sides\n");
+	printf("\t-n targets\t8 byte atomic targets, the client uses at most the server's (default 1)\n");
+	printf("\t-j conns\tclient connections for -A, each with -Q atomics in flight,\n"
+	       "\t\t\tconnections being set up at once for -R, or load generator connections\n");
+	printf("\t-g gap\t\tusec between load generator connection starts (default 100)\n");
+	printf("\t-L\t\tper-phase latency breakdown, the client also shows the server's with -C\n");
+	printf("\t-D\t\tfirst ping's advertisement in the connect private data\n");
+	printf("\t-i\t\techo with RDMA WRITE WITH IMM instead of a WRITE and a go-ahead SEND\n");
+	printf("\t-R count\tconnect storm: open and close count connections to a -P server\n");
 }
 
 int main(int argc, char *argv[])
 {
 	struct rping_cb *cb;
+	long long val;
 	int op;
 	int ret = 0;
 	int persistent_server = 0;
@@ -1124,18 +4739,99 @@ int main(int argc, char *argv[])
 	cb->server = -1;
 	cb->state = IDLE;
 	cb->size = 64;
+	cb->depth = 1;
+	cb->block = 4096;
+	cb->pattern = -1;
+	cb->targets = 1;
+	cb->conns = 1;
+	cb->gap = 100;
 	cb->sin.ss_family = PF_INET;
 	cb->port = htons(7174);
 	sem_init(&cb->sem, 0, 0);
 
 	opterr = 0;
-	while ((op=getopt(argc, argv, "a:Pp:C:S:t:scvVd")) != -1) {
+	while ((op=getopt(argc, argv, "a:Pp:C:S:t:T:Q:k:w:b:A:n:j:g:R:BDILiscvVde")) != -1) {
 		switch (op) {
 		case 'a':
 			ret = get_addr(optarg, (struct sockaddr *) &cb->sin);
 			break;
 		case 'P':
 			persistent_server = 1;
+			cb->persistent = 1;
+			break;
+		case 'B':
+			cb->pooled = 1;
+			break;
+		case 'I':
+			cb->integrity = 1;
+			break;
+		case 'L':
+			cb->phases = 1;
+			break;
+		case 'D':
+			cb->cm_adv = 1;
+			break;
+		case 'i':
+			cb->write_imm = 1;
+			break;
+		case 'R':
+			cb->storm = atoi(optarg);
+			if (cb->storm < 1) {
+				fprintf(stderr, "Invalid storm count %s\n",
+					optarg);
+				ret = EINVAL;
+			}
+			break;
+		case 'T':
+			cb->pattern = pattern_parse(optarg);
+			if (cb->pattern < 0) {
+				fprintf(stderr, "Unknown pattern %s\n",
+					optarg);
+				ret = EINVAL;
+			}
+			break;
+		case 'A':
+			cb->atomic = 1;
+			if (!strcmp(optarg, "fadd")) {
+				cb->atomic_op = IBV_WR_ATOMIC_FETCH_AND_ADD;
+			} else if (!strcmp(optarg, "cas")) {
+				cb->atomic_op = IBV_WR_ATOMIC_CMP_AND_SWP;
+			} else {
+				fprintf(stderr, "Invalid atomic op %s\n",
+					optarg);
+				ret = EINVAL;
+			}
+			break;
+		case 'n':
+			cb->targets = atoi(optarg);
+			if (cb->targets < 1) {
+				fprintf(stderr, "Invalid targets %s\n",
+					optarg);
+				ret = EINVAL;
+			}
+			break;
+		case 'g':
+			cb->gap = atoi(optarg);
+			if (cb->gap < 0) {
+				fprintf(stderr, "Invalid gap %s\n", optarg);
+				ret = EINVAL;
+			}
+			break;
+		case 'j':
+			cb->conns = atoi(optarg);
+			if (cb->conns < 1) {
+				fprintf(stderr, "Invalid conns %s\n", optarg);
+				ret = EINVAL;
+			}
+			break;
+		case 'b':
+			val = suffix_binary_parse(optarg);
+			if (errno || val < 0 || val > RPING_BUFSIZE) {
+				fprintf(stderr, "Invalid block size %s\n",
+					optarg);
+				ret = EINVAL;
+			} else
+				cb->block = val;
 			break;
 		case 'p':
 			cb->port = htons(atoi(optarg));
@@ -1150,16 +4846,28 @@ int main(int argc, char *argv[])
 			DEBUG_LOG("client\n");
 			break;
 		case 'S':
-			cb->size = atoi(optarg);
-			if ((cb->size < RPING_MIN_BUFSIZE) ||
-			    (cb->size > (RPING_BUFSIZE - 1))) {
-				fprintf(stderr, "Invalid size %d "
+			val = suffix_binary_parse(optarg);
+			if (errno || (val < RPING_MIN_BUFSIZE) ||
+			    (val > RPING_BUFSIZE)) {
+				fprintf(stderr, "Invalid size %s "
 				       "(valid range is %d to %d)\n",
-				       (int)cb->size, (int)(RPING_MIN_BUFSIZE),
+				       optarg, (int)(RPING_MIN_BUFSIZE),
 				       (int)(RPING_BUFSIZE));
 				ret = EINVAL;
-			} else
-				DEBUG_LOG("size %d\n", (int) atoi(optarg));
+			} else {
+				cb->size = val;
+				DEBUG_LOG("size %d\n", cb->size);
+			}
+			break;
+		case 'k':
+			val = suffix_binary_parse(optarg);
+			if (errno || val < 0 || val > RPING_BUFSIZE) {
+				fprintf(stderr, "Invalid chunk %s\n", optarg);
+				ret = EINVAL;
+			} else {
+				cb->chunk = val;
+				DEBUG_LOG("chunk %d\n", cb->chunk);
+			}
 			break;
 		case 'C':
 			cb->count = atoi(optarg);
@@ -1181,6 +4889,24 @@ int main(int argc, char *argv[])
 		case 'd':
 			debug++;
 			break;
+		case 'e':
+			cb->use_events = 1;
+			break;
+		case 'w':
+			cb->workers = atoi(optarg);
+			if (cb->workers <= 0)
+				cb->workers = sysconf(_SC_NPROCESSORS_ONLN);
+			DEBUG_LOG("workers %d\n", cb->workers);
+			break;
+		case 'Q':
+			cb->depth = atoi(optarg);
+			if (cb->depth < 1) {
+				fprintf(stderr, "Invalid depth %d\n",
+					cb->depth);
+				ret = EINVAL;
+			} else
+				DEBUG_LOG("depth %d\n", cb->depth);
+			break;
 		default:
 			usage("rping");
 			ret = EINVAL;
@@ -1196,6 +4922,91 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	cb->payload = cb->size;
+	if (cb->integrity)
+		cb->payload -= crc32c_trailer_len(cb->size, cb->block);
+	if (cb->payload < (int) RPING_MIN_BUFSIZE) {
+		fprintf(stderr, "size %d leaves no room for the ping text "
+			"and checksums\n", cb->size);
+		ret = EINVAL;
+		goto out;
+	}
+
+	if (cb->pooled && !persistent_server) {
+		fprintf(stderr, "-B needs -P\n");
+		ret = EINVAL;
+		goto out;
+	}
+
+	if (cb->workers && cb->server &&
+	    (!persistent_server || cb->depth > 1)) {
+		fprintf(stderr, "-w needs -P and does not support -Q\n");
+		ret = EINVAL;
+		goto out;
+	}
+
+	if (cb->storm && (cb->server || cb->atomic)) {
+		fprintf(stderr, "-R is a client mode and excludes -A\n");
+		ret = EINVAL;
+		goto out;
+	}
+
+	if (cb->cm_adv && (cb->server || cb->depth > 1 || cb->atomic ||
+			   cb->storm)) {
+		fprintf(stderr, "-D is for lock-step client pings, servers "
+			"always take it\n");
+		ret = EINVAL;
+		goto out;
+	}
+
+	if (cb->write_imm && (cb->server || cb->depth > 1 || cb->atomic ||
+			      cb->storm)) {
+		fprintf(stderr, "-i is for lock-step client pings, servers "
+			"always take it\n");
+		ret = EINVAL;
+		goto out;
+	}
+
+	if (!cb->server && !cb->atomic && !cb->storm) {
+		if (cb->workers && cb->conns == 1) {
+			fprintf(stderr, "client -w drives -j connections\n");
+			ret = EINVAL;
+			goto out;
+		}
+		if (cb->conns > 1 && (cb->depth > 1 || cb->phases)) {
+			fprintf(stderr, "-j pings are lock-step, without -Q "
+				"or -L\n");
+			ret = EINVAL;
+			goto out;
+		}
+		if (cb->conns > 1 && !cb->count)
+			cb->count = 10000;
+	}
+
+	if (cb->atomic) {
+		if (cb->workers) {
+			fprintf(stderr, "-A does not support -w\n");
+			ret = EINVAL;
+			goto out;
+		}
+
+		/* -Q is atomics in flight, the messaging stays lock-step */
+		cb->atomic_depth = cb->server ? 0 : cb->depth;
+		cb->depth = 1;
+		if (!cb->server && !cb->count)
+			cb->count = 100000;
+
+		if (cb->server) {
+			rping_targets.count = cb->targets;
+			ret = posix_memalign((void **) &rping_targets.buf, 64,
+					     cb->targets * sizeof(uint64_t));
+			if (ret)
+				goto out;
+			memset(rping_targets.buf, 0,
+			       cb->targets * sizeof(uint64_t));
+		}
+	}
+
 	cb->cm_channel = rdma_create_event_channel();
 	if (!cb->cm_channel) {
 		perror("rdma_create_event_channel");
@@ -1216,7 +5027,13 @@ int main(int argc, char *argv[])
 			ret = rping_run_persistent_server(cb);
 		else
 			ret = rping_run_server(cb);
-	} else
+	} else if (cb->storm)
+		ret = rping_run_storm(cb);
+	else if (cb->atomic)
+		ret = rping_run_atomic_clients(cb);
+	else if (cb->conns > 1)
+		ret = rping_run_load(cb);
+	else
 		ret = rping_run_client(cb);
 
 	DEBUG_LOG("destroy cm_id %p\n", cb->cm_id);
@@ -1224,6 +5041,7 @@ int main(int argc, char *argv[])
 out2:
 	rdma_destroy_event_channel(cb->cm_channel);
 out:
+	free(rping_targets.buf);
 	free(cb);
 	return ret;
 }
@@ -0,0 +1,835 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Multi-producer queue in server memory that producers fill
+//     without the server CPU arbitrating between them. The server
+//     (no address given) registers a ring of --slots entries and a
+//     tail counter. A producer reserves a ticket by FETCH_ADDing one
+//     to the tail, then RDMA WRITEs its entry into slot ticket %
+//     slots. The last 8 bytes of the entry are the slot's ready flag
+//     and hold ticket + 1, big endian like the SEND trailer, so they
+//     go out in the same WRITE and the flag of an older lap never
+//     looks ready.
+//
+//     The server consumes the ring in ticket order by polling the
+//     ready flag of the slot at its head and publishes the head for
+//     producers to RDMA READ. A producer only reads the head when its
+//     ticket would lap an entry that might still be unconsumed.
+//
+//     For comparison the same entries can be enqueued with SEND into
+//     receives the server keeps posted for every connection. The
+//     client sweeps 1, 2, 4 ... --producers producer threads, each on
+//     its own connection, and reports enqueue rate and latency for
+//     both designs.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <endian.h>
+#include <time.h>
+
+#include <rdma/rdma_cma.h>
+#include <rdma/rdma_verbs.h>
+#include <infiniband/verbs.h>
+
+#include "../argconfig/argconfig.h"
+#include "../argconfig/report.h"
+#include "../pattern/pattern.h"
+
+enum errors {
+  BAD_ARGS       = 1,
+  NO_BUFFER,
+  SETUP_PROBLEM,
+  RUN_PROBLEM,
+};
+
+/* Tail and head on their own cache lines */
+struct rq_ctrl {
+  uint64_t                tail;
+  uint64_t                pad0[7];
+  uint64_t                head;
+  uint64_t                pad1[7];
+};
+
+/* Server to client after connecting, big endian */
+struct rq_hello {
+  uint64_t                ring_addr;
+  uint64_t                ctrl_addr;
+  uint32_t                ring_rkey;
+  uint32_t                ctrl_rkey;
+  uint32_t                slots;
+  uint32_t                entry;
+};
+
+const char program_desc[] =
+    "Multi-producer RDMA queue with FETCH_ADD slot reservation";
+
+struct rqueue {
+  char                    *addr;
+  char                    *port;
+  unsigned                slots;
+  unsigned                entry;
+  unsigned                depth;
+  unsigned                producers;
+  long                    iters;
+  unsigned                check;
+  unsigned                verbose;
+};
+
+static const struct rqueue defaults = {
+  .addr       = NULL,
+  .port       = "12348",
+  .slots      = 4096,
+  .entry      = 64,
+  .depth      = 64,
+  .producers  = 8,
+  .iters      = 100000,
+  .check      = 0,
+  .verbose    = 0,
+};
+
+static const struct argconfig_commandline_options command_line_options[] = {
+    {"port",          "PORT", CFG_STRING, &defaults.port, required_argument,
+            "port to use"},
+    {"slots",         "NUM", CFG_POSITIVE, &defaults.slots, required_argument,
+            "server: entries in the ring"},
+    {"e",             "NUM", CFG_POSITIVE, &defaults.entry, required_argument, NULL},
+    {"entry",         "NUM", CFG_POSITIVE, &defaults.entry, required_argument,
+            "server: entry bytes including the 8 byte ready flag"},
+    {"depth",         "NUM", CFG_POSITIVE, &defaults.depth, required_argument,
+            "server: receives kept posted per connection for SEND"},
+    {"check",         "", CFG_NONE, &defaults.check, no_argument,
+            "server: verify every entry it consumes"},
+    {"p",             "NUM", CFG_POSITIVE, &defaults.producers, required_argument, NULL},
+    {"producers",     "NUM", CFG_POSITIVE, &defaults.producers, required_argument,
+            "client: most producer threads to sweep up to"},
+    {"i",             "NUM", CFG_LONG_SUFFIX, &defaults.iters, required_argument, NULL},
+    {"iters",         "NUM", CFG_LONG_SUFFIX, &defaults.iters, required_argument,
+            "client: enqueues per producer and test"},
+    {"v",             "", CFG_NONE, &defaults.verbose, no_argument, NULL},
+    {"verbose",       "", CFG_NONE, &defaults.verbose, no_argument,
+            "be verbose"},
+    {0}
+};
+
+static int report(const char *func, int val)
+{
+  fprintf(stderr, "%s: %d = %s.\n", func, errno, strerror(errno));
+  return val;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct ibv_qp_init_attr qp_attr(unsigned depth)
+{
+  struct ibv_qp_init_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.cap.max_send_wr = 4;
+  attr.cap.max_recv_wr = depth;
+  attr.cap.max_send_sge = attr.cap.max_recv_sge = 1;
+  attr.sq_sig_all = 1;
+  return attr;
+}
+
+/*
+ * Server. The accept thread hands connections to the consumer, which
+ * is the only thread that touches the ring or the receive queues.
+ */
+
+struct rq_conn {
+  struct rdma_cm_id       *id;
+  char                    *bufs;
+  struct ibv_mr           *mr;
+  struct rq_hello         hello;
+  struct ibv_mr           *hello_mr;
+  unsigned                idle;
+  struct rq_conn          *next;
+};
+
+struct rq_server {
+  struct rqueue           *cfg;
+  char                    *ring;
+  struct rq_ctrl          *ctrl;
+  struct ibv_pd           *pd;
+  struct ibv_mr           *ring_mr;
+  struct ibv_mr           *ctrl_mr;
+
+  pthread_mutex_t         lock;
+  struct rq_conn          *incoming;
+  struct rq_conn          *conns;
+
+  uint64_t                head;
+  unsigned long           ring_entries;
+  unsigned long           send_entries;
+  unsigned long           bad;
+};
+
+static void free_conn(struct rq_conn *c)
+{
+  if (c->mr)
+    rdma_dereg_mr(c->mr);
+  if (c->hello_mr)
+    rdma_dereg_mr(c->hello_mr);
+  free(c->bufs);
+  rdma_destroy_ep(c->id);
+  free(c);
+}
+
+static int post_conn_recv(struct rq_server *s, struct rq_conn *c, unsigned i)
+{
+  unsigned entry = s->cfg->entry;
+
+  return rdma_post_recv(c->id, (void *) (uintptr_t) i, c->bufs + i * entry,
+                        entry, c->mr);
+}
+
+/* Like kvstore, every connection shares the device's default PD */
+static int reg_ring(struct rq_server *s, struct rdma_cm_id *id)
+{
+  size_t ring_size = (size_t) s->cfg->slots * s->cfg->entry;
+
+  if (s->ring_mr) {
+    if (id->pd != s->pd) {
+      errno = EXDEV;
+      return report("connection on another device", -1);
+    }
+    return 0;
+  }
+
+  s->pd = id->pd;
+  s->ring_mr = ibv_reg_mr(s->pd, s->ring, ring_size,
+                          IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+  s->ctrl_mr = ibv_reg_mr(s->pd, s->ctrl, sizeof(*s->ctrl),
+                          IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+                          IBV_ACCESS_REMOTE_ATOMIC);
+  if (!s->ring_mr || !s->ctrl_mr)
+    return report("ibv_reg_mr", -1);
+  return 0;
+}
+
+static int accept_conn(struct rq_server *s, struct rdma_cm_id *id)
+{
+  struct rqueue *cfg = s->cfg;
+  struct rq_conn *c;
+  struct ibv_wc wc;
+
+  c = calloc(1, sizeof(*c));
+  if (!c) {
+    rdma_destroy_ep(id);
+    return report("calloc", NO_BUFFER);
+  }
+  c->id = id;
+  c->bufs = malloc((size_t) cfg->depth * cfg->entry);
+  if (!c->bufs || reg_ring(s, id))
+    goto err;
+
+  c->mr = rdma_reg_msgs(id, c->bufs, (size_t) cfg->depth * cfg->entry);
+  c->hello_mr = rdma_reg_msgs(id, &c->hello, sizeof(c->hello));
+  if (!c->mr || !c->hello_mr) {
+    report("rdma_reg_msgs", 0);
+    goto err;
+  }
+
+  for (unsigned i=0; i<cfg->depth; i++)
+    if (post_conn_recv(s, c, i)) {
+      report("rdma_post_recv", 0);
+      goto err;
+    }
+
+  if (rdma_accept(id, NULL)) {
+    report("rdma_accept", 0);
+    goto err;
+  }
+
+  c->hello.ring_addr = htobe64((uintptr_t) s->ring);
+  c->hello.ring_rkey = htobe32(s->ring_mr->rkey);
+  c->hello.ctrl_addr = htobe64((uintptr_t) s->ctrl);
+  c->hello.ctrl_rkey = htobe32(s->ctrl_mr->rkey);
+  c->hello.slots = htobe32(cfg->slots);
+  c->hello.entry = htobe32(cfg->entry);
+  if (rdma_post_send(id, NULL, &c->hello, sizeof(c->hello), c->hello_mr, 0) ||
+      rdma_get_send_comp(id, &wc) <= 0 || wc.status) {
+    report("send hello", 0);
+    rdma_disconnect(id);
+    goto err;
+  }
+
+  fcntl(id->channel->fd, F_SETFL,
+        fcntl(id->channel->fd, F_GETFL) | O_NONBLOCK);
+
+  pthread_mutex_lock(&s->lock);
+  c->next = s->incoming;
+  __atomic_store_n(&s->incoming, c, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&s->lock);
+  return 0;
+
+err:
+  free_conn(c);
+  return SETUP_PROBLEM;
+}
+
+static void *accept_thread(void *arg)
+{
+  struct rq_server *s = arg;
+  struct rdma_addrinfo hints, *res;
+  struct ibv_qp_init_attr attr = qp_attr(s->cfg->depth);
+  struct rdma_cm_id *lid, *id;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_flags = RAI_PASSIVE;
+  hints.ai_port_space = RDMA_PS_TCP;
+  if (rdma_getaddrinfo(NULL, s->cfg->port, &hints, &res)) {
+    report("rdma_getaddrinfo", 0);
+    exit(SETUP_PROBLEM);
+  }
+
+  if (rdma_create_ep(&lid, res, NULL, &attr)) {
+    report("rdma_create_ep", 0);
+    exit(SETUP_PROBLEM);
+  }
+  rdma_freeaddrinfo(res);
+
+  if (rdma_listen(lid, 0)) {
+    report("rdma_listen", 0);
+    exit(SETUP_PROBLEM);
+  }
+
+  while (!rdma_get_request(lid, &id))
+    accept_conn(s, id);
+
+  report("rdma_get_request", 0);
+  exit(RUN_PROBLEM);
+}
+
+static void consume(struct rq_server *s, const char *entry, uint64_t seed)
+{
+  if (s->cfg->check &&
+      pattern_verify(entry, s->cfg->entry - sizeof(uint64_t),
+                     PATTERN_PRBS, seed) >= 0)
+    s->bad++;
+}
+
+static void poll_ring(struct rq_server *s)
+{
+  struct rqueue *cfg = s->cfg;
+
+  for (int n=0; n<64; n++) {
+    char *entry = s->ring + (s->head % cfg->slots) * cfg->entry;
+    volatile uint64_t *ready = (void *) (entry + cfg->entry - sizeof(uint64_t));
+
+    if (be64toh(*ready) != s->head + 1)
+      break;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    consume(s, entry, s->head);
+    s->head++;
+    s->ring_entries++;
+    __atomic_store_n(&s->ctrl->head, s->head, __ATOMIC_RELEASE);
+  }
+}
+
+/*
+ * A producer that goes away does not flush our QP, it only shows up
+ * as a CM event on the connection's (non-blocking) channel.
+ */
+static int disconnected(struct rdma_cm_id *id)
+{
+  struct rdma_cm_event *event;
+  int gone;
+
+  if (rdma_get_cm_event(id->channel, &event))
+    return 0;
+  gone = event->event == RDMA_CM_EVENT_DISCONNECTED;
+  rdma_ack_cm_event(event);
+  return gone;
+}
+
+/* Returns -1 once the connection has gone away */
+static int poll_conn(struct rq_server *s, struct rq_conn *c)
+{
+  struct ibv_wc wc[16];
+  int n = ibv_poll_cq(c->id->recv_cq, 16, wc);
+
+  if (!n && ++c->idle % 4096 == 0 && disconnected(c->id))
+    return -1;
+
+  for (int i=0; i<n; i++) {
+    unsigned slot = wc[i].wr_id;
+    char *entry = c->bufs + slot * s->cfg->entry;
+
+    if (wc[i].status)
+      return -1;
+
+    consume(s, entry, be64toh(*(uint64_t *) (entry + s->cfg->entry -
+                                             sizeof(uint64_t))) - 1);
+    s->send_entries++;
+    if (post_conn_recv(s, c, slot))
+      return -1;
+  }
+
+  return n < 0 ? -1 : 0;
+}
+
+static int run_server(struct rqueue *cfg)
+{
+  struct rq_server s = { .cfg = cfg };
+  struct rq_conn **pc, *c;
+  pthread_t thread;
+  double last = now();
+
+  s.ring = aligned_alloc(4096, (size_t) cfg->slots * cfg->entry);
+  s.ctrl = aligned_alloc(64, sizeof(*s.ctrl));
+  if (!s.ring || !s.ctrl)
+    return report("aligned_alloc", NO_BUFFER);
+  memset(s.ring, 0, (size_t) cfg->slots * cfg->entry);
+  memset(s.ctrl, 0, sizeof(*s.ctrl));
+  pthread_mutex_init(&s.lock, NULL);
+
+  if (pthread_create(&thread, NULL, accept_thread, &s))
+    return report("pthread_create", SETUP_PROBLEM);
+
+  fprintf(stdout, "Serving %u slots of %u bytes on port %s.\n", cfg->slots,
+          cfg->entry, cfg->port);
+
+  while (1) {
+    /* Unlocked peek, the lock is only taken when there is something */
+    if (__atomic_load_n(&s.incoming, __ATOMIC_ACQUIRE)) {
+      pthread_mutex_lock(&s.lock);
+      for (c = s.incoming; c->next; c = c->next)
+        ;
+      c->next = s.conns;
+      s.conns = s.incoming;
+      __atomic_store_n(&s.incoming, NULL, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&s.lock);
+    }
+
+    poll_ring(&s);
+
+    for (pc = &s.conns; *pc; ) {
+      c = *pc;
+      if (poll_conn(&s, c)) {
+        *pc = c->next;
+        rdma_disconnect(c->id);
+        free_conn(c);
+        continue;
+      }
+      pc = &c->next;
+    }
+
+    if (cfg->verbose && now() - last >= 1) {
+      fprintf(stdout, "Consumed %lu ring and %lu SEND entries, %lu bad.\n",
+              s.ring_entries, s.send_entries, s.bad);
+      last = now();
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Client. Every producer has its own connection and runs the tests
+ * in lock step with the others.
+ */
+
+struct rq_producer {
+  struct rqueue           *cfg;
+  int                     index;
+  struct rdma_cm_id       *id;
+  uint64_t                ring_addr;
+  uint64_t                ctrl_addr;
+  uint32_t                ring_rkey;
+  uint32_t                ctrl_rkey;
+  uint32_t                slots;
+  uint32_t                entry;
+
+  uint64_t                *word;            /* FETCH_ADD and READ results */
+  struct ibv_mr           *word_mr;
+  char                    *buf;
+  struct ibv_mr           *buf_mr;
+  struct rq_hello         hello;
+  struct ibv_mr           *hello_mr;
+
+  uint64_t                head;             /* last head read */
+  unsigned long           head_reads;
+  double                  *lat;
+  double                  start;
+  double                  end;
+  int                     ret;
+};
+
+struct rq_test {
+  const char              *name;
+  int                     (*enqueue)(struct rq_producer *, long);
+  pthread_mutex_t         lock;
+  pthread_cond_t          cond;
+  int                     state;      /* 0 wait, 1 go, -1 abort */
+  struct rq_producer      *producers;
+};
+
+static int wait_send(struct rq_producer *p)
+{
+  struct ibv_wc wc;
+  int n;
+
+  while (!(n = ibv_poll_cq(p->id->send_cq, 1, &wc)))
+    ;
+  if (n < 0 || wc.status) {
+    fprintf(stderr, "producer %d: completion failed status %d\n", p->index,
+            n < 0 ? n : (int) wc.status);
+    return -1;
+  }
+  return 0;
+}
+
+static int post_one(struct rq_producer *p, struct ibv_send_wr *wr,
+                    struct ibv_sge *sge)
+{
+  struct ibv_send_wr *bad_wr;
+
+  wr->sg_list = sge;
+  wr->num_sge = 1;
+  wr->send_flags = IBV_SEND_SIGNALED;
+  if (ibv_post_send(p->id->qp, wr, &bad_wr))
+    return report("ibv_post_send", -1);
+  return wait_send(p);
+}
+
+static void fill_entry(struct rq_producer *p, uint64_t ticket)
+{
+  pattern_fill(p->buf, p->entry - sizeof(uint64_t), PATTERN_PRBS, ticket);
+}
+
+static int enqueue_ring(struct rq_producer *p, long i)
+{
+  struct ibv_sge sge = {
+    .addr   = (uintptr_t) p->word,
+    .length = sizeof(uint64_t),
+    .lkey   = p->word_mr->lkey,
+  };
+  struct ibv_send_wr wr;
+  uint64_t ticket;
+
+  memset(&wr, 0, sizeof(wr));
+  wr.opcode = IBV_WR_ATOMIC_FETCH_AND_ADD;
+  wr.wr.atomic.remote_addr = p->ctrl_addr + offsetof(struct rq_ctrl, tail);
+  wr.wr.atomic.rkey = p->ctrl_rkey;
+  wr.wr.atomic.compare_add = 1;
+  if (post_one(p, &wr, &sge))
+    return -1;
+  ticket = *p->word;
+
+  /* Wait for the consumer to free the slot from the last lap */
+  while (ticket - p->head >= p->slots) {
+    memset(&wr, 0, sizeof(wr));
+    wr.opcode = IBV_WR_RDMA_READ;
+    wr.wr.rdma.remote_addr = p->ctrl_addr + offsetof(struct rq_ctrl, head);
+    wr.wr.rdma.rkey = p->ctrl_rkey;
+    if (post_one(p, &wr, &sge))
+      return -1;
+    p->head = *p->word;
+    p->head_reads++;
+  }
+
+  fill_entry(p, ticket);
+  *(uint64_t *) (p->buf + p->entry - sizeof(uint64_t)) = htobe64(ticket + 1);
+
+  sge.addr = (uintptr_t) p->buf;
+  sge.length = p->entry;
+  sge.lkey = p->buf_mr->lkey;
+  memset(&wr, 0, sizeof(wr));
+  wr.opcode = IBV_WR_RDMA_WRITE;
+  wr.wr.rdma.remote_addr = p->ring_addr + (ticket % p->slots) * p->entry;
+  wr.wr.rdma.rkey = p->ring_rkey;
+  return post_one(p, &wr, &sge);
+}
+
+/* The trailer carries a per-producer number so the server can check */
+static int enqueue_send(struct rq_producer *p, long i)
+{
+  struct ibv_sge sge = {
+    .addr   = (uintptr_t) p->buf,
+    .length = p->entry,
+    .lkey   = p->buf_mr->lkey,
+  };
+  struct ibv_send_wr wr;
+  uint64_t seed = ((uint64_t) p->index << 40) | i;
+
+  fill_entry(p, seed);
+  *(uint64_t *) (p->buf + p->entry - sizeof(uint64_t)) = htobe64(seed + 1);
+
+  memset(&wr, 0, sizeof(wr));
+  wr.opcode = IBV_WR_SEND;
+  return post_one(p, &wr, &sge);
+}
+
+struct rq_run {
+  struct rq_test          *test;
+  struct rq_producer      *p;
+};
+
+static void *run_producer(void *arg)
+{
+  struct rq_run *r = arg;
+  struct rq_producer *p = r->p;
+  double t;
+  int state;
+
+  pthread_mutex_lock(&r->test->lock);
+  while (!r->test->state)
+    pthread_cond_wait(&r->test->cond, &r->test->lock);
+  state = r->test->state;
+  pthread_mutex_unlock(&r->test->lock);
+  if (state < 0)
+    return NULL;
+
+  p->ret = 0;
+  p->start = now();
+  for (long i=0; i<p->cfg->iters; i++) {
+    t = now();
+    if (r->test->enqueue(p, i)) {
+      p->ret = RUN_PROBLEM;
+      break;
+    }
+    p->lat[i] = now() - t;
+  }
+  p->end = now();
+
+  return NULL;
+}
+
+static int run_test(struct rq_test *test, int n)
+{
+  struct rqueue *cfg = test->producers[0].cfg;
+  struct rq_run *runs = calloc(n, sizeof(*runs));
+  pthread_t *threads = calloc(n, sizeof(*threads));
+  double *lat = malloc((size_t) n * cfg->iters * sizeof(*lat));
+  double start = 0, end = 0;
+  unsigned long head_reads = 0;
+  int started = 0, ret = 0;
+
+  if (!runs || !threads || !lat) {
+    ret = report("malloc", NO_BUFFER);
+    goto out;
+  }
+
+  /* Held back until all are started so they still begin in lock step */
+  pthread_mutex_init(&test->lock, NULL);
+  pthread_cond_init(&test->cond, NULL);
+  test->state = 0;
+  for (; started<n; started++) {
+    runs[started].test = test;
+    runs[started].p = &test->producers[started];
+    runs[started].p->head_reads = 0;
+    errno = pthread_create(&threads[started], NULL, run_producer,
+                           &runs[started]);
+    if (errno) {
+      ret = report("pthread_create", SETUP_PROBLEM);
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&test->lock);
+  test->state = ret ? -1 : 1;
+  pthread_cond_broadcast(&test->cond);
+  pthread_mutex_unlock(&test->lock);
+
+  for (int i=0; i<started; i++) {
+    struct rq_producer *p = &test->producers[i];
+
+    pthread_join(threads[i], NULL);
+    if (ret)
+      continue;
+    if (p->ret)
+      ret = p->ret;
+    start = i && start < p->start ? start : p->start;
+    end = end > p->end ? end : p->end;
+    head_reads += p->head_reads;
+    memcpy(lat + (size_t) i * cfg->iters, p->lat, cfg->iters * sizeof(*lat));
+  }
+  pthread_cond_destroy(&test->cond);
+  pthread_mutex_destroy(&test->lock);
+  if (ret)
+    goto out;
+
+  fprintf(stdout, "%s x%d: %ld enqueues in %.3f s = %.0f enqueues/s",
+          test->name, n, n * cfg->iters, end - start,
+          n * cfg->iters / (end - start));
+  if (head_reads)
+    fprintf(stdout, ", %lu head reads", head_reads);
+  fprintf(stdout, "\n%s x%d latency: ", test->name, n);
+  report_latency_elapsed(stdout, NULL, lat, (size_t) n * cfg->iters);
+  fprintf(stdout, "\n%s x%d percentiles: ", test->name, n);
+  report_percentiles_elapsed(stdout, lat, (size_t) n * cfg->iters);
+  fprintf(stdout, "\n");
+
+out:
+  free(runs);
+  free(threads);
+  free(lat);
+  return ret;
+}
+
+static int connect_producer(struct rqueue *cfg, struct rq_producer *p)
+{
+  struct rdma_addrinfo hints, *res;
+  struct ibv_qp_init_attr attr = qp_attr(1);
+  struct ibv_device_attr dev;
+  struct ibv_wc wc;
+  int ret;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_port_space = RDMA_PS_TCP;
+  ret = rdma_getaddrinfo(cfg->addr, cfg->port, &hints, &res);
+  if (ret)
+    return report("rdma_getaddrinfo", SETUP_PROBLEM);
+
+  ret = rdma_create_ep(&p->id, res, NULL, &attr);
+  rdma_freeaddrinfo(res);
+  if (ret)
+    return report("rdma_create_ep", SETUP_PROBLEM);
+
+  if (ibv_query_device(p->id->verbs, &dev))
+    return report("ibv_query_device", SETUP_PROBLEM);
+  if (dev.atomic_cap == IBV_ATOMIC_NONE) {
+    errno = EOPNOTSUPP;
+    return report("device has no atomics", SETUP_PROBLEM);
+  }
+
+  p->hello_mr = rdma_reg_msgs(p->id, &p->hello, sizeof(p->hello));
+  if (!p->hello_mr)
+    return report("rdma_reg_msgs", SETUP_PROBLEM);
+  if (rdma_post_recv(p->id, NULL, &p->hello, sizeof(p->hello), p->hello_mr))
+    return report("rdma_post_recv", SETUP_PROBLEM);
+
+  if (rdma_connect(p->id, NULL))
+    return report("rdma_connect", SETUP_PROBLEM);
+  if (rdma_get_recv_comp(p->id, &wc) <= 0 || wc.status)
+    return report("hello", SETUP_PROBLEM);
+
+  p->ring_addr = be64toh(p->hello.ring_addr);
+  p->ring_rkey = be32toh(p->hello.ring_rkey);
+  p->ctrl_addr = be64toh(p->hello.ctrl_addr);
+  p->ctrl_rkey = be32toh(p->hello.ctrl_rkey);
+  p->slots = be32toh(p->hello.slots);
+  p->entry = be32toh(p->hello.entry);
+
+  p->word = aligned_alloc(8, sizeof(uint64_t));
+  p->buf = aligned_alloc(64, p->entry);
+  p->lat = malloc(cfg->iters * sizeof(*p->lat));
+  if (!p->word || !p->buf || !p->lat)
+    return report("malloc", NO_BUFFER);
+  p->word_mr = rdma_reg_msgs(p->id, p->word, sizeof(uint64_t));
+  p->buf_mr = rdma_reg_msgs(p->id, p->buf, p->entry);
+  if (!p->word_mr || !p->buf_mr)
+    return report("rdma_reg_msgs", SETUP_PROBLEM);
+
+  return 0;
+}
+
+static void free_producer(struct rq_producer *p)
+{
+  if (p->id)
+    rdma_disconnect(p->id);
+  if (p->word_mr)
+    rdma_dereg_mr(p->word_mr);
+  if (p->buf_mr)
+    rdma_dereg_mr(p->buf_mr);
+  if (p->hello_mr)
+    rdma_dereg_mr(p->hello_mr);
+  if (p->id)
+    rdma_destroy_ep(p->id);
+  free(p->word);
+  free(p->buf);
+  free(p->lat);
+}
+
+static int run_client(struct rqueue *cfg)
+{
+  struct rq_producer *producers;
+  struct rq_test tests[] = {
+    {.name = "fetch-add ring", .enqueue = enqueue_ring},
+    {.name = "send",           .enqueue = enqueue_send},
+  };
+  int ret = 0;
+
+  producers = calloc(cfg->producers, sizeof(*producers));
+  if (!producers)
+    return report("calloc", NO_BUFFER);
+
+  for (unsigned i=0; i<cfg->producers && !ret; i++) {
+    producers[i].cfg = cfg;
+    producers[i].index = i;
+    ret = connect_producer(cfg, &producers[i]);
+  }
+
+  if (!ret && cfg->verbose)
+    fprintf(stdout, "Connected %u producers: %u slots of %u bytes.\n",
+            cfg->producers, producers[0].slots, producers[0].entry);
+
+  for (unsigned n=1; !ret; n *= 2) {
+    if (n > cfg->producers)
+      n = cfg->producers;
+    for (unsigned t=0; t<sizeof(tests)/sizeof(tests[0]) && !ret; t++) {
+      tests[t].producers = producers;
+      ret = run_test(&tests[t], n);
+    }
+    if (n == cfg->producers)
+      break;
+  }
+
+  for (unsigned i=0; i<cfg->producers; i++)
+    free_producer(&producers[i]);
+  free(producers);
+  return ret;
+}
+
+int main(int argc, char *argv[])
+{
+  struct rqueue cfg;
+
+  argconfig_append_usage("[SERVER_NAME]");
+  int args = argconfig_parse(argc, argv, program_desc, command_line_options,
+                             &defaults, &cfg, sizeof(cfg));
+  if (args > 1) {
+    argconfig_print_help(argv[0], program_desc, command_line_options);
+    return BAD_ARGS;
+  }
+  if (args == 1)
+    cfg.addr = argv[1];
+
+  if (cfg.entry < 2 * sizeof(uint64_t) || cfg.entry % sizeof(uint64_t) ||
+      cfg.iters <= 0)
+    return report("bad arguments", BAD_ARGS);
+
+  if (cfg.addr)
+    return run_client(&cfg);
+  return run_server(&cfg);
+}
@@ -0,0 +1,65 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Wire format shared by rblk_server and rblk_client. Every field
+//     is big endian.
+//
+//     On connecting the server SENDs an rblk_info. After that the
+//     client SENDs rblk_cmd capsules naming one of its registered
+//     buffers and the server moves the data itself, RDMA WRITE into
+//     the buffer for a read and RDMA READ out of it for a write, then
+//     SENDs an rblk_resp with the same tag. A client has at most
+//     info.qdepth commands outstanding and its tags are below that.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef RBLK_H
+#define RBLK_H
+
+#include <stdint.h>
+
+#define RBLK_PORT "7472"
+
+enum rblk_op {
+	RBLK_READ	= 1,
+	RBLK_WRITE	= 2,
+};
+
+struct rblk_info {
+	uint64_t nblocks;
+	uint32_t block_size;
+	uint32_t max_blocks;		/* per command */
+	uint32_t qdepth;
+	uint32_t reserved;
+};
+
+struct rblk_cmd {
+	uint8_t op;
+	uint8_t reserved[3];
+	uint32_t tag;
+	uint64_t lba;
+	uint64_t addr;
+	uint32_t rkey;
+	uint32_t nblocks;
+};
+
+struct rblk_resp {
+	uint32_t tag;
+	int32_t status;			/* 0 or a negative errno */
+};
+
+#endif
@@ -0,0 +1,395 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     fio like load generator for rblk_server. Keeps -q commands of
+//     -b bytes outstanding, sequential or random, reads, writes or a
+//     -M percent read mix, until -n commands have finished or -t
+//     seconds have passed. Reports IOPS, bandwidth and completion
+//     latency percentiles, latency being from posting the command to
+//     receiving its response.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <endian.h>
+#include <time.h>
+#include <rdma/rdma_cma.h>
+#include <rdma/rdma_verbs.h>
+
+#include "rblk.h"
+
+static char *server = "127.0.0.1";
+static char *port = RBLK_PORT;
+static char *rw = "randread";
+static uint32_t bs = 4096;
+static uint32_t iodepth = 16;
+static unsigned long number;
+static double runtime = 10;
+static unsigned rwmixread = 50;
+
+struct rdma_cm_id *id;
+struct ibv_mr *data_mr, *recv_mr;
+char *data;
+
+union rblk_msg {
+	struct rblk_info info;
+	struct rblk_resp resp;
+};
+union rblk_msg *recv_msgs;
+
+static struct rblk_info info;
+static int random_offsets, reads, writes;
+static uint64_t next_lba, seed = 88172645463325252ULL;
+static double *start, *lat;
+static unsigned long nlat, lat_size;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t xorshift(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+static int parse_rw(void)
+{
+	if (!strcmp(rw, "read") || !strcmp(rw, "randread"))
+		reads = 1;
+	else if (!strcmp(rw, "write") || !strcmp(rw, "randwrite"))
+		writes = 1;
+	else if (strcmp(rw, "rw") && strcmp(rw, "randrw"))
+		return -1;
+	random_offsets = !strncmp(rw, "rand", 4);
+	return 0;
+}
+
+static int post_resp_recv(unsigned i)
+{
+	return rdma_post_recv(id, (void *) (uintptr_t) i, &recv_msgs[i],
+			      sizeof(*recv_msgs), recv_mr);
+}
+
+static int issue(uint32_t tag)
+{
+	uint32_t blocks = bs / info.block_size;
+	uint64_t span = info.nblocks - blocks + 1;
+	struct rblk_cmd cmd;
+	uint64_t lba;
+	int read;
+
+	if (random_offsets) {
+		lba = xorshift() % span;
+	} else {
+		lba = next_lba;
+		next_lba = next_lba + blocks < span ? next_lba + blocks : 0;
+	}
+	read = reads || (!writes && xorshift() % 100 < rwmixread);
+
+	memset(&cmd, 0, sizeof cmd);
+	cmd.op = read ? RBLK_READ : RBLK_WRITE;
+	cmd.tag = htobe32(tag);
+	cmd.lba = htobe64(lba);
+	cmd.addr = htobe64((uintptr_t) data + (size_t) tag * bs);
+	cmd.rkey = htobe32(data_mr->rkey);
+	cmd.nblocks = htobe32(blocks);
+
+	start[tag] = now();
+	return rdma_post_send(id, NULL, &cmd, sizeof cmd, NULL,
+			      IBV_SEND_INLINE);
+}
+
+static int record(double elapsed)
+{
+	if (nlat == lat_size) {
+		lat_size = lat_size ? 2 * lat_size : 1 << 16;
+		lat = realloc(lat, lat_size * sizeof *lat);
+		if (!lat)
+			return -1;
+	}
+	lat[nlat++] = elapsed;
+	return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(double elapsed)
+{
+	static const double pcts[] = {50, 90, 99, 99.9, 99.99};
+	double sum = 0;
+
+	qsort(lat, nlat, sizeof *lat, cmp_double);
+	for (unsigned long i = 0; i < nlat; i++)
+		sum += lat[i];
+
+	printf("%s: bs=%u iodepth=%u: %lu ios in %.3f s\n", rw, bs, iodepth,
+	       nlat, elapsed);
+	printf("  IOPS=%.0f, BW=%.1fMiB/s\n", nlat / elapsed,
+	       nlat * (double) bs / elapsed / (1 << 20));
+	if (!nlat)
+		return;
+	printf("  clat (usec): min=%.1f, max=%.1f, avg=%.1f\n",
+	       lat[0] * 1e6, lat[nlat - 1] * 1e6, sum / nlat * 1e6);
+	printf("  clat percentiles (usec):");
+	for (unsigned i = 0; i < sizeof pcts / sizeof pcts[0]; i++)
+		printf(" p%g=%.1f", pcts[i],
+		       lat[(unsigned long) (pcts[i] / 100 * (nlat - 1))] * 1e6);
+	printf("\n");
+}
+
+static int run_load(void)
+{
+	struct ibv_wc wc[16];
+	uint32_t *free_tags;
+	unsigned long issued = 0;
+	unsigned nfree = 0, inflight = 0;
+	double begin, stop;
+	int n, ret = 0;
+
+	free_tags = malloc(iodepth * sizeof *free_tags);
+	start = calloc(iodepth, sizeof *start);
+	if (!free_tags || !start)
+		return -1;
+	for (uint32_t t = iodepth; t > 0; t--)
+		free_tags[nfree++] = t - 1;
+
+	begin = now();
+	stop = begin + runtime;
+	while (1) {
+		int more = (!number || issued < number) && now() < stop;
+
+		if (!more && !inflight)
+			break;
+
+		while (more && nfree && (!number || issued < number)) {
+			ret = issue(free_tags[--nfree]);
+			if (ret) {
+				printf("rdma_post_send %d\n", errno);
+				goto out;
+			}
+			issued++;
+			inflight++;
+		}
+
+		n = ibv_poll_cq(id->recv_cq, 16, wc);
+		for (int i = 0; i < n; i++) {
+			struct rblk_resp *resp = &recv_msgs[wc[i].wr_id].resp;
+			uint32_t tag = be32toh(resp->tag);
+			int status = be32toh(resp->status);
+
+			if (wc[i].status || tag >= iodepth || status) {
+				printf("rblk_client: command failed, wc %d "
+				       "tag %u status %d\n", wc[i].status, tag,
+				       status);
+				ret = -1;
+				goto out;
+			}
+			if (record(now() - start[tag]) ||
+			    post_resp_recv(wc[i].wr_id)) {
+				ret = -1;
+				goto out;
+			}
+			free_tags[nfree++] = tag;
+			inflight--;
+		}
+
+		n = ibv_poll_cq(id->send_cq, 16, wc);
+		for (int i = 0; i < n; i++)
+			if (wc[i].status) {
+				printf("rblk_client: send status %d\n",
+				       wc[i].status);
+				ret = -1;
+				goto out;
+			}
+	}
+
+	report(now() - begin);
+
+out:
+	free(free_tags);
+	free(start);
+	free(lat);
+	return ret;
+}
+
+static int run(void)
+{
+	struct rdma_addrinfo hints, *res;
+	struct ibv_qp_init_attr attr;
+	struct ibv_wc wc;
+	int ret;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_port_space = RDMA_PS_TCP;
+	ret = rdma_getaddrinfo(server, port, &hints, &res);
+	if (ret) {
+		printf("rdma_getaddrinfo %d\n", errno);
+		return ret;
+	}
+
+	memset(&attr, 0, sizeof attr);
+	attr.cap.max_send_wr = attr.cap.max_recv_wr = iodepth + 1;
+	attr.cap.max_send_sge = attr.cap.max_recv_sge = 1;
+	attr.cap.max_inline_data = sizeof(struct rblk_cmd);
+	attr.sq_sig_all = 1;
+	ret = rdma_create_ep(&id, res, NULL, &attr);
+	rdma_freeaddrinfo(res);
+	if (ret) {
+		printf("rdma_create_ep %d\n", errno);
+		return ret;
+	}
+
+	recv_msgs = calloc(iodepth + 1, sizeof *recv_msgs);
+	if (!recv_msgs)
+		return -1;
+	recv_mr = rdma_reg_msgs(id, recv_msgs, (iodepth + 1) * sizeof *recv_msgs);
+	if (!recv_mr) {
+		printf("rdma_reg_msgs %d\n", errno);
+		return -1;
+	}
+
+	for (unsigned i = 0; i < iodepth + 1; i++) {
+		ret = post_resp_recv(i);
+		if (ret) {
+			printf("rdma_post_recv %d\n", errno);
+			return ret;
+		}
+	}
+
+	ret = rdma_connect(id, NULL);
+	if (ret) {
+		printf("rdma_connect %d\n", errno);
+		return ret;
+	}
+
+	ret = rdma_get_recv_comp(id, &wc);
+	if (ret <= 0 || wc.status) {
+		printf("rdma_get_recv_comp %d\n", ret);
+		return -1;
+	}
+	info.nblocks = be64toh(recv_msgs[wc.wr_id].info.nblocks);
+	info.block_size = be32toh(recv_msgs[wc.wr_id].info.block_size);
+	info.max_blocks = be32toh(recv_msgs[wc.wr_id].info.max_blocks);
+	info.qdepth = be32toh(recv_msgs[wc.wr_id].info.qdepth);
+	post_resp_recv(wc.wr_id);
+
+	if (bs % info.block_size || bs / info.block_size > info.max_blocks ||
+	    bs / info.block_size > info.nblocks) {
+		printf("rblk_client: -b must be a multiple of %u up to %u\n",
+		       info.block_size, info.block_size * info.max_blocks);
+		return -1;
+	}
+	if (iodepth > info.qdepth) {
+		printf("rblk_client: server allows iodepth %u\n", info.qdepth);
+		iodepth = info.qdepth;
+	}
+
+	data = aligned_alloc(4096, (size_t) iodepth * bs);
+	if (!data)
+		return -1;
+	memset(data, 0xa5, (size_t) iodepth * bs);
+	data_mr = ibv_reg_mr(id->pd, data, (size_t) iodepth * bs,
+			     IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+			     IBV_ACCESS_REMOTE_READ);
+	if (!data_mr) {
+		printf("ibv_reg_mr %d\n", errno);
+		return -1;
+	}
+
+	ret = run_load();
+
+	rdma_disconnect(id);
+	ibv_dereg_mr(data_mr);
+	rdma_dereg_mr(recv_mr);
+	rdma_destroy_ep(id);
+	free(data);
+	free(recv_msgs);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	while ((op = getopt(argc, argv, "s:p:w:b:q:n:t:M:")) != -1) {
+		switch (op) {
+		case 's':
+			server = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'w':
+			rw = optarg;
+			break;
+		case 'b':
+			bs = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			iodepth = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			number = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			runtime = strtod(optarg, NULL);
+			break;
+		case 'M':
+			rwmixread = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			rw = NULL;
+			break;
+		}
+	}
+
+	if (!rw || parse_rw() || !bs || !iodepth || runtime <= 0 ||
+	    rwmixread > 100) {
+		printf("usage: %s\n", argv[0]);
+		printf("\t[-s server_address]\n");
+		printf("\t[-p port_number]\n");
+		printf("\t[-w read|write|rw|randread|randwrite|randrw] "
+		       "(default randread)\n");
+		printf("\t[-b block_size] bytes per command (default 4096)\n");
+		printf("\t[-q iodepth] commands outstanding (default 16)\n");
+		printf("\t[-n number] commands to run (default until -t)\n");
+		printf("\t[-t runtime] seconds (default 10)\n");
+		printf("\t[-M rwmixread] percent reads for rw (default 50)\n");
+		exit(1);
+	}
+
+	printf("rblk_client: start\n");
+	ret = run();
+	printf("rblk_client: end %d\n", ret);
+	return ret;
+}
@@ -0,0 +1,509 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Remote block device server. Exports FILE as fixed size blocks
+//     to any number of rblk_client instances, each connection served
+//     by its own thread with its own io_uring. A command's data goes
+//     between the file and a per-tag registered buffer with O_DIRECT
+//     and between that buffer and the client with RDMA WRITE (reads)
+//     or RDMA READ (writes). The client never copies the data itself.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <rdma/rdma_cma.h>
+#include <rdma/rdma_verbs.h>
+#include <liburing.h>
+
+#include "rblk.h"
+
+static char *port = RBLK_PORT;
+static uint32_t block_size = 4096;
+static uint32_t max_blocks = 32;
+static uint32_t qdepth = 64;
+static int verbose;
+
+static int fd;
+static uint64_t nblocks;
+
+struct rblk_conn {
+	struct rdma_cm_id *id;
+	struct io_uring ring;
+	int ring_ready;
+	int fixed;
+	char *data;			/* one max sized buffer per tag */
+	struct ibv_mr *data_mr;
+	struct rblk_cmd *recv_cmds;	/* as received, one per receive */
+	struct ibv_mr *recv_mr;
+	struct rblk_cmd *cmds;		/* in host order, by tag */
+	unsigned inflight;		/* submitted to the ring */
+	unsigned long ios;
+};
+
+static char *tag_buf(struct rblk_conn *c, uint32_t tag)
+{
+	return c->data + (size_t) tag * max_blocks * block_size;
+}
+
+static int post_cmd_recv(struct rblk_conn *c, unsigned i)
+{
+	return rdma_post_recv(c->id, (void *) (uintptr_t) i, &c->recv_cmds[i],
+			      sizeof(*c->recv_cmds), c->recv_mr);
+}
+
+static int send_resp(struct rblk_conn *c, uint32_t tag, int status)
+{
+	struct rblk_resp resp;
+
+	resp.tag = htobe32(tag);
+	resp.status = htobe32(status);
+	return rdma_post_send(c->id, NULL, &resp, sizeof resp, NULL,
+			      IBV_SEND_INLINE);
+}
+
+/*
+ * Chains the data WRITE and the response SEND in one post so the
+ * response can only arrive after the data.
+ */
+static int send_read_data(struct rblk_conn *c, struct rblk_cmd *cmd)
+{
+	struct ibv_send_wr wr[2], *bad_wr;
+	struct ibv_sge sge;
+	struct rblk_resp resp;
+	struct ibv_sge resp_sge;
+
+	sge.addr = (uintptr_t) tag_buf(c, cmd->tag);
+	sge.length = cmd->nblocks * block_size;
+	sge.lkey = c->data_mr->lkey;
+
+	resp.tag = htobe32(cmd->tag);
+	resp.status = 0;
+	resp_sge.addr = (uintptr_t) &resp;
+	resp_sge.length = sizeof resp;
+	resp_sge.lkey = 0;
+
+	memset(wr, 0, sizeof wr);
+	wr[0].opcode = IBV_WR_RDMA_WRITE;
+	wr[0].sg_list = &sge;
+	wr[0].num_sge = 1;
+	wr[0].wr.rdma.remote_addr = cmd->addr;
+	wr[0].wr.rdma.rkey = cmd->rkey;
+	wr[0].next = &wr[1];
+	wr[1].opcode = IBV_WR_SEND;
+	wr[1].sg_list = &resp_sge;
+	wr[1].num_sge = 1;
+	wr[1].send_flags = IBV_SEND_INLINE;
+
+	return ibv_post_send(c->id->qp, wr, &bad_wr);
+}
+
+static int submit_io(struct rblk_conn *c, struct rblk_cmd *cmd)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&c->ring);
+	char *buf = tag_buf(c, cmd->tag);
+	unsigned len = cmd->nblocks * block_size;
+	off_t off = cmd->lba * block_size;
+
+	if (!sqe)
+		return -EBUSY;
+
+	if (cmd->op == RBLK_READ && c->fixed)
+		io_uring_prep_read_fixed(sqe, fd, buf, len, off, 0);
+	else if (cmd->op == RBLK_READ)
+		io_uring_prep_read(sqe, fd, buf, len, off);
+	else if (c->fixed)
+		io_uring_prep_write_fixed(sqe, fd, buf, len, off, 0);
+	else
+		io_uring_prep_write(sqe, fd, buf, len, off);
+	io_uring_sqe_set_data64(sqe, cmd->tag);
+
+	if (io_uring_submit(&c->ring) < 0)
+		return -EIO;
+	c->inflight++;
+	return 0;
+}
+
+static int start_cmd(struct rblk_conn *c, struct rblk_cmd *wire)
+{
+	struct rblk_cmd *cmd;
+	uint32_t tag = be32toh(wire->tag);
+	int ret;
+
+	if (tag >= qdepth) {
+		printf("rblk_server: bad tag %u\n", tag);
+		return -1;
+	}
+
+	cmd = &c->cmds[tag];
+	cmd->op = wire->op;
+	cmd->tag = tag;
+	cmd->lba = be64toh(wire->lba);
+	cmd->addr = be64toh(wire->addr);
+	cmd->rkey = be32toh(wire->rkey);
+	cmd->nblocks = be32toh(wire->nblocks);
+
+	if ((cmd->op != RBLK_READ && cmd->op != RBLK_WRITE) ||
+	    !cmd->nblocks || cmd->nblocks > max_blocks ||
+	    cmd->lba >= nblocks || cmd->nblocks > nblocks - cmd->lba)
+		return send_resp(c, tag, -EINVAL);
+
+	if (cmd->op == RBLK_READ) {
+		ret = submit_io(c, cmd);
+		return ret ? send_resp(c, tag, ret) : 0;
+	}
+
+	return rdma_post_read(c->id, (void *) (uintptr_t) (tag + 1),
+			      tag_buf(c, tag), cmd->nblocks * block_size,
+			      c->data_mr, 0, cmd->addr, cmd->rkey);
+}
+
+static int finish_io(struct rblk_conn *c, struct io_uring_cqe *cqe)
+{
+	struct rblk_cmd *cmd = &c->cmds[io_uring_cqe_get_data64(cqe)];
+	int res = cqe->res;
+
+	io_uring_cqe_seen(&c->ring, cqe);
+	c->inflight--;
+	c->ios++;
+
+	if (res >= 0 && (unsigned) res != cmd->nblocks * block_size)
+		res = -EIO;
+	if (res < 0)
+		return send_resp(c, cmd->tag, res);
+	if (cmd->op == RBLK_READ)
+		return send_read_data(c, cmd);
+	return send_resp(c, cmd->tag, 0);
+}
+
+/*
+ * A remote disconnect does not move the QP to error, so receives are
+ * not flushed when the client leaves. Nothing else reads the sync
+ * endpoint's CM events; poll them now and then to notice it.
+ */
+static int disconnected(struct rblk_conn *c)
+{
+	struct rdma_cm_event *event;
+	int gone;
+
+	if (rdma_get_cm_event(c->id->channel, &event))
+		return 0;
+	gone = event->event == RDMA_CM_EVENT_DISCONNECTED;
+	rdma_ack_cm_event(event);
+	return gone;
+}
+
+/*
+ * Busy polls the receive queue for commands, the send queue for
+ * finished RDMA READs and the ring for finished disk I/O until the
+ * client goes away.
+ */
+static int serve(struct rblk_conn *c)
+{
+	struct io_uring_cqe *cqe;
+	struct ibv_wc wc[16];
+	unsigned idle = 0;
+	int n, ret;
+
+	fcntl(c->id->channel->fd, F_SETFL,
+	      fcntl(c->id->channel->fd, F_GETFL) | O_NONBLOCK);
+
+	while (1) {
+		n = ibv_poll_cq(c->id->recv_cq, 16, wc);
+		if (n < 0)
+			return n;
+		if (n)
+			idle = 0;
+		else if (++idle % 4096 == 0 && disconnected(c))
+			return 0;
+		for (int i = 0; i < n; i++) {
+			if (wc[i].status)
+				return wc[i].status == IBV_WC_WR_FLUSH_ERR ?
+					0 : -1;
+			ret = start_cmd(c, &c->recv_cmds[wc[i].wr_id]);
+			if (ret || post_cmd_recv(c, wc[i].wr_id))
+				return -1;
+		}
+
+		n = ibv_poll_cq(c->id->send_cq, 16, wc);
+		if (n < 0)
+			return n;
+		for (int i = 0; i < n; i++) {
+			if (wc[i].status) {
+				printf("rblk_server: send status %d\n",
+				       wc[i].status);
+				return -1;
+			}
+			if (!wc[i].wr_id)
+				continue;
+			ret = submit_io(c, &c->cmds[wc[i].wr_id - 1]);
+			if (ret && send_resp(c, wc[i].wr_id - 1, ret))
+				return -1;
+		}
+
+		while (!io_uring_peek_cqe(&c->ring, &cqe))
+			if (finish_io(c, cqe))
+				return -1;
+	}
+}
+
+static void free_conn(struct rblk_conn *c)
+{
+	struct io_uring_cqe *cqe;
+
+	/* Let the disk finish with the data buffers before freeing them */
+	while (c->inflight && !io_uring_wait_cqe(&c->ring, &cqe)) {
+		io_uring_cqe_seen(&c->ring, cqe);
+		c->inflight--;
+	}
+
+	if (c->data_mr)
+		ibv_dereg_mr(c->data_mr);
+	if (c->recv_mr)
+		rdma_dereg_mr(c->recv_mr);
+	if (c->ring_ready)
+		io_uring_queue_exit(&c->ring);
+	free(c->data);
+	free(c->recv_cmds);
+	free(c->cmds);
+	rdma_destroy_ep(c->id);
+	free(c);
+}
+
+static void *conn_thread(void *arg)
+{
+	struct rblk_conn *c = arg;
+	int ret;
+
+	ret = serve(c);
+	if (verbose || ret)
+		printf("rblk_server: connection closed after %lu ios, %d\n",
+		       c->ios, ret);
+
+	rdma_disconnect(c->id);
+	free_conn(c);
+	return NULL;
+}
+
+static int setup_conn(struct rblk_conn *c)
+{
+	size_t len = (size_t) qdepth * max_blocks * block_size;
+	struct rblk_info info;
+	struct iovec iov;
+	int ret;
+
+	ret = io_uring_queue_init(qdepth, &c->ring, 0);
+	if (ret) {
+		printf("io_uring_queue_init %d\n", -ret);
+		return ret;
+	}
+	c->ring_ready = 1;
+
+	c->data = aligned_alloc(4096, len);
+	c->recv_cmds = calloc(qdepth, sizeof(*c->recv_cmds));
+	c->cmds = calloc(qdepth, sizeof(*c->cmds));
+	if (!c->data || !c->recv_cmds || !c->cmds) {
+		printf("rblk_server: out of memory\n");
+		return -1;
+	}
+
+	iov.iov_base = c->data;
+	iov.iov_len = len;
+	c->fixed = !io_uring_register_buffers(&c->ring, &iov, 1);
+
+	c->data_mr = ibv_reg_mr(c->id->pd, c->data, len,
+				IBV_ACCESS_LOCAL_WRITE);
+	c->recv_mr = rdma_reg_msgs(c->id, c->recv_cmds,
+				   qdepth * sizeof(*c->recv_cmds));
+	if (!c->data_mr || !c->recv_mr) {
+		printf("rdma_reg_msgs %d\n", errno);
+		return -1;
+	}
+
+	for (unsigned i = 0; i < qdepth; i++) {
+		ret = post_cmd_recv(c, i);
+		if (ret) {
+			printf("rdma_post_recv %d\n", errno);
+			return ret;
+		}
+	}
+
+	ret = rdma_accept(c->id, NULL);
+	if (ret) {
+		printf("rdma_accept %d\n", errno);
+		return ret;
+	}
+
+	info.nblocks = htobe64(nblocks);
+	info.block_size = htobe32(block_size);
+	info.max_blocks = htobe32(max_blocks);
+	info.qdepth = htobe32(qdepth);
+	info.reserved = 0;
+	ret = rdma_post_send(c->id, NULL, &info, sizeof info, NULL,
+			     IBV_SEND_INLINE);
+	if (ret) {
+		printf("rdma_post_send %d\n", errno);
+		return ret;
+	}
+
+	return 0;
+}
+
+static int run(void)
+{
+	struct rdma_addrinfo hints, *res;
+	struct ibv_qp_init_attr attr;
+	struct rdma_cm_id *listen_id, *id;
+	struct rblk_conn *c;
+	pthread_t thread;
+	int ret;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_flags = RAI_PASSIVE;
+	hints.ai_port_space = RDMA_PS_TCP;
+	ret = rdma_getaddrinfo(NULL, port, &hints, &res);
+	if (ret) {
+		printf("rdma_getaddrinfo %d\n", errno);
+		return ret;
+	}
+
+	memset(&attr, 0, sizeof attr);
+	/* room for a WRITE and SEND per tag while completions lag behind */
+	attr.cap.max_send_wr = 4 * qdepth + 1;
+	attr.cap.max_recv_wr = qdepth;
+	attr.cap.max_send_sge = attr.cap.max_recv_sge = 1;
+	attr.cap.max_inline_data = sizeof(struct rblk_info);
+	attr.sq_sig_all = 1;
+	ret = rdma_create_ep(&listen_id, res, NULL, &attr);
+	rdma_freeaddrinfo(res);
+	if (ret) {
+		printf("rdma_create_ep %d\n", errno);
+		return ret;
+	}
+
+	ret = rdma_listen(listen_id, 0);
+	if (ret) {
+		printf("rdma_listen %d\n", errno);
+		return ret;
+	}
+
+	while (!(ret = rdma_get_request(listen_id, &id))) {
+		c = calloc(1, sizeof *c);
+		if (!c) {
+			rdma_destroy_ep(id);
+			continue;
+		}
+		c->id = id;
+
+		if (setup_conn(c) ||
+		    pthread_create(&thread, NULL, conn_thread, c)) {
+			rdma_disconnect(id);
+			free_conn(c);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	printf("rdma_get_request %d\n", errno);
+	rdma_destroy_ep(listen_id);
+	return ret;
+}
+
+/* Falls back to the page cache where the file system has no O_DIRECT */
+static int open_file(const char *path)
+{
+	struct stat st;
+
+	fd = open(path, O_RDWR | O_DIRECT);
+	if (fd < 0 && errno == EINVAL) {
+		fd = open(path, O_RDWR);
+		if (fd >= 0)
+			printf("rblk_server: no O_DIRECT for %s\n", path);
+	}
+	if (fd < 0 || fstat(fd, &st)) {
+		printf("rblk_server: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	nblocks = st.st_size / block_size;
+	if (!nblocks) {
+		printf("rblk_server: %s is smaller than a block\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char *path = NULL;
+	int op, ret;
+
+	while ((op = getopt(argc, argv, "f:p:b:m:q:v")) != -1) {
+		switch (op) {
+		case 'f':
+			path = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'b':
+			block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			max_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			qdepth = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			path = NULL;
+			break;
+		}
+	}
+
+	if (!path || !block_size || block_size % 512 || !max_blocks ||
+	    !qdepth) {
+		printf("usage: %s -f file\n", argv[0]);
+		printf("\t[-p port_number]\n");
+		printf("\t[-b block_size] (default 4096, a multiple of 512)\n");
+		printf("\t[-m max_blocks] blocks per command (default 32)\n");
+		printf("\t[-q queue_depth] commands per client (default 64)\n");
+		printf("\t[-v] report every closed connection\n");
+		exit(1);
+	}
+
+	if (open_file(path))
+		exit(1);
+
+	printf("rblk_server: exporting %llu blocks of %u bytes\n",
+	       (unsigned long long) nblocks, block_size);
+	ret = run();
+	printf("rblk_server: end %d\n", ret);
+	return ret;
+}
@@ -27,27 +27,205 @@
  * SOFTWARE.
  */
 
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <getopt.h>
+#include <endian.h>
+#include <time.h>
 #include <rdma/rdma_cma.h>
 #include <rdma/rdma_verbs.h>
 
+#include "rpc.h"
+#include "rpc_ops.h"
+
 static char *server = "127.0.0.1";
 static char *port = "7471";
+static unsigned depth = 64;
+static unsigned msg_size = 1024;
+static unsigned batch = 16;
+static unsigned long count = 1;
+static unsigned size = 16;
+static double rate;
+static char *workload = "echo";
+static unsigned get_pct = 90;
+static unsigned long keys = 1000;
 
 struct rdma_cm_id *id;
-struct ibv_mr *mr;
-uint8_t send_msg[16];
-uint8_t recv_msg[16];
+struct rpc_conn conn;
+
+struct bench {
+	double *start;			/* by id % depth */
+	double *lat;
+	unsigned long done;
+	unsigned long errors;
+	uint64_t seed;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t xorshift(struct bench *b)
+{
+	b->seed ^= b->seed << 13;
+	b->seed ^= b->seed >> 7;
+	b->seed ^= b->seed << 17;
+	return b->seed;
+}
+
+static void on_resp(void *arg, uint64_t rid, int status, const void *resp,
+		    uint32_t len)
+{
+	struct bench *b = arg;
+
+	/* a GET of a key nobody PUT yet is no failure */
+	if (status && status != -ENOENT)
+		b->errors++;
+	b->lat[b->done++] = now() - b->start[rid % depth];
+}
+
+/*
+ * Returns 0, -EAGAIN while the ring is full or another error. Preloading
+ * PUTs key i for request i.
+ */
+static int call(struct bench *b, char *buf, unsigned long i, int preload,
+		double start)
+{
+	struct rpc_kv_req *kv = (struct rpc_kv_req *) buf;
+	uint64_t rid;
+	int ret;
+
+	if (!strcmp(workload, "echo")) {
+		ret = rpc_call(&conn, RPC_ECHO, buf, size, &rid);
+	} else {
+		kv->key = htobe64(preload ? i : xorshift(b) % keys);
+		if (preload || xorshift(b) % 100 >= get_pct)
+			ret = rpc_call(&conn, RPC_PUT, buf, sizeof *kv + size,
+				       &rid);
+		else
+			ret = rpc_call(&conn, RPC_GET, buf, sizeof *kv, &rid);
+	}
+
+	if (!ret)
+		b->start[rid % depth] = start;
+	return ret;
+}
+
+/*
+ * Closed loop (rate 0) keeps the ring full. Open loop issues request i
+ * at i / rate seconds and measures latency from then, so a slow server
+ * can't hide queueing delay by holding the client back.
+ */
+static int run_load(struct bench *b, unsigned long n, double rate,
+		    int preload)
+{
+	char *buf = calloc(1, msg_size);
+	unsigned long issued = 0;
+	double t0 = now(), t;
+	int ret = 0;
+
+	if (!buf)
+		return -1;
+	memset(buf, 0x5a, msg_size);
+
+	b->done = 0;
+	while (b->done < n) {
+		while (issued < n) {
+			t = now();
+			if (rate && t < t0 + issued / rate)
+				break;
+			ret = call(b, buf, issued, preload,
+				   rate ? t0 + issued / rate : t);
+			if (ret == -EAGAIN)
+				break;
+			if (ret)
+				goto out;
+			issued++;
+		}
+
+		ret = rpc_flush(&conn);
+		if (!ret)
+			ret = rpc_poll_resp(&conn, on_resp, b) < 0;
+		if (ret)
+			goto out;
+	}
+
+out:
+	if (ret)
+		printf("rdma_client: rpc failed, %s\n", strerror(errno));
+	free(buf);
+	return ret ? -1 : 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(struct bench *b, double elapsed, unsigned long doorbells)
+{
+	double sum = 0;
+
+	qsort(b->lat, b->done, sizeof *b->lat, cmp_double);
+	for (unsigned long i = 0; i < b->done; i++)
+		sum += b->lat[i];
+
+	printf("%s %s loop: %lu requests of %u bytes in %.3f s = %.0f req/s, "
+	       "%.1f per doorbell\n", workload, rate ? "open" : "closed",
+	       b->done, size, elapsed, b->done / elapsed,
+	       (double) b->done / doorbells);
+	printf("  latency (usec): avg=%.1f p50=%.1f p99=%.1f p99.9=%.1f "
+	       "max=%.1f\n", sum / b->done * 1e6,
+	       b->lat[(b->done - 1) / 2] * 1e6,
+	       b->lat[(unsigned long) ((b->done - 1) * 0.99)] * 1e6,
+	       b->lat[(unsigned long) ((b->done - 1) * 0.999)] * 1e6,
+	       b->lat[b->done - 1] * 1e6);
+	if (b->errors)
+		printf("  %lu requests failed\n", b->errors);
+}
+
+static int run_bench(void)
+{
+	struct bench b = {.seed = 88172645463325252ULL};
+	unsigned long doorbells;
+	double start;
+	int ret = -1;
+
+	b.start = calloc(depth, sizeof *b.start);
+	b.lat = malloc((count > keys ? count : keys) * sizeof *b.lat);
+	if (!b.start || !b.lat)
+		goto out;
+
+	if (strcmp(workload, "echo") && run_load(&b, keys, 0, 1))
+		goto out;
+
+	doorbells = conn.doorbells;
+	b.errors = 0;
+	start = now();
+	if (run_load(&b, count, rate, 0))
+		goto out;
+	report(&b, now() - start, conn.doorbells - doorbells);
+	ret = b.errors ? -1 : 0;
+
+out:
+	free(b.start);
+	free(b.lat);
+	return ret;
+}
 
 static int run(void)
 {
 	struct rdma_addrinfo hints, *res;
 	struct ibv_qp_init_attr attr;
-	struct ibv_wc wc;
 	int ret;
 
 	memset(&hints, 0, sizeof hints);
@@ -58,12 +236,7 @@ static int run(void)
 		return ret;
 	}
 
-	memset(&attr, 0, sizeof attr);
-	attr.cap.max_send_wr = attr.cap.max_recv_wr = 1;
-	attr.cap.max_send_sge = attr.cap.max_recv_sge = 1;
-	attr.cap.max_inline_data = 16;
-	attr.qp_context = id;
-	attr.sq_sig_all = 1;
+	rpc_qp_attr(&attr, depth);
 	ret = rdma_create_ep(&id, res, NULL, &attr);
 	rdma_freeaddrinfo(res);
 	if (ret) {
@@ -71,13 +244,13 @@ static int run(void)
 		return ret;
 	}
 
-	mr = rdma_reg_msgs(id, recv_msg, 16);
-	if (!mr) {
-		printf("rdma_reg_msgs %d\n", errno);
+	ret = rpc_conn_init(&conn, id, 0, depth, msg_size, batch);
+	if (ret) {
+		printf("rpc_conn_init %d\n", errno);
 		return ret;
 	}
 
-	ret = rdma_post_recv(id, NULL, recv_msg, 16, mr);
+	ret = rpc_post_recvs(&conn);
 	if (ret) {
 		printf("rdma_post_recv %d\n", errno);
 		return ret;
@@ -89,29 +262,19 @@ static int run(void)
 		return ret;
 	}
 
-	ret = rdma_post_send(id, NULL, send_msg, 16, NULL, IBV_SEND_INLINE);
-	if (ret) {
-		printf("rdma_post_send %d\n", errno);
-		return ret;
-	}
-
-	ret = rdma_get_recv_comp(id, &wc);
-	if (ret <= 0) {
-		printf("rdma_get_recv_comp %d\n", ret);
-		return ret;
-	}
+	ret = run_bench();
 
 	rdma_disconnect(id);
-	rdma_dereg_mr(mr);
+	rpc_conn_destroy(&conn);
 	rdma_destroy_ep(id);
-	return 0;
+	return ret;
 }
 
 int main(int argc, char **argv)
 {
 	int op, ret;
 
-	while ((op = getopt(argc, argv, "s:p:")) != -1) {
+	while ((op = getopt(argc, argv, "s:p:d:m:b:n:S:r:w:G:k:")) != -1) {
 		switch (op) {
 		case 's':
 			server = optarg;
@@ -119,14 +282,59 @@ int main(int argc, char **argv)
 		case 'p':
 			port = optarg;
 			break;
+		case 'd':
+			depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			msg_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			batch = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rate = strtod(optarg, NULL);
+			break;
+		case 'w':
+			workload = optarg;
+			break;
+		case 'G':
+			get_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			keys = strtoul(optarg, NULL, 0);
+			break;
 		default:
-			printf("usage: %s\n", argv[0]);
-			printf("\t[-s server_address]\n");
-			printf("\t[-p port_number]\n");
-			exit(1);
+			depth = 0;
+			break;
 		}
 	}
 
+	if (!depth || !count || !keys || rate < 0 || get_pct > 100 ||
+	    (strcmp(workload, "echo") && strcmp(workload, "kv")) ||
+	    size + sizeof(struct rpc_hdr) + sizeof(struct rpc_kv_req) >
+	    msg_size) {
+		printf("usage: %s\n", argv[0]);
+		printf("\t[-s server_address]\n");
+		printf("\t[-p port_number]\n");
+		printf("\t[-d depth] ring slots each way (default 64)\n");
+		printf("\t[-m msg_size] bytes per ring slot, as the server's "
+		       "(default 1024)\n");
+		printf("\t[-b batch] requests per doorbell (default 16)\n");
+		printf("\t[-n count] requests (default 1)\n");
+		printf("\t[-S size] payload bytes (default 16)\n");
+		printf("\t[-w echo|kv] workload (default echo)\n");
+		printf("\t[-G get_percent] kv GETs, the rest PUTs (default 90)\n");
+		printf("\t[-k keys] kv keys, PUT before the run (default 1000)\n");
+		printf("\t[-r rate] open loop requests/s (default closed loop)\n");
+		exit(1);
+	}
+
 	printf("rdma_client: start\n");
 	ret = run();
 	printf("rdma_client: end %d\n", ret);
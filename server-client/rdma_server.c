@@ -27,27 +27,189 @@
  * SOFTWARE.
  */
 
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <getopt.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <rdma/rdma_cma.h>
 #include <rdma/rdma_verbs.h>
 
+#include "rpc.h"
+#include "rpc_ops.h"
+
 static char *port = "7471";
+static unsigned depth = 64;
+static unsigned msg_size = 1024;
+static unsigned kv_slots = 1 << 16;
+static unsigned threads;
 
 struct rdma_cm_id *listen_id, *id;
-struct ibv_mr *mr;
-uint8_t send_msg[16];
-uint8_t recv_msg[16];
+struct rpc_conn conn;
+struct rpc_handlers handlers;
+
+/*
+ * Handlers
+ */
+
+struct kv_entry {
+	uint64_t key;
+	uint32_t len;
+	uint32_t used;
+	char *value;
+};
+
+/* Locked since -L serves connections from several threads */
+struct kv_table {
+	struct kv_entry *entries;
+	unsigned slots;
+	unsigned value_size;
+	pthread_mutex_t lock;
+};
+
+static int echo(void *ctx, const void *req, uint32_t len, void *resp,
+		uint32_t *resp_len)
+{
+	if (len > *resp_len)
+		return -EMSGSIZE;
+	memcpy(resp, req, len);
+	*resp_len = len;
+	return 0;
+}
+
+/* Linear probing from the key's hash, NULL if the table is full */
+static struct kv_entry *kv_find(struct kv_table *t, uint64_t key)
+{
+	unsigned i = (key * 0x9e3779b97f4a7c15ULL) >> 32;
+
+	for (unsigned n = 0; n < t->slots; n++, i++) {
+		struct kv_entry *e = &t->entries[i % t->slots];
+
+		if (!e->used || e->key == key)
+			return e;
+	}
+	return NULL;
+}
+
+static int kv_get(void *ctx, const void *req, uint32_t len, void *resp,
+		  uint32_t *resp_len)
+{
+	const struct rpc_kv_req *kv = req;
+	struct kv_table *t = ctx;
+	struct kv_entry *e;
+	int ret = 0;
+
+	if (len < sizeof *kv)
+		return -EINVAL;
+
+	pthread_mutex_lock(&t->lock);
+	e = kv_find(t, be64toh(kv->key));
+	if (!e || !e->used) {
+		ret = -ENOENT;
+	} else if (e->len > *resp_len) {
+		ret = -EMSGSIZE;
+	} else {
+		memcpy(resp, e->value, e->len);
+		*resp_len = e->len;
+	}
+	pthread_mutex_unlock(&t->lock);
+	return ret;
+}
+
+static int kv_put(void *ctx, const void *req, uint32_t len, void *resp,
+		  uint32_t *resp_len)
+{
+	const struct rpc_kv_req *kv = req;
+	struct kv_table *t = ctx;
+	struct kv_entry *e;
+
+	*resp_len = 0;
+	if (len < sizeof *kv)
+		return -EINVAL;
+	len -= sizeof *kv;
+	if (len > t->value_size)
+		return -EMSGSIZE;
+
+	pthread_mutex_lock(&t->lock);
+	e = kv_find(t, be64toh(kv->key));
+	if (e) {
+		e->key = be64toh(kv->key);
+		e->len = len;
+		e->used = 1;
+		memcpy(e->value, kv + 1, len);
+	}
+	pthread_mutex_unlock(&t->lock);
+	return e ? 0 : -ENOSPC;
+}
+
+static int kv_init(struct kv_table *t)
+{
+	t->slots = kv_slots;
+	t->value_size = msg_size - sizeof(struct rpc_hdr) -
+		sizeof(struct rpc_kv_req);
+	pthread_mutex_init(&t->lock, NULL);
+	t->entries = calloc(t->slots, sizeof *t->entries);
+	if (!t->entries)
+		return -1;
+	for (unsigned i = 0; i < t->slots; i++) {
+		t->entries[i].value = malloc(t->value_size);
+		if (!t->entries[i].value)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * The endpoint is synchronous, so nothing reads its CM events. Poll
+ * them now and then to notice the client leaving.
+ */
+static int disconnected(void)
+{
+	struct rdma_cm_event *event;
+	int gone;
+
+	if (rdma_get_cm_event(id->channel, &event))
+		return 0;
+	gone = event->event == RDMA_CM_EVENT_DISCONNECTED;
+	rdma_ack_cm_event(event);
+	return gone;
+}
+
+static int serve(void)
+{
+	unsigned long requests = 0;
+	unsigned idle = 0;
+	int n;
+
+	fcntl(id->channel->fd, F_SETFL,
+	      fcntl(id->channel->fd, F_GETFL) | O_NONBLOCK);
+
+	while ((n = rpc_serve(&conn, &handlers)) >= 0) {
+		requests += n;
+		if (n)
+			idle = 0;
+		else if (++idle % 4096 == 0 && disconnected())
+			break;
+	}
+
+	printf("rdma_server: %lu requests in %lu doorbells\n", requests,
+	       conn.doorbells);
+	return 0;
+}
 
 static int run(void)
 {
 	struct rdma_addrinfo hints, *res;
 	struct ibv_qp_init_attr attr;
-	struct ibv_wc wc;
 	int ret;
 
 	memset(&hints, 0, sizeof hints);
@@ -59,11 +221,7 @@ static int run(void)
 		return ret;
 	}
 
-	memset(&attr, 0, sizeof attr);
-	attr.cap.max_send_wr = attr.cap.max_recv_wr = 1;
-	attr.cap.max_send_sge = attr.cap.max_recv_sge = 1;
-	attr.cap.max_inline_data = 16;
-	attr.sq_sig_all = 1;
+	rpc_qp_attr(&attr, depth);
 	ret = rdma_create_ep(&listen_id, res, NULL, &attr);
 	rdma_freeaddrinfo(res);
 	if (ret) {
@@ -83,13 +241,13 @@ static int run(void)
 		return ret;
 	}
 
-	mr = rdma_reg_msgs(id, recv_msg, 16);
-	if (!mr) {
-		printf("rdma_reg_msgs %d\n", errno);
+	ret = rpc_conn_init(&conn, id, 1, depth, msg_size, depth);
+	if (ret) {
+		printf("rpc_conn_init %d\n", errno);
 		return ret;
 	}
 
-	ret = rdma_post_recv(id, NULL, recv_msg, 16, mr);
+	ret = rpc_post_recvs(&conn);
 	if (ret) {
 		printf("rdma_post_recv %d\n", errno);
 		return ret;
@@ -101,49 +259,446 @@ static int run(void)
 		return ret;
 	}
 
-	ret = rdma_get_recv_comp(id, &wc);
-	if (ret <= 0) {
-		printf("rdma_get_recv_comp %d\n", ret);
+	ret = serve();
+
+	rdma_disconnect(id);
+	rpc_conn_destroy(&conn);
+	rdma_destroy_ep(id);
+	rdma_destroy_ep(listen_id);
+	return ret;
+}
+
+/*
+ * Long running mode, -L. The listening id lives on an event channel
+ * whose fd the main thread waits on with epoll, also printing rates
+ * once a second. Every connection gets its own completion channel for
+ * its two CQs, and that fd goes into the epoll set of one of the worker
+ * threads, round robin. A worker serves a connection whenever its
+ * channel fires. The main thread takes connections out of a worker's
+ * set when they go away; the worker frees them after the batch of
+ * events it is working on.
+ */
+
+struct worker;
+
+struct conn {
+	struct rdma_cm_id *id;
+	struct worker *worker;
+	struct ibv_comp_channel *channel;
+	struct ibv_cq *send_cq, *recv_cq;
+	struct rpc_conn rpc;
+	int failed;
+	struct conn *next;
+};
+
+struct worker {
+	pthread_t thread;
+	int epfd;
+	int wake;			/* eventfd, for retired connections */
+	pthread_mutex_t lock;
+	struct conn *dead;
+	unsigned long messages;
+};
+
+static struct worker *workers;
+static unsigned next_worker;
+
+static struct {
+	unsigned long established;
+	unsigned long closed;
+	unsigned long rejected;
+} stats;
+
+static struct ibv_pd *get_pd(struct ibv_context *verbs)
+{
+	static struct ibv_pd *pds[16];
+
+	for (unsigned i = 0; i < 16; i++) {
+		if (pds[i] && pds[i]->context == verbs)
+			return pds[i];
+		if (!pds[i])
+			return pds[i] = ibv_alloc_pd(verbs);
+	}
+	return NULL;
+}
+
+/* Leaves the cm_id to the caller */
+static void free_conn(struct conn *c)
+{
+	if (c->id->qp)
+		rdma_destroy_qp(c->id);
+	rpc_conn_destroy(&c->rpc);
+	if (c->send_cq)
+		ibv_destroy_cq(c->send_cq);
+	if (c->recv_cq)
+		ibv_destroy_cq(c->recv_cq);
+	if (c->channel)
+		ibv_destroy_comp_channel(c->channel);
+	free(c);
+}
+
+/*
+ * Disconnecting brings RDMA_CM_EVENT_DISCONNECTED to the main thread,
+ * which retires the connection like any other that goes away.
+ */
+static void fail_conn(struct conn *c)
+{
+	if (c->failed)
+		return;
+	c->failed = 1;
+	rdma_disconnect(c->id);
+}
+
+/* Drains the channel, rearms both CQs and serves what has arrived */
+static void conn_event(struct conn *c)
+{
+	struct ibv_cq *cq;
+	void *ctx;
+	int n;
+
+	while (!ibv_get_cq_event(c->channel, &cq, &ctx)) {
+		ibv_ack_cq_events(cq, 1);
+		if (ibv_req_notify_cq(cq, 0))
+			fail_conn(c);
+	}
+	if (c->failed)
+		return;
+
+	while ((n = rpc_serve(&c->rpc, &handlers)) > 0)
+		__atomic_add_fetch(&c->worker->messages, n, __ATOMIC_RELAXED);
+	if (n < 0)
+		fail_conn(c);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct epoll_event events[64];
+	struct conn *dead;
+	uint64_t wakes;
+	int n;
+
+	while (1) {
+		n = epoll_wait(w->epfd, events, 64, -1);
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.ptr == w) {
+				if (read(w->wake, &wakes, sizeof wakes) < 0)
+					continue;
+			} else {
+				conn_event(events[i].data.ptr);
+			}
+		}
+
+		pthread_mutex_lock(&w->lock);
+		dead = w->dead;
+		w->dead = NULL;
+		pthread_mutex_unlock(&w->lock);
+
+		while (dead) {
+			struct conn *c = dead;
+			struct rdma_cm_id *cm_id = c->id;
+
+			dead = c->next;
+			free_conn(c);
+			rdma_destroy_id(cm_id);
+		}
+	}
+
+	return NULL;
+}
+
+static int start_workers(void)
+{
+	struct epoll_event ev = {.events = EPOLLIN};
+
+	workers = calloc(threads, sizeof *workers);
+	if (!workers)
+		return -1;
+
+	for (unsigned i = 0; i < threads; i++) {
+		struct worker *w = &workers[i];
+
+		w->epfd = epoll_create1(0);
+		w->wake = eventfd(0, EFD_NONBLOCK);
+		if (w->epfd < 0 || w->wake < 0) {
+			printf("epoll_create1 %d\n", errno);
+			return -1;
+		}
+		pthread_mutex_init(&w->lock, NULL);
+
+		ev.data.ptr = w;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wake, &ev) ||
+		    pthread_create(&w->thread, NULL, worker_thread, w)) {
+			printf("worker %u: %d\n", i, errno);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int accept_conn(struct rdma_cm_id *cm_id)
+{
+	struct epoll_event ev = {.events = EPOLLIN};
+	struct ibv_qp_init_attr attr;
+	struct conn *c;
+	int ret;
+
+	c = calloc(1, sizeof *c);
+	if (!c)
+		return -1;
+	c->id = cm_id;
+	cm_id->context = c;
+	c->worker = &workers[next_worker++ % threads];
+
+	c->channel = ibv_create_comp_channel(cm_id->verbs);
+	if (!c->channel)
+		goto err;
+	fcntl(c->channel->fd, F_SETFL,
+	      fcntl(c->channel->fd, F_GETFL) | O_NONBLOCK);
+
+	c->send_cq = ibv_create_cq(cm_id->verbs, depth, c, c->channel, 0);
+	c->recv_cq = ibv_create_cq(cm_id->verbs, depth, c, c->channel, 0);
+	if (!c->send_cq || !c->recv_cq)
+		goto err;
+
+	rpc_qp_attr(&attr, depth);
+	attr.send_cq = c->send_cq;
+	attr.recv_cq = c->recv_cq;
+	ret = rdma_create_qp(cm_id, get_pd(cm_id->verbs), &attr);
+	if (ret)
+		goto err;
+
+	if (rpc_conn_init(&c->rpc, cm_id, 1, depth, msg_size, depth))
+		goto err;
+	c->rpc.send_cq = c->send_cq;
+	c->rpc.recv_cq = c->recv_cq;
+	if (rpc_post_recvs(&c->rpc) ||
+	    ibv_req_notify_cq(c->send_cq, 0) ||
+	    ibv_req_notify_cq(c->recv_cq, 0))
+		goto err;
+
+	ev.data.ptr = c;
+	if (epoll_ctl(c->worker->epfd, EPOLL_CTL_ADD, c->channel->fd, &ev))
+		goto err;
+
+	if (rdma_accept(cm_id, NULL)) {
+		epoll_ctl(c->worker->epfd, EPOLL_CTL_DEL, c->channel->fd, NULL);
+		goto err;
+	}
+	return 0;
+
+err:
+	printf("rdma_server: can't accept, %s\n", strerror(errno));
+	cm_id->context = NULL;
+	free_conn(c);
+	return -1;
+}
+
+static void retire_conn(struct conn *c)
+{
+	struct worker *w = c->worker;
+	uint64_t one = 1;
+
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->channel->fd, NULL);
+
+	pthread_mutex_lock(&w->lock);
+	c->next = w->dead;
+	w->dead = c;
+	pthread_mutex_unlock(&w->lock);
+
+	if (write(w->wake, &one, sizeof one) < 0)
+		printf("rdma_server: can't wake worker, %d\n", errno);
+}
+
+static void cm_event(struct rdma_cm_event *event)
+{
+	struct rdma_cm_id *cm_id = event->id;
+	struct conn *c = cm_id->context;
+
+	switch (event->event) {
+	case RDMA_CM_EVENT_CONNECT_REQUEST:
+		if (accept_conn(cm_id)) {
+			rdma_reject(cm_id, NULL, 0);
+			stats.rejected++;
+			rdma_ack_cm_event(event);
+			rdma_destroy_id(cm_id);
+			return;
+		}
+		break;
+	case RDMA_CM_EVENT_ESTABLISHED:
+		stats.established++;
+		break;
+	case RDMA_CM_EVENT_DISCONNECTED:
+		rdma_disconnect(cm_id);
+		stats.closed++;
+		rdma_ack_cm_event(event);
+		retire_conn(c);
+		return;
+	case RDMA_CM_EVENT_CONNECT_ERROR:
+	case RDMA_CM_EVENT_UNREACHABLE:
+	case RDMA_CM_EVENT_REJECTED:
+		stats.rejected++;
+		rdma_ack_cm_event(event);
+		if (c)
+			retire_conn(c);
+		return;
+	default:
+		break;
+	}
+
+	rdma_ack_cm_event(event);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report_rates(double elapsed)
+{
+	static unsigned long last_established, last_messages;
+	unsigned long messages = 0;
+
+	for (unsigned i = 0; i < threads; i++)
+		messages += __atomic_load_n(&workers[i].messages,
+					    __ATOMIC_RELAXED);
+
+	printf("rdma_server: %lu connected, %.0f connects/s, %.0f msgs/s, "
+	       "%lu closed, %lu failed\n",
+	       stats.established - stats.closed,
+	       (stats.established - last_established) / elapsed,
+	       (messages - last_messages) / elapsed, stats.closed,
+	       stats.rejected);
+	last_established = stats.established;
+	last_messages = messages;
+}
+
+static int run_long(void)
+{
+	struct rdma_event_channel *channel;
+	struct rdma_addrinfo hints, *res;
+	struct rdma_cm_event *event;
+	struct epoll_event ev = {.events = EPOLLIN};
+	double last;
+	int epfd, ret;
+
+	channel = rdma_create_event_channel();
+	if (!channel) {
+		printf("rdma_create_event_channel %d\n", errno);
+		return -1;
+	}
+	fcntl(channel->fd, F_SETFL, fcntl(channel->fd, F_GETFL) | O_NONBLOCK);
+
+	ret = rdma_create_id(channel, &listen_id, NULL, RDMA_PS_TCP);
+	if (ret) {
+		printf("rdma_create_id %d\n", errno);
+		return ret;
+	}
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_flags = RAI_PASSIVE;
+	hints.ai_port_space = RDMA_PS_TCP;
+	ret = rdma_getaddrinfo(NULL, port, &hints, &res);
+	if (ret) {
+		printf("rdma_getaddrinfo %d\n", errno);
 		return ret;
 	}
 
-	ret = rdma_post_send(id, NULL, send_msg, 16, NULL, IBV_SEND_INLINE);
+	ret = rdma_bind_addr(listen_id, res->ai_src_addr);
+	rdma_freeaddrinfo(res);
 	if (ret) {
-		printf("rdma_post_send %d\n", errno);
+		printf("rdma_bind_addr %d\n", errno);
 		return ret;
 	}
 
-	ret = rdma_get_send_comp(id, &wc);
-	if (ret <= 0) {
-		printf("rdma_get_send_comp %d\n", ret);
+	ret = rdma_listen(listen_id, 1024);
+	if (ret) {
+		printf("rdma_listen %d\n", errno);
 		return ret;
 	}
 
-	rdma_disconnect(id);
-	rdma_dereg_mr(mr);
-	rdma_destroy_ep(id);
-	rdma_destroy_ep(listen_id);
+	if (start_workers())
+		return -1;
+
+	epfd = epoll_create1(0);
+	if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, channel->fd, &ev)) {
+		printf("epoll %d\n", errno);
+		return -1;
+	}
+
+	printf("rdma_server: serving on port %s with %u threads\n", port,
+	       threads);
+
+	last = now();
+	while (1) {
+		if (epoll_wait(epfd, &ev, 1, 1000) > 0)
+			while (!rdma_get_cm_event(channel, &event))
+				cm_event(event);
+
+		if (now() - last >= 1) {
+			report_rates(now() - last);
+			last = now();
+		}
+	}
+
 	return 0;
 }
 
 int main(int argc, char **argv)
 {
+	static struct kv_table table;
 	int op, ret;
 
-	while ((op = getopt(argc, argv, "p:")) != -1) {
+	while ((op = getopt(argc, argv, "p:d:m:k:L:")) != -1) {
 		switch (op) {
 		case 'p':
 			port = optarg;
 			break;
+		case 'd':
+			depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			msg_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			kv_slots = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			threads = strtoul(optarg, NULL, 0);
+			if (!threads)
+				depth = 0;
+			break;
 		default:
-			printf("usage: %s\n", argv[0]);
-			printf("\t[-p port_number]\n");
-			exit(1);
+			depth = 0;
+			break;
 		}
 	}
 
+	if (!depth || !kv_slots ||
+	    msg_size < sizeof(struct rpc_hdr) + sizeof(struct rpc_kv_req)) {
+		printf("usage: %s\n", argv[0]);
+		printf("\t[-p port_number]\n");
+		printf("\t[-d depth] ring slots each way (default 64)\n");
+		printf("\t[-m msg_size] bytes per ring slot (default 1024)\n");
+		printf("\t[-k kv_slots] key-value table size (default 65536)\n");
+		printf("\t[-L threads] keep serving any number of clients "
+		       "with epoll on threads\n");
+		exit(1);
+	}
+
+	if (kv_init(&table)) {
+		printf("rdma_server: no memory for %u kv slots\n", kv_slots);
+		exit(1);
+	}
+	rpc_register(&handlers, RPC_ECHO, echo, NULL);
+	rpc_register(&handlers, RPC_GET, kv_get, &table);
+	rpc_register(&handlers, RPC_PUT, kv_put, &table);
+
 	printf("rdma_server: start\n");
-	ret = run();
+	ret = threads ? run_long() : run();
 	printf("rdma_server: end %d\n", ret);
 	return ret;
 }
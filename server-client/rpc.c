@@ -0,0 +1,346 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <rdma/rdma_verbs.h>
+
+#include "rpc.h"
+
+void rpc_qp_attr(struct ibv_qp_init_attr *attr, unsigned depth)
+{
+	memset(attr, 0, sizeof *attr);
+	attr->cap.max_send_wr = depth;
+	attr->cap.max_recv_wr = depth;
+	attr->cap.max_send_sge = attr->cap.max_recv_sge = 1;
+	attr->sq_sig_all = 0;
+}
+
+int rpc_conn_init(struct rpc_conn *c, struct rdma_cm_id *id, int server,
+		  unsigned depth, unsigned msg_size, unsigned batch)
+{
+	size_t len = (size_t) depth * msg_size;
+
+	memset(c, 0, sizeof *c);
+	c->id = id;
+	c->send_cq = id->send_cq;
+	c->recv_cq = id->recv_cq;
+	c->server = server;
+	c->depth = depth;
+	c->msg_size = msg_size;
+	c->batch = batch < 1 ? 1 : batch > depth ? depth : batch;
+
+	c->req_ring = calloc(1, len);
+	c->resp_ring = calloc(1, len);
+	c->wrs = calloc(depth, sizeof *c->wrs);
+	c->sges = calloc(depth, sizeof *c->sges);
+	c->recv_wrs = calloc(depth, sizeof *c->recv_wrs);
+	c->recv_sges = calloc(depth, sizeof *c->recv_sges);
+	if (!c->req_ring || !c->resp_ring || !c->wrs || !c->sges ||
+	    !c->recv_wrs || !c->recv_sges) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	c->req_mr = rdma_reg_msgs(id, c->req_ring, len);
+	c->resp_mr = rdma_reg_msgs(id, c->resp_ring, len);
+	if (!c->req_mr || !c->resp_mr)
+		return -1;
+
+	return 0;
+}
+
+void rpc_conn_destroy(struct rpc_conn *c)
+{
+	if (c->req_mr)
+		rdma_dereg_mr(c->req_mr);
+	if (c->resp_mr)
+		rdma_dereg_mr(c->resp_mr);
+	free(c->req_ring);
+	free(c->resp_ring);
+	free(c->wrs);
+	free(c->sges);
+	free(c->recv_wrs);
+	free(c->recv_sges);
+	memset(c, 0, sizeof *c);
+}
+
+int rpc_register(struct rpc_handlers *h, uint16_t op, rpc_handler fn,
+		 void *ctx)
+{
+	if (op >= RPC_MAX_OPS) {
+		errno = EINVAL;
+		return -1;
+	}
+	h->fn[op] = fn;
+	h->ctx[op] = ctx;
+	return 0;
+}
+
+/* Servers receive into the request ring, clients into the response ring */
+static char *recv_ring(struct rpc_conn *c)
+{
+	return c->server ? c->req_ring : c->resp_ring;
+}
+
+static void add_recv(struct rpc_conn *c, unsigned n, unsigned slot)
+{
+	c->recv_sges[n].addr = (uintptr_t) recv_ring(c) +
+		(size_t) slot * c->msg_size;
+	c->recv_sges[n].length = c->msg_size;
+	c->recv_sges[n].lkey = (c->server ? c->req_mr : c->resp_mr)->lkey;
+
+	memset(&c->recv_wrs[n], 0, sizeof c->recv_wrs[n]);
+	c->recv_wrs[n].wr_id = slot;
+	c->recv_wrs[n].sg_list = &c->recv_sges[n];
+	c->recv_wrs[n].num_sge = 1;
+	if (n)
+		c->recv_wrs[n - 1].next = &c->recv_wrs[n];
+}
+
+static int post_recvs(struct rpc_conn *c, unsigned n)
+{
+	struct ibv_recv_wr *bad_wr;
+
+	if (!n)
+		return 0;
+	return ibv_post_recv(c->id->qp, c->recv_wrs, &bad_wr);
+}
+
+int rpc_post_recvs(struct rpc_conn *c)
+{
+	for (unsigned i = 0; i < c->depth; i++)
+		add_recv(c, i, i);
+	return post_recvs(c, c->depth);
+}
+
+/*
+ * Sending side
+ */
+
+static struct rpc_hdr *send_slot(struct rpc_conn *c)
+{
+	char *ring = c->server ? c->resp_ring : c->req_ring;
+
+	return (struct rpc_hdr *) (ring +
+		(size_t) (c->send_head % c->depth) * c->msg_size);
+}
+
+/*
+ * The wr_id of a SEND is its sequence number in the sending ring,
+ * which on a client is the request id.
+ */
+static void queue_send(struct rpc_conn *c, uint32_t len)
+{
+	unsigned n = c->queued++;
+
+	c->sges[n].addr = (uintptr_t) send_slot(c);
+	c->sges[n].length = sizeof(struct rpc_hdr) + len;
+	c->sges[n].lkey = (c->server ? c->resp_mr : c->req_mr)->lkey;
+
+	memset(&c->wrs[n], 0, sizeof c->wrs[n]);
+	c->wrs[n].wr_id = c->send_head;
+	c->wrs[n].opcode = IBV_WR_SEND;
+	c->wrs[n].sg_list = &c->sges[n];
+	c->wrs[n].num_sge = 1;
+	if (n)
+		c->wrs[n - 1].next = &c->wrs[n];
+
+	c->send_head++;
+}
+
+/*
+ * Posts the queued SENDs with one doorbell. Only the last one is
+ * signaled, its completion frees the ring up to and including it.
+ */
+static int flush_sends(struct rpc_conn *c)
+{
+	struct ibv_send_wr *bad_wr, *last;
+
+	if (!c->queued)
+		return 0;
+
+	last = &c->wrs[c->queued - 1];
+	last->send_flags = IBV_SEND_SIGNALED;
+	last->next = NULL;
+
+	if (ibv_post_send(c->id->qp, c->wrs, &bad_wr))
+		return -1;
+
+	c->doorbells++;
+	c->sent += c->queued;
+	c->queued = 0;
+	return 0;
+}
+
+static int poll_sends(struct rpc_conn *c)
+{
+	struct ibv_wc wc[8];
+	int n = ibv_poll_cq(c->send_cq, 8, wc);
+
+	for (int i = 0; i < n; i++) {
+		if (wc[i].status)
+			return -1;
+		c->send_tail = wc[i].wr_id + 1;
+	}
+	return n < 0 ? -1 : 0;
+}
+
+static unsigned send_room(struct rpc_conn *c)
+{
+	return c->depth - (c->send_head - c->send_tail);
+}
+
+/*
+ * Server
+ */
+
+int rpc_serve(struct rpc_conn *c, const struct rpc_handlers *h)
+{
+	struct ibv_wc wc[64];
+	unsigned max = c->depth < 64 ? c->depth : 64;
+	unsigned room;
+	int n;
+
+	if (poll_sends(c))
+		return -1;
+
+	/* leave requests in the CQ until there are slots to answer them */
+	room = send_room(c);
+	if (!room)
+		return 0;
+	n = ibv_poll_cq(c->recv_cq, room < max ? room : max, wc);
+	if (n <= 0)
+		return n;
+
+	for (int i = 0; i < n; i++) {
+		struct rpc_hdr *req, *resp;
+		uint32_t req_len, len;
+		uint16_t op;
+		int status;
+
+		if (wc[i].status)
+			return -1;
+
+		req = (struct rpc_hdr *) (c->req_ring +
+					  wc[i].wr_id * c->msg_size);
+		resp = send_slot(c);
+		op = be16toh(req->op);
+		req_len = be32toh(req->len);
+		len = c->msg_size - sizeof *resp;
+
+		if (wc[i].byte_len < sizeof *req ||
+		    req_len > wc[i].byte_len - sizeof *req) {
+			status = -EINVAL;
+			len = 0;
+		} else if (op >= RPC_MAX_OPS || !h->fn[op]) {
+			status = -EOPNOTSUPP;
+			len = 0;
+		} else {
+			status = h->fn[op](h->ctx[op], req + 1, req_len,
+					   resp + 1, &len);
+		}
+		resp->id = req->id;
+		resp->op = req->op;
+		resp->status = htobe16(status);
+		resp->len = htobe32(len);
+
+		queue_send(c, len);
+		add_recv(c, i, wc[i].wr_id);
+	}
+
+	/*
+	 * Repost before replying: a client may send its next request as
+	 * soon as it sees the response, and it must not find us without a
+	 * receive.
+	 */
+	if (post_recvs(c, n) || flush_sends(c))
+		return -1;
+	return n;
+}
+
+/*
+ * Client
+ */
+
+int rpc_call(struct rpc_conn *c, uint16_t op, const void *req, uint32_t len,
+	     uint64_t *id)
+{
+	struct rpc_hdr *hdr;
+
+	if (len > c->msg_size - sizeof *hdr) {
+		errno = EMSGSIZE;
+		return -EMSGSIZE;
+	}
+
+	if (c->outstanding == c->depth || !send_room(c)) {
+		if (flush_sends(c) || poll_sends(c))
+			return -1;
+		if (c->outstanding == c->depth || !send_room(c))
+			return -EAGAIN;
+	}
+
+	hdr = send_slot(c);
+	hdr->id = htobe64(c->send_head);
+	hdr->op = htobe16(op);
+	hdr->status = 0;
+	hdr->len = htobe32(len);
+	memcpy(hdr + 1, req, len);
+	if (id)
+		*id = c->send_head;
+
+	queue_send(c, len);
+	c->outstanding++;
+
+	if (c->queued >= c->batch)
+		return flush_sends(c);
+	return 0;
+}
+
+int rpc_flush(struct rpc_conn *c)
+{
+	return flush_sends(c);
+}
+
+int rpc_poll_resp(struct rpc_conn *c, rpc_done done, void *arg)
+{
+	struct ibv_wc wc[64];
+	unsigned max = c->depth < 64 ? c->depth : 64;
+	int n;
+
+	if (poll_sends(c))
+		return -1;
+
+	n = ibv_poll_cq(c->recv_cq, max, wc);
+	if (n <= 0)
+		return n;
+
+	for (int i = 0; i < n; i++) {
+		struct rpc_hdr *resp;
+
+		if (wc[i].status)
+			return -1;
+
+		resp = (struct rpc_hdr *) (c->resp_ring +
+					   wc[i].wr_id * c->msg_size);
+		c->outstanding--;
+		done(arg, be64toh(resp->id), (int16_t) be16toh(resp->status),
+		     resp + 1, be32toh(resp->len));
+		add_recv(c, i, wc[i].wr_id);
+	}
+
+	return post_recvs(c, n) ? -1 : n;
+}
@@ -0,0 +1,134 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Small request/response RPC layer over an RC endpoint created
+//     with rdma_create_ep. Each connection has a request ring and a
+//     response ring of depth msg_size slots, both registered.
+//
+//     The client copies a request into the next request slot and
+//     queues its SEND. Queued SENDs go out as one chained
+//     ibv_post_send (one doorbell) when batch of them are waiting or
+//     on rpc_flush. A request's id is its sequence number in the
+//     request ring; the SEND's wr_id and the header both carry it and
+//     the response echoes it back.
+//
+//     The server runs the handler registered for the request's op,
+//     which writes its response straight into a response slot. All
+//     responses and receive reposts from one poll go out as one chain
+//     each. Only the last SEND of a chain is signaled; its completion
+//     frees the ring slots of the whole chain.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef RPC_H
+#define RPC_H
+
+#include <stdint.h>
+#include <rdma/rdma_cma.h>
+
+#define RPC_MAX_OPS 16
+
+/* Big endian on the wire, the payload is the handler's business */
+struct rpc_hdr {
+	uint64_t id;
+	uint16_t op;
+	int16_t status;			/* 0 or a negative errno */
+	uint32_t len;			/* payload bytes after the header */
+};
+
+/*
+ * Handles one request of req_len bytes. Writes at most *resp_len bytes
+ * of response to resp, sets *resp_len to what it wrote and returns the
+ * status for the response header.
+ */
+typedef int (*rpc_handler)(void *ctx, const void *req, uint32_t req_len,
+			   void *resp, uint32_t *resp_len);
+
+struct rpc_handlers {
+	rpc_handler fn[RPC_MAX_OPS];
+	void *ctx[RPC_MAX_OPS];
+};
+
+/* Called by rpc_poll_resp for every response */
+typedef void (*rpc_done)(void *arg, uint64_t id, int status,
+			 const void *resp, uint32_t len);
+
+struct rpc_conn {
+	struct rdma_cm_id *id;
+	/*
+	 * The id's CQs by default. rdma_create_qp only records CQs it made
+	 * itself in the id, a caller passing its own sets them after init.
+	 */
+	struct ibv_cq *send_cq;
+	struct ibv_cq *recv_cq;
+	int server;
+	unsigned depth;
+	unsigned msg_size;
+	unsigned batch;
+
+	char *req_ring;
+	char *resp_ring;
+	struct ibv_mr *req_mr;
+	struct ibv_mr *resp_mr;
+
+	/* the sending ring: request ring on clients, response ring on servers */
+	uint64_t send_head;		/* slots filled */
+	uint64_t send_tail;		/* slots whose SEND completed */
+	struct ibv_send_wr *wrs;
+	struct ibv_sge *sges;
+	unsigned queued;
+
+	struct ibv_recv_wr *recv_wrs;
+	struct ibv_sge *recv_sges;
+
+	unsigned outstanding;		/* client requests awaiting responses */
+
+	unsigned long doorbells;
+	unsigned long sent;
+};
+
+/* Sizes the QP for depth receives and depth sends */
+void rpc_qp_attr(struct ibv_qp_init_attr *attr, unsigned depth);
+
+int rpc_conn_init(struct rpc_conn *c, struct rdma_cm_id *id, int server,
+		  unsigned depth, unsigned msg_size, unsigned batch);
+void rpc_conn_destroy(struct rpc_conn *c);
+
+/* Posts every receive of the ring, before connecting or accepting */
+int rpc_post_recvs(struct rpc_conn *c);
+
+int rpc_register(struct rpc_handlers *h, uint16_t op, rpc_handler fn,
+		 void *ctx);
+
+/*
+ * Server: handles what requests have arrived and sends their responses.
+ * Returns how many it handled or -1 once the connection has failed.
+ */
+int rpc_serve(struct rpc_conn *c, const struct rpc_handlers *h);
+
+/*
+ * Client: queues a request and returns its id in *id. Returns -EAGAIN,
+ * having flushed what was queued, while the ring is full.
+ */
+int rpc_call(struct rpc_conn *c, uint16_t op, const void *req, uint32_t len,
+	     uint64_t *id);
+int rpc_flush(struct rpc_conn *c);
+
+/* Client: returns how many responses it passed to done or -1 */
+int rpc_poll_resp(struct rpc_conn *c, rpc_done done, void *arg);
+
+#endif
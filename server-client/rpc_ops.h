@@ -0,0 +1,40 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     The RPC ops rdma_server registers and rdma_client drives. ECHO
+//     returns its payload. GET and PUT start with a big endian 64 bit
+//     key; a PUT's value follows the key and a GET returns it, or
+//     -ENOENT.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef RPC_OPS_H
+#define RPC_OPS_H
+
+#include <stdint.h>
+
+enum rpc_ops {
+	RPC_ECHO	= 1,
+	RPC_GET		= 2,
+	RPC_PUT		= 3,
+};
+
+struct rpc_kv_req {
+	uint64_t key;
+};
+
+#endif